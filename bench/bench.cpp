@@ -0,0 +1,427 @@
+// Host micro-benchmarks of the M7 publish path: the frame buffer, frame copy, the serializers and the Modbus
+// decode, built from the firmware sources, and the spool compression of recorded traces. Each benchmark prints
+// one JSON line on stdout, see README.
+#include <Arduino.h>
+#include "data_frame.h"
+#include "payload.h"
+#include "frame_codec.h"
+#include "frame_spool.h"
+#include "modbus_decode.h"
+#include <chrono>
+#include <vector>
+
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION "dev-unknown"
+#endif
+const char *VERSION = FIRMWARE_VERSION;
+
+static const char usage[] =
+    "Usage: program [options] [benchmark...]\n"
+    "  --min-time <s>  run each benchmark at least this long, 0.5 by default\n"
+    "  --trace <file>  report the spool compression of the frames in a trace, may be repeated\n"
+    "  --list          list the benchmarks\n";
+
+// Results are folded in here so the work is not optimised away
+static volatile uint32_t benchSink;
+
+// Frames like the M4 sends: a few counts per input, cumulative totals and slowly moving analog values
+static void makeFrame(DATA_FRAME_SEND *frame, unsigned int n)
+{
+  memset(frame, 0, sizeof(*frame));
+  unsigned int *counts = &frame->userButtonCount;
+  unsigned int *states = &frame->userButtonState;
+  unsigned int *totals = &frame->userButtonTotal;
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    counts[i] = (n * (i + 1)) % 5;
+    states[i] = (n + i) % 2;
+    totals[i] = 1000 * i + n * 2;
+  }
+  frame->input7Analog = 2048 + (n * 7) % 64;
+  frame->input8Analog = 1024 + (n * 13) % 32;
+  frame->input7Min = frame->input7Analog - 3;
+  frame->input7Max = frame->input7Analog + 3;
+  frame->input8Min = frame->input8Analog - 2;
+  frame->input8Max = frame->input8Analog + 2;
+  frame->span = 1;
+  frame->dutyCycle = 2;
+  frame->frameNumber = n + 1;
+}
+
+static const unsigned int frameCount = 256;
+static DATA_FRAME_SEND frames[frameCount];
+
+// A buffer of the firmware's capacity in host memory, the shared region itself is not mapped here
+static volatile DATA_FRAME_BUFFER *ringBuffer;
+
+// Each benchmark runs iterations operations and returns the bytes they produced or moved
+typedef size_t (*BenchFunction)(unsigned long iterations);
+
+// The M4 writes a frame at the head, the M7 copies it out and advances the tail, both through the journaled indices
+static size_t benchRingBuffer(unsigned long iterations)
+{
+  DATA_FRAME_SEND frame;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    const unsigned int head = readFrameIndex(&ringBuffer->head);
+    copyDataFrame(&ringBuffer->frames[head], &frames[i % frameCount]);
+    writeFrameIndex(&ringBuffer->head, (head + 1) % dataFrameCapacity);
+
+    const unsigned int tail = readFrameIndex(&ringBuffer->tail);
+    if (dataFrameCount(readFrameIndex(&ringBuffer->head), tail) > 0)
+    {
+      copyDataFrame(&frame, &ringBuffer->frames[tail]);
+      writeFrameIndex(&ringBuffer->tail, (tail + 1) % dataFrameCapacity);
+      benchSink = benchSink + frame.input1Total;
+    }
+  }
+  return iterations * sizeof(DATA_FRAME_SEND);
+}
+
+static size_t benchFrameCopy(unsigned long iterations)
+{
+  DATA_FRAME_SEND frame;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    copyDataFrame(&frame, &ringBuffer->frames[i % frameCount]);
+    benchSink = benchSink + frame.input1Total;
+  }
+  return iterations * sizeof(DATA_FRAME_SEND);
+}
+
+static const METER_READING meter = {230.1f, 229.8f, 231.0f, 12.5f, 11.9f, 12.2f, 0.97f, 123456.7f};
+
+static size_t benchPayload(unsigned long iterations, unsigned int keyframeInterval, const METER_READING *reading)
+{
+  PAYLOAD_ENCODER encoder;
+  resetPayloadEncoder(&encoder);
+  char message[2056];
+  size_t bytes = 0;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    bytes += encodePayload(&encoder, keyframeInterval, &frames[i % frameCount], -60, 5, reading, message, sizeof(message));
+  }
+  benchSink = benchSink + message[0];
+  return bytes;
+}
+
+// The full message, as sent with delta encoding off and a meter attached
+static size_t benchPayloadFull(unsigned long iterations)
+{
+  return benchPayload(iterations, 0, &meter);
+}
+
+// Delta messages with a keyframe every 60
+static size_t benchPayloadDelta(unsigned long iterations)
+{
+  return benchPayload(iterations, 60, nullptr);
+}
+
+static size_t benchBlockEncode(unsigned long iterations)
+{
+  uint8_t block[FRAME_BLOCK_MAX_BYTES];
+  size_t bytes = 0;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    bytes += encodeFrameBlock(&frames[(i * FRAME_BLOCK_FRAMES) % frameCount], FRAME_BLOCK_FRAMES, block, sizeof(block));
+  }
+  benchSink = benchSink + block[0];
+  return bytes;
+}
+
+static size_t benchBlockDecode(unsigned long iterations)
+{
+  uint8_t block[FRAME_BLOCK_MAX_BYTES];
+  const size_t length = encodeFrameBlock(frames, FRAME_BLOCK_FRAMES, block, sizeof(block));
+  DATA_FRAME_SEND decoded[FRAME_BLOCK_FRAMES];
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    benchSink = benchSink + decodeFrameBlock(block, length, decoded);
+  }
+  return iterations * length;
+}
+
+// One meter reading, eight register pairs
+static size_t benchModbusDecode(unsigned long iterations)
+{
+  uint16_t registers[16];
+  for (int i = 0; i < 8; i++)
+  {
+    uint32_t bits;
+    memcpy(&bits, (const float *)&meter + i, sizeof(bits));
+    registers[2 * i] = bits >> 16;
+    registers[2 * i + 1] = bits & 0xFFFF;
+  }
+
+  float sum = 0;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    for (int j = 0; j < 8; j++)
+    {
+      sum += decodeModbusValue(registers[2 * j], registers[2 * j + 1], (i & 1) ? MODBUS_STYLE_UINT32_LSW : MODBUS_STYLE_IEEE_FLOAT);
+    }
+  }
+  benchSink = benchSink + (uint32_t)sum;
+  return iterations * sizeof(registers);
+}
+
+// Frame keys of the messages, to rebuild frames from a trace
+static const struct
+{
+  const char *key;
+  size_t offset;
+} traceKeys[] = {
+    {"cb", offsetof(DATA_FRAME_SEND, userButtonCount)},
+    {"c1", offsetof(DATA_FRAME_SEND, input1Count)},
+    {"c2", offsetof(DATA_FRAME_SEND, input2Count)},
+    {"c3", offsetof(DATA_FRAME_SEND, input3Count)},
+    {"c4", offsetof(DATA_FRAME_SEND, input4Count)},
+    {"c5", offsetof(DATA_FRAME_SEND, input5Count)},
+    {"c6", offsetof(DATA_FRAME_SEND, input6Count)},
+    {"sb", offsetof(DATA_FRAME_SEND, userButtonState)},
+    {"s1", offsetof(DATA_FRAME_SEND, input1State)},
+    {"s2", offsetof(DATA_FRAME_SEND, input2State)},
+    {"s3", offsetof(DATA_FRAME_SEND, input3State)},
+    {"s4", offsetof(DATA_FRAME_SEND, input4State)},
+    {"s5", offsetof(DATA_FRAME_SEND, input5State)},
+    {"s6", offsetof(DATA_FRAME_SEND, input6State)},
+    {"a7", offsetof(DATA_FRAME_SEND, input7Analog)},
+    {"a8", offsetof(DATA_FRAME_SEND, input8Analog)},
+    {"tb", offsetof(DATA_FRAME_SEND, userButtonTotal)},
+    {"t1", offsetof(DATA_FRAME_SEND, input1Total)},
+    {"t2", offsetof(DATA_FRAME_SEND, input2Total)},
+    {"t3", offsetof(DATA_FRAME_SEND, input3Total)},
+    {"t4", offsetof(DATA_FRAME_SEND, input4Total)},
+    {"t5", offsetof(DATA_FRAME_SEND, input5Total)},
+    {"t6", offsetof(DATA_FRAME_SEND, input6Total)},
+    {"d4", offsetof(DATA_FRAME_SEND, dutyCycle)},
+    {"fn", offsetof(DATA_FRAME_SEND, frameNumber)}};
+
+// Unsigned value of a key in a message, false if the key is missing
+static bool messageValue(const char *message, const char *key, unsigned int *value)
+{
+  char pattern[16];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *found = strstr(message, pattern);
+  if (!found)
+  {
+    return false;
+  }
+  *value = strtoul(found + strlen(pattern), nullptr, 10);
+  return true;
+}
+
+// Rebuild the frames of a trace: the messages of one device's main or backfill topic as JSON lines, either the
+// payloads alone (mosquitto_sub) or as the simulator's broker writes them. Keys missing from a delta message
+// carry over from the previous one. Other messages (urgent events, edge batches) are skipped.
+static bool loadTrace(const char *path, std::vector<DATA_FRAME_SEND> *trace)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+
+  DATA_FRAME_SEND frame;
+  memset(&frame, 0, sizeof(frame));
+  char *line = nullptr;
+  size_t size = 0;
+  while (getline(&line, &size, file) > 0)
+  {
+    const char *payload = strstr(line, "\"payload\":");
+    payload = payload ? payload : line;
+
+    unsigned int value;
+    if (!messageValue(payload, "t1", &value) && !messageValue(payload, "seq", &value))
+    {
+      continue;
+    }
+    if (messageValue(payload, "age", &value) || strstr(payload, "\"e\":"))
+    {
+      continue;
+    }
+
+    for (const auto &traceKey : traceKeys)
+    {
+      messageValue(payload, traceKey.key, (unsigned int *)((uint8_t *)&frame + traceKey.offset));
+    }
+
+    // The self-test flag carries over in delta messages, legacy ones only have it when set
+    if (messageValue(payload, "st", &value))
+    {
+      frame.flags = value ? FRAME_FLAG_SELF_TEST : 0;
+    }
+    else if (!strstr(payload, "\"seq\":"))
+    {
+      frame.flags = 0;
+    }
+
+    // Messages without a span cover one interval, and their analog range is the value itself
+    if (!messageValue(payload, "sp", &frame.span))
+    {
+      frame.span = 1;
+    }
+    if (frame.span == 1 || !messageValue(payload, "a7n", &frame.input7Min) ||
+        !messageValue(payload, "a7x", &frame.input7Max) || !messageValue(payload, "a8n", &frame.input8Min) ||
+        !messageValue(payload, "a8x", &frame.input8Max))
+    {
+      frame.input7Min = frame.input7Max = frame.input7Analog;
+      frame.input8Min = frame.input8Max = frame.input8Analog;
+    }
+    trace->push_back(frame);
+  }
+
+  free(line);
+  fclose(file);
+  return true;
+}
+
+// Encode frames in spool blocks and report the bytes per frame, the ratio to the buffer's frames and how many frames
+// the spool would hold at that rate. Each block is stored with a record header and padded to 8 bytes.
+static void reportCompression(const char *name, const DATA_FRAME_SEND *trace, size_t count)
+{
+  uint8_t block[FRAME_BLOCK_MAX_BYTES];
+  size_t bytes = 0;
+  size_t stored = 0;
+  for (size_t k = 0; k < count; k += FRAME_BLOCK_FRAMES)
+  {
+    const unsigned int n = min((size_t)FRAME_BLOCK_FRAMES, count - k);
+    const size_t length = encodeFrameBlock(&trace[k], n, block, sizeof(block));
+    bytes += length;
+    stored += (sizeof(FRAME_SPOOL_RECORD) + length + 7) & ~(size_t)7;
+  }
+
+  const double bytesPerFrame = count ? (double)bytes / count : 0;
+  const size_t spoolFrames = stored ? (FRAME_SPOOL_SIZE - offsetof(FRAME_SPOOL, data)) * count / stored : 0;
+  printf("{\"bench\":\"compression\",\"v\":\"%s\",\"trace\":\"%s\",\"frames\":%zu,\"bytes\":%zu,\"bytes_per_frame\":%.2f,"
+         "\"ratio\":%.2f,\"spool_frames\":%zu}\n",
+         VERSION, name, count, bytes, bytesPerFrame, bytesPerFrame > 0 ? sizeof(DATA_FRAME_SEND) / bytesPerFrame : 0,
+         spoolFrames);
+}
+
+static const struct
+{
+  const char *name;
+  BenchFunction function;
+} benchmarks[] = {
+    {"ring_buffer", benchRingBuffer},
+    {"frame_copy", benchFrameCopy},
+    {"payload_full", benchPayloadFull},
+    {"payload_delta", benchPayloadDelta},
+    {"block_encode", benchBlockEncode},
+    {"block_decode", benchBlockDecode},
+    {"modbus_decode", benchModbusDecode},
+};
+
+static double elapsedSeconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Double the iterations until a run takes minTime, then report that run
+static void runBenchmark(const char *name, BenchFunction function, double minTime)
+{
+  function(1); // Warm up
+  for (unsigned long iterations = 1;; iterations *= 2)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t bytes = function(iterations);
+    const double seconds = elapsedSeconds(start);
+    if (seconds >= minTime || iterations >= (1UL << 40))
+    {
+      printf("{\"bench\":\"%s\",\"v\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f,\"bytes_per_op\":%.1f,\"mb_per_s\":%.2f}\n",
+             name, VERSION, iterations, seconds * 1e9 / iterations, iterations / seconds, (double)bytes / iterations,
+             bytes / seconds / 1e6);
+      return;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  double minTime = 0.5;
+  const char *selected[32];
+  int selectedCount = 0;
+  const char *traces[32];
+  int traceCount = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0)
+    {
+      minTime = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc && traceCount < 32)
+    {
+      traces[traceCount++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "--list") == 0)
+    {
+      for (const auto &benchmark : benchmarks)
+      {
+        printf("%s\n", benchmark.name);
+      }
+      printf("compression\n");
+      return 0;
+    }
+    else if (argv[i][0] != '-' && selectedCount < 32)
+    {
+      selected[selectedCount++] = argv[i];
+    }
+    else
+    {
+      fprintf(stderr, "%s", usage);
+      return 2;
+    }
+  }
+
+  for (unsigned int i = 0; i < frameCount; i++)
+  {
+    makeFrame(&frames[i], i);
+  }
+
+  ringBuffer = (volatile DATA_FRAME_BUFFER *)calloc(1, offsetof(DATA_FRAME_BUFFER, frames) + dataFrameCapacity * sizeof(DATA_FRAME_SEND));
+  writeFrameIndex(&ringBuffer->head, 0);
+  writeFrameIndex(&ringBuffer->tail, 0);
+  for (unsigned int i = 0; i < frameCount; i++)
+  {
+    copyDataFrame(&ringBuffer->frames[i], &frames[i]);
+  }
+
+  for (const auto &benchmark : benchmarks)
+  {
+    bool run = selectedCount == 0;
+    for (int i = 0; i < selectedCount; i++)
+    {
+      run = run || strcmp(selected[i], benchmark.name) == 0;
+    }
+    if (run)
+    {
+      runBenchmark(benchmark.name, benchmark.function, minTime);
+    }
+  }
+
+  // Traces replace the synthetic frames, which compress better than real inputs do
+  if (traceCount == 0)
+  {
+    bool run = selectedCount == 0;
+    for (int i = 0; i < selectedCount; i++)
+    {
+      run = run || strcmp(selected[i], "compression") == 0;
+    }
+    if (run)
+    {
+      reportCompression("synthetic", frames, frameCount);
+    }
+  }
+  for (int i = 0; i < traceCount; i++)
+  {
+    std::vector<DATA_FRAME_SEND> trace;
+    if (!loadTrace(traces[i], &trace))
+    {
+      return 1;
+    }
+    reportCompression(traces[i], trace.data(), trace.size());
+  }
+  return 0;
+}
@@ -0,0 +1,836 @@
+// Fleet load test: many DAUs publishing into one broker, for sizing the broker and backend against reconnect
+// storms and backlog floods. Each device is a simulator process running both cores of the firmware, so its
+// traffic is what a DAU sends: the newest frame live, the backlog spooled and drained on the backfill topic,
+// frames merged once the buffer is full, undelivered frames sent again after a reconnect, urgent events and edge
+// batches. A monitor subscribed to every device measures what arrives at the broker against the frame logs the
+// simulators write. Results are JSON lines on stdout, see README.
+#include <Arduino.h>
+#include <Ethernet.h>
+#include "sim.h"
+#include "mqtt_client.h"
+#include "benchmark.h"
+#include <math.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION "dev-unknown"
+#endif
+const char *VERSION = FIRMWARE_VERSION;
+
+static const char usage[] =
+    "Usage: program [options]\n"
+    "  --program <file>           simulator to run per device, .pio/build/native/program by default\n"
+    "  --devices <n>              simulated devices, 10 by default\n"
+    "  --broker <host>[:<port>]   broker to publish to, 127.0.0.1:1883 by default\n"
+    "  --local-broker             run the simulator's broker on 127.0.0.1 at that port\n"
+    "  --interval <s>[:<s>]       send interval, or the range each device picks its own from, 5 by default\n"
+    "  --duration <s>             how long devices take frames for, 60 by default\n"
+    "  --drain <s>                longest wait for the backlogs to empty afterwards, 60 by default\n"
+    "  --outage <start s>+<length s>  outage on every device at once, may be repeated\n"
+    "  --flaky <up s>:<down s>    independent outages on each device, mean seconds up and down\n"
+    "  --events <s>               mean seconds between urgent events on input 2, 30 by default, 0 for none\n"
+    "  --edges <hz>               pulses on input 3, edge logged, 1 by default, 0 for none\n"
+    "  --qos <0|1>                as mqo, 1 by default\n"
+    "  --window <n>               as mif, 8 by default\n"
+    "  --mqtt <4|5>               as mpv, 4 by default\n"
+    "  --dki <n>                  as dki, 0 by default\n"
+    "  --bfr <n> --bfb <n>        as bfr and bfb, 120 and 10 by default\n"
+    "  --prefix <topic>           as mtp, none by default\n"
+    "  --id <prefix>              device IDs are this prefix and a number, fleet- by default\n"
+    "  --logs <dir>               keep each simulator's output there, discarded by default\n"
+    "  --report <s>               progress line interval, 5 by default, 0 for none\n"
+    "  --seed <n>                 seed for intervals, phases and outages\n";
+
+// The monitor's connection, as the M7: 2 s between connect attempts, a 15 s keep alive
+static const unsigned long reconnectDelay = 2000;
+static const uint16_t keepAlive = 15;
+
+// Options
+static const char *program = ".pio/build/native/program";
+static unsigned int deviceCount = 10;
+static const char *brokerHost = "127.0.0.1";
+static uint16_t brokerPort = 1883;
+static bool localBroker = false;
+static double minInterval = 5;
+static double maxInterval = 5;
+static double duration = 60;
+static double drainTime = 60;
+static double flakyUp = 0;
+static double flakyDown = 0;
+static double eventInterval = 30;
+static double edgeRate = 1;
+static unsigned int qos = 1;
+static unsigned int window = 8;
+static unsigned int mqttVersion = MQTT_VERSION_3_1_1;
+static unsigned int keyframeInterval = 0;
+static long backfillRate = 120;
+static long backfillBurst = 10;
+static const char *topicPrefix = "";
+static const char *idPrefix = "fleet-";
+static const char *logDirectory = nullptr;
+static double reportInterval = 5;
+static uint32_t seed = 1;
+
+struct FLEET_OUTAGE
+{
+  double start; // Seconds from the start of the run
+  double length;
+};
+
+// Outages of every device at once
+static std::vector<FLEET_OUTAGE> fleetOutages;
+
+// What the monitor saw of a frame
+enum FrameArrival : uint8_t
+{
+  FRAME_MISSING,
+  FRAME_LIVE,
+  FRAME_BACKFILL,
+  FRAME_MERGED // Only as part of a coalesced frame
+};
+
+struct FLEET_DEVICE
+{
+  unsigned int index;
+  char id[32];
+  unsigned int interval; // Milliseconds, the device's sin
+  double startAt;        // Seconds from the start of the run its simulator is started at
+  uint32_t random;
+  std::vector<FLEET_OUTAGE> outages; // Its own, from --flaky
+
+  pid_t pid;
+  bool exited;
+  std::string configPath;
+  std::string scriptPath;
+  std::string framePath;
+  FILE *frameLog;
+
+  // Frames are numbered from 1 by the M4. takenAt comes from the simulator's frame log, frames counts those
+  // taken before the run's duration ended and closed is set once a later one is logged.
+  std::vector<uint64_t> takenAt;
+  unsigned int frames;
+  bool closed;
+
+  // The monitor's view, under monitorLock. Coalesced frames carry their span in sp, which delta messages only
+  // send when it changes, so the last one is kept per topic.
+  std::vector<uint8_t> received;
+  std::vector<uint64_t> arrivedAt;
+  unsigned int liveSpan;
+  unsigned int backfillSpan;
+  unsigned int firstMissing; // Frames before it have all arrived
+};
+
+static FLEET_DEVICE **devices;
+static unsigned int maxFrames; // Per device
+static char workDirectory[] = "/tmp/fleet_XXXXXX";
+static uint64_t runStartedAt; // hostMicros()
+static uint64_t takingEndsAt;
+
+uint64_t simMicros()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t simBootMicros()
+{
+  return simMicros();
+}
+
+// The host's monotonic clock, the one the simulators log frames against
+static uint64_t hostMicros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift32, uniform in [0, 1)
+static double nextRandom(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state / 4294967296.0;
+}
+
+static void buildDeviceTopic(char *topic, size_t size, const char *deviceId, const char *suffix)
+{
+  if (strlen(topicPrefix) > 0)
+  {
+    snprintf(topic, size, "%s/busroot/v2/dau/%s%s", topicPrefix, deviceId, suffix);
+  }
+  else
+  {
+    snprintf(topic, size, "busroot/v2/dau/%s%s", deviceId, suffix);
+  }
+}
+
+static bool writeFile(const std::string &path, const std::string &text)
+{
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file)
+  {
+    return false;
+  }
+  const bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  return fclose(file) == 0 && written;
+}
+
+// The config a DAU of the fleet is given: input 2 raises urgent events and input 3 is edge logged
+static bool writeDeviceConfig(const FLEET_DEVICE *device)
+{
+  char config[1024];
+  snprintf(config, sizeof(config),
+           "{\"did\":\"%s\",\"com\":\"ETHERNET\",\"msv\":\"%s\",\"mpo\":%u,\"mci\":\"%s\",\"mtp\":\"%s\",\"fbt\":true,"
+           "\"sin\":%u,\"dki\":%u,\"bfr\":%ld,\"bfb\":%ld,\"mqo\":%u,\"mif\":%u,\"mpv\":%u,"
+           "\"iur\":[0,0,%d,0,0,0,0],\"iel\":[0,0,0,%d,0,0,0]}",
+           device->id, brokerHost, brokerPort, device->id, topicPrefix, device->interval, keyframeInterval,
+           backfillRate, backfillBurst, qos, window, mqttVersion, eventInterval > 0, edgeRate > 0);
+  return writeFile(device->configPath, config);
+}
+
+// Inputs as on a machine: a pulse a second on input 1, the urgent and edge logged inputs at their rates, and the
+// analog inputs drifting. Each device starts at its own point in the waveforms.
+static bool writeDeviceScript(FLEET_DEVICE *device)
+{
+  char script[512];
+  int length = snprintf(script, sizeof(script), "%u 1=pulse:1\n0 7=sine:2048:400:%u\n0 8=ramp:900:1100:%u\n",
+                        (unsigned int)(1000 * nextRandom(&device->random)),
+                        60000 + (unsigned int)(60000 * nextRandom(&device->random)),
+                        300000 + (unsigned int)(300000 * nextRandom(&device->random)));
+  if (eventInterval > 0)
+  {
+    length += snprintf(script + length, sizeof(script) - length, "%u 2=pulse:%.6f\n",
+                       (unsigned int)(eventInterval * 2000 * nextRandom(&device->random)), 1 / (2 * eventInterval));
+  }
+  if (edgeRate > 0)
+  {
+    length += snprintf(script + length, sizeof(script) - length, "%u 3=pulse:%.3f:0.3\n",
+                       (unsigned int)(1000 / edgeRate * nextRandom(&device->random)), edgeRate);
+  }
+  return writeFile(device->scriptPath, script);
+}
+
+// Start the device's simulator. Outages are given from its own start.
+static bool startDevice(FLEET_DEVICE *device)
+{
+  const double startedAt = (hostMicros() - runStartedAt) / 1e6;
+  std::vector<std::string> arguments = {program, "--config", device->configPath, "--script", device->scriptPath,
+                                        "--frames", device->framePath, "--duration"};
+  char value[64];
+  snprintf(value, sizeof(value), "%.0f", duration + drainTime + 10 - startedAt);
+  arguments.push_back(value);
+  for (const std::vector<FLEET_OUTAGE> *outages : {&fleetOutages, &device->outages})
+  {
+    for (const FLEET_OUTAGE &outage : *outages)
+    {
+      const double start = outage.start - startedAt;
+      if (start + outage.length > 0)
+      {
+        snprintf(value, sizeof(value), "%.3f+%.3f", max(start, 0.0), start < 0 ? outage.length + start : outage.length);
+        arguments.push_back("--outage");
+        arguments.push_back(value);
+      }
+    }
+  }
+
+  std::string logPath = "/dev/null";
+  if (logDirectory)
+  {
+    logPath = std::string(logDirectory) + "/" + device->id + ".log";
+  }
+  std::vector<char *> argv;
+  for (std::string &argument : arguments)
+  {
+    argv.push_back(&argument[0]);
+  }
+  argv.push_back(nullptr);
+
+  device->pid = fork();
+  if (device->pid == 0)
+  {
+    const int output = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output >= 0)
+    {
+      dup2(output, STDOUT_FILENO);
+      dup2(output, STDERR_FILENO);
+    }
+    execv(program, argv.data());
+    _exit(127);
+  }
+  return device->pid > 0;
+}
+
+// Take in the frames the simulator logged since the last call
+static void readFrameLog(FLEET_DEVICE *device)
+{
+  char line[128];
+  for (;;)
+  {
+    const long position = ftell(device->frameLog);
+    if (!fgets(line, sizeof(line), device->frameLog))
+    {
+      clearerr(device->frameLog);
+      return;
+    }
+    // A line still being written is read again next time
+    if (!strchr(line, '\n'))
+    {
+      fseek(device->frameLog, position, SEEK_SET);
+      return;
+    }
+
+    unsigned int number;
+    long long host;
+    if (sscanf(line, "{\"fn\":%u,\"at\":%*u,\"host_us\":%lld}", &number, &host) != 2 || number > maxFrames ||
+        device->takenAt[number] != 0)
+    {
+      continue;
+    }
+    device->takenAt[number] = host;
+    if ((uint64_t)host < takingEndsAt)
+    {
+      device->frames = max(device->frames, number);
+    }
+    else
+    {
+      device->closed = true;
+    }
+  }
+}
+
+// The monitor: what the broker passed on, by device and frame
+static MQTT_CLIENT monitor;
+static EthernetClient monitorTransport;
+static std::mutex monitorLock; // Guards the counts below and the devices' views
+static unsigned long messagesReceived = 0;
+static unsigned long bytesReceived = 0;
+static unsigned long duplicates = 0;
+static unsigned long events = 0;
+static unsigned long edgeBatches = 0;
+static unsigned long unknown = 0; // Not from a device of this run, or a frame without a frame number
+static std::vector<unsigned long> perSecond;
+
+static unsigned long findValue(const char *text, const char *key, unsigned long missing)
+{
+  const char *found = strstr(text, key);
+  return found ? strtoul(found + strlen(key), nullptr, 10) : missing;
+}
+
+static void frameReceived(FLEET_DEVICE *device, bool backfill, const char *text, uint64_t now)
+{
+  const unsigned long number = findValue(text, "\"fn\":", 0);
+  unsigned int *span = backfill ? &device->backfillSpan : &device->liveSpan;
+  *span = findValue(text, "\"sp\":", keyframeInterval > 0 ? *span : 1);
+  if (number == 0 || number > maxFrames)
+  {
+    unknown++;
+    return;
+  }
+  if (device->received[number] == FRAME_LIVE || device->received[number] == FRAME_BACKFILL)
+  {
+    duplicates++;
+    return;
+  }
+
+  // A coalesced frame stands for the frames merged into it as well
+  for (unsigned long merged = number > *span ? number - *span + 1 : 1; merged < number; merged++)
+  {
+    if (device->received[merged] == FRAME_MISSING)
+    {
+      device->received[merged] = FRAME_MERGED;
+      device->arrivedAt[merged] = now;
+    }
+  }
+  device->received[number] = backfill ? FRAME_BACKFILL : FRAME_LIVE;
+  device->arrivedAt[number] = now;
+}
+
+static void messageReceived(char *topic, uint8_t *payload, size_t length)
+{
+  const uint64_t now = hostMicros();
+  std::lock_guard<std::mutex> lock(monitorLock);
+  messagesReceived++;
+  bytesReceived += length;
+  const size_t second = (now - runStartedAt) / 1000000;
+  if (perSecond.size() <= second)
+  {
+    perSecond.resize(second + 1);
+  }
+  perSecond[second]++;
+
+  // .../dau/{idPrefix}{index}[/backfill|/event|/edges]
+  const char *id = strstr(topic, "/dau/");
+  const size_t prefixLength = strlen(idPrefix);
+  if (!id || strncmp(id + 5, idPrefix, prefixLength) != 0)
+  {
+    unknown++;
+    return;
+  }
+  char *end;
+  const unsigned long index = strtoul(id + 5 + prefixLength, &end, 10);
+  if (end == id + 5 + prefixLength || index >= deviceCount)
+  {
+    unknown++;
+    return;
+  }
+  if (strcmp(end, "/event") == 0)
+  {
+    events++;
+    return;
+  }
+  if (strcmp(end, "/edges") == 0)
+  {
+    edgeBatches++;
+    return;
+  }
+  if (*end != '\0' && strcmp(end, "/backfill") != 0)
+  {
+    unknown++;
+    return;
+  }
+
+  // The payload is not terminated, copy it to search it
+  char text[MQTT_MAX_PACKET_SIZE + 1];
+  length = min(length, sizeof(text) - 1);
+  memcpy(text, payload, length);
+  text[length] = '\0';
+  frameReceived(devices[index], *end != '\0', text, now);
+}
+
+static bool connectMonitor()
+{
+  if (!mqttConnect(&monitor, "fleet-monitor", nullptr, nullptr))
+  {
+    return false;
+  }
+  for (const char *suffix : {"", "/backfill", "/event", "/edges"})
+  {
+    char filter[MQTT_MAX_TOPIC_LENGTH];
+    buildDeviceTopic(filter, sizeof(filter), "+", suffix);
+    mqttSubscribe(&monitor, filter);
+  }
+  return true;
+}
+
+static void runMonitor()
+{
+  for (;;)
+  {
+    if (!mqttConnected(&monitor) && !connectMonitor())
+    {
+      delay(reconnectDelay);
+      continue;
+    }
+    mqttLoop(&monitor);
+    delay(1);
+  }
+}
+
+struct FLEET_TOTALS
+{
+  unsigned long frames;
+  unsigned int running;
+  bool complete; // Every frame taken in the duration arrived
+};
+
+// Under monitorLock
+static void sumDevices(FLEET_TOTALS *totals)
+{
+  memset(totals, 0, sizeof(*totals));
+  totals->complete = true;
+  for (unsigned int i = 0; i < deviceCount; i++)
+  {
+    FLEET_DEVICE *device = devices[i];
+    totals->frames += device->frames;
+    totals->running += device->pid > 0 && !device->exited;
+    while (device->firstMissing <= device->frames && device->received[device->firstMissing] != FRAME_MISSING)
+    {
+      device->firstMissing++;
+    }
+    totals->complete = totals->complete && device->closed && device->firstMissing > device->frames;
+  }
+}
+
+// One line per report interval, rates over that interval
+static void reportProgress(double seconds, double elapsed, unsigned long *lastMessages)
+{
+  std::lock_guard<std::mutex> lock(monitorLock);
+  FLEET_TOTALS totals;
+  sumDevices(&totals);
+  printf("{\"fleet\":\"progress\",\"at_s\":%.1f,\"running\":%u,\"frames\":%lu,\"messages\":%lu,\"msgs_per_s\":%.1f}\n",
+         seconds, totals.running, totals.frames, messagesReceived,
+         (messagesReceived - *lastMessages) / elapsed);
+  *lastMessages = messagesReceived;
+}
+
+static void reportResult(double seconds)
+{
+  std::lock_guard<std::mutex> lock(monitorLock);
+  FLEET_TOTALS totals;
+  sumDevices(&totals);
+  unsigned long peak = 0;
+  for (unsigned long count : perSecond)
+  {
+    peak = max(peak, count);
+  }
+
+  // Latency of the frames taken in the duration, from the frame logs
+  static BENCH_LATENCY liveLatency;
+  static BENCH_LATENCY backfillLatency;
+  resetBenchLatency(&liveLatency);
+  resetBenchLatency(&backfillLatency);
+  unsigned long liveLatencyMax = 0;
+  unsigned long received = 0;
+  unsigned long merged = 0;
+  for (unsigned int i = 0; i < deviceCount; i++)
+  {
+    const FLEET_DEVICE *device = devices[i];
+    for (unsigned int number = 1; number <= device->frames; number++)
+    {
+      const uint8_t arrival = device->received[number];
+      received += arrival == FRAME_LIVE || arrival == FRAME_BACKFILL;
+      merged += arrival == FRAME_MERGED;
+      if (device->takenAt[number] == 0 || device->arrivedAt[number] < device->takenAt[number])
+      {
+        continue;
+      }
+      const unsigned long latency = device->arrivedAt[number] - device->takenAt[number];
+      if (arrival == FRAME_LIVE)
+      {
+        addBenchLatency(&liveLatency, latency);
+        liveLatencyMax = max(liveLatencyMax, latency);
+      }
+      else if (arrival == FRAME_BACKFILL)
+      {
+        addBenchLatency(&backfillLatency, latency);
+      }
+    }
+  }
+  const unsigned long lost = totals.frames - received - merged;
+
+  printf("{\"bench\":\"fleet\",\"v\":\"%s\",\"devices\":%u,\"qos\":%u,\"s\":%.1f,\"frames\":%lu,\"received\":%lu,"
+         "\"merged\":%lu,\"duplicates\":%lu,\"unknown\":%lu,\"lost\":%lu,\"loss_rate\":%.6f,\"events\":%lu,"
+         "\"edge_batches\":%lu,\"msgs_per_s\":%.1f,\"peak_msgs_per_s\":%lu,\"bytes_per_s\":%.0f,"
+         "\"live_samples\":%lu,\"p50_ms\":%.1f,\"p99_ms\":%.1f,\"max_ms\":%.1f,"
+         "\"backfill_samples\":%lu,\"backfill_p50_ms\":%.1f,\"backfill_p99_ms\":%.1f}\n",
+         VERSION, deviceCount, qos, seconds, totals.frames, received, merged, duplicates, unknown, lost,
+         totals.frames > 0 ? (double)lost / totals.frames : 0.0, events, edgeBatches, messagesReceived / seconds, peak,
+         bytesReceived / seconds, liveLatency.seen, benchLatencyPercentile(&liveLatency, 50) / 1000.0,
+         benchLatencyPercentile(&liveLatency, 99) / 1000.0, liveLatencyMax / 1000.0, backfillLatency.seen,
+         benchLatencyPercentile(&backfillLatency, 50) / 1000.0, benchLatencyPercentile(&backfillLatency, 99) / 1000.0);
+}
+
+static bool parseOption(const char *option, const char *value)
+{
+  char extra;
+  if (strcmp(option, "--program") == 0)
+  {
+    program = value;
+    return access(value, X_OK) == 0;
+  }
+  if (strcmp(option, "--devices") == 0)
+  {
+    deviceCount = atoi(value);
+    return deviceCount > 0 && deviceCount <= 1000;
+  }
+  if (strcmp(option, "--broker") == 0)
+  {
+    static char host[128];
+    unsigned int port = brokerPort;
+    const int fields = sscanf(value, "%127[^:]:%u%c", host, &port, &extra);
+    brokerHost = host;
+    brokerPort = port;
+    return (fields == 1 || fields == 2) && port > 0 && port < 65536;
+  }
+  if (strcmp(option, "--interval") == 0)
+  {
+    const int fields = sscanf(value, "%lf:%lf%c", &minInterval, &maxInterval, &extra);
+    if (fields == 1)
+    {
+      maxInterval = minInterval;
+    }
+    return (fields == 1 || fields == 2) && minInterval >= 0.1 && maxInterval >= minInterval;
+  }
+  if (strcmp(option, "--duration") == 0)
+  {
+    duration = atof(value);
+    return duration > 0;
+  }
+  if (strcmp(option, "--drain") == 0)
+  {
+    drainTime = atof(value);
+    return drainTime >= 0;
+  }
+  if (strcmp(option, "--outage") == 0)
+  {
+    FLEET_OUTAGE outage;
+    if (sscanf(value, "%lf+%lf%c", &outage.start, &outage.length, &extra) != 2 || outage.start < 0 || outage.length <= 0)
+    {
+      return false;
+    }
+    fleetOutages.push_back(outage);
+    return true;
+  }
+  if (strcmp(option, "--flaky") == 0)
+  {
+    return sscanf(value, "%lf:%lf%c", &flakyUp, &flakyDown, &extra) == 2 && flakyUp > 0 && flakyDown > 0;
+  }
+  if (strcmp(option, "--events") == 0)
+  {
+    eventInterval = atof(value);
+    return eventInterval >= 0;
+  }
+  if (strcmp(option, "--edges") == 0)
+  {
+    edgeRate = atof(value);
+    return edgeRate >= 0 && edgeRate <= 20;
+  }
+  if (strcmp(option, "--qos") == 0)
+  {
+    qos = atoi(value);
+    return strcmp(value, "0") == 0 || strcmp(value, "1") == 0;
+  }
+  if (strcmp(option, "--window") == 0)
+  {
+    window = atoi(value);
+    return window >= 1 && window <= MQTT_MAX_INFLIGHT;
+  }
+  if (strcmp(option, "--mqtt") == 0)
+  {
+    mqttVersion = atoi(value);
+    return mqttVersion == MQTT_VERSION_3_1_1 || mqttVersion == MQTT_VERSION_5;
+  }
+  if (strcmp(option, "--dki") == 0)
+  {
+    keyframeInterval = atoi(value);
+    return true;
+  }
+  if (strcmp(option, "--bfr") == 0)
+  {
+    backfillRate = atol(value);
+    return backfillRate >= 0;
+  }
+  if (strcmp(option, "--bfb") == 0)
+  {
+    backfillBurst = atol(value);
+    return backfillBurst >= 0;
+  }
+  if (strcmp(option, "--prefix") == 0)
+  {
+    topicPrefix = value;
+    return true;
+  }
+  if (strcmp(option, "--id") == 0)
+  {
+    idPrefix = value;
+    return strlen(value) < 20;
+  }
+  if (strcmp(option, "--logs") == 0)
+  {
+    logDirectory = value;
+    return true;
+  }
+  if (strcmp(option, "--report") == 0)
+  {
+    reportInterval = atof(value);
+    return reportInterval >= 0;
+  }
+  if (strcmp(option, "--seed") == 0)
+  {
+    seed = strtoul(value, nullptr, 10);
+    return true;
+  }
+  return false;
+}
+
+static FLEET_DEVICE *createDevice(unsigned int index)
+{
+  FLEET_DEVICE *device = new FLEET_DEVICE();
+  device->index = index;
+  snprintf(device->id, sizeof(device->id), "%s%04u", idPrefix, index);
+  device->random = (seed + index) * 2654435761U | 1;
+
+  // Each device keeps its own interval and starts at a random point in it
+  device->interval = (unsigned int)((minInterval + (maxInterval - minInterval) * nextRandom(&device->random)) * 1000);
+  device->startAt = device->interval * nextRandom(&device->random) / 1000;
+
+  // Alternating up and down times drawn from exponential distributions
+  if (flakyUp > 0)
+  {
+    double at = 0;
+    while (at < duration)
+    {
+      at += -flakyUp * log(1 - nextRandom(&device->random));
+      const double length = -flakyDown * log(1 - nextRandom(&device->random));
+      if (at < duration)
+      {
+        device->outages.push_back({at, length});
+      }
+      at += length;
+    }
+  }
+
+  const std::string base = std::string(workDirectory) + "/" + device->id;
+  device->configPath = base + ".json";
+  device->scriptPath = base + ".script";
+  device->framePath = base + ".frames";
+  device->takenAt.assign(maxFrames + 1, 0);
+  device->received.assign(maxFrames + 1, FRAME_MISSING);
+  device->arrivedAt.assign(maxFrames + 1, 0);
+  device->liveSpan = 1;
+  device->backfillSpan = 1;
+  device->firstMissing = 1;
+  if (!writeDeviceConfig(device) || !writeDeviceScript(device) || !writeFile(device->framePath, ""))
+  {
+    return nullptr;
+  }
+  device->frameLog = fopen(device->framePath.c_str(), "r");
+  return device->frameLog ? device : nullptr;
+}
+
+// Stop the simulators and remove their files
+static void stopDevices()
+{
+  for (unsigned int i = 0; i < deviceCount; i++)
+  {
+    FLEET_DEVICE *device = devices[i];
+    if (device && device->pid > 0 && !device->exited)
+    {
+      kill(device->pid, SIGTERM);
+      waitpid(device->pid, nullptr, 0);
+    }
+    if (device)
+    {
+      unlink(device->configPath.c_str());
+      unlink(device->scriptPath.c_str());
+      unlink(device->framePath.c_str());
+    }
+  }
+  rmdir(workDirectory);
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *option = argv[i];
+    if (strcmp(option, "--local-broker") == 0)
+    {
+      localBroker = true;
+      continue;
+    }
+    const char *value = i + 1 < argc ? argv[++i] : nullptr;
+    if (!value || !parseOption(option, value))
+    {
+      fprintf(stderr, "[fleet] bad option %s %s\n%s", option, value ? value : "", usage);
+      return 2;
+    }
+  }
+
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+  if (access(program, X_OK) != 0)
+  {
+    fprintf(stderr, "[fleet] no simulator at %s, build it with pio run -e native\n", program);
+    return 1;
+  }
+  if (!mkdtemp(workDirectory))
+  {
+    return 1;
+  }
+  if (localBroker && !startSimBroker(brokerPort, "/dev/null"))
+  {
+    return 1;
+  }
+
+  // The monitor subscribes before any device publishes
+  mqttInit(&monitor, &monitorTransport, brokerHost, brokerPort, keepAlive, 1, messageReceived, nullptr);
+  if (!connectMonitor())
+  {
+    fprintf(stderr, "[fleet] cannot connect to %s:%u, rc=%d\n", brokerHost, brokerPort, monitor.state);
+    return 1;
+  }
+  std::thread(runMonitor).detach();
+  delay(500);
+
+  // Frames go on being taken while the backlogs drain, those are live and not counted
+  maxFrames = (unsigned int)((duration + drainTime + 10) / minInterval) + 2;
+  devices = new FLEET_DEVICE *[deviceCount]();
+  for (unsigned int i = 0; i < deviceCount; i++)
+  {
+    devices[i] = createDevice(i);
+    if (!devices[i])
+    {
+      fprintf(stderr, "[fleet] cannot write the files of device %u in %s\n", i, workDirectory);
+      stopDevices();
+      return 1;
+    }
+  }
+  runStartedAt = hostMicros();
+  takingEndsAt = runStartedAt + (uint64_t)(duration * 1e6);
+  fprintf(stderr, "[fleet] %u devices publishing to %s:%u for %.0f s\n", deviceCount, brokerHost, brokerPort, duration);
+
+  // Start the simulators at their points in the first interval, take frames for the duration, then give the
+  // backlogs time to drain
+  unsigned int started = 0;
+  unsigned long lastMessages = 0;
+  double lastReport = 0;
+  double seconds = 0;
+  for (;;)
+  {
+    delay(started < deviceCount ? 5 : 100);
+    seconds = (hostMicros() - runStartedAt) / 1e6;
+    for (unsigned int i = 0; i < deviceCount; i++)
+    {
+      FLEET_DEVICE *device = devices[i];
+      if (device->pid == 0 && seconds >= device->startAt)
+      {
+        if (!startDevice(device))
+        {
+          fprintf(stderr, "[fleet] cannot start the simulator of %s\n", device->id);
+          stopDevices();
+          return 1;
+        }
+        started++;
+      }
+      if (device->pid > 0 && !device->exited && waitpid(device->pid, nullptr, WNOHANG) == device->pid)
+      {
+        fprintf(stderr, "[fleet] simulator of %s exited\n", device->id);
+        device->exited = true;
+      }
+      readFrameLog(device);
+    }
+
+    if (reportInterval > 0 && seconds - lastReport >= reportInterval)
+    {
+      reportProgress(seconds, seconds - lastReport, &lastMessages);
+      lastReport = seconds;
+    }
+    if (seconds < duration)
+    {
+      continue;
+    }
+
+    FLEET_TOTALS totals;
+    std::lock_guard<std::mutex> lock(monitorLock);
+    sumDevices(&totals);
+    if (totals.complete || totals.running == 0 || seconds >= duration + drainTime)
+    {
+      break;
+    }
+  }
+
+  reportResult(seconds);
+  fflush(stdout);
+  stopDevices();
+  // The monitor thread never returns, leave without running destructors under it
+  _exit(0);
+}
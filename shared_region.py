@@ -0,0 +1,80 @@
+"""
+Reserve the shared region for the inter-core frame buffer in D2 SRAM.
+
+The region sits at the top of SRAM1-2 (0x30000000-0x3003FFFF, also seen by the M4 at 0x10000000),
+just below SRAM3 which mbed uses for Ethernet DMA. Both cores get its bounds as the linker symbols
+__shared_region_start and __shared_region_end, and the M4 RAM is shrunk so it never overlaps it.
+
+The size is set per project with custom_shared_region_size in platformio.ini.
+
+The native simulator maps the D2 SRAM at the same address (see sim/sim.h), so it gets the same symbols. As
+they are absolute it has to be linked as a fixed position executable.
+"""
+
+import re
+
+Import("env")
+
+D2_SRAM_START = 0x30000000
+D2_SRAM_END = 0x30040000  # End of SRAM2, SRAM3 above belongs to Ethernet
+M4_RAM_ALIAS = 0x10000000  # D2 SRAM as addressed by the M4 linker script
+
+size = int(env.GetProjectOption("custom_shared_region_size", "0x20000"), 0)
+if size <= 0 or size % 0x1000 != 0 or size > (D2_SRAM_END - D2_SRAM_START) - 0x10000:
+    raise SystemExit(
+        "custom_shared_region_size must be a multiple of 4KB and leave at least 64KB of RAM for the M4"
+    )
+
+start = D2_SRAM_END - size
+
+env.Append(
+    LINKFLAGS=[
+        "-Wl,--defsym=__shared_region_start=0x%08X" % start,
+        "-Wl,--defsym=__shared_region_end=0x%08X" % D2_SRAM_END,
+    ]
+)
+
+
+def parse_length(text):
+    text = text.strip()
+    if text[-1] in "kK":
+        return int(text[:-1], 0) * 1024
+    return int(text, 0)
+
+
+def shrink_m4_ram():
+    source = env.subst("$LDSCRIPT_PATH")
+    with open(source) as f:
+        script = f.read()
+
+    pattern = re.compile(
+        r"(RAM\w*\s*\([^)]*\)\s*:\s*ORIGIN\s*=\s*)(0x[0-9a-fA-F]+)(\s*,\s*LENGTH\s*=\s*)([0-9a-fA-Fx]+[kK]?)"
+    )
+
+    limit = start - D2_SRAM_START
+    patched = False
+
+    def replace(match):
+        nonlocal patched
+        origin = int(match.group(2), 0)
+        if origin not in (M4_RAM_ALIAS, D2_SRAM_START):
+            return match.group(0)
+        patched = True
+        length = min(parse_length(match.group(4)), limit)
+        return "%s%s%s0x%X" % (match.group(1), match.group(2), match.group(3), length)
+
+    script = pattern.sub(replace, script)
+    if not patched:
+        raise SystemExit("Could not find the M4 RAM region in %s to reserve the shared region" % source)
+
+    target = env.subst("$BUILD_DIR/linker_script_shared.ld")
+    with open(target, "w") as f:
+        f.write(script)
+    env.Replace(LDSCRIPT_PATH=target)
+
+
+if env.subst("$PIOENV") == "opta_m4":
+    shrink_m4_ram()
+
+if env.subst("$PIOPLATFORM") == "native":
+    env.Append(LINKFLAGS=["-no-pie"])
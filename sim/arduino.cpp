@@ -0,0 +1,234 @@
+#include <Arduino.h>
+#include "sim.h"
+#include <poll.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
+
+SimSerial Serial;
+
+// Levels last written to the outputs, kept so reading one back behaves
+static int outputLevels[SIM_PIN_COUNT];
+
+unsigned long millis()
+{
+  return simBootMicros() / 1000;
+}
+
+unsigned long micros()
+{
+  return simBootMicros();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(pin_size_t, int)
+{
+}
+
+void digitalWrite(pin_size_t pin, int value)
+{
+  if (pin >= 0 && pin < SIM_PIN_COUNT)
+  {
+    outputLevels[pin] = value;
+  }
+}
+
+// Inputs 1-6 are A0-A5 and inputs 7-8 A6-A7. The user button pulls its pin low while pressed.
+int digitalRead(pin_size_t pin)
+{
+  if (pin == BTN_USER)
+  {
+    return 1 - simInputLevel(0, simMicros());
+  }
+  if (pin >= A0 && pin <= A7)
+  {
+    const int level = simInputLevel(pin - A0 + 1, simMicros());
+    return pin >= A6 ? level >= 2048 : level;
+  }
+  return pin >= 0 && pin < SIM_PIN_COUNT ? outputLevels[pin] : LOW;
+}
+
+int analogRead(pin_size_t pin)
+{
+  if (pin >= A0 && pin <= A7)
+  {
+    const int level = simInputLevel(pin - A0 + 1, simMicros());
+    return pin >= A6 ? level : level * 4095;
+  }
+  return 0;
+}
+
+void analogReadResolution(int)
+{
+}
+
+size_t Print::write(const uint8_t *data, size_t length)
+{
+  size_t n = 0;
+  while (length--)
+  {
+    n += write(*data++);
+  }
+  return n;
+}
+
+size_t Print::write(const char *text)
+{
+  return text ? write((const uint8_t *)text, strlen(text)) : 0;
+}
+
+size_t Print::print(const char *text)
+{
+  return write(text);
+}
+
+size_t Print::print(const String &text)
+{
+  return write(text.c_str());
+}
+
+size_t Print::print(char value)
+{
+  return write((uint8_t)value);
+}
+
+size_t Print::print(unsigned char value, int base)
+{
+  return printNumber(value, base);
+}
+
+size_t Print::print(int value, int base)
+{
+  return print((long long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base)
+{
+  return printNumber(value, base);
+}
+
+size_t Print::print(long value, int base)
+{
+  return print((long long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+  return printNumber(value, base);
+}
+
+// As the Arduino core, negative numbers only get a sign in decimal and are printed as 32 bit values otherwise
+size_t Print::print(long long value, int base)
+{
+  if (base != DEC)
+  {
+    return printNumber(value >= INT32_MIN && value <= UINT32_MAX ? (uint32_t)value : (unsigned long long)value, base);
+  }
+  if (value < 0)
+  {
+    return print('-') + printNumber(-(unsigned long long)value, DEC);
+  }
+  return printNumber(value, DEC);
+}
+
+size_t Print::print(unsigned long long value, int base)
+{
+  return printNumber(value, base);
+}
+
+size_t Print::print(double value, int digits)
+{
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write(text);
+}
+
+size_t Print::print(const Printable &value)
+{
+  return value.printTo(*this);
+}
+
+size_t Print::println()
+{
+  return write((const uint8_t *)"\r\n", 2);
+}
+
+size_t Print::printNumber(unsigned long long value, int base)
+{
+  if (base < 2)
+  {
+    base = DEC;
+  }
+
+  char text[65];
+  char *digit = &text[sizeof(text) - 1];
+  *digit = '\0';
+  do
+  {
+    const int remainder = value % base;
+    *--digit = remainder < 10 ? '0' + remainder : 'A' + remainder - 10;
+    value /= base;
+  } while (value);
+  return write(digit);
+}
+
+void SimSerial::begin(unsigned long)
+{
+}
+
+// Input comes from stdin without blocking, so the config editor can be used from the terminal
+static int pendingInput = -1;
+
+int SimSerial::available()
+{
+  if (pendingInput < 0)
+  {
+    pollfd input = {STDIN_FILENO, POLLIN, 0};
+    uint8_t value;
+    if (poll(&input, 1, 0) == 1 && (input.revents & POLLIN) && ::read(STDIN_FILENO, &value, 1) == 1)
+    {
+      pendingInput = value;
+    }
+  }
+  return pendingInput >= 0 ? 1 : 0;
+}
+
+int SimSerial::read()
+{
+  if (!available())
+  {
+    return -1;
+  }
+  const int value = pendingInput;
+  pendingInput = -1;
+  return value;
+}
+
+int SimSerial::peek()
+{
+  return available() ? pendingInput : -1;
+}
+
+size_t SimSerial::write(uint8_t value)
+{
+  return fwrite(&value, 1, 1, stdout);
+}
+
+size_t SimSerial::write(const uint8_t *data, size_t length)
+{
+  return fwrite(data, 1, length, stdout);
+}
+
+void SimSerial::flush()
+{
+  fflush(stdout);
+}
@@ -0,0 +1,741 @@
+#include "sim.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/x509_crt.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Just enough of an MQTT 3.1.1 and 5 broker to stand in for one in tests: every session is clean, QoS 1
+// publishes are acknowledged at once and forwarded at QoS 0 to matching subscriptions, topic aliases are resolved.
+// Each message received is written to the sink as a JSON line with the time, client, topic, QoS and payload.
+// With a latency set, every packet is only handled that long after it arrived, which adds it to each round trip.
+// With TLS set, every connection is TLS and sessions are cached by ID, so a client offering one resumes it.
+// With refusals set, that many QoS 1 publishes from MQTT 5 clients are refused in their PUBACK instead.
+
+struct SIM_BROKER_CLIENT
+{
+  int socket;
+  uint8_t version;
+  std::string id;
+  std::vector<std::string> filters;
+  std::vector<std::string> aliases;
+  mbedtls_ssl_context *tls; // nullptr over plain TCP
+  std::mutex tlsLock;       // A TLS context is read and written from more than one thread
+};
+
+// A packet waiting out the latency
+struct SIM_BROKER_PACKET
+{
+  uint64_t due; // simMicros()
+  uint8_t header;
+  std::vector<uint8_t> body;
+};
+
+static std::mutex brokerLock; // Guards the clients, their subscriptions and the sink
+static std::vector<SIM_BROKER_CLIENT *> brokerClients;
+static FILE *brokerSink = stdout;
+static unsigned int brokerLatency = 0; // Milliseconds
+static unsigned int brokerRefusals = 0; // Publishes still to refuse, under brokerLock
+static uint8_t brokerRefusalReason = 0;
+
+// TLS of setSimBrokerTls, shared by every connection. Handshakes take turns, as the session cache and the
+// random generator are not safe to share between threads.
+static bool brokerTls = false;
+static std::mutex tlsHandshakeLock;
+static std::mutex tlsRandomLock;
+static mbedtls_entropy_context tlsEntropy;
+static mbedtls_ctr_drbg_context tlsRandom;
+static mbedtls_x509_crt tlsCertificate;
+static mbedtls_pk_context tlsKey;
+static mbedtls_ssl_cache_context tlsCache;
+static mbedtls_ssl_config tlsConfig;
+
+static int randomLocked(void *context, unsigned char *output, size_t length)
+{
+  std::lock_guard<std::mutex> lock(tlsRandomLock);
+  return mbedtls_ctr_drbg_random(context, output, length);
+}
+
+static int sendToSocket(void *context, const unsigned char *data, size_t length)
+{
+  const ssize_t sent = send(*(int *)context, data, length, MSG_NOSIGNAL);
+  return sent < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : (int)sent;
+}
+
+static int receiveFromSocket(void *context, unsigned char *data, size_t length)
+{
+  const ssize_t received = recv(*(int *)context, data, length, 0);
+  return received < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : (int)received;
+}
+
+// Wait for a TLS record without holding the context, so packets can still be sent to the client meanwhile
+static bool waitForRecord(SIM_BROKER_CLIENT *client)
+{
+  {
+    std::lock_guard<std::mutex> lock(client->tlsLock);
+    if (mbedtls_ssl_get_bytes_avail(client->tls) > 0)
+    {
+      return true;
+    }
+  }
+  pollfd readable = {client->socket, POLLIN, 0};
+  return poll(&readable, 1, -1) > 0;
+}
+
+static bool receiveAll(SIM_BROKER_CLIENT *client, uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t received;
+    if (client->tls)
+    {
+      if (!waitForRecord(client))
+      {
+        return false;
+      }
+      std::lock_guard<std::mutex> lock(client->tlsLock);
+      received = mbedtls_ssl_read(client->tls, data, length);
+      if (received == MBEDTLS_ERR_SSL_WANT_READ || received == MBEDTLS_ERR_SSL_WANT_WRITE)
+      {
+        continue;
+      }
+    }
+    else
+    {
+      received = recv(client->socket, data, length, 0);
+    }
+    if (received <= 0)
+    {
+      return false;
+    }
+    data += received;
+    length -= received;
+  }
+  return true;
+}
+
+static bool sendAll(SIM_BROKER_CLIENT *client, const uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t sent;
+    if (client->tls)
+    {
+      std::lock_guard<std::mutex> lock(client->tlsLock);
+      sent = mbedtls_ssl_write(client->tls, data, length);
+      if (sent == MBEDTLS_ERR_SSL_WANT_READ || sent == MBEDTLS_ERR_SSL_WANT_WRITE)
+      {
+        continue;
+      }
+    }
+    else
+    {
+      sent = send(client->socket, data, length, MSG_NOSIGNAL);
+    }
+    if (sent <= 0)
+    {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+static void appendVarint(std::vector<uint8_t> &packet, size_t value)
+{
+  do
+  {
+    const uint8_t digit = value % 128;
+    value /= 128;
+    packet.push_back(value > 0 ? digit | 0x80 : digit);
+  } while (value > 0);
+}
+
+static bool readVarint(const uint8_t *data, size_t end, size_t *position, size_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 28 && *position < end; shift += 7)
+  {
+    const uint8_t digit = data[(*position)++];
+    *value |= (size_t)(digit & 0x7F) << shift;
+    if (!(digit & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool readString(const uint8_t *data, size_t end, size_t *position, std::string *text)
+{
+  if (*position + 2 > end)
+  {
+    return false;
+  }
+  const size_t length = data[*position] << 8 | data[*position + 1];
+  if (*position + 2 + length > end)
+  {
+    return false;
+  }
+  text->assign((const char *)data + *position + 2, length);
+  *position += 2 + length;
+  return true;
+}
+
+// Skip a property block, returning the topic alias in it (0 if none)
+static bool readProperties(const uint8_t *data, size_t end, size_t *position, unsigned int *alias)
+{
+  size_t length;
+  if (!readVarint(data, end, position, &length) || *position + length > end)
+  {
+    return false;
+  }
+  const size_t last = *position + length;
+  *alias = 0;
+  while (*position < last)
+  {
+    const uint8_t id = data[(*position)++];
+    size_t value;
+    std::string text;
+    switch (id)
+    {
+    case 0x01: // Byte properties
+    case 0x17:
+    case 0x19:
+    case 0x24:
+    case 0x25:
+    case 0x28:
+    case 0x29:
+    case 0x2A:
+      *position += 1;
+      break;
+    case 0x13: // Two byte integers
+    case 0x21:
+    case 0x22:
+      *position += 2;
+      break;
+    case 0x23:
+      if (*position + 2 > last)
+      {
+        return false;
+      }
+      *alias = data[*position] << 8 | data[*position + 1];
+      *position += 2;
+      break;
+    case 0x02: // Four byte integers
+    case 0x11:
+    case 0x18:
+    case 0x27:
+      *position += 4;
+      break;
+    case 0x0B: // Subscription identifier
+      if (!readVarint(data, last, position, &value))
+      {
+        return false;
+      }
+      break;
+    case 0x26: // User property, a pair of strings
+      if (!readString(data, last, position, &text))
+      {
+        return false;
+      }
+      // Fall through for the value
+    default: // Strings and binary data
+      if (!readString(data, last, position, &text))
+      {
+        return false;
+      }
+    }
+  }
+  *position = last;
+  return *position <= end;
+}
+
+static bool sendPacket(SIM_BROKER_CLIENT *client, uint8_t type, const std::vector<uint8_t> &body)
+{
+  std::vector<uint8_t> packet = {type};
+  appendVarint(packet, body.size());
+  packet.insert(packet.end(), body.begin(), body.end());
+  return sendAll(client, packet.data(), packet.size());
+}
+
+// Replies from a client's own thread, serialised with the messages forwarded to it
+// True if the next publish is to be refused, with the reason code to give, see setSimBrokerRefusals
+static bool takeRefusal(uint8_t *reason)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  if (brokerRefusals == 0)
+  {
+    return false;
+  }
+  brokerRefusals--;
+  *reason = brokerRefusalReason;
+  return true;
+}
+
+static bool reply(SIM_BROKER_CLIENT *client, uint8_t type, const std::vector<uint8_t> &body)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  return sendPacket(client, type, body);
+}
+
+static bool topicMatches(const std::string &filter, const std::string &topic)
+{
+  size_t f = 0, t = 0;
+  while (f < filter.size())
+  {
+    if (filter[f] == '#')
+    {
+      return true;
+    }
+    if (filter[f] == '+')
+    {
+      while (t < topic.size() && topic[t] != '/')
+      {
+        t++;
+      }
+      f++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t])
+    {
+      // "a/#" also matches "a"
+      return t == topic.size() && filter.compare(f, std::string::npos, "/#") == 0;
+    }
+    f++;
+    t++;
+  }
+  return t == topic.size();
+}
+
+static void writeJsonString(FILE *file, const uint8_t *data, size_t length)
+{
+  fputc('"', file);
+  for (size_t i = 0; i < length; i++)
+  {
+    const uint8_t c = data[i];
+    if (c == '"' || c == '\\')
+    {
+      fprintf(file, "\\%c", c);
+    }
+    else if (c < 0x20 || c >= 0x7F)
+    {
+      fprintf(file, "\\u%04x", c);
+    }
+    else
+    {
+      fputc(c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// Record a message and pass it on to the subscribers
+static void routePublish(SIM_BROKER_CLIENT *from, const std::string &topic, int qos, const uint8_t *payload, size_t length)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  fprintf(brokerSink, "{\"at\":%llu,\"client\":", (unsigned long long)(simMicros() / 1000));
+  writeJsonString(brokerSink, (const uint8_t *)from->id.data(), from->id.size());
+  fprintf(brokerSink, ",\"topic\":");
+  writeJsonString(brokerSink, (const uint8_t *)topic.data(), topic.size());
+  fprintf(brokerSink, ",\"qos\":%d,\"payload\":", qos);
+  writeJsonString(brokerSink, payload, length);
+  fprintf(brokerSink, "}\n");
+  fflush(brokerSink);
+
+  for (SIM_BROKER_CLIENT *client : brokerClients)
+  {
+    for (const std::string &filter : client->filters)
+    {
+      if (!topicMatches(filter, topic))
+      {
+        continue;
+      }
+      std::vector<uint8_t> body = {(uint8_t)(topic.size() >> 8), (uint8_t)topic.size()};
+      body.insert(body.end(), topic.begin(), topic.end());
+      if (client->version == 5)
+      {
+        body.push_back(0); // No properties
+      }
+      body.insert(body.end(), payload, payload + length);
+      sendPacket(client, 0x30, body);
+      break;
+    }
+  }
+}
+
+// Handle one packet, false to close the connection
+static bool handlePacket(SIM_BROKER_CLIENT *client, uint8_t header, const uint8_t *data, size_t end)
+{
+  size_t position = 0;
+  unsigned int alias;
+  switch (header >> 4)
+  {
+  case 1: // CONNECT
+  {
+    std::string protocol;
+    if (!readString(data, end, &position, &protocol) || position + 4 > end)
+    {
+      return false;
+    }
+    client->version = data[position];
+    position += 4; // Level, flags and keep alive
+    if (client->version == 5 && !readProperties(data, end, &position, &alias))
+    {
+      return false;
+    }
+    readString(data, end, &position, &client->id);
+    if (client->version == 5)
+    {
+      return reply(client, 0x20, {0, 0, 0});
+    }
+    return reply(client, 0x20, {0, 0});
+  }
+  case 3: // PUBLISH
+  {
+    const int qos = (header >> 1) & 3;
+    std::string topic;
+    if (!readString(data, end, &position, &topic))
+    {
+      return false;
+    }
+    uint8_t packetId[2] = {0, 0};
+    if (qos > 0)
+    {
+      if (position + 2 > end)
+      {
+        return false;
+      }
+      packetId[0] = data[position];
+      packetId[1] = data[position + 1];
+      position += 2;
+    }
+    if (client->version == 5)
+    {
+      if (!readProperties(data, end, &position, &alias))
+      {
+        return false;
+      }
+      // An alias with a topic sets it, an empty topic uses it
+      if (alias > 0 && alias <= 0xFFFF)
+      {
+        if (client->aliases.size() <= alias)
+        {
+          client->aliases.resize(alias + 1);
+        }
+        if (topic.empty())
+        {
+          topic = client->aliases[alias];
+        }
+        else
+        {
+          client->aliases[alias] = topic;
+        }
+      }
+    }
+    // A refused message is neither forwarded nor written to the sink
+    uint8_t reason;
+    if (qos > 0 && client->version == 5 && takeRefusal(&reason))
+    {
+      return reply(client, 0x40, {packetId[0], packetId[1], reason});
+    }
+    routePublish(client, topic, qos, data + position, end - position);
+    return qos == 0 || reply(client, 0x40, {packetId[0], packetId[1]});
+  }
+  case 8: // SUBSCRIBE
+  {
+    if (end < 2)
+    {
+      return false;
+    }
+    std::vector<uint8_t> body = {data[0], data[1]};
+    position = 2;
+    if (client->version == 5)
+    {
+      if (!readProperties(data, end, &position, &alias))
+      {
+        return false;
+      }
+      body.push_back(0);
+    }
+    std::string filter;
+    while (position < end && readString(data, end, &position, &filter) && position < end)
+    {
+      position++; // Options
+      {
+        std::lock_guard<std::mutex> lock(brokerLock);
+        client->filters.push_back(filter);
+      }
+      body.push_back(0); // Granted QoS 0
+    }
+    return reply(client, 0x90, body);
+  }
+  case 10: // UNSUBSCRIBE, subscriptions are kept until the client goes
+    if (end < 2)
+    {
+      return false;
+    }
+    return reply(client, 0xB0, {data[0], data[1]});
+  case 12: // PINGREQ
+    return reply(client, 0xD0, {});
+  case 14: // DISCONNECT
+    return false;
+  default:
+    return true;
+  }
+}
+
+static bool receivePacket(SIM_BROKER_CLIENT *client, SIM_BROKER_PACKET *packet)
+{
+  size_t length = 0;
+  bool ok = receiveAll(client, &packet->header, 1);
+  for (int shift = 0; ok && shift < 28; shift += 7)
+  {
+    uint8_t digit;
+    ok = receiveAll(client, &digit, 1);
+    length |= (size_t)(digit & 0x7F) << shift;
+    if (!(digit & 0x80))
+    {
+      break;
+    }
+  }
+  packet->body.resize(length);
+  packet->due = simMicros() + brokerLatency * 1000ULL;
+  return ok && receiveAll(client, packet->body.data(), length);
+}
+
+// Hand packets on once their latency has passed, in the order they arrived. Packets that arrived before the
+// client went are still handled, as a broker would.
+static void delayPackets(SIM_BROKER_CLIENT *client, std::deque<SIM_BROKER_PACKET> *queue, std::mutex *queueLock,
+                         std::condition_variable *queued, const bool *closed)
+{
+  std::unique_lock<std::mutex> lock(*queueLock);
+  for (;;)
+  {
+    queued->wait(lock, [&]
+                 { return !queue->empty() || *closed; });
+    if (queue->empty())
+    {
+      return;
+    }
+    SIM_BROKER_PACKET packet = std::move(queue->front());
+    queue->pop_front();
+    lock.unlock();
+
+    const uint64_t now = simMicros();
+    if (packet.due > now)
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(packet.due - now));
+    }
+    if (!handlePacket(client, packet.header, packet.body.data(), packet.body.size()))
+    {
+      shutdown(client->socket, SHUT_RDWR);
+    }
+    lock.lock();
+  }
+}
+
+// Run the server side of the handshake, false if it failed
+static bool startTls(SIM_BROKER_CLIENT *client)
+{
+  client->tls = new mbedtls_ssl_context;
+  mbedtls_ssl_init(client->tls);
+  if (mbedtls_ssl_setup(client->tls, &tlsConfig) != 0)
+  {
+    return false;
+  }
+  mbedtls_ssl_set_bio(client->tls, &client->socket, sendToSocket, receiveFromSocket, nullptr);
+
+  std::lock_guard<std::mutex> lock(tlsHandshakeLock);
+  int result;
+  while ((result = mbedtls_ssl_handshake(client->tls)) != 0)
+  {
+    if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      fprintf(stderr, "[sim] broker TLS handshake failed: -0x%04X\n", -result);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void serveClient(int socket)
+{
+  SIM_BROKER_CLIENT *client = new SIM_BROKER_CLIENT{socket, 4};
+  if (brokerTls && !startTls(client))
+  {
+    mbedtls_ssl_free(client->tls);
+    delete client->tls;
+    close(socket);
+    delete client;
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(brokerLock);
+    brokerClients.push_back(client);
+  }
+
+  std::deque<SIM_BROKER_PACKET> queue;
+  std::mutex queueLock;
+  std::condition_variable queued;
+  bool closed = false;
+  std::thread delayer;
+  if (brokerLatency > 0)
+  {
+    delayer = std::thread(delayPackets, client, &queue, &queueLock, &queued, &closed);
+  }
+
+  SIM_BROKER_PACKET packet;
+  while (receivePacket(client, &packet))
+  {
+    if (brokerLatency == 0)
+    {
+      if (!handlePacket(client, packet.header, packet.body.data(), packet.body.size()))
+      {
+        break;
+      }
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(queueLock);
+    queue.push_back(std::move(packet));
+    queued.notify_one();
+  }
+
+  if (delayer.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(queueLock);
+      closed = true;
+      queued.notify_one();
+    }
+    delayer.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(brokerLock);
+    for (size_t i = 0; i < brokerClients.size(); i++)
+    {
+      if (brokerClients[i] == client)
+      {
+        brokerClients.erase(brokerClients.begin() + i);
+        break;
+      }
+    }
+  }
+  if (client->tls)
+  {
+    mbedtls_ssl_close_notify(client->tls);
+    mbedtls_ssl_free(client->tls);
+    delete client->tls;
+  }
+  close(socket);
+  delete client;
+}
+
+void setSimBrokerLatency(unsigned int ms)
+{
+  brokerLatency = ms;
+}
+
+void setSimBrokerRefusals(unsigned int count, uint8_t reason)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  brokerRefusals = count;
+  brokerRefusalReason = reason;
+}
+
+bool setSimBrokerTls(const char *certificatePath, const char *keyPath)
+{
+  mbedtls_entropy_init(&tlsEntropy);
+  mbedtls_ctr_drbg_init(&tlsRandom);
+  mbedtls_x509_crt_init(&tlsCertificate);
+  mbedtls_pk_init(&tlsKey);
+  mbedtls_ssl_cache_init(&tlsCache);
+  mbedtls_ssl_config_init(&tlsConfig);
+
+  const char *failed = nullptr;
+  if (mbedtls_ctr_drbg_seed(&tlsRandom, mbedtls_entropy_func, &tlsEntropy, nullptr, 0) != 0)
+  {
+    failed = "cannot seed the random generator";
+  }
+  else if (mbedtls_x509_crt_parse_file(&tlsCertificate, certificatePath) != 0)
+  {
+    failed = "cannot read the certificate";
+  }
+  else if (mbedtls_pk_parse_keyfile(&tlsKey, keyPath, nullptr) != 0)
+  {
+    failed = "cannot read the key";
+  }
+  else if (mbedtls_ssl_config_defaults(&tlsConfig, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                       MBEDTLS_SSL_PRESET_DEFAULT) != 0 ||
+           mbedtls_ssl_conf_own_cert(&tlsConfig, &tlsCertificate, &tlsKey) != 0)
+  {
+    failed = "cannot set up TLS";
+  }
+  if (failed)
+  {
+    fprintf(stderr, "[sim] broker %s\n", failed);
+    return false;
+  }
+
+  mbedtls_ssl_conf_rng(&tlsConfig, randomLocked, &tlsRandom);
+  mbedtls_ssl_conf_session_cache(&tlsConfig, &tlsCache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+  brokerTls = true;
+  return true;
+}
+
+bool startSimBroker(uint16_t port, const char *sinkPath)
+{
+  if (sinkPath)
+  {
+    brokerSink = fopen(sinkPath, "a");
+    if (!brokerSink)
+    {
+      fprintf(stderr, "[sim] cannot open %s for the broker\n", sinkPath);
+      return false;
+    }
+  }
+
+  const int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const int reuse = 1;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+      bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+  {
+    fprintf(stderr, "[sim] cannot listen on port %u: %s\n", port, strerror(errno));
+    return false;
+  }
+
+  std::thread([listener]
+              {
+                for (;;)
+                {
+                  const int socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                  if (socket >= 0)
+                  {
+                    std::thread(serveClient, socket).detach();
+                  }
+                } })
+      .detach();
+  return true;
+}
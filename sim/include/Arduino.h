@@ -0,0 +1,98 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+// Host stand-in for the Arduino core as used by the firmware. Time comes from the host clock, inputs from the
+// scripted waveforms (see sim.h) and Serial is stdin/stdout.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include "Print.h"
+#include "WString.h"
+#include "IPAddress.h"
+#include "stm32_hal.h"
+#include "rtos.h"
+
+typedef uint8_t byte;
+typedef int pin_size_t;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// Inputs 1-8 (A0-A7) and the user button are read from the waveforms, outputs only keep their level
+enum SimPin
+{
+  A0,
+  A1,
+  A2,
+  A3,
+  A4,
+  A5,
+  A6,
+  A7,
+  BTN_USER,
+  LEDR,
+  LEDG,
+  LEDB,
+  LED_D0,
+  LED_D1,
+  LED_D2,
+  LED_D3,
+  SIM_PIN_COUNT
+};
+
+#define SERIAL_8N1 0x06
+
+template <class T, class L>
+auto min(const T &a, const L &b) -> decltype((b < a) ? b : a)
+{
+  return (b < a) ? b : a;
+}
+
+template <class T, class L>
+auto max(const T &a, const L &b) -> decltype((b < a) ? b : a)
+{
+  return (a < b) ? b : a;
+}
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(pin_size_t pin, int mode);
+void digitalWrite(pin_size_t pin, int value);
+int digitalRead(pin_size_t pin);
+int analogRead(pin_size_t pin);
+void analogReadResolution(int bits);
+
+// Starts the M4 thread, see sim.cpp
+void bootM4();
+
+class SimSerial : public Stream
+{
+public:
+  void begin(unsigned long baud);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  void flush() override;
+  // A monitor is always attached
+  operator bool() { return true; }
+};
+
+extern SimSerial Serial;
+
+#endif // SIM_ARDUINO_H
@@ -0,0 +1,31 @@
+#ifndef SIM_ARDUINOMODBUS_H
+#define SIM_ARDUINOMODBUS_H
+
+#include "Arduino.h"
+#include "ArduinoRS485.h"
+
+#define COILS 1
+#define DISCRETE_INPUTS 2
+#define HOLDING_REGISTERS 3
+#define INPUT_REGISTERS 4
+
+// Energy meters answering every address. Register pairs hold 32 bit IEEE754 floats, most significant word first,
+// that drift slowly around a value set by the device ID and address, so readings are reproducible.
+class ModbusRTUClientClass
+{
+public:
+  int begin(unsigned long baudrate, uint16_t config = SERIAL_8N1);
+  void setTimeout(unsigned long timeout);
+  int requestFrom(int id, int type, int address, int count);
+  long read();
+  const char *lastError();
+
+private:
+  uint16_t registers[16];
+  int count = 0;
+  int position = 0;
+};
+
+extern ModbusRTUClientClass ModbusRTUClient;
+
+#endif // SIM_ARDUINOMODBUS_H
@@ -0,0 +1,21 @@
+#ifndef SIM_ARDUINORS485_H
+#define SIM_ARDUINORS485_H
+
+// The RS485 transceiver, only its timing is set by the firmware
+class RS485Class
+{
+public:
+  void setDelays(int preDelay, int postDelay)
+  {
+    this->preDelay = preDelay;
+    this->postDelay = postDelay;
+  }
+
+private:
+  int preDelay = 0;
+  int postDelay = 0;
+};
+
+extern RS485Class RS485;
+
+#endif // SIM_ARDUINORS485_H
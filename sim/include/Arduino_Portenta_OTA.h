@@ -0,0 +1,30 @@
+#ifndef SIM_ARDUINO_PORTENTA_OTA_H
+#define SIM_ARDUINO_PORTENTA_OTA_H
+
+#include <stdint.h>
+
+#define QSPI_FLASH_FATFS_MBR 2
+
+// Never reached in the simulator, where the OTA partition cannot be mounted
+class Arduino_Portenta_OTA
+{
+public:
+  enum class Error : int
+  {
+    None = 0,
+    NoCapableBootloader = -1
+  };
+};
+
+class Arduino_Portenta_OTA_QSPI : public Arduino_Portenta_OTA
+{
+public:
+  Arduino_Portenta_OTA_QSPI(int, uint32_t) {}
+
+  bool isOtaCapable() { return false; }
+  Error begin() { return Error::NoCapableBootloader; }
+  int decompress() { return -1; }
+  Error update() { return Error::NoCapableBootloader; }
+};
+
+#endif // SIM_ARDUINO_PORTENTA_OTA_H
@@ -0,0 +1,34 @@
+#ifndef SIM_BLOCKDEVICE_H
+#define SIM_BLOCKDEVICE_H
+
+#include <stdint.h>
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+namespace mbed
+{
+  // The mbed block device interface
+  class BlockDevice
+  {
+  public:
+    virtual ~BlockDevice() {}
+
+    // The QSPI flash, the simulator has none
+    static BlockDevice *get_default_instance();
+
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+    virtual int read(void *buffer, bd_addr_t address, bd_size_t size) = 0;
+    virtual int program(const void *buffer, bd_addr_t address, bd_size_t size) = 0;
+    virtual int erase(bd_addr_t address, bd_size_t size) = 0;
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+    virtual bd_size_t get_erase_size() const = 0;
+    virtual bd_size_t get_erase_size(bd_addr_t) const { return get_erase_size(); }
+    virtual int get_erase_value() const { return -1; }
+    virtual bd_size_t size() const = 0;
+  };
+}
+
+#endif // SIM_BLOCKDEVICE_H
@@ -0,0 +1,39 @@
+#ifndef SIM_ETHERNET_H
+#define SIM_ETHERNET_H
+
+#include "Arduino.h"
+#include "SocketClient.h"
+
+enum EthernetLinkStatus
+{
+  Unknown,
+  LinkON,
+  LinkOFF
+};
+
+// Ethernet gets a lease at once and reaches everything the host does. The link is off during outages.
+class EthernetClass
+{
+public:
+  int begin(uint8_t *mac = nullptr, unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
+  int begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
+  EthernetLinkStatus linkStatus();
+  void macAddress(uint8_t *mac);
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsServerIP();
+
+private:
+  bool leased = false;
+};
+
+extern EthernetClass Ethernet;
+
+class EthernetClient : public SocketClient
+{
+public:
+  EthernetClient() : SocketClient(SIM_LINK_ETHERNET) {}
+};
+
+#endif // SIM_ETHERNET_H
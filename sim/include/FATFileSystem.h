@@ -0,0 +1,19 @@
+#ifndef SIM_FATFILESYSTEM_H
+#define SIM_FATFILESYSTEM_H
+
+#include "BlockDevice.h"
+
+namespace mbed
+{
+  // Mounting always fails as there is no QSPI flash, which leaves OTA disabled and the CA bundle empty
+  class FATFileSystem
+  {
+  public:
+    FATFileSystem(const char *) {}
+
+    int mount(BlockDevice *) { return -1; }
+    int unmount() { return 0; }
+  };
+}
+
+#endif // SIM_FATFILESYSTEM_H
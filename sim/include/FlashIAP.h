@@ -0,0 +1,29 @@
+#ifndef SIM_FLASHIAP_H
+#define SIM_FLASHIAP_H
+
+#include <stdint.h>
+
+// Sketch end as linked for the 50_50 layout, user data goes in the sectors after it
+#define FLASHIAP_APP_ROM_END_ADDR 0x080C0000
+
+namespace mbed
+{
+  // The internal flash, kept in the simulator's flash image (see sim.cpp). As on the STM32H7, programming can
+  // only clear bits and erasing sets a whole sector back to 0xFF.
+  class FlashIAP
+  {
+  public:
+    int init();
+    int deinit();
+    int read(void *buffer, uint32_t address, uint32_t size);
+    int program(const void *buffer, uint32_t address, uint32_t size);
+    int erase(uint32_t address, uint32_t size);
+    uint32_t get_sector_size(uint32_t address) const;
+    uint32_t get_flash_start() const;
+    uint32_t get_flash_size() const;
+    uint32_t get_page_size() const;
+    uint8_t get_erase_value() const;
+  };
+}
+
+#endif // SIM_FLASHIAP_H
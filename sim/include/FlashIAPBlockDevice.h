@@ -0,0 +1,32 @@
+#ifndef SIM_FLASHIAPBLOCKDEVICE_H
+#define SIM_FLASHIAPBLOCKDEVICE_H
+
+#include "BlockDevice.h"
+#include "FlashIAP.h"
+
+// A range of the internal flash as a block device, addresses relative to its start
+class FlashIAPBlockDevice : public mbed::BlockDevice
+{
+public:
+  FlashIAPBlockDevice(uint32_t address, uint32_t size) : base(address), length(size) {}
+
+  int init() override;
+  int deinit() override;
+  int read(void *buffer, bd_addr_t address, bd_size_t size) override;
+  int program(const void *buffer, bd_addr_t address, bd_size_t size) override;
+  int erase(bd_addr_t address, bd_size_t size) override;
+  bd_size_t get_read_size() const override;
+  bd_size_t get_program_size() const override;
+  bd_size_t get_erase_size() const override;
+  int get_erase_value() const override;
+  bd_size_t size() const override;
+
+private:
+  bool contains(bd_addr_t address, bd_size_t size) const;
+
+  mbed::FlashIAP flash;
+  uint32_t base;
+  uint32_t length;
+};
+
+#endif // SIM_FLASHIAPBLOCKDEVICE_H
@@ -0,0 +1,38 @@
+#ifndef SIM_IPADDRESS_H
+#define SIM_IPADDRESS_H
+
+#include <stdint.h>
+#include "Print.h"
+
+// IPv4 address stored as in the Arduino core, first octet in the lowest byte
+class IPAddress : public Printable
+{
+public:
+  IPAddress() : address(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+  IPAddress(uint32_t address) : address(address) {}
+
+  operator uint32_t() const { return address; }
+  bool operator==(const IPAddress &other) const { return address == other.address; }
+  bool operator!=(const IPAddress &other) const { return address != other.address; }
+  uint8_t operator[](int index) const { return address >> (index * 8); }
+
+  size_t printTo(Print &p) const override
+  {
+    size_t n = 0;
+    for (int i = 0; i < 4; i++)
+    {
+      if (i > 0)
+      {
+        n += p.print('.');
+      }
+      n += p.print((unsigned int)(*this)[i]);
+    }
+    return n;
+  }
+
+private:
+  uint32_t address;
+};
+
+#endif // SIM_IPADDRESS_H
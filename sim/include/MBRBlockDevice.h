@@ -0,0 +1,26 @@
+#ifndef SIM_MBRBLOCKDEVICE_H
+#define SIM_MBRBLOCKDEVICE_H
+
+#include "BlockDevice.h"
+
+namespace mbed
+{
+  // A partition of the QSPI flash. There is no QSPI flash in the simulator, so it never initialises.
+  class MBRBlockDevice : public BlockDevice
+  {
+  public:
+    MBRBlockDevice(BlockDevice *, int) {}
+
+    int init() override { return -1; }
+    int deinit() override { return 0; }
+    int read(void *, bd_addr_t, bd_size_t) override { return -1; }
+    int program(const void *, bd_addr_t, bd_size_t) override { return -1; }
+    int erase(bd_addr_t, bd_size_t) override { return -1; }
+    bd_size_t get_read_size() const override { return 1; }
+    bd_size_t get_program_size() const override { return 1; }
+    bd_size_t get_erase_size() const override { return 4096; }
+    bd_size_t size() const override { return 0; }
+  };
+}
+
+#endif // SIM_MBRBLOCKDEVICE_H
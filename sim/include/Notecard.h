@@ -0,0 +1,32 @@
+#ifndef SIM_NOTECARD_H
+#define SIM_NOTECARD_H
+
+#include "Arduino.h"
+
+// JSON objects of note-c, just enough to build requests
+struct J;
+
+J *JCreateObject();
+void JDelete(J *item);
+J *JAddStringToObject(J *object, const char *name, const char *value);
+J *JAddNumberToObject(J *object, const char *name, double value);
+J *JAddBoolToObject(J *object, const char *name, bool value);
+bool JAddItemToObject(J *object, const char *name, J *item);
+const char *JGetString(J *object, const char *name);
+
+// A Notecard that takes every request. Requests are written as JSON lines to the sink set with
+// setSimNotecardSink, where queued notes and syncs can be checked.
+class Notecard
+{
+public:
+  void begin() {}
+  void setDebugOutputStream(Stream &) {}
+
+  J *newRequest(const char *request);
+  bool sendRequest(J *request);
+  J *requestAndResponse(J *request);
+  bool responseError(J *response);
+  void deleteResponse(J *response);
+};
+
+#endif // SIM_NOTECARD_H
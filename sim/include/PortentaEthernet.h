@@ -0,0 +1,6 @@
+#ifndef SIM_PORTENTAETHERNET_H
+#define SIM_PORTENTAETHERNET_H
+
+#include "Ethernet.h"
+
+#endif // SIM_PORTENTAETHERNET_H
@@ -0,0 +1,4 @@
+#ifndef SIM_SDRAM_H
+#define SIM_SDRAM_H
+
+#endif // SIM_SDRAM_H
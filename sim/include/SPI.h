@@ -0,0 +1,4 @@
+#ifndef SIM_SPI_H
+#define SIM_SPI_H
+
+#endif // SIM_SPI_H
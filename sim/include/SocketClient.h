@@ -0,0 +1,35 @@
+#ifndef SIM_SOCKETCLIENT_H
+#define SIM_SOCKETCLIENT_H
+
+#include "Client.h"
+#include "../sim.h"
+
+// TCP connection over the host's network for the WiFi and Ethernet clients. The connection breaks and new
+// ones are refused while the link it runs over has an outage scheduled.
+class SocketClient : public Client
+{
+public:
+  explicit SocketClient(SimLink link) : link(link) {}
+  ~SocketClient() { stop(); }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *data, size_t length) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return socket >= 0; }
+
+private:
+  bool linkLost();
+
+  SimLink link;
+  int socket = -1;
+};
+
+#endif // SIM_SOCKETCLIENT_H
@@ -0,0 +1,44 @@
+#ifndef SIM_WSTRING_H
+#define SIM_WSTRING_H
+
+#include <string.h>
+#include <string>
+
+// The part of the Arduino String the firmware uses
+class String
+{
+public:
+  String() {}
+  String(const char *text) : text(text ? text : "") {}
+
+  const char *c_str() const { return text.c_str(); }
+  unsigned int length() const { return text.length(); }
+
+  void replace(const char *find, const char *replacement)
+  {
+    const size_t findLength = strlen(find);
+    if (findLength == 0)
+    {
+      return;
+    }
+    for (size_t at = text.find(find); at != std::string::npos; at = text.find(find, at + strlen(replacement)))
+    {
+      text.replace(at, findLength, replacement);
+    }
+  }
+
+  void toCharArray(char *buffer, unsigned int size) const
+  {
+    if (size == 0)
+    {
+      return;
+    }
+    const size_t length = text.copy(buffer, size - 1);
+    buffer[length] = '\0';
+  }
+
+private:
+  std::string text;
+};
+
+#endif // SIM_WSTRING_H
@@ -0,0 +1,30 @@
+#ifndef SIM_WATCHDOG_H
+#define SIM_WATCHDOG_H
+
+#include <stdint.h>
+#include <atomic>
+
+namespace mbed
+{
+  // One independent watchdog per core, as IWDG1 and IWDG2. Once started, the simulator resets when a core
+  // has not kicked its watchdog within the timeout.
+  class Watchdog
+  {
+  public:
+    static Watchdog &get_instance();
+
+    bool start(uint32_t timeout);
+    bool start();
+    void kick();
+    uint32_t get_max_timeout() const;
+
+    // For the simulator's monitor: true when started and not kicked in time
+    bool expired(uint64_t now) const;
+
+  private:
+    std::atomic<uint32_t> timeout{0};
+    std::atomic<uint64_t> lastKick{0};
+  };
+}
+
+#endif // SIM_WATCHDOG_H
@@ -0,0 +1,54 @@
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+#include "Arduino.h"
+#include "SocketClient.h"
+
+#define WL_IDLE_STATUS 0
+#define WL_NO_SSID_AVAIL 1
+#define WL_CONNECTED 3
+#define WL_CONNECT_FAILED 4
+#define WL_CONNECTION_LOST 5
+#define WL_DISCONNECTED 6
+
+#define ENC_TYPE_WEP 5
+#define ENC_TYPE_TKIP 2
+#define ENC_TYPE_CCMP 4
+#define ENC_TYPE_NONE 7
+#define ENC_TYPE_AUTO 8
+
+// WiFi joins any network straight away and reaches everything the host does. A fixed station answers scans.
+class WiFiClass
+{
+public:
+  int begin(const char *ssid);
+  int begin(const char *ssid, const char *password);
+  void config(IPAddress local, IPAddress dns, IPAddress gateway, IPAddress subnet);
+  void disconnect();
+  uint8_t status();
+
+  int8_t scanNetworks();
+  const char *SSID(uint8_t network);
+  int32_t RSSI(uint8_t network);
+  uint8_t encryptionType(uint8_t network);
+
+  int32_t RSSI();
+  uint8_t *macAddress(uint8_t *mac);
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(int n = 0);
+
+private:
+  bool joined = false;
+};
+
+extern WiFiClass WiFi;
+
+class WiFiClient : public SocketClient
+{
+public:
+  WiFiClient() : SocketClient(SIM_LINK_WIFI) {}
+};
+
+#endif // SIM_WIFI_H
@@ -0,0 +1,103 @@
+#ifndef SIM_RTOS_H
+#define SIM_RTOS_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// The parts of mbed's RTOS the firmware uses beyond its main thread. Threads are host threads, priorities and
+// stack sizes are taken but not used.
+
+enum osPriority
+{
+  osPriorityLow = 8,
+  osPriorityBelowNormal = 16,
+  osPriorityNormal = 24,
+  osPriorityAboveNormal = 32,
+  osPriorityHigh = 40
+};
+
+typedef int32_t osStatus;
+#define osOK 0
+#define osWaitForever 0xFFFFFFFFU
+
+namespace rtos
+{
+  class EventFlags
+  {
+  public:
+    uint32_t set(uint32_t flags)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      state |= flags;
+      condition.notify_all();
+      return state;
+    }
+
+    // Wait for any of flags, returning those set and clearing them
+    uint32_t wait_any(uint32_t flags, uint32_t millisec = osWaitForever, bool clear = true)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      auto ready = [&]
+      { return (state & flags) != 0; };
+      if (millisec == osWaitForever)
+      {
+        condition.wait(guard, ready);
+      }
+      else
+      {
+        condition.wait_for(guard, std::chrono::milliseconds(millisec), ready);
+      }
+      const uint32_t taken = state & flags;
+      if (clear)
+      {
+        state &= ~taken;
+      }
+      return taken;
+    }
+
+  private:
+    std::mutex lock;
+    std::condition_variable condition;
+    uint32_t state = 0;
+  };
+
+  class Mutex
+  {
+  public:
+    osStatus lock()
+    {
+      mutex.lock();
+      return osOK;
+    }
+
+    bool trylock()
+    {
+      return mutex.try_lock();
+    }
+
+    osStatus unlock()
+    {
+      mutex.unlock();
+      return osOK;
+    }
+
+  private:
+    std::mutex mutex;
+  };
+
+  class Thread
+  {
+  public:
+    Thread(osPriority = osPriorityNormal, uint32_t = 4096) {}
+
+    osStatus start(void (*task)())
+    {
+      std::thread(task).detach();
+      return osOK;
+    }
+  };
+}
+
+#endif // SIM_RTOS_H
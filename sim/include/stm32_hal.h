@@ -0,0 +1,58 @@
+#ifndef SIM_STM32_HAL_H
+#define SIM_STM32_HAL_H
+
+#include <stdint.h>
+#include <atomic>
+
+// CMSIS and STM32 HAL calls made by the firmware. Both cores are host threads sharing one cache coherent
+// memory, so barriers become full fences and cache maintenance, clocks and the MPU are no-ops.
+
+inline void __DSB() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline void __ISB() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline void __DMB() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+
+inline void SCB_CleanDCache_by_Addr(uint32_t *, int32_t) {}
+inline void SCB_InvalidateDCache_by_Addr(uint32_t *, int32_t) {}
+inline void SCB_CleanInvalidateDCache_by_Addr(uint32_t *, int32_t) {}
+
+#define __HAL_RCC_D2SRAM1_CLK_ENABLE()
+#define __HAL_RCC_D2SRAM2_CLK_ENABLE()
+#define __HAL_RCC_BKPRAM_CLK_ENABLE()
+#define __HAL_RCC_HSEM_CLK_ENABLE()
+
+inline void HAL_PWR_EnableBkUpAccess() {}
+
+struct MPU_Region_InitTypeDef
+{
+  uint8_t Enable;
+  uint8_t Number;
+  uint32_t BaseAddress;
+  uint8_t Size;
+  uint8_t SubRegionDisable;
+  uint8_t TypeExtField;
+  uint8_t AccessPermission;
+  uint8_t DisableExec;
+  uint8_t IsShareable;
+  uint8_t IsCacheable;
+  uint8_t IsBufferable;
+};
+
+#define MPU_REGION_ENABLE 0x01
+#define MPU_REGION_NUMBER15 0x0F
+#define MPU_REGION_SIZE_256KB 0x11
+#define MPU_TEX_LEVEL1 0x01
+#define MPU_REGION_FULL_ACCESS 0x03
+#define MPU_INSTRUCTION_ACCESS_DISABLE 0x01
+#define MPU_ACCESS_SHAREABLE 0x01
+#define MPU_ACCESS_NOT_CACHEABLE 0x00
+#define MPU_ACCESS_NOT_BUFFERABLE 0x00
+#define MPU_PRIVILEGED_DEFAULT 0x04
+
+inline void HAL_MPU_Disable() {}
+inline void HAL_MPU_ConfigRegion(MPU_Region_InitTypeDef *) {}
+inline void HAL_MPU_Enable(uint32_t) {}
+
+// Restarts the simulator with the RAM contents kept, as a warm reset does, see sim.cpp
+[[noreturn]] void HAL_NVIC_SystemReset();
+
+#endif // SIM_STM32_HAL_H
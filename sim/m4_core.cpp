@@ -0,0 +1,14 @@
+// The M4 firmware in its own namespace, so its setup(), loop() and globals stay apart from the M7's as they
+// would in a separate image. Headers are included here first, their guards keep them out of the namespace.
+#include <Arduino.h>
+#include <Watchdog.h>
+#include "data_frame.h"
+#include "counter_totals.h"
+#include "notify.h"
+#include "duty_cycle.h"
+
+namespace m4
+{
+#include "../src/duty_cycle.cpp"
+#include "../src/m4.cpp"
+}
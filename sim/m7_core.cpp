@@ -0,0 +1,36 @@
+// The M7 firmware in its own namespace, see m4_core.cpp. The modules both cores link are built once, outside.
+#include <Arduino.h>
+#include <Notecard.h>
+#include <WiFi.h>
+#include <SPI.h>
+#include <PortentaEthernet.h>
+#include <Ethernet.h>
+#include <Watchdog.h>
+#include <ArduinoModbus.h>
+#include <ArduinoRS485.h>
+#include <ArduinoJson.h>
+#include "config.h"
+#include "status.h"
+#include "data_frame.h"
+#include "payload.h"
+#include "notify.h"
+#include "duty_cycle.h"
+#include "frame_spool.h"
+#include "edge_batch.h"
+#include "mqtt_client.h"
+#include "tls_client.h"
+#include "ota_update.h"
+#include "modbus_decode.h"
+#include "benchmark.h"
+#include "self_test.h"
+#include "note_queue.h"
+#include "SDRAM.h"
+
+namespace m7
+{
+#include "../src/duty_cycle.cpp"
+#include "../src/m7.cpp"
+}
+
+// The firmware version for config and payload, defined by m7.cpp
+const char *VERSION = m7::VERSION;
@@ -0,0 +1,350 @@
+#include <WiFi.h>
+#include <Ethernet.h>
+#include "sim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <vector>
+
+WiFiClass WiFi;
+EthernetClass Ethernet;
+
+struct SIM_OUTAGE
+{
+  int link; // SimLink, or SIM_LINKS for both
+  uint64_t start;
+  uint64_t end;
+};
+
+// Set up before the cores start, read only afterwards
+static std::vector<SIM_OUTAGE> outages;
+
+// How long a connect may take, as the core's network stacks
+static const int connectTimeout = 5000;
+
+bool addSimOutage(const char *text)
+{
+  int link = SIM_LINKS;
+  if (strncmp(text, "eth:", 4) == 0)
+  {
+    link = SIM_LINK_ETHERNET;
+    text += 4;
+  }
+  else if (strncmp(text, "wifi:", 5) == 0)
+  {
+    link = SIM_LINK_WIFI;
+    text += 5;
+  }
+
+  double start, length;
+  char extra;
+  if (sscanf(text, "%lf+%lf%c", &start, &length, &extra) != 2 || start < 0 || length <= 0)
+  {
+    return false;
+  }
+  outages.push_back({link, (uint64_t)(start * 1e6), (uint64_t)((start + length) * 1e6)});
+  return true;
+}
+
+bool simLinkUp(SimLink link)
+{
+  const uint64_t now = simMicros();
+  for (const SIM_OUTAGE &outage : outages)
+  {
+    if ((outage.link == link || outage.link == SIM_LINKS) && now >= outage.start && now < outage.end)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const IPAddress simLocalIp(127, 0, 0, 1);
+static const IPAddress simGateway(127, 0, 0, 1);
+static const IPAddress simSubnet(255, 0, 0, 0);
+
+int WiFiClass::begin(const char *ssid)
+{
+  return begin(ssid, nullptr);
+}
+
+int WiFiClass::begin(const char *, const char *)
+{
+  joined = true;
+  return status();
+}
+
+void WiFiClass::config(IPAddress, IPAddress, IPAddress, IPAddress)
+{
+}
+
+void WiFiClass::disconnect()
+{
+  joined = false;
+}
+
+uint8_t WiFiClass::status()
+{
+  if (!joined)
+  {
+    return WL_IDLE_STATUS;
+  }
+  return simLinkUp(SIM_LINK_WIFI) ? WL_CONNECTED : WL_CONNECTION_LOST;
+}
+
+int8_t WiFiClass::scanNetworks()
+{
+  return 1;
+}
+
+const char *WiFiClass::SSID(uint8_t)
+{
+  return "sim";
+}
+
+int32_t WiFiClass::RSSI(uint8_t)
+{
+  return -50;
+}
+
+uint8_t WiFiClass::encryptionType(uint8_t)
+{
+  return ENC_TYPE_CCMP;
+}
+
+int32_t WiFiClass::RSSI()
+{
+  return status() == WL_CONNECTED ? -50 : 0;
+}
+
+uint8_t *WiFiClass::macAddress(uint8_t *mac)
+{
+  static const uint8_t address[6] = {0x02, 0x00, 0x00, 0x00, 0x57, 0x01};
+  memcpy(mac, address, sizeof(address));
+  return mac;
+}
+
+IPAddress WiFiClass::localIP()
+{
+  return status() == WL_CONNECTED ? simLocalIp : IPAddress();
+}
+
+IPAddress WiFiClass::gatewayIP()
+{
+  return simGateway;
+}
+
+IPAddress WiFiClass::subnetMask()
+{
+  return simSubnet;
+}
+
+IPAddress WiFiClass::dnsIP(int)
+{
+  return simGateway;
+}
+
+int EthernetClass::begin(uint8_t *, unsigned long, unsigned long)
+{
+  leased = linkStatus() == LinkON;
+  return leased ? 1 : 0;
+}
+
+int EthernetClass::begin(uint8_t *, IPAddress, IPAddress, IPAddress, IPAddress)
+{
+  leased = true;
+  return 1;
+}
+
+EthernetLinkStatus EthernetClass::linkStatus()
+{
+  return simLinkUp(SIM_LINK_ETHERNET) ? LinkON : LinkOFF;
+}
+
+void EthernetClass::macAddress(uint8_t *mac)
+{
+  static const uint8_t address[6] = {0x02, 0x00, 0x00, 0x00, 0xE7, 0x01};
+  memcpy(mac, address, sizeof(address));
+}
+
+IPAddress EthernetClass::localIP()
+{
+  return leased ? simLocalIp : IPAddress();
+}
+
+IPAddress EthernetClass::gatewayIP()
+{
+  return simGateway;
+}
+
+IPAddress EthernetClass::subnetMask()
+{
+  return simSubnet;
+}
+
+IPAddress EthernetClass::dnsServerIP()
+{
+  return simGateway;
+}
+
+// Drop the connection once its link goes down, the other end sees it as a silent network failure
+bool SocketClient::linkLost()
+{
+  if (socket >= 0 && !simLinkUp(link))
+  {
+    stop();
+  }
+  return socket < 0;
+}
+
+int SocketClient::connect(IPAddress ip, uint16_t port)
+{
+  char host[16];
+  snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return connect(host, port);
+}
+
+int SocketClient::connect(const char *host, uint16_t port)
+{
+  stop();
+  if (!simLinkUp(link))
+  {
+    delay(connectTimeout);
+    return 0;
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &addresses) != 0)
+  {
+    return 0;
+  }
+
+  // Connect without blocking past the timeout, then keep the socket non-blocking for reads
+  socket = ::socket(addresses->ai_family, addresses->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  bool ok = socket >= 0;
+  if (ok && ::connect(socket, addresses->ai_addr, addresses->ai_addrlen) != 0)
+  {
+    pollfd pending = {socket, POLLOUT, 0};
+    int error = errno;
+    socklen_t length = sizeof(error);
+    ok = error == EINPROGRESS && poll(&pending, 1, connectTimeout) == 1 &&
+         getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+  }
+  freeaddrinfo(addresses);
+
+  if (!ok)
+  {
+    stop();
+    return 0;
+  }
+  const int noDelay = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  return 1;
+}
+
+size_t SocketClient::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+// Blocks until everything is sent or the connection fails, as the core's clients do
+size_t SocketClient::write(const uint8_t *data, size_t length)
+{
+  size_t written = 0;
+  while (written < length && !linkLost())
+  {
+    const ssize_t sent = send(socket, data + written, length - written, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      written += sent;
+      continue;
+    }
+
+    pollfd pending = {socket, POLLOUT, 0};
+    if (sent == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || poll(&pending, 1, timeout) != 1)
+    {
+      stop();
+    }
+  }
+  return written;
+}
+
+int SocketClient::available()
+{
+  int pending = 0;
+  if (linkLost() || ioctl(socket, FIONREAD, &pending) != 0)
+  {
+    return 0;
+  }
+  return pending;
+}
+
+int SocketClient::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int SocketClient::read(uint8_t *data, size_t length)
+{
+  if (linkLost())
+  {
+    return -1;
+  }
+
+  const ssize_t received = recv(socket, data, length, 0);
+  if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    stop();
+    return -1;
+  }
+  return received > 0 ? (int)received : -1;
+}
+
+int SocketClient::peek()
+{
+  uint8_t value;
+  if (linkLost() || recv(socket, &value, 1, MSG_PEEK) != 1)
+  {
+    return -1;
+  }
+  return value;
+}
+
+void SocketClient::stop()
+{
+  if (socket >= 0)
+  {
+    close(socket);
+    socket = -1;
+  }
+}
+
+// Closed once the peer has hung up and everything it sent has been read
+uint8_t SocketClient::connected()
+{
+  if (linkLost())
+  {
+    return 0;
+  }
+
+  uint8_t value;
+  const ssize_t received = recv(socket, &value, 1, MSG_PEEK);
+  if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    stop();
+    return 0;
+  }
+  return 1;
+}
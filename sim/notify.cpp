@@ -0,0 +1,70 @@
+#include "notify.h"
+#include "data_frame.h"
+#include "sim.h"
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <chrono>
+
+// The HSEM interrupt becomes a latched flag under a condition variable, with the same semantics:
+// a notification sent before the M7 waits wakes it straight away.
+static std::mutex frameLock;
+static std::condition_variable frameCondition;
+static bool frameAvailable = false;
+
+// Frame log of setSimFrameLog, written from the M4 as it notifies
+static FILE *frameLog = nullptr;
+static unsigned int loggedFrameNumber = 0;
+
+void setSimFrameLog(const char *path)
+{
+  frameLog = fopen(path, "a");
+  if (frameLog)
+  {
+    setvbuf(frameLog, nullptr, _IOLBF, 0);
+  }
+}
+
+// The M4 notifies right after writing a frame, so a newer frame number at the head was taken just now. Urgent
+// events and edges notify as well and leave it as it was.
+static void logFrameTaken()
+{
+  unsigned int head;
+  if (!frameLog || !readJournaledIndex(&data_frame_buffer_sdram->head, dataFrameCapacity, &head))
+  {
+    return;
+  }
+  const unsigned int newest = (head + dataFrameCapacity - 1) % dataFrameCapacity;
+  const unsigned int frameNumber = data_frame_buffer_sdram->frames[newest].frameNumber;
+  if (frameNumber > loggedFrameNumber)
+  {
+    const auto host = std::chrono::steady_clock::now().time_since_epoch();
+    fprintf(frameLog, "{\"fn\":%u,\"at\":%llu,\"host_us\":%lld}\n", frameNumber,
+            (unsigned long long)(simMicros() / 1000),
+            (long long)std::chrono::duration_cast<std::chrono::microseconds>(host).count());
+    loggedFrameNumber = frameNumber;
+  }
+}
+
+void initFrameNotification()
+{
+}
+
+void notifyFrameAvailable()
+{
+  logFrameTaken();
+  {
+    std::lock_guard<std::mutex> lock(frameLock);
+    frameAvailable = true;
+  }
+  frameCondition.notify_one();
+}
+
+bool waitForFrame(unsigned long timeoutMs)
+{
+  std::unique_lock<std::mutex> lock(frameLock);
+  const bool notified = frameCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), []
+                                                { return frameAvailable; });
+  frameAvailable = false;
+  return notified;
+}
@@ -0,0 +1,260 @@
+#include <ArduinoModbus.h>
+#include <ArduinoRS485.h>
+#include <Notecard.h>
+#include "sim.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+RS485Class RS485;
+ModbusRTUClientClass ModbusRTUClient;
+
+int ModbusRTUClientClass::begin(unsigned long, uint16_t)
+{
+  return 1;
+}
+
+void ModbusRTUClientClass::setTimeout(unsigned long)
+{
+}
+
+int ModbusRTUClientClass::requestFrom(int id, int type, int address, int count)
+{
+  if (count <= 0 || count > (int)(sizeof(registers) / sizeof(registers[0])) || type != INPUT_REGISTERS)
+  {
+    this->count = 0;
+    return 0;
+  }
+
+  // A minute long cycle of +-1% so consecutive frames differ
+  const double drift = 1 + 0.01 * sin(2 * M_PI * (simMicros() / 1e6) / 60);
+  for (int i = 0; i + 1 < count; i += 2)
+  {
+    const float value = (float)((id * 1000 + address + i) / 10.0 * drift);
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    registers[i] = bits >> 16;
+    registers[i + 1] = bits & 0xFFFF;
+  }
+  this->count = count;
+  position = 0;
+  return count;
+}
+
+long ModbusRTUClientClass::read()
+{
+  return position < count ? registers[position++] : -1;
+}
+
+const char *ModbusRTUClientClass::lastError()
+{
+  return "Invalid request";
+}
+
+struct J
+{
+  enum Type
+  {
+    OBJECT,
+    STRING,
+    NUMBER,
+    BOOL
+  } type;
+  std::string text;
+  double number = 0;
+  std::vector<std::pair<std::string, J *>> members;
+};
+
+J *JCreateObject()
+{
+  return new J{J::OBJECT};
+}
+
+void JDelete(J *item)
+{
+  if (!item)
+  {
+    return;
+  }
+  for (auto &member : item->members)
+  {
+    JDelete(member.second);
+  }
+  delete item;
+}
+
+bool JAddItemToObject(J *object, const char *name, J *item)
+{
+  if (!object || !item || object->type != J::OBJECT)
+  {
+    return false;
+  }
+  object->members.emplace_back(name, item);
+  return true;
+}
+
+J *JAddStringToObject(J *object, const char *name, const char *value)
+{
+  J *item = new J{J::STRING};
+  item->text = value;
+  return JAddItemToObject(object, name, item) ? item : (delete item, nullptr);
+}
+
+J *JAddNumberToObject(J *object, const char *name, double value)
+{
+  J *item = new J{J::NUMBER};
+  item->number = value;
+  return JAddItemToObject(object, name, item) ? item : (delete item, nullptr);
+}
+
+J *JAddBoolToObject(J *object, const char *name, bool value)
+{
+  J *item = new J{J::BOOL};
+  item->number = value;
+  return JAddItemToObject(object, name, item) ? item : (delete item, nullptr);
+}
+
+const char *JGetString(J *object, const char *name)
+{
+  if (object)
+  {
+    for (auto &member : object->members)
+    {
+      if (member.first == name && member.second->type == J::STRING)
+      {
+        return member.second->text.c_str();
+      }
+    }
+  }
+  return "";
+}
+
+static void appendJsonString(std::string &json, const std::string &text)
+{
+  json += '"';
+  for (const char c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      json += '\\';
+      json += c;
+    }
+    else if ((unsigned char)c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json += escaped;
+    }
+    else
+    {
+      json += c;
+    }
+  }
+  json += '"';
+}
+
+static void appendJson(std::string &json, const J *item)
+{
+  switch (item->type)
+  {
+  case J::STRING:
+    appendJsonString(json, item->text);
+    break;
+  case J::NUMBER:
+  {
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", item->number);
+    json += number;
+    break;
+  }
+  case J::BOOL:
+    json += item->number ? "true" : "false";
+    break;
+  default:
+    json += '{';
+    for (size_t i = 0; i < item->members.size(); i++)
+    {
+      if (i > 0)
+      {
+        json += ',';
+      }
+      appendJsonString(json, item->members[i].first);
+      json += ':';
+      appendJson(json, item->members[i].second);
+    }
+    json += '}';
+  }
+}
+
+static FILE *notecardSink = nullptr;
+static std::mutex notecardSinkLock;
+
+void setSimNotecardSink(const char *path)
+{
+  notecardSink = path ? fopen(path, "a") : nullptr;
+  if (path && !notecardSink)
+  {
+    fprintf(stderr, "[sim] cannot open %s for the Notecard requests\n", path);
+  }
+}
+
+// Each request is written with the simulation time it was received at
+static void recordRequest(const J *request)
+{
+  std::lock_guard<std::mutex> lock(notecardSinkLock);
+  if (!notecardSink)
+  {
+    return;
+  }
+
+  std::string json;
+  appendJson(json, request);
+  fprintf(notecardSink, "{\"at\":%llu,\"request\":%s}\n", (unsigned long long)(simMicros() / 1000), json.c_str());
+  fflush(notecardSink);
+}
+
+J *Notecard::newRequest(const char *request)
+{
+  J *object = JCreateObject();
+  JAddStringToObject(object, "req", request);
+  return object;
+}
+
+bool Notecard::sendRequest(J *request)
+{
+  if (!request)
+  {
+    return false;
+  }
+  recordRequest(request);
+  JDelete(request);
+  return true;
+}
+
+J *Notecard::requestAndResponse(J *request)
+{
+  if (!request)
+  {
+    return nullptr;
+  }
+  recordRequest(request);
+  const bool version = strcmp(JGetString(request, "req"), "card.version") == 0;
+  JDelete(request);
+
+  J *response = JCreateObject();
+  if (version)
+  {
+    JAddStringToObject(response, "version", "notecard-sim");
+  }
+  return response;
+}
+
+bool Notecard::responseError(J *response)
+{
+  return !response || JGetString(response, "err")[0] != '\0';
+}
+
+void Notecard::deleteResponse(J *response)
+{
+  JDelete(response);
+}
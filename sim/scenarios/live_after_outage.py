@@ -0,0 +1,113 @@
+"""
+Simulator scenario: after an outage the live topic carries the current frame, never the backlog.
+
+Runs the native build with its own broker through a 60 s outage at one frame a second and checks the sink:
+- frame numbers on the live topic only ever go up, so no backlog frame is published live
+- the first live frame after the outage is newer than every frame taken during it
+- every frame taken during the outage arrives on /backfill, and none is missing from either topic
+
+    pio run -e native && python3 sim/scenarios/live_after_outage.py
+
+Exits non-zero on the first check that fails.
+"""
+
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+PROGRAM = os.environ.get("SIM_PROGRAM", ".pio/build/native/program")
+PORT = 18830
+INTERVAL = 1.0
+OUTAGE_START = 20
+OUTAGE_LENGTH = 60
+DURATION = 150
+
+CONFIG = {
+    "did": "SIMLIVE1",
+    "com": "ETHERNET",
+    "msv": "127.0.0.1",
+    "mpo": PORT,
+    "mci": "sim-live",
+    "mtp": "",
+    "fbt": True,
+    "sin": int(INTERVAL * 1000),
+    "bfr": 600,
+    "bfb": 10,
+}
+
+
+def fail(message):
+    print("FAIL: " + message)
+    sys.exit(1)
+
+
+def run(directory):
+    config = os.path.join(directory, "config.json")
+    sink = os.path.join(directory, "messages.jsonl")
+    with open(config, "w") as file:
+        json.dump(CONFIG, file)
+
+    subprocess.run(
+        [PROGRAM, "--config", config, "--broker", str(PORT), "--sink", sink, "--input", "1=pulse:2",
+         "--outage", "%d+%d" % (OUTAGE_START, OUTAGE_LENGTH), "--duration", str(DURATION)],
+        check=True, stdout=subprocess.DEVNULL)
+
+    # Frames by topic in arrival order, as (arrival ms, fn)
+    live, backfill = [], []
+    topic = "busroot/v2/dau/" + CONFIG["did"]
+    with open(sink) as file:
+        for line in file:
+            message = json.loads(line)
+            payload = json.loads(message["payload"])
+            if "fn" not in payload:
+                continue
+            if message["topic"] == topic:
+                live.append((message["at"], payload["fn"]))
+            elif message["topic"] == topic + "/backfill":
+                backfill.append((message["at"], payload["fn"]))
+    return live, backfill
+
+
+def check(live, backfill):
+    if not live or not backfill:
+        fail("expected frames on both topics, got %d live and %d backfill" % (len(live), len(backfill)))
+
+    newest = 0
+    for at, fn in live:
+        if fn <= newest:
+            fail("live frame %d at %d ms after frame %d" % (fn, at, newest))
+        newest = fn
+
+    # Frames the broker saw before the outage, and the first live one once it ended
+    outage_end = (OUTAGE_START + OUTAGE_LENGTH) * 1000
+    before = max(fn for at, fn in live if at < OUTAGE_START * 1000)
+    after = [(at, fn) for at, fn in live if at >= outage_end]
+    if not after:
+        fail("no live frame after the outage")
+    first_at, first = after[0]
+
+    during = sorted(fn for at, fn in backfill)
+    if not during or max(during) >= first:
+        fail("first live frame %d after the outage is not newer than the backfill (up to %s)"
+             % (first, max(during) if during else "none"))
+    if first - before < OUTAGE_LENGTH / INTERVAL * 0.9:
+        fail("first live frame %d after the outage is not the current one, %d was live before it" % (first, before))
+
+    missing = set(range(before + 1, first)) - set(during)
+    if missing:
+        fail("%d outage frames never arrived on /backfill, e.g. %d" % (len(missing), min(missing)))
+
+    print("ok: %d live, %d backfill, first live frame after the outage %d at %.1f s"
+          % (len(live), len(backfill), first, first_at / 1000))
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        live, backfill = run(directory)
+    check(live, backfill)
+
+
+if __name__ == "__main__":
+    main()
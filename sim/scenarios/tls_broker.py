@@ -0,0 +1,129 @@
+"""
+Simulator scenario: MQTT over TLS against the simulator's broker serving TLS with a self-signed certificate.
+
+Runs the native build with the broker key pinned (mpn) through a 10 s outage, then again with a wrong pin:
+- the first connect runs a full handshake and frames arrive over it
+- the reconnect after the outage resumes the TLS session and frames arrive again
+- with a pin that does not match the broker's key the device never gets to publish, and says why
+
+    pio run -e native && python3 sim/scenarios/tls_broker.py
+
+Needs the openssl command line tool for the certificate. Exits non-zero on the first check that fails.
+"""
+
+import hashlib
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+PROGRAM = os.environ.get("SIM_PROGRAM", ".pio/build/native/program")
+PORT = 18831
+OUTAGE_START = 15
+OUTAGE_LENGTH = 10
+DURATION = 45
+MISMATCH_DURATION = 15
+
+CONFIG = {
+    "did": "SIMTLS1",
+    "com": "ETHERNET",
+    "msv": "127.0.0.1",
+    "mpo": PORT,
+    "mci": "sim-tls",
+    "mtp": "",
+    "fbt": True,
+    "sin": 1000,
+    "mtl": True,
+}
+
+HANDSHAKE = re.compile(r"TLS handshake: (\d+) ms( \(resumed\))?")
+
+
+def fail(message):
+    print("FAIL: " + message)
+    sys.exit(1)
+
+
+# A self-signed P-256 certificate, and the pin of its public key as the README describes
+def make_certificate(directory):
+    certificate = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(
+        ["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+         "-keyout", key, "-out", certificate, "-days", "2", "-subj", "/CN=127.0.0.1"],
+        check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    public_key = subprocess.run(["openssl", "x509", "-in", certificate, "-pubkey", "-noout"],
+                                check=True, capture_output=True).stdout
+    der = subprocess.run(["openssl", "pkey", "-pubin", "-outform", "der"], input=public_key,
+                         check=True, capture_output=True).stdout
+    return certificate, key, hashlib.sha256(der).hexdigest()
+
+
+# Serial output and the frames that reached the broker, as (arrival ms, fn)
+def run(directory, name, pin, certificate, key, duration, outage=None):
+    config = os.path.join(directory, name + ".json")
+    sink = os.path.join(directory, name + ".jsonl")
+    with open(config, "w") as file:
+        json.dump(dict(CONFIG, mpn=pin), file)
+
+    arguments = [PROGRAM, "--config", config, "--broker", str(PORT), "--tls", certificate + ":" + key,
+                 "--sink", sink, "--input", "1=pulse:2", "--duration", str(duration)]
+    if outage:
+        arguments += ["--outage", "%d+%d" % outage]
+    serial = subprocess.run(arguments, check=True, capture_output=True, text=True).stdout
+
+    frames = []
+    if os.path.exists(sink):
+        with open(sink) as file:
+            for line in file:
+                message = json.loads(line)
+                payload = json.loads(message["payload"])
+                if message["client"] == CONFIG["mci"] and "fn" in payload:
+                    frames.append((message["at"], payload["fn"]))
+    return serial, frames
+
+
+def check_pinned(serial, frames):
+    handshakes = [(int(ms), bool(resumed)) for ms, resumed in HANDSHAKE.findall(serial)]
+    if len(handshakes) < 2:
+        fail("expected a handshake before and after the outage, got %d" % len(handshakes))
+    if handshakes[0][1]:
+        fail("the first handshake claims to resume a session")
+    if not any(resumed for ms, resumed in handshakes[1:]):
+        fail("no reconnect after the outage resumed the TLS session")
+
+    outage_end = (OUTAGE_START + OUTAGE_LENGTH) * 1000
+    before = [fn for at, fn in frames if at < OUTAGE_START * 1000]
+    after = [fn for at, fn in frames if at >= outage_end]
+    if not before or not after:
+        fail("expected frames over TLS before and after the outage, got %d and %d" % (len(before), len(after)))
+
+    full = handshakes[0][0]
+    resumed = min(ms for ms, resumed in handshakes if resumed)
+    print("ok: full handshake %d ms, resumed %d ms, %d frames before and %d after the outage"
+          % (full, resumed, len(before), len(after)))
+
+
+def check_mismatch(serial, frames):
+    if frames:
+        fail("%d frames were published with a wrong pin" % len(frames))
+    if "tls=-0x2700" not in serial:
+        fail("no connect failed with the certificate verification error")
+    print("ok: wrong pin refused, no frames published")
+
+
+def main():
+    with tempfile.TemporaryDirectory() as directory:
+        certificate, key, pin = make_certificate(directory)
+        serial, frames = run(directory, "pinned", pin, certificate, key, DURATION, (OUTAGE_START, OUTAGE_LENGTH))
+        check_pinned(serial, frames)
+
+        wrong = ("0" if pin[0] != "0" else "1") + pin[1:]
+        serial, frames = run(directory, "mismatch", wrong, certificate, key, MISMATCH_DURATION)
+        check_mismatch(serial, frames)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,429 @@
+#include <Arduino.h>
+#include <Watchdog.h>
+#include <ArduinoJson.h>
+#include <FlashIAPBlockDevice.h>
+#include "sim.h"
+#include "config.h"
+#include "config_store.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace m4
+{
+  void setup();
+  void loop();
+}
+
+namespace m7
+{
+  void setup();
+  void loop();
+}
+
+// Config storage of config.cpp, written with --config before the M7 starts
+extern FlashIAPBlockDevice blockDevice;
+
+// Carried over a simulated reset in the environment: the simulation start time and the memory descriptors
+#define SIM_ENV_EPOCH "OPTA_SIM_EPOCH"
+#define SIM_ENV_RAM "OPTA_SIM_RAM_FD"
+#define SIM_ENV_FLASH "OPTA_SIM_FLASH_FD"
+
+static const char usage[] =
+    "Usage: program [options]\n"
+    "  --config <file>          JSON config (config token keys) written to the flash on a cold start\n"
+    "  --flash <file>           keep the internal flash, so the config, in a file across runs\n"
+    "  --input <ch>=<waveform>  waveform on a channel from the start, see sim.h (0 button, 1-6, 7-8 analog)\n"
+    "  --script <file>          timed waveforms, lines of \"<ms> <ch>=<waveform>\"\n"
+    "  --outage [eth:|wifi:]<start s>+<length s>  network outage, may be repeated\n"
+    "  --broker <port>          run a minimal MQTT broker on 127.0.0.1 as the sink\n"
+    "  --sink <file>            where the broker writes received messages, stdout by default\n"
+    "  --latency <ms>           round trip the broker adds, by holding every packet that long\n"
+    "  --tls <cert>:<key>       the broker serves TLS with these PEM files\n"
+    "  --notecard <file>        where Notecard requests are written\n"
+    "  --frames <file>          where the number and time of every frame taken are written\n"
+    "  --duration <s>           stop after this long and report the edges generated on each input\n";
+
+static uint64_t epochNanos;
+static uint64_t bootNanos;
+static uint8_t *flashImage;
+static char **arguments;
+
+static uint64_t monotonicNanos()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t simMicros()
+{
+  return (monotonicNanos() - epochNanos) / 1000;
+}
+
+uint64_t simBootMicros()
+{
+  return (monotonicNanos() - bootNanos) / 1000;
+}
+
+uint8_t *simFlashImage()
+{
+  return flashImage;
+}
+
+// Descriptor passed on by the previous boot, -1 on a cold start
+static int inheritedDescriptor(const char *name)
+{
+  const char *value = getenv(name);
+  return value ? atoi(value) : -1;
+}
+
+// RAM is zero on a cold start and kept over a reset. Regions are mapped at their hardware addresses.
+static bool mapMemory(bool warm)
+{
+  const size_t size = SIM_D2_SRAM_SIZE + SIM_SRAM4_SIZE + SIM_BACKUP_SRAM_SIZE;
+  int ram = warm ? inheritedDescriptor(SIM_ENV_RAM) : -1;
+  if (ram < 0)
+  {
+    ram = memfd_create("opta-ram", 0);
+    if (ram < 0 || ftruncate(ram, size) != 0)
+    {
+      return false;
+    }
+  }
+
+  const struct
+  {
+    uintptr_t address;
+    size_t size;
+  } regions[] = {{SIM_D2_SRAM_ADDRESS, SIM_D2_SRAM_SIZE}, {SIM_SRAM4_ADDRESS, SIM_SRAM4_SIZE}, {SIM_BACKUP_SRAM_ADDRESS, SIM_BACKUP_SRAM_SIZE}};
+  off_t offset = 0;
+  for (const auto &region : regions)
+  {
+    void *mapped = mmap((void *)region.address, region.size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED_NOREPLACE, ram, offset);
+    if (mapped != (void *)region.address)
+    {
+      fprintf(stderr, "[sim] cannot map memory at 0x%08lX\n", (unsigned long)region.address);
+      return false;
+    }
+    offset += region.size;
+  }
+
+  char value[16];
+  snprintf(value, sizeof(value), "%d", ram);
+  setenv(SIM_ENV_RAM, value, 1);
+  return true;
+}
+
+// The flash is erased (0xFF) when new, from a file with --flash or in memory otherwise
+static bool mapFlash(bool warm, const char *path)
+{
+  int flash = warm ? inheritedDescriptor(SIM_ENV_FLASH) : -1;
+  if (flash < 0)
+  {
+    flash = path ? open(path, O_RDWR | O_CREAT, 0644) : memfd_create("opta-flash", 0);
+    struct stat status;
+    if (flash < 0 || fstat(flash, &status) != 0)
+    {
+      fprintf(stderr, "[sim] cannot open the flash image\n");
+      return false;
+    }
+
+    if (status.st_size < SIM_FLASH_SIZE)
+    {
+      std::vector<uint8_t> erased(SIM_FLASH_SIZE - status.st_size, 0xFF);
+      if (pwrite(flash, erased.data(), erased.size(), status.st_size) != (ssize_t)erased.size())
+      {
+        return false;
+      }
+    }
+  }
+
+  flashImage = (uint8_t *)mmap(nullptr, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flash, 0);
+  if (flashImage == MAP_FAILED)
+  {
+    return false;
+  }
+
+  char value[16];
+  snprintf(value, sizeof(value), "%d", flash);
+  setenv(SIM_ENV_FLASH, value, 1);
+  return true;
+}
+
+// Store a JSON config as the config editor does
+static bool writeConfig(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    return false;
+  }
+  char text[4096];
+  const size_t length = fread(text, 1, sizeof(text), file);
+  fclose(file);
+
+  JsonDocument doc;
+  if (deserializeJson(doc, text, length) || !doc.is<JsonObject>())
+  {
+    return false;
+  }
+  if (!doc.containsKey("v"))
+  {
+    doc["v"] = VERSION;
+  }
+
+  uint8_t msgPack[CONFIG_RECORD_MAX_LENGTH];
+  const size_t packed = serializeMsgPack(doc, msgPack, sizeof(msgPack));
+  initFlashStorage();
+  const bool ok = packed > 0 && packed < sizeof(msgPack) && writeConfigRecord(&blockDevice, msgPack, packed);
+  deinitFlashStorage();
+  return ok;
+}
+
+void simReset(const char *reason)
+{
+  fprintf(stderr, "[sim] reset: %s\n", reason);
+  fflush(stdout);
+  fflush(stderr);
+
+  char epoch[24];
+  snprintf(epoch, sizeof(epoch), "%llu", (unsigned long long)epochNanos);
+  setenv(SIM_ENV_EPOCH, epoch, 1);
+  execv("/proc/self/exe", arguments);
+
+  fprintf(stderr, "[sim] cannot restart\n");
+  _exit(3);
+}
+
+void HAL_NVIC_SystemReset()
+{
+  simReset("system reset requested");
+}
+
+// Watchdogs per core, the thread names the core
+static thread_local const char *coreName = "main";
+static std::mutex watchdogLock;
+static std::vector<std::pair<const char *, mbed::Watchdog *>> watchdogs;
+
+namespace mbed
+{
+  Watchdog &Watchdog::get_instance()
+  {
+    static thread_local Watchdog watchdog;
+    return watchdog;
+  }
+
+  bool Watchdog::start(uint32_t timeout)
+  {
+    kick();
+    if (this->timeout.exchange(timeout) == 0)
+    {
+      std::lock_guard<std::mutex> lock(watchdogLock);
+      watchdogs.emplace_back(coreName, this);
+    }
+    return true;
+  }
+
+  bool Watchdog::start()
+  {
+    return start(get_max_timeout());
+  }
+
+  void Watchdog::kick()
+  {
+    lastKick = simBootMicros();
+  }
+
+  // The largest IWDG timeout of the STM32H7
+  uint32_t Watchdog::get_max_timeout() const
+  {
+    return 32768;
+  }
+
+  bool Watchdog::expired(uint64_t now) const
+  {
+    const uint32_t limit = timeout;
+    const uint64_t kicked = lastKick;
+    return limit > 0 && now > kicked && now - kicked > (uint64_t)limit * 1000;
+  }
+}
+
+static void runCore(const char *name, void (*setup)(), void (*loop)())
+{
+  coreName = name;
+  setup();
+  for (;;)
+  {
+    loop();
+  }
+}
+
+void bootM4()
+{
+  static std::once_flag booted;
+  std::call_once(booted, []
+                 { std::thread(runCore, "M4", m4::setup, m4::loop).detach(); });
+}
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+  stopRequested = 1;
+}
+
+// Edges the waveforms produced, to compare against the totals the DAU published
+static void reportEdges()
+{
+  const uint64_t now = simMicros();
+  fprintf(stderr, "[sim] after %.1f s, falling edges generated:", now / 1e6);
+  for (unsigned int channel = 0; channel < SIM_FIRST_ANALOG_CHANNEL; channel++)
+  {
+    fprintf(stderr, " %s%u=%llu", channel == 0 ? "button" : "input", channel, (unsigned long long)simFallingEdges(channel, now));
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+  arguments = argv;
+  bootNanos = monotonicNanos();
+  const char *epoch = getenv(SIM_ENV_EPOCH);
+  const bool warm = epoch != nullptr;
+  epochNanos = warm ? strtoull(epoch, nullptr, 10) : bootNanos;
+
+  const char *configPath = nullptr;
+  const char *flashPath = nullptr;
+  const char *sinkPath = nullptr;
+  int brokerPort = 0;
+  double duration = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    const char *option = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool ok = value != nullptr;
+    if (strcmp(option, "--config") == 0 && ok)
+    {
+      configPath = value;
+    }
+    else if (strcmp(option, "--flash") == 0 && ok)
+    {
+      flashPath = value;
+    }
+    else if (strcmp(option, "--input") == 0 && ok)
+    {
+      unsigned int channel;
+      int consumed = 0;
+      ok = sscanf(value, "%u=%n", &channel, &consumed) == 1 && consumed > 0 && addSimWaveform(channel, 0, value + consumed);
+    }
+    else if (strcmp(option, "--script") == 0 && ok)
+    {
+      ok = loadSimScript(value);
+    }
+    else if (strcmp(option, "--outage") == 0 && ok)
+    {
+      ok = addSimOutage(value);
+    }
+    else if (strcmp(option, "--broker") == 0 && ok)
+    {
+      brokerPort = atoi(value);
+      ok = brokerPort > 0 && brokerPort < 65536;
+    }
+    else if (strcmp(option, "--sink") == 0 && ok)
+    {
+      sinkPath = value;
+    }
+    else if (strcmp(option, "--latency") == 0 && ok)
+    {
+      const int latency = atoi(value);
+      ok = latency > 0;
+      setSimBrokerLatency(latency);
+    }
+    else if (strcmp(option, "--tls") == 0 && ok)
+    {
+      const char *separator = strchr(value, ':');
+      ok = separator != nullptr && setSimBrokerTls(std::string(value, separator).c_str(), separator + 1);
+    }
+    else if (strcmp(option, "--notecard") == 0 && ok)
+    {
+      setSimNotecardSink(value);
+    }
+    else if (strcmp(option, "--frames") == 0 && ok)
+    {
+      setSimFrameLog(value);
+    }
+    else if (strcmp(option, "--duration") == 0 && ok)
+    {
+      duration = atof(value);
+      ok = duration > 0;
+    }
+    else
+    {
+      ok = false;
+    }
+
+    if (!ok)
+    {
+      fprintf(stderr, "[sim] bad option %s %s\n%s", option, value ? value : "", usage);
+      return 2;
+    }
+    i++;
+  }
+
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  if (!mapMemory(warm) || !mapFlash(warm, flashPath))
+  {
+    return 1;
+  }
+
+  if (configPath && !warm)
+  {
+    if (!writeConfig(configPath))
+    {
+      fprintf(stderr, "[sim] cannot store the config from %s\n", configPath);
+      return 1;
+    }
+  }
+
+  if (brokerPort && !startSimBroker(brokerPort, sinkPath))
+  {
+    return 1;
+  }
+
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+  signal(SIGPIPE, SIG_IGN);
+
+  // The M7 boots the M4 from its setup()
+  std::thread(runCore, "M7", m7::setup, m7::loop).detach();
+
+  while (!stopRequested && (duration <= 0 || simMicros() < duration * 1e6))
+  {
+    delay(100);
+
+    std::lock_guard<std::mutex> lock(watchdogLock);
+    for (const auto &watchdog : watchdogs)
+    {
+      if (watchdog.second->expired(simBootMicros()))
+      {
+        char reason[48];
+        snprintf(reason, sizeof(reason), "%s watchdog expired", watchdog.first);
+        simReset(reason);
+      }
+    }
+  }
+
+  fflush(stdout);
+  reportEdges();
+  // The cores never return, leave without running destructors under them
+  _exit(0);
+}
@@ -0,0 +1,91 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Host simulator running the M4 and M7 firmware on two threads of one process. The D2 SRAM, SRAM4 and
+// backup SRAM are mapped at their real addresses from memory that is kept over a simulated reset (the process
+// restarts itself), inputs follow scripted waveforms and the network is the host's, cut by scripted outages.
+
+// Memory shared by the cores, at the addresses the firmware uses
+#define SIM_D2_SRAM_ADDRESS 0x30000000
+#define SIM_D2_SRAM_SIZE 0x40000
+#define SIM_SRAM4_ADDRESS 0x38000000
+#define SIM_SRAM4_SIZE 0x10000
+#define SIM_BACKUP_SRAM_ADDRESS 0x38800000
+#define SIM_BACKUP_SRAM_SIZE 0x1000
+
+// Internal flash, only reached through FlashIAP
+#define SIM_FLASH_ADDRESS 0x08000000
+#define SIM_FLASH_SIZE 0x200000
+#define SIM_FLASH_SECTOR_SIZE 0x20000
+#define SIM_FLASH_PAGE_SIZE 32
+
+// Flash image, SIM_FLASH_SIZE bytes from SIM_FLASH_ADDRESS
+uint8_t *simFlashImage();
+
+// Input channels as numbered in the frames: user button, inputs 1-6 (digital) and inputs 7-8 (analog)
+#define SIM_CHANNELS 9
+#define SIM_FIRST_ANALOG_CHANNEL 7
+
+// Microseconds since the simulation started, carried over simulated resets
+uint64_t simMicros();
+
+// Microseconds since this boot, what millis() and micros() count
+uint64_t simBootMicros();
+
+// Waveforms. A channel follows its latest waveform whose start has passed, from its start:
+//   level:<value>                 constant (0 or 1 for digital channels, 0-4095 for analog ones)
+//   pulse:<hz>[:<duty>]           square wave starting high, duty 0.5 by default
+//   burst:<hz>:<pulses>:<ms>      that many pulses at hz at the start of every period of ms, low in between
+//   ramp:<from>:<to>:<ms>         analog sawtooth
+//   sine:<centre>:<amplitude>:<ms> analog sine
+// Returns false if the text is malformed or the shape does not suit the channel.
+bool addSimWaveform(unsigned int channel, uint64_t startMicros, const char *text);
+
+// Load timed waveforms, lines of "<ms> <channel>=<waveform>" with # comments
+bool loadSimScript(const char *path);
+
+// Level of a channel at a simulation time
+int simInputLevel(unsigned int channel, uint64_t micros);
+
+// Falling edges of a digital channel up to a simulation time, what the M4 counts by default
+uint64_t simFallingEdges(unsigned int channel, uint64_t micros);
+
+// Network links, each can have outages scheduled
+enum SimLink
+{
+  SIM_LINK_ETHERNET,
+  SIM_LINK_WIFI,
+  SIM_LINKS
+};
+
+// Parse "[eth:|wifi:]<start s>+<length s>", without a link both go down
+bool addSimOutage(const char *text);
+bool simLinkUp(SimLink link);
+
+// Minimal MQTT broker on 127.0.0.1 taking everything published, written as JSON lines to sink
+bool startSimBroker(uint16_t port, const char *sinkPath);
+
+// Milliseconds the broker holds every packet before handling it, so added to each round trip. Set before
+// clients connect.
+void setSimBrokerLatency(unsigned int ms);
+
+// Refuse the next count QoS 1 publishes from MQTT 5 clients with this PUBACK reason code, without taking them
+void setSimBrokerRefusals(unsigned int count, uint8_t reason);
+
+// Serve TLS with a PEM certificate and key, caching sessions so they can be resumed. Set before clients connect.
+bool setSimBrokerTls(const char *certificatePath, const char *keyPath);
+
+// Where the Notecard stub writes its requests as JSON lines, null to drop them
+void setSimNotecardSink(const char *path);
+
+// Where the number of every frame the M4 takes is written as a JSON line, with the simulation time in ms
+// ("at") and the host's monotonic clock in microseconds ("host_us"), which other processes can compare against
+void setSimFrameLog(const char *path);
+
+// Restart the process as a reset does. Memory and flash are kept, millis() starts again.
+[[noreturn]] void simReset(const char *reason);
+
+#endif // SIM_H
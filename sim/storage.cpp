@@ -0,0 +1,143 @@
+#include <FlashIAP.h>
+#include <FlashIAPBlockDevice.h>
+#include "sim.h"
+#include <string.h>
+
+static bool inFlash(uint32_t address, uint32_t size)
+{
+  return address >= SIM_FLASH_ADDRESS && size <= SIM_FLASH_SIZE &&
+         address - SIM_FLASH_ADDRESS <= SIM_FLASH_SIZE - size;
+}
+
+namespace mbed
+{
+  int FlashIAP::init()
+  {
+    return 0;
+  }
+
+  int FlashIAP::deinit()
+  {
+    return 0;
+  }
+
+  int FlashIAP::read(void *buffer, uint32_t address, uint32_t size)
+  {
+    if (!inFlash(address, size))
+    {
+      return -1;
+    }
+    memcpy(buffer, simFlashImage() + (address - SIM_FLASH_ADDRESS), size);
+    return 0;
+  }
+
+  int FlashIAP::program(const void *buffer, uint32_t address, uint32_t size)
+  {
+    if (!inFlash(address, size) || address % SIM_FLASH_PAGE_SIZE != 0 || size % SIM_FLASH_PAGE_SIZE != 0)
+    {
+      return -1;
+    }
+    uint8_t *cell = simFlashImage() + (address - SIM_FLASH_ADDRESS);
+    const uint8_t *data = (const uint8_t *)buffer;
+    for (uint32_t i = 0; i < size; i++)
+    {
+      cell[i] &= data[i];
+    }
+    return 0;
+  }
+
+  int FlashIAP::erase(uint32_t address, uint32_t size)
+  {
+    if (!inFlash(address, size) || address % SIM_FLASH_SECTOR_SIZE != 0 || size % SIM_FLASH_SECTOR_SIZE != 0)
+    {
+      return -1;
+    }
+    memset(simFlashImage() + (address - SIM_FLASH_ADDRESS), 0xFF, size);
+    return 0;
+  }
+
+  uint32_t FlashIAP::get_sector_size(uint32_t address) const
+  {
+    return inFlash(address, 1) ? SIM_FLASH_SECTOR_SIZE : 0;
+  }
+
+  uint32_t FlashIAP::get_flash_start() const
+  {
+    return SIM_FLASH_ADDRESS;
+  }
+
+  uint32_t FlashIAP::get_flash_size() const
+  {
+    return SIM_FLASH_SIZE;
+  }
+
+  uint32_t FlashIAP::get_page_size() const
+  {
+    return SIM_FLASH_PAGE_SIZE;
+  }
+
+  uint8_t FlashIAP::get_erase_value() const
+  {
+    return 0xFF;
+  }
+
+  BlockDevice *BlockDevice::get_default_instance()
+  {
+    return nullptr;
+  }
+}
+
+bool FlashIAPBlockDevice::contains(bd_addr_t address, bd_size_t size) const
+{
+  return size <= length && address <= length - size;
+}
+
+int FlashIAPBlockDevice::init()
+{
+  return flash.init();
+}
+
+int FlashIAPBlockDevice::deinit()
+{
+  return flash.deinit();
+}
+
+int FlashIAPBlockDevice::read(void *buffer, bd_addr_t address, bd_size_t size)
+{
+  return contains(address, size) ? flash.read(buffer, base + address, size) : -1;
+}
+
+int FlashIAPBlockDevice::program(const void *buffer, bd_addr_t address, bd_size_t size)
+{
+  return contains(address, size) ? flash.program(buffer, base + address, size) : -1;
+}
+
+int FlashIAPBlockDevice::erase(bd_addr_t address, bd_size_t size)
+{
+  return contains(address, size) ? flash.erase(base + address, size) : -1;
+}
+
+bd_size_t FlashIAPBlockDevice::get_read_size() const
+{
+  return 1;
+}
+
+bd_size_t FlashIAPBlockDevice::get_program_size() const
+{
+  return flash.get_page_size();
+}
+
+bd_size_t FlashIAPBlockDevice::get_erase_size() const
+{
+  return flash.get_sector_size(base);
+}
+
+int FlashIAPBlockDevice::get_erase_value() const
+{
+  return flash.get_erase_value();
+}
+
+bd_size_t FlashIAPBlockDevice::size() const
+{
+  return length;
+}
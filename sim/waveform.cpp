@@ -0,0 +1,217 @@
+#include "sim.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+enum SimWaveShape
+{
+  WAVE_LEVEL,
+  WAVE_PULSE,
+  WAVE_BURST,
+  WAVE_RAMP,
+  WAVE_SINE
+};
+
+struct SIM_WAVEFORM
+{
+  uint64_t start; // Simulation micros
+  SimWaveShape shape;
+  double a, b, c; // Shape parameters in the order of the text, periods converted to micros
+};
+
+// Set up before the cores start, read only afterwards
+static std::vector<SIM_WAVEFORM> waveforms[SIM_CHANNELS];
+
+bool addSimWaveform(unsigned int channel, uint64_t startMicros, const char *text)
+{
+  if (channel >= SIM_CHANNELS)
+  {
+    return false;
+  }
+  const bool analog = channel >= SIM_FIRST_ANALOG_CHANNEL;
+
+  char name[16];
+  double values[3] = {0, 0, 0};
+  const int fields = sscanf(text, "%15[a-z]:%lf:%lf:%lf", name, &values[0], &values[1], &values[2]) - 1;
+
+  SIM_WAVEFORM waveform = {startMicros, WAVE_LEVEL, values[0], values[1], values[2]};
+  if (strcmp(name, "level") == 0 && fields == 1)
+  {
+    waveform.shape = WAVE_LEVEL;
+  }
+  else if (strcmp(name, "pulse") == 0 && !analog && (fields == 1 || fields == 2) && values[0] > 0)
+  {
+    waveform.shape = WAVE_PULSE;
+    waveform.a = 1e6 / values[0];
+    waveform.b = fields == 2 ? values[1] : 0.5;
+    if (waveform.b <= 0 || waveform.b >= 1)
+    {
+      return false;
+    }
+  }
+  else if (strcmp(name, "burst") == 0 && !analog && fields == 3 && values[0] > 0 && values[1] >= 1)
+  {
+    waveform.shape = WAVE_BURST;
+    waveform.a = 1e6 / values[0];
+    waveform.b = floor(values[1]);
+    waveform.c = values[2] * 1000;
+    if (waveform.c < waveform.a * waveform.b)
+    {
+      return false;
+    }
+  }
+  else if ((strcmp(name, "ramp") == 0 || strcmp(name, "sine") == 0) && analog && fields == 3 && values[2] > 0)
+  {
+    waveform.shape = name[0] == 'r' ? WAVE_RAMP : WAVE_SINE;
+    waveform.c = values[2] * 1000;
+  }
+  else
+  {
+    return false;
+  }
+
+  std::vector<SIM_WAVEFORM> &list = waveforms[channel];
+  list.push_back(waveform);
+  std::stable_sort(list.begin(), list.end(), [](const SIM_WAVEFORM &x, const SIM_WAVEFORM &y)
+                   { return x.start < y.start; });
+  return true;
+}
+
+bool loadSimScript(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  char line[256];
+  bool ok = true;
+  for (int number = 1; fgets(line, sizeof(line), file); number++)
+  {
+    char *comment = strchr(line, '#');
+    if (comment)
+    {
+      *comment = '\0';
+    }
+
+    double at;
+    unsigned int channel;
+    char text[128];
+    const int fields = sscanf(line, "%lf %u=%127s", &at, &channel, text);
+    if (fields == EOF || (fields <= 0 && strspn(line, " \t\r\n") == strlen(line)))
+    {
+      continue;
+    }
+    if (fields != 3 || at < 0 || !addSimWaveform(channel, (uint64_t)(at * 1000), text))
+    {
+      fprintf(stderr, "[sim] %s:%d: cannot read waveform\n", path, number);
+      ok = false;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+// Waveform a channel follows at a time, null before the first one starts
+static const SIM_WAVEFORM *activeWaveform(unsigned int channel, uint64_t micros)
+{
+  const std::vector<SIM_WAVEFORM> &list = waveforms[channel];
+  const SIM_WAVEFORM *active = nullptr;
+  for (size_t i = 0; i < list.size() && list[i].start <= micros; i++)
+  {
+    active = &list[i];
+  }
+  return active;
+}
+
+static double waveformValue(const SIM_WAVEFORM *waveform, double t)
+{
+  switch (waveform->shape)
+  {
+  case WAVE_PULSE:
+    return fmod(t, waveform->a) < waveform->a * waveform->b ? 1 : 0;
+  case WAVE_BURST:
+  {
+    const double inPeriod = fmod(t, waveform->c);
+    return inPeriod < waveform->a * waveform->b && fmod(inPeriod, waveform->a) < waveform->a / 2 ? 1 : 0;
+  }
+  case WAVE_RAMP:
+    return waveform->a + (waveform->b - waveform->a) * fmod(t, waveform->c) / waveform->c;
+  case WAVE_SINE:
+    return waveform->a + waveform->b * sin(2 * M_PI * t / waveform->c);
+  default:
+    return waveform->a;
+  }
+}
+
+// Falling edges from the start of a waveform until t micros into it
+static uint64_t waveformFallingEdges(const SIM_WAVEFORM *waveform, double t)
+{
+  switch (waveform->shape)
+  {
+  case WAVE_PULSE:
+  {
+    // One per period, when the high part ends
+    const double high = waveform->a * waveform->b;
+    return t < high ? 0 : (uint64_t)floor((t - high) / waveform->a) + 1;
+  }
+  case WAVE_BURST:
+  {
+    const uint64_t periods = (uint64_t)floor(t / waveform->c);
+    const double inPeriod = t - periods * waveform->c;
+    const double high = waveform->a / 2;
+    const uint64_t inBurst = inPeriod < high ? 0 : (uint64_t)floor((inPeriod - high) / waveform->a) + 1;
+    return periods * (uint64_t)waveform->b + std::min(inBurst, (uint64_t)waveform->b);
+  }
+  default:
+    return 0;
+  }
+}
+
+int simInputLevel(unsigned int channel, uint64_t micros)
+{
+  const SIM_WAVEFORM *waveform = channel < SIM_CHANNELS ? activeWaveform(channel, micros) : nullptr;
+  if (!waveform)
+  {
+    return 0;
+  }
+
+  const double value = waveformValue(waveform, (double)(micros - waveform->start));
+  if (channel < SIM_FIRST_ANALOG_CHANNEL)
+  {
+    return value >= 0.5 ? 1 : 0;
+  }
+  // 12 bit readings as set up by the M4
+  return (int)std::min(std::max(lround(value), 0L), 4095L);
+}
+
+uint64_t simFallingEdges(unsigned int channel, uint64_t micros)
+{
+  if (channel >= SIM_FIRST_ANALOG_CHANNEL)
+  {
+    return 0;
+  }
+
+  // Edges within each waveform up to the next one, plus a falling edge where a waveform hands over from high to low
+  const std::vector<SIM_WAVEFORM> &list = waveforms[channel];
+  uint64_t edges = 0;
+  int level = 0;
+  for (size_t i = 0; i < list.size() && list[i].start <= micros; i++)
+  {
+    const SIM_WAVEFORM *waveform = &list[i];
+    if (level == 1 && waveformValue(waveform, 0) < 0.5)
+    {
+      edges++;
+    }
+
+    const uint64_t end = i + 1 < list.size() && list[i + 1].start <= micros ? list[i + 1].start : micros;
+    const double duration = (double)(end - waveform->start);
+    edges += waveformFallingEdges(waveform, duration);
+    level = end > waveform->start ? simInputLevel(channel, end - 1) : level;
+  }
+  return edges;
+}
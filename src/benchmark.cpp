@@ -0,0 +1,86 @@
+#include "benchmark.h"
+#include "payload.h"
+#include <stdlib.h>
+
+extern const char *VERSION;
+
+void resetBenchLatency(BENCH_LATENCY *latency)
+{
+  latency->count = 0;
+  latency->seen = 0;
+  latency->seed = 0x2545F491;
+}
+
+// Reservoir sampling: once full, the n-th latency replaces a random sample with probability samples / n
+void addBenchLatency(BENCH_LATENCY *latency, unsigned long micros)
+{
+  latency->seen++;
+  if (latency->count < BENCH_LATENCY_SAMPLES)
+  {
+    latency->samples[latency->count++] = micros;
+    return;
+  }
+
+  // xorshift32
+  latency->seed ^= latency->seed << 13;
+  latency->seed ^= latency->seed >> 17;
+  latency->seed ^= latency->seed << 5;
+  const unsigned long slot = latency->seed % latency->seen;
+  if (slot < BENCH_LATENCY_SAMPLES)
+  {
+    latency->samples[slot] = micros;
+  }
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+  const unsigned long x = *(const unsigned long *)a;
+  const unsigned long y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank
+unsigned long benchLatencyPercentile(BENCH_LATENCY *latency, unsigned int percent)
+{
+  if (latency->count == 0)
+  {
+    return 0;
+  }
+  qsort(latency->samples, latency->count, sizeof(latency->samples[0]), compareLatencies);
+  const unsigned int rank = (latency->count * min(percent, 100U) + 99) / 100;
+  return latency->samples[rank > 0 ? rank - 1 : 0];
+}
+
+size_t encodeBenchReport(BENCH_REPORT *report, char *message, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  message[0] = '\0';
+
+  const double seconds = report->millis > 0 ? report->millis / 1000.0 : 1;
+  size_t length = 0;
+  appendFormat(message, size, &length, "{\"bench\":\"%s\",\"v\":\"%s\",\"transport\":\"%s\"", report->name, VERSION,
+         report->transport);
+  if (report->qos >= 0)
+  {
+    appendFormat(message, size, &length, ",\"qos\":%d", report->qos);
+  }
+  appendFormat(message, size, &length, ",\"frames\":%lu,\"bytes\":%lu,\"ms\":%lu,\"frames_per_s\":%.2f,\"bytes_per_s\":%.1f",
+         report->frames, report->bytes, report->millis, report->frames / seconds, report->bytes / seconds);
+  if (report->backfillRate >= 0)
+  {
+    appendFormat(message, size, &length, ",\"backfill_rate\":%ld", report->backfillRate);
+  }
+  if (report->latency && report->latency->count > 0)
+  {
+    const unsigned long p50 = benchLatencyPercentile(report->latency, 50);
+    const unsigned long p99 = benchLatencyPercentile(report->latency, 99);
+    appendFormat(message, size, &length, ",\"latency_samples\":%lu,\"p50_ms\":%.3f,\"p99_ms\":%.3f", report->latency->seen,
+           p50 / 1000.0, p99 / 1000.0);
+  }
+  appendFormat(message, size, &length, "}");
+
+  return length;
+}
@@ -0,0 +1,44 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <Arduino.h>
+
+// Results of a benchmark run, reported as one JSON line per run so they can be collected and compared release
+// over release. Latencies are kept as a uniform sample of at most BENCH_LATENCY_SAMPLES values, enough for a
+// p99 without holding every frame.
+#define BENCH_LATENCY_SAMPLES 2048
+
+struct BENCH_LATENCY
+{
+  unsigned long samples[BENCH_LATENCY_SAMPLES]; // Microseconds
+  unsigned int count;                           // Samples held
+  unsigned long seen;                           // Latencies added, a sample of them is held once full
+  uint32_t seed;                                // Picks which sample a new latency replaces
+};
+
+struct BENCH_REPORT
+{
+  const char *name;             // Run name, "bench" in the output
+  const char *transport;        // Transport the frames went out on
+  int qos;                      // MQTT QoS, -1 to leave out
+  unsigned long frames;         // Frames delivered
+  unsigned long bytes;          // Message bytes sent for them
+  unsigned long millis;         // Length of the run
+  long backfillRate;            // Backfill messages per minute the run was paced at, -1 to leave out
+  BENCH_LATENCY *latency;       // Sample-to-publish latencies, nullptr or empty to leave out
+};
+
+// Empty the latency sample
+void resetBenchLatency(BENCH_LATENCY *latency);
+
+// Add a latency in microseconds
+void addBenchLatency(BENCH_LATENCY *latency, unsigned long micros);
+
+// Latency in microseconds below which percent of the sample lies, 0 if empty. Sorts the sample.
+unsigned long benchLatencyPercentile(BENCH_LATENCY *latency, unsigned int percent);
+
+// Build the JSON line for a run: frames and bytes per second, p50 and p99 latency in milliseconds.
+// Returns the message length.
+size_t encodeBenchReport(BENCH_REPORT *report, char *message, size_t size);
+
+#endif // BENCHMARK_H
@@ -2,6 +2,10 @@
 #include "status.h"
 #include <base64.hpp>
 #include <FlashIAPLimits.h>
+#include "config_store.h"
+#include "frame_codec.h"
+#include <mbedtls/md.h>
+#include <time.h>
 
 // Config variables
 CommunicationMode communicationMode = WIFI;
@@ -13,9 +17,45 @@ int mqttPort = 1883;
 char mqttUsername[128] = "";
 char mqttPassword[128] = "";
 char mqttClientId[128] = "";
+bool deviceIdDerived = false;
+bool mqttClientIdDerived = false;
 char mqttTopicPrefix[128] = "";
 int modbusDeviceCount = 0;
 int modbusRegisterStyle = 0;
+int payloadKeyframeInterval = 0; // 0 = full messages, N = delta messages with a keyframe every N
+bool fastBoot = false;
+char configSigningKey[65] = "";
+unsigned long configSequence = 0; // csq of the running config, remote tokens must carry a higher one
+char otaSigningKey[129] = "";
+int sendInterval = 5000;
+int debounceDelays[INPUT_CHANNELS] = {50, 50, 50, 50, 50, 50, 50};
+int channelModes[INPUT_CHANNELS] = {0, 0, 0, 0, 0, 0, 0};
+int urgentInputs[INPUT_CHANNELS] = {0, 0, 0, 0, 0, 0, 0};
+int edgeLogInputs[INPUT_CHANNELS] = {0, 0, 0, 0, 0, 0, 0};
+int backfillRate = 120;
+int backfillBurst = 10;
+int mqttQos = 1;
+int mqttWindow = 8;
+int mqttVersion = 4;
+unsigned long mqttSessionExpiry = 3600;
+unsigned long mqttMessageExpiry = 0;
+bool mqttTls = false;
+char mqttTlsPin[65] = "";
+CommunicationMode transportOrder[MAX_TRANSPORTS] = {WIFI};
+int transportCount = 1;
+int noteBatchFrames = 32;
+unsigned long noteSyncInterval = 900;
+int noteSyncNotes = 8;
+
+uint32_t cachedLocalIp = 0;
+uint32_t cachedGateway = 0;
+uint32_t cachedSubnet = 0;
+uint32_t cachedDns = 0;
+uint32_t cachedLeaseExpiry = 0;
+
+// How long a cached lease is reused for. The network stacks do not expose the DHCP lease time, an hour is within
+// the usual ones.
+static const uint32_t networkLeaseLifetime = 3600;
 
 int p1VoltsModbusAddress = 0;
 int p2VoltsModbusAddress = 0;
@@ -38,6 +78,10 @@ bool promptShown = false;
 
 JsonDocument configDoc;
 unsigned char configToken[512] = {0};
+size_t configTokenLength = 0;
+
+// A remote config waiting for the restart in flash, the running config must not be saved over it
+static bool configStaged = false;
 
 // Flash storage
 auto [flashSize, startAddress, iapSize] = getFlashIAPLimits();
@@ -55,11 +99,25 @@ void deinitFlashStorage()
 
 void loadConfigTokenFromMemory()
 {
-  blockDevice.read(configToken, 0, 512);
+  const ConfigRecordType type = readConfigRecord(&blockDevice, configToken, sizeof(configToken), &configTokenLength);
+
+  if (type == CONFIG_RECORD_LEGACY)
+  {
+    // Token uploaded by the web tool is base64 encoded msgpack
+    unsigned char msgPack[512] = {0};
+    configTokenLength = decode_base64(configToken, configTokenLength, msgPack);
+    memcpy(configToken, msgPack, sizeof(configToken));
+  }
 }
 
-void saveConfigTokenToMemory()
+bool saveConfigTokenToMemory()
 {
+  if (configStaged)
+  {
+    Serial.println("Configuration not saved, a remote config waits for the restart");
+    return false;
+  }
+
   // Build config from current values
   JsonDocument saveDoc;
   saveDoc["v"] = VERSION;
@@ -68,8 +126,8 @@ void saveConfigTokenToMemory()
   saveDoc["mpw"] = mqttPassword;
   saveDoc["wid"] = wifiSsid;
   saveDoc["wpw"] = wifiPassword;
-  saveDoc["did"] = deviceId;
-  saveDoc["mci"] = mqttClientId;
+  saveDoc["did"] = deviceIdDerived ? "" : deviceId; // Derived again at the next boot
+  saveDoc["mci"] = mqttClientIdDerived ? "" : mqttClientId;
   saveDoc["mtp"] = mqttTopicPrefix;
   saveDoc["mpo"] = mqttPort;
   saveDoc["mdc"] = modbusDeviceCount;
@@ -105,30 +163,97 @@ void saveConfigTokenToMemory()
   }
 
   saveDoc["mrs"] = modbusRegisterStyle;
+  saveDoc["dki"] = payloadKeyframeInterval;
+  saveDoc["fbt"] = fastBoot;
+  saveDoc["sin"] = sendInterval;
+
+  JsonArray dbd = saveDoc["dbd"].to<JsonArray>();
+  JsonArray icm = saveDoc["icm"].to<JsonArray>();
+  JsonArray iur = saveDoc["iur"].to<JsonArray>();
+  JsonArray iel = saveDoc["iel"].to<JsonArray>();
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    dbd.add(debounceDelays[i]);
+    icm.add(channelModes[i]);
+    iur.add(urgentInputs[i]);
+    iel.add(edgeLogInputs[i]);
+  }
 
-  // Serialize to msgpack
-  unsigned char msgPack[512] = {0};
-  serializeMsgPack(saveDoc, msgPack, 512);
+  saveDoc["bfr"] = backfillRate;
+  saveDoc["bfb"] = backfillBurst;
+  saveDoc["mqo"] = mqttQos;
+  saveDoc["mif"] = mqttWindow;
+  saveDoc["mpv"] = mqttVersion;
+  saveDoc["mse"] = mqttSessionExpiry;
+  saveDoc["mme"] = mqttMessageExpiry;
+  saveDoc["mtl"] = mqttTls;
+
+  if (strlen(mqttTlsPin) > 0)
+  {
+    saveDoc["mpn"] = mqttTlsPin;
+  }
 
-  // Encode to base64
-  memset(configToken, 0, 512);
-  encode_base64(msgPack, 512, configToken);
+  if (transportCount > 1)
+  {
+    JsonArray cfo = saveDoc["cfo"].to<JsonArray>();
+    for (int i = 1; i < transportCount; i++)
+    {
+      cfo.add(getCommunicationModeName(transportOrder[i]));
+    }
+  }
+  saveDoc["nbf"] = noteBatchFrames;
+  saveDoc["nsi"] = noteSyncInterval;
+  saveDoc["nsn"] = noteSyncNotes;
+
+  if (strlen(configSigningKey) > 0)
+  {
+    saveDoc["csk"] = configSigningKey;
+  }
+
+  if (configSequence > 0)
+  {
+    saveDoc["csq"] = configSequence;
+  }
+
+  if (strlen(otaSigningKey) > 0)
+  {
+    saveDoc["osk"] = otaSigningKey;
+  }
+
+  if (cachedLocalIp != 0)
+  {
+    JsonArray nwc = saveDoc["nwc"].to<JsonArray>();
+    nwc.add(cachedLocalIp);
+    nwc.add(cachedGateway);
+    nwc.add(cachedSubnet);
+    nwc.add(cachedDns);
+    nwc.add(cachedLeaseExpiry);
+  }
+
+  // Serialize to msgpack
+  memset(configToken, 0, sizeof(configToken));
+  configTokenLength = serializeMsgPack(saveDoc, configToken, sizeof(configToken));
 
   // Save to flash
   blockDevice.init();
-  blockDevice.erase(0, 128 * 1024);
-  blockDevice.program(configToken, 0, 512);
+  const bool saved = writeConfigRecord(&blockDevice, configToken, configTokenLength);
   blockDevice.deinit();
 
-  Serial.println("Configuration saved to flash memory");
+  if (saved)
+  {
+    Serial.println("Configuration saved to flash memory");
+  }
+  else
+  {
+    Serial.println("Failed to save configuration to flash memory");
+  }
+
+  return saved;
 }
 
 void applyConfigToken()
 {
-
-  unsigned char msgPack[512] = {0};
-  decode_base64(configToken, 512, msgPack);
-  DeserializationError err = deserializeMsgPack(configDoc, msgPack);
+  DeserializationError err = deserializeMsgPack(configDoc, configToken, configTokenLength);
 
   if (err || !configDoc.containsKey("v"))
   {
@@ -144,39 +269,45 @@ void applyConfigToken()
 
   if (configDoc.containsKey("com"))
   {
-    const char *mode = configDoc["com"];
-    if (strcmp(mode, "ETHERNET") == 0)
-    {
-      communicationMode = ETHERNET;
-    }
-    else if (strcmp(mode, "BLUES") == 0)
-    {
-      communicationMode = BLUES;
-    }
-    else if (strcmp(mode, "NONE") == 0)
+    communicationMode = parseCommunicationMode(configDoc["com"]);
+  }
+
+  // Failover transports follow the configured one, skipping repeats and NONE
+  transportOrder[0] = communicationMode;
+  transportCount = 1;
+  bool wifiUsed = communicationMode == WIFI;
+  for (JsonVariant name : configDoc["cfo"].as<JsonArray>())
+  {
+    const CommunicationMode mode = parseCommunicationMode(name | "");
+    bool listed = mode == NONE || communicationMode == NONE;
+    for (int i = 0; i < transportCount; i++)
     {
-      communicationMode = NONE;
+      listed = listed || transportOrder[i] == mode;
     }
-    else
+    if (!listed && transportCount < MAX_TRANSPORTS)
     {
-      communicationMode = WIFI; // default to WIFI for any other value
+      transportOrder[transportCount++] = mode;
+      wifiUsed = wifiUsed || mode == WIFI;
     }
   }
 
-  if (communicationMode == WIFI && configDoc.containsKey("wid"))
+  if (wifiUsed && configDoc.containsKey("wid"))
   {
     strcpy(wifiSsid, configDoc["wid"]);
     strcpy(wifiPassword, configDoc["wpw"]);
   }
 
-  if (configDoc.containsKey("did"))
+  // Left empty, the device ID and client ID keep the values derived at boot
+  if (strlen(configDoc["did"] | "") > 0)
   {
     strcpy(deviceId, configDoc["did"]);
+    deviceIdDerived = false;
   }
 
-  if (configDoc.containsKey("mci"))
+  if (strlen(configDoc["mci"] | "") > 0)
   {
     strcpy(mqttClientId, configDoc["mci"]);
+    mqttClientIdDerived = false;
   }
 
   if (configDoc.containsKey("mtp"))
@@ -218,6 +349,398 @@ void applyConfigToken()
   {
     modbusRegisterStyle = configDoc["mrs"];
   }
+
+  if (configDoc.containsKey("dki"))
+  {
+    payloadKeyframeInterval = configDoc["dki"];
+  }
+  else
+  {
+    payloadKeyframeInterval = 0;
+  }
+
+  fastBoot = configDoc["fbt"] | false;
+
+  sendInterval = configDoc["sin"] | 5000;
+
+  // Debounce may be a single value for every channel or one per channel
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    if (configDoc["dbd"].is<JsonArray>())
+    {
+      debounceDelays[i] = configDoc["dbd"][i] | 50;
+    }
+    else
+    {
+      debounceDelays[i] = configDoc["dbd"] | 50;
+    }
+    channelModes[i] = configDoc["icm"][i] | 0;
+    urgentInputs[i] = configDoc["iur"][i] | 0;
+    edgeLogInputs[i] = configDoc["iel"][i] | 0;
+  }
+
+  backfillRate = configDoc["bfr"] | 120;
+  backfillBurst = configDoc["bfb"] | 10;
+  mqttQos = constrain(configDoc["mqo"] | 1, 0, 1);
+  mqttWindow = constrain(configDoc["mif"] | 8, 1, 16);
+  mqttVersion = (configDoc["mpv"] | 4) == 5 ? 5 : 4;
+  mqttSessionExpiry = configDoc["mse"] | 3600UL;
+  mqttMessageExpiry = configDoc["mme"] | 0UL;
+  mqttTls = configDoc["mtl"] | false;
+  noteBatchFrames = constrain(configDoc["nbf"] | 32, 1, FRAME_BLOCK_FRAMES);
+  noteSyncInterval = configDoc["nsi"] | 900UL;
+  noteSyncNotes = max(configDoc["nsn"] | 8, 1);
+
+  if (configDoc.containsKey("mpn"))
+  {
+    strncpy(mqttTlsPin, configDoc["mpn"], sizeof(mqttTlsPin) - 1);
+  }
+
+  if (configDoc.containsKey("csk"))
+  {
+    strncpy(configSigningKey, configDoc["csk"], sizeof(configSigningKey) - 1);
+  }
+
+  configSequence = configDoc["csq"] | 0UL;
+
+  if (configDoc.containsKey("osk"))
+  {
+    strncpy(otaSigningKey, configDoc["osk"], sizeof(otaSigningKey) - 1);
+  }
+
+  if (configDoc.containsKey("nwc"))
+  {
+    cachedLocalIp = configDoc["nwc"][0];
+    cachedGateway = configDoc["nwc"][1];
+    cachedSubnet = configDoc["nwc"][2];
+    cachedDns = configDoc["nwc"][3];
+    cachedLeaseExpiry = configDoc["nwc"][4];
+  }
+}
+
+// True if a string setting in the token differs from the running value
+static bool settingChanged(JsonDocument &doc, const char *key, const char *current)
+{
+  const char *value = doc[key] | "";
+  return strcmp(value, current) != 0;
+}
+
+// True if the failover transports in the token differ from the running ones
+static bool transportsChanged(JsonDocument &doc)
+{
+  JsonArray cfo = doc["cfo"].as<JsonArray>();
+  if ((int)cfo.size() != transportCount - 1)
+  {
+    return true;
+  }
+  for (int i = 1; i < transportCount; i++)
+  {
+    if (strcmp(cfo[i - 1] | "", getCommunicationModeName(transportOrder[i])) != 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Settings that are only used while connecting need a restart to take effect
+// A setting derived at boot when left empty: an empty value only changes it if the running one was configured
+static bool derivedSettingChanged(JsonDocument &doc, const char *key, const char *current, bool derived)
+{
+  const char *value = doc[key] | "";
+  if (strlen(value) == 0)
+  {
+    return !derived;
+  }
+  return strcmp(value, current) != 0;
+}
+
+static bool restartRequired(JsonDocument &doc)
+{
+  return settingChanged(doc, "com", getCommunicationModeName(communicationMode)) ||
+         transportsChanged(doc) ||
+         settingChanged(doc, "wid", wifiSsid) ||
+         settingChanged(doc, "wpw", wifiPassword) ||
+         settingChanged(doc, "msv", mqttServer) ||
+         settingChanged(doc, "mun", mqttUsername) ||
+         settingChanged(doc, "mpw", mqttPassword) ||
+         derivedSettingChanged(doc, "mci", mqttClientId, mqttClientIdDerived) ||
+         derivedSettingChanged(doc, "did", deviceId, deviceIdDerived) ||
+         settingChanged(doc, "mtp", mqttTopicPrefix) ||
+         (doc["mpo"] | 1883) != mqttPort ||
+         (doc["mif"] | 8) != mqttWindow ||
+         ((doc["mpv"] | 4) == 5 ? 5 : 4) != mqttVersion ||
+         (doc["mse"] | 3600UL) != mqttSessionExpiry ||
+         (doc["mme"] | 0UL) != mqttMessageExpiry ||
+         (doc["mtl"] | false) != mqttTls ||
+         settingChanged(doc, "mpn", mqttTlsPin) ||
+         settingChanged(doc, "osk", otaSigningKey);
+}
+
+bool verifySignedPayload(const uint8_t *payload, size_t length, size_t *bodyLength)
+{
+  const size_t signatureLength = 32;
+
+  if (strlen(configSigningKey) == 0 || length < signatureLength)
+  {
+    return false;
+  }
+
+  *bodyLength = length - signatureLength;
+  uint8_t signature[32];
+  if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                      (const unsigned char *)configSigningKey, strlen(configSigningKey),
+                      payload, *bodyLength, signature) != 0)
+  {
+    return false;
+  }
+
+  // Constant time compare
+  uint8_t difference = 0;
+  for (size_t i = 0; i < signatureLength; i++)
+  {
+    difference |= signature[i] ^ payload[*bodyLength + i];
+  }
+  return difference == 0;
+}
+
+// Save a token as it was received, with what is only known locally (e.g. the cached lease), for the next boot
+// to apply. The running config is left as it is.
+static bool stageConfigToken(JsonDocument &doc)
+{
+  if (cachedLocalIp != 0 && !doc.containsKey("nwc"))
+  {
+    JsonArray nwc = doc["nwc"].to<JsonArray>();
+    nwc.add(cachedLocalIp);
+    nwc.add(cachedGateway);
+    nwc.add(cachedSubnet);
+    nwc.add(cachedDns);
+    nwc.add(cachedLeaseExpiry);
+  }
+
+  unsigned char staged[sizeof(configToken)];
+  const size_t stagedLength = serializeMsgPack(doc, staged, sizeof(staged));
+  if (stagedLength == 0 || stagedLength >= sizeof(staged))
+  {
+    return false;
+  }
+
+  blockDevice.init();
+  const bool saved = writeConfigRecord(&blockDevice, staged, stagedLength);
+  blockDevice.deinit();
+  configStaged = saved;
+  return saved;
+}
+
+// Validate, save and apply a config token received over MQTT. The payload is the msgpack token
+// followed by its signature (see verifySignedPayload). The token's csq must be above the running one, so a
+// recorded older token cannot be sent again to roll the config back.
+RemoteConfigResult applyRemoteConfig(const uint8_t *payload, size_t length)
+{
+  if (strlen(configSigningKey) == 0)
+  {
+    return REMOTE_CONFIG_DISABLED;
+  }
+
+  size_t tokenLength;
+  if (!verifySignedPayload(payload, length, &tokenLength) || tokenLength == 0 || tokenLength > sizeof(configToken))
+  {
+    return REMOTE_CONFIG_BAD_SIGNATURE;
+  }
+
+  JsonDocument doc;
+  if (deserializeMsgPack(doc, payload, tokenLength) || !doc.containsKey("v") || !doc.containsKey("msv"))
+  {
+    return REMOTE_CONFIG_INVALID;
+  }
+
+  if (configStaged)
+  {
+    return REMOTE_CONFIG_PENDING;
+  }
+
+  if ((doc["csq"] | 0UL) <= configSequence)
+  {
+    return REMOTE_CONFIG_REPLAYED;
+  }
+
+  // Settings only used while connecting, the device ID and the topic prefix are staged for the restart:
+  // the response and anything sent before it still go out as the running config
+  if (restartRequired(doc))
+  {
+    return stageConfigToken(doc) ? REMOTE_CONFIG_RESTART : REMOTE_CONFIG_SAVE_FAILED;
+  }
+
+  // Apply over the running config, then save it along with anything only known locally
+  memcpy(configToken, payload, tokenLength);
+  configTokenLength = tokenLength;
+  applyConfigToken();
+
+  if (!saveConfigTokenToMemory())
+  {
+    return REMOTE_CONFIG_SAVE_FAILED;
+  }
+
+  return REMOTE_CONFIG_APPLIED;
+}
+
+const char *getCommunicationModeName(CommunicationMode mode)
+{
+  switch (mode)
+  {
+  case WIFI:
+    return "WIFI";
+  case ETHERNET:
+    return "ETHERNET";
+  case BLUES:
+    return "BLUES";
+  default:
+    return "NONE";
+  }
+}
+
+CommunicationMode parseCommunicationMode(const char *name)
+{
+  if (strcmp(name, "ETHERNET") == 0)
+  {
+    return ETHERNET;
+  }
+  else if (strcmp(name, "BLUES") == 0)
+  {
+    return BLUES;
+  }
+  else if (strcmp(name, "NONE") == 0)
+  {
+    return NONE;
+  }
+  return WIFI; // default to WIFI for any other value
+}
+
+const char *getRemoteConfigResultName(RemoteConfigResult result)
+{
+  switch (result)
+  {
+  case REMOTE_CONFIG_APPLIED:
+    return "APPLIED";
+  case REMOTE_CONFIG_RESTART:
+    return "RESTART";
+  case REMOTE_CONFIG_DISABLED:
+    return "DISABLED";
+  case REMOTE_CONFIG_BAD_SIGNATURE:
+    return "BAD_SIGNATURE";
+  case REMOTE_CONFIG_INVALID:
+    return "INVALID";
+  case REMOTE_CONFIG_SAVE_FAILED:
+    return "SAVE_FAILED";
+  case REMOTE_CONFIG_REPLAYED:
+    return "REPLAYED";
+  case REMOTE_CONFIG_PENDING:
+    return "PENDING";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+// Commands share the config sequence with config tokens, so neither a recorded command nor a token sent to a
+// command topic is accepted. The sequence is saved before the command runs, so a restart does not let it replay.
+SignedCommandResult acceptSignedCommand(const uint8_t *payload, size_t length, const char *command, JsonDocument &doc)
+{
+  if (strlen(configSigningKey) == 0)
+  {
+    return SIGNED_COMMAND_DISABLED;
+  }
+
+  size_t bodyLength;
+  if (!verifySignedPayload(payload, length, &bodyLength))
+  {
+    return SIGNED_COMMAND_BAD_SIGNATURE;
+  }
+
+  if (deserializeJson(doc, payload, bodyLength) || !doc.is<JsonObject>() || strcmp(doc["cmd"] | "", command) != 0)
+  {
+    return SIGNED_COMMAND_INVALID;
+  }
+
+  const unsigned long sequence = doc["csq"] | 0UL;
+  if (sequence <= configSequence)
+  {
+    return SIGNED_COMMAND_REPLAYED;
+  }
+
+  if (configStaged)
+  {
+    return SIGNED_COMMAND_PENDING;
+  }
+
+  const unsigned long previousSequence = configSequence;
+  configSequence = sequence;
+  if (!saveConfigTokenToMemory())
+  {
+    configSequence = previousSequence;
+    return SIGNED_COMMAND_SAVE_FAILED;
+  }
+  return SIGNED_COMMAND_ACCEPTED;
+}
+
+const char *getSignedCommandResultName(SignedCommandResult result)
+{
+  switch (result)
+  {
+  case SIGNED_COMMAND_ACCEPTED:
+    return "accepted";
+  case SIGNED_COMMAND_DISABLED:
+    return "disabled";
+  case SIGNED_COMMAND_BAD_SIGNATURE:
+    return "bad_signature";
+  case SIGNED_COMMAND_INVALID:
+    return "invalid";
+  case SIGNED_COMMAND_REPLAYED:
+    return "replayed";
+  case SIGNED_COMMAND_PENDING:
+    return "pending";
+  case SIGNED_COMMAND_SAVE_FAILED:
+    return "save_failed";
+  default:
+    return "unknown";
+  }
+}
+
+// Check the stored config for fast boot before the editor runs, without applying anything
+bool fastBootConfigured()
+{
+  JsonDocument doc;
+  if (deserializeMsgPack(doc, configToken, configTokenLength))
+  {
+    return false;
+  }
+  return doc["fbt"] | false;
+}
+
+// Remember the network lease for the next boot, until networkLeaseLifetime from now. Only written to flash when
+// it changes, so the same addresses in use again (e.g. from the cached lease itself) do not extend it.
+// Passing zeros forgets the lease, e.g. after it failed to get us connected or expired.
+void cacheNetworkLease(uint32_t localIp, uint32_t gateway, uint32_t subnet, uint32_t dns)
+{
+  if (localIp == cachedLocalIp && gateway == cachedGateway && subnet == cachedSubnet && dns == cachedDns)
+  {
+    return;
+  }
+
+  cachedLocalIp = localIp;
+  cachedGateway = gateway;
+  cachedSubnet = subnet;
+  cachedDns = dns;
+  cachedLeaseExpiry = localIp != 0 ? time(nullptr) + networkLeaseLifetime : 0;
+  saveConfigTokenToMemory();
+}
+
+// True while the cached lease is within its lifetime by the RTC. The RTC keeps counting through warm resets only:
+// after a power loss or brown-out it starts again from 0 (nothing else on the Opta keeps time without power), the
+// lease then counts as expired and DHCP is used.
+bool networkLeaseValid()
+{
+  const uint32_t now = time(nullptr);
+  return cachedLocalIp != 0 && now < cachedLeaseExpiry && cachedLeaseExpiry - now <= networkLeaseLifetime;
 }
 
 void printConfig()
@@ -293,6 +816,94 @@ void printConfig()
 
   Serial.print("modbusDeviceCount: ");
   Serial.println(modbusDeviceCount);
+
+  Serial.print("payloadKeyframeInterval: ");
+  Serial.println(payloadKeyframeInterval);
+
+  Serial.print("fastBoot: ");
+  Serial.println(fastBoot);
+
+  Serial.print("sendInterval: ");
+  Serial.println(sendInterval);
+
+  Serial.print("debounceDelays:");
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    Serial.print(" ");
+    Serial.print(debounceDelays[i]);
+  }
+  Serial.println();
+
+  Serial.print("channelModes:");
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    Serial.print(" ");
+    Serial.print(channelModes[i]);
+  }
+  Serial.println();
+
+  Serial.print("urgentInputs:");
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    Serial.print(" ");
+    Serial.print(urgentInputs[i]);
+  }
+  Serial.println();
+
+  Serial.print("edgeLogInputs:");
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    Serial.print(" ");
+    Serial.print(edgeLogInputs[i]);
+  }
+  Serial.println();
+
+  Serial.print("backfillRate: ");
+  Serial.println(backfillRate);
+
+  Serial.print("backfillBurst: ");
+  Serial.println(backfillBurst);
+
+  Serial.print("mqttQos: ");
+  Serial.println(mqttQos);
+
+  Serial.print("mqttWindow: ");
+  Serial.println(mqttWindow);
+
+  Serial.print("mqttVersion: ");
+  Serial.println(mqttVersion);
+
+  Serial.print("mqttSessionExpiry: ");
+  Serial.println(mqttSessionExpiry);
+
+  Serial.print("mqttMessageExpiry: ");
+  Serial.println(mqttMessageExpiry);
+
+  Serial.print("mqttTls: ");
+  Serial.println(mqttTls);
+
+  Serial.print("mqttTlsPin: ");
+  Serial.println(mqttTlsPin);
+
+  Serial.print("transportOrder: ");
+  for (int i = 0; i < transportCount; i++)
+  {
+    Serial.print(i > 0 ? ", " : "");
+    Serial.print(getCommunicationModeName(transportOrder[i]));
+  }
+  Serial.println();
+
+  Serial.print("noteBatchFrames: ");
+  Serial.println(noteBatchFrames);
+
+  Serial.print("noteSyncInterval: ");
+  Serial.println(noteSyncInterval);
+
+  Serial.print("noteSyncNotes: ");
+  Serial.println(noteSyncNotes);
+
+  Serial.print("otaSigningKey: ");
+  Serial.println(otaSigningKey);
 }
 
 void showConfigPrompt()
@@ -473,6 +1084,22 @@ void initConfigEditor()
 {
   editorState = WAITING_INITIAL;
   editorDeadline = millis() + 5000; // 5 second initial wait
+
+  if (fastBoot)
+  {
+    // Only offer the editor when asked for, by a key already sent or BTN_USER held at power-on
+    if (Serial.available() || digitalRead(BTN_USER) == LOW)
+    {
+      Serial.println();
+      Serial.println("Press return to edit config...");
+      editorState = WAITING_FOR_ENTER;
+      editorDeadline = millis() + 10000;
+    }
+    else
+    {
+      editorState = RUNNING;
+    }
+  }
 }
 
 bool handleConfigEditorState()
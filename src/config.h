@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include "data_frame.h"
 
 // Version
 extern const char* VERSION;
@@ -25,6 +26,9 @@ enum ConfigEditorState
   RUNNING            // Normal operation
 };
 
+// Most transports tried in turn, communicationMode first
+#define MAX_TRANSPORTS 3
+
 // Config variables
 extern CommunicationMode communicationMode;
 extern char deviceId[128];
@@ -35,9 +39,58 @@ extern int mqttPort;
 extern char mqttUsername[128];
 extern char mqttPassword[128];
 extern char mqttClientId[128];
+extern bool deviceIdDerived;     // deviceId was left empty and taken from the MAC at boot
+extern bool mqttClientIdDerived; // mqttClientId was left empty and set to the device ID at boot
 extern char mqttTopicPrefix[128];
 extern int modbusDeviceCount;
 extern int modbusRegisterStyle;
+extern int payloadKeyframeInterval;
+extern bool fastBoot;
+extern char configSigningKey[65]; // Shared secret for config tokens received over MQTT, empty disables remote config
+extern unsigned long configSequence; // csq, raised by every remote config token and signed command
+extern char otaSigningKey[129];   // Base64 DER ECDSA P-256 public key for firmware updates over MQTT, empty disables OTA
+
+// Sampling parameters pushed to the M4, applied without a restart
+extern int sendInterval;                   // Milliseconds between frames
+extern int debounceDelays[INPUT_CHANNELS]; // Milliseconds, user button then inputs 1-6
+extern int channelModes[INPUT_CHANNELS];   // ChannelMode, user button then inputs 1-6
+extern int urgentInputs[INPUT_CHANNELS];   // 1 publishes every debounced change at once, user button then inputs 1-6
+extern int edgeLogInputs[INPUT_CHANNELS];  // 1 logs every debounced edge with its timestamp, user button then inputs 1-6
+
+// Pacing of buffered frames on the backfill topic, applied without a restart
+extern int backfillRate;  // Messages per minute
+extern int backfillBurst; // Messages that may be sent back to back after an idle spell
+
+// MQTT delivery: QoS 0 or 1, and how many QoS 1 messages may wait for a PUBACK at once (applied at connect)
+extern int mqttQos;
+extern int mqttWindow;
+
+// MQTT protocol, 4 for 3.1.1 or 5. The expiry intervals (seconds, 0 for none) only apply to MQTT 5.
+extern int mqttVersion;
+extern unsigned long mqttSessionExpiry; // How long the broker keeps the session, subscriptions included, after a disconnect
+extern unsigned long mqttMessageExpiry; // How long the broker keeps a message no subscriber has taken yet
+
+// MQTT over TLS. The broker is checked against the SHA-256 pin of its public key (64 hex digits) if set,
+// otherwise against the CA bundle in the QSPI flash.
+extern bool mqttTls;
+extern char mqttTlsPin[65];
+
+// Transports in priority order: communicationMode, then the failover transports from config
+extern CommunicationMode transportOrder[MAX_TRANSPORTS];
+extern int transportCount;
+
+// Notecard batching, applied without a restart: frames per note (1 to FRAME_BLOCK_FRAMES), and when to have
+// the Notecard send its queued notes (seconds since the last sync, 0 for never, or notes waiting)
+extern int noteBatchFrames;
+extern unsigned long noteSyncInterval;
+extern int noteSyncNotes;
+
+// Last network lease, reused on the next boot when fastBoot is set until it expires (all zero if none)
+extern uint32_t cachedLocalIp;
+extern uint32_t cachedGateway;
+extern uint32_t cachedSubnet;
+extern uint32_t cachedDns;
+extern uint32_t cachedLeaseExpiry; // RTC seconds
 
 extern int p1VoltsModbusAddress;
 extern int p2VoltsModbusAddress;
@@ -59,14 +112,54 @@ extern int inputBufferIndex;
 extern bool promptShown;
 
 extern JsonDocument configDoc;
-extern unsigned char configToken[512];
+extern unsigned char configToken[512]; // Raw msgpack config
+extern size_t configTokenLength;
+
+// Outcome of a config token received over MQTT
+enum RemoteConfigResult
+{
+  REMOTE_CONFIG_APPLIED,       // Saved and applied without a restart
+  REMOTE_CONFIG_RESTART,       // Saved, applied by the restart it needs for network settings
+  REMOTE_CONFIG_DISABLED,      // No signing key configured
+  REMOTE_CONFIG_BAD_SIGNATURE, // Signature missing or does not match
+  REMOTE_CONFIG_INVALID,       // Not a valid config token
+  REMOTE_CONFIG_SAVE_FAILED,   // Could not be written to flash
+  REMOTE_CONFIG_REPLAYED,      // csq not above the running config's
+  REMOTE_CONFIG_PENDING        // An earlier token waits for its restart
+};
+
+// Outcome of a signed command received over MQTT (e.g. a totals reset)
+enum SignedCommandResult
+{
+  SIGNED_COMMAND_ACCEPTED,
+  SIGNED_COMMAND_DISABLED,      // No signing key configured
+  SIGNED_COMMAND_BAD_SIGNATURE, // Signature missing or does not match
+  SIGNED_COMMAND_INVALID,       // Not JSON naming this command
+  SIGNED_COMMAND_REPLAYED,      // csq not above the last one accepted
+  SIGNED_COMMAND_PENDING,       // A config token waits for its restart, the sequence cannot be saved
+  SIGNED_COMMAND_SAVE_FAILED    // The sequence could not be written to flash
+};
 
 // Function declarations
 void initFlashStorage();
 void deinitFlashStorage();
 void loadConfigTokenFromMemory();
-void saveConfigTokenToMemory();
+bool saveConfigTokenToMemory();
 void applyConfigToken();
+// Check the 32 byte HMAC-SHA256 ending a command received over MQTT, keyed with configSigningKey. False if
+// there is no key or the signature does not match, otherwise bodyLength is the length of what it signs.
+bool verifySignedPayload(const uint8_t *payload, size_t length, size_t *bodyLength);
+RemoteConfigResult applyRemoteConfig(const uint8_t *payload, size_t length);
+// Check a signed command: a JSON body naming it in "cmd", with a csq above the last one accepted. On success the
+// sequence is saved and doc holds the body.
+SignedCommandResult acceptSignedCommand(const uint8_t *payload, size_t length, const char *command, JsonDocument &doc);
+const char *getSignedCommandResultName(SignedCommandResult result);
+const char *getRemoteConfigResultName(RemoteConfigResult result);
+const char *getCommunicationModeName(CommunicationMode mode);
+CommunicationMode parseCommunicationMode(const char *name); // WIFI for anything unknown
+bool fastBootConfigured();
+void cacheNetworkLease(uint32_t localIp, uint32_t gateway, uint32_t subnet, uint32_t dns);
+bool networkLeaseValid();
 void printConfig();
 void showConfigPrompt();
 void processConfigInput(char c);
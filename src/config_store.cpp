@@ -0,0 +1,193 @@
+#include "config_store.h"
+#include "crc.h"
+
+// Scratch space for one record rounded up to the program size
+static uint8_t recordBuffer[1024];
+
+// Result of scanning both sectors
+struct CONFIG_SCAN
+{
+  bool legacy;                // Sector A holds a legacy base64 token
+  int newestSector;           // Sector of the newest valid record, -1 if none
+  bd_addr_t newestOffset;     // Offset of the newest valid record within the device
+  CONFIG_RECORD_HEADER newest;
+  bd_size_t end[2];           // First unprogrammed offset within each sector
+};
+
+static bool isBase64(uint8_t c)
+{
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/' || c == '=';
+}
+
+static bool isErased(const void *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    if (((const uint8_t *)data)[i] != 0xFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int sectorCount(mbed::BlockDevice *device)
+{
+  return device->size() >= 2 * device->get_erase_size() ? 2 : 1;
+}
+
+static bd_size_t recordSize(mbed::BlockDevice *device, size_t length)
+{
+  const bd_size_t programSize = device->get_program_size();
+  return ((sizeof(CONFIG_RECORD_HEADER) + length + programSize - 1) / programSize) * programSize;
+}
+
+static uint32_t recordCrc(const CONFIG_RECORD_HEADER *header, const uint8_t *data)
+{
+  uint32_t crc = crc32(&header->sequence, sizeof(header->sequence) + sizeof(header->length));
+  return crc32(data, header->length, crc);
+}
+
+static void scan(mbed::BlockDevice *device, CONFIG_SCAN *result)
+{
+  const bd_size_t sectorSize = device->get_erase_size();
+
+  memset(result, 0, sizeof(CONFIG_SCAN));
+  result->newestSector = -1;
+
+  uint8_t first = 0xFF;
+  device->read(&first, 0, 1);
+  result->legacy = isBase64(first);
+
+  for (int sector = 0; sector < sectorCount(device); sector++)
+  {
+    if (sector == 0 && result->legacy)
+    {
+      // Nothing can be appended after a legacy token
+      result->end[sector] = sectorSize;
+      continue;
+    }
+
+    bd_size_t offset = 0;
+    while (offset + sizeof(CONFIG_RECORD_HEADER) <= sectorSize)
+    {
+      CONFIG_RECORD_HEADER header;
+      device->read(&header, sector * sectorSize + offset, sizeof(header));
+
+      // Erased flash, or a header too damaged to know where the next record starts
+      if (header.magic != CONFIG_RECORD_MAGIC || header.length > CONFIG_RECORD_MAX_LENGTH)
+      {
+        if (!isErased(&header, sizeof(header)))
+        {
+          // Interrupted write - nothing more can be appended to this sector
+          offset = sectorSize;
+        }
+        break;
+      }
+
+      device->read(recordBuffer, sector * sectorSize + offset + sizeof(header), header.length);
+
+      // Signed difference handles sequence wrap-around
+      if (header.crc == recordCrc(&header, recordBuffer) &&
+          (result->newestSector < 0 || (int32_t)(header.sequence - result->newest.sequence) > 0))
+      {
+        result->newestSector = sector;
+        result->newestOffset = sector * sectorSize + offset;
+        result->newest = header;
+      }
+
+      // Damaged records are skipped but still take up space
+      offset += recordSize(device, header.length);
+    }
+
+    result->end[sector] = offset;
+  }
+}
+
+ConfigRecordType readConfigRecord(mbed::BlockDevice *device, uint8_t *buffer, size_t size, size_t *length)
+{
+  CONFIG_SCAN result;
+  scan(device, &result);
+
+  *length = 0;
+
+  if (result.legacy)
+  {
+    device->read(buffer, 0, size);
+
+    // Token runs until the first non base64 character (normally erased flash)
+    while (*length < size && isBase64(buffer[*length]))
+    {
+      (*length)++;
+    }
+    return CONFIG_RECORD_LEGACY;
+  }
+
+  if (result.newestSector < 0 || result.newest.length > size)
+  {
+    return CONFIG_RECORD_NONE;
+  }
+
+  device->read(buffer, result.newestOffset + sizeof(CONFIG_RECORD_HEADER), result.newest.length);
+  *length = result.newest.length;
+  return CONFIG_RECORD_VALID;
+}
+
+bool writeConfigRecord(mbed::BlockDevice *device, const uint8_t *data, size_t length)
+{
+  const bd_size_t sectorSize = device->get_erase_size();
+  const bd_size_t size = recordSize(device, length);
+
+  if (length > CONFIG_RECORD_MAX_LENGTH || size > sizeof(recordBuffer))
+  {
+    return false;
+  }
+
+  CONFIG_SCAN result;
+  scan(device, &result);
+
+  // Append to the sector holding the newest record. A legacy token is replaced from sector B.
+  int sector = result.legacy ? 1 : (result.newestSector < 0 ? 0 : result.newestSector);
+  if (sectorCount(device) == 1)
+  {
+    sector = 0;
+  }
+
+  if (result.end[sector] + size > sectorSize)
+  {
+    // Sector full - start over in the other one, the newest record stays valid until this write is complete
+    if (!result.legacy && sectorCount(device) == 2)
+    {
+      sector = 1 - sector;
+    }
+
+    if (device->erase(sector * sectorSize, sectorSize) != 0)
+    {
+      return false;
+    }
+    result.end[sector] = 0;
+  }
+
+  CONFIG_RECORD_HEADER header;
+  header.magic = CONFIG_RECORD_MAGIC;
+  header.sequence = result.newestSector < 0 ? 1 : result.newest.sequence + 1;
+  header.length = length;
+  header.crc = recordCrc(&header, data);
+
+  memset(recordBuffer, 0xFF, size);
+  memcpy(recordBuffer, &header, sizeof(header));
+  memcpy(recordBuffer + sizeof(header), data, length);
+
+  if (device->program(recordBuffer, sector * sectorSize + result.end[sector], size) != 0)
+  {
+    return false;
+  }
+
+  // The new record is in place, the legacy token can go
+  if (result.legacy && sectorCount(device) == 2)
+  {
+    device->erase(0, sectorSize);
+  }
+
+  return true;
+}
@@ -0,0 +1,40 @@
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <Arduino.h>
+#include <BlockDevice.h>
+
+// Journaled config storage on a block device split into two erase sectors (A and B).
+// Each save appends a record (raw msgpack, length, sequence number and CRC-32) after the last one in
+// the active sector. A sector is only erased when the other one is full, so most saves program a few
+// hundred bytes without any erase, and a power cut during a save only ever spoils the record being written.
+// Loading picks the valid record with the highest sequence number.
+//
+// Config tokens uploaded by the web tool are base64 text at the start of sector A. Such a legacy token
+// always takes precedence as it is the most recent upload; the next save moves to sector B and erases it.
+
+#define CONFIG_RECORD_MAGIC 0x47464301 // "\x01CFG" - first byte can never start a base64 token or erased flash
+#define CONFIG_RECORD_MAX_LENGTH 512
+
+struct CONFIG_RECORD_HEADER
+{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t length; // Length of the msgpack data following the header
+  uint32_t crc;    // CRC-32 over sequence, length and data
+};
+
+enum ConfigRecordType
+{
+  CONFIG_RECORD_NONE,   // Nothing stored
+  CONFIG_RECORD_LEGACY, // Base64 token written by the web tool, returned as-is
+  CONFIG_RECORD_VALID   // Raw msgpack from the newest valid record
+};
+
+// Read the newest config into buffer. length is set to the number of bytes read.
+ConfigRecordType readConfigRecord(mbed::BlockDevice *device, uint8_t *buffer, size_t size, size_t *length);
+
+// Append a new config record. Returns false if the device could not be programmed.
+bool writeConfigRecord(mbed::BlockDevice *device, const uint8_t *data, size_t length);
+
+#endif // CONFIG_STORE_H
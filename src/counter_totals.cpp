@@ -0,0 +1,127 @@
+#include "counter_totals.h"
+#include "crc.h"
+
+const uint32_t BACKUP_SRAM_START_ADDRESS = ((uint32_t)0x38800000); // 4KB backup SRAM in the D3 domain
+
+// Two records at the start of backup SRAM
+static volatile COUNTER_TOTALS_RECORD *records = (volatile COUNTER_TOTALS_RECORD *)BACKUP_SRAM_START_ADDRESS;
+
+// Records of firmware that did not keep the frame number, read once to carry the totals over an update
+struct COUNTER_TOTALS_LEGACY_RECORD
+{
+  unsigned int magic;
+  unsigned int sequence;
+  unsigned int totals[COUNTER_TOTALS_CHANNELS];
+  unsigned int crc;
+};
+
+static volatile COUNTER_TOTALS_LEGACY_RECORD *legacyRecords = (volatile COUNTER_TOTALS_LEGACY_RECORD *)BACKUP_SRAM_START_ADDRESS;
+
+// Working copy of the newest record and the slot it lives in
+static COUNTER_TOTALS_RECORD current;
+static unsigned int currentSlot = 0;
+
+static uint32_t recordCrc(const COUNTER_TOTALS_RECORD *record)
+{
+  return crc32(record, offsetof(COUNTER_TOTALS_RECORD, crc));
+}
+
+static void readWords(const volatile void *source, void *destination, size_t size)
+{
+  const volatile unsigned int *from = (const volatile unsigned int *)source;
+  unsigned int *to = (unsigned int *)destination;
+  for (size_t i = 0; i < size / sizeof(unsigned int); i++)
+  {
+    to[i] = from[i];
+  }
+}
+
+// Copy a record out of backup SRAM, returns true if it is intact
+static bool readRecord(unsigned int slot, COUNTER_TOTALS_RECORD *record)
+{
+  readWords(&records[slot], record, sizeof(COUNTER_TOTALS_RECORD));
+  return record->magic == COUNTER_TOTALS_MAGIC && record->crc == recordCrc(record);
+}
+
+static bool readLegacyRecord(unsigned int slot, COUNTER_TOTALS_LEGACY_RECORD *record)
+{
+  readWords(&legacyRecords[slot], record, sizeof(COUNTER_TOTALS_LEGACY_RECORD));
+  return record->magic == COUNTER_TOTALS_LEGACY_MAGIC &&
+         record->crc == crc32(record, offsetof(COUNTER_TOTALS_LEGACY_RECORD, crc));
+}
+
+// Write the working copy to the slot not holding the newest record
+static void writeRecord()
+{
+  current.sequence++;
+  current.crc = recordCrc(&current);
+
+  const unsigned int slot = 1 - currentSlot;
+  volatile unsigned int *to = (volatile unsigned int *)&records[slot];
+  const unsigned int *from = (const unsigned int *)&current;
+  for (size_t i = 0; i < sizeof(COUNTER_TOTALS_RECORD) / sizeof(unsigned int); i++)
+  {
+    to[i] = from[i];
+  }
+  __DSB();
+
+  currentSlot = slot;
+}
+
+bool initCounterTotals()
+{
+  HAL_PWR_EnableBkUpAccess();
+  __HAL_RCC_BKPRAM_CLK_ENABLE();
+
+  COUNTER_TOTALS_RECORD record[2];
+  const bool valid[2] = {readRecord(0, &record[0]), readRecord(1, &record[1])};
+
+  if (valid[0] || valid[1])
+  {
+    // Signed difference handles sequence wrap-around
+    currentSlot = (valid[0] && (!valid[1] || (int)(record[0].sequence - record[1].sequence) > 0)) ? 0 : 1;
+    current = record[currentSlot];
+    return true;
+  }
+
+  // Cold boot or corrupted - start from zero, keeping the totals of a record left by older firmware
+  memset(&current, 0, sizeof(current));
+  current.magic = COUNTER_TOTALS_MAGIC;
+
+  COUNTER_TOTALS_LEGACY_RECORD legacy[2];
+  const bool legacyValid[2] = {readLegacyRecord(0, &legacy[0]), readLegacyRecord(1, &legacy[1])};
+  if (legacyValid[0] || legacyValid[1])
+  {
+    const unsigned int slot =
+        (legacyValid[0] && (!legacyValid[1] || (int)(legacy[0].sequence - legacy[1].sequence) > 0)) ? 0 : 1;
+    memcpy(current.totals, legacy[slot].totals, sizeof(current.totals));
+  }
+
+  currentSlot = 1;
+  writeRecord();
+  return legacyValid[0] || legacyValid[1];
+}
+
+void addCounterTotal(unsigned int channel)
+{
+  current.totals[channel]++;
+  writeRecord();
+}
+
+unsigned int getCounterTotal(unsigned int channel)
+{
+  return current.totals[channel];
+}
+
+void resetCounterTotals()
+{
+  memset(current.totals, 0, sizeof(current.totals));
+  writeRecord();
+}
+
+unsigned int takeFrameNumber()
+{
+  current.frameNumber++;
+  writeRecord();
+  return current.frameNumber;
+}
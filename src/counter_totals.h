@@ -0,0 +1,38 @@
+#ifndef COUNTER_TOTALS_H
+#define COUNTER_TOTALS_H
+
+#include <Arduino.h>
+
+// Monotonic per-input totals kept in the 4KB backup SRAM so they survive watchdog and software resets.
+// Channel 0 is the user button, channels 1-6 are inputs 1-6. The frame number is kept with them.
+#define COUNTER_TOTALS_CHANNELS 7
+#define COUNTER_TOTALS_MAGIC 0x544F5432        // "TOT2"
+#define COUNTER_TOTALS_LEGACY_MAGIC 0x544F544C // "TOTL", records without a frame number
+
+// Totals are written alternately to two records so a reset mid-write always leaves one valid copy
+struct COUNTER_TOTALS_RECORD
+{
+  unsigned int magic;
+  unsigned int sequence; // Incremented on every write, the valid record with the highest sequence wins
+  unsigned int totals[COUNTER_TOTALS_CHANNELS];
+  unsigned int frameNumber; // Of the last frame taken
+  unsigned int crc;         // CRC-32 over every field above
+};
+
+extern const uint32_t BACKUP_SRAM_START_ADDRESS;
+
+// Enable backup SRAM and restore the newest valid record. Returns false if totals had to start from zero.
+bool initCounterTotals();
+
+// Count one pulse on a channel
+void addCounterTotal(unsigned int channel);
+
+unsigned int getCounterTotal(unsigned int channel);
+
+// Clear every total, e.g. after a meter exchange. Frame numbers carry on.
+void resetCounterTotals();
+
+// Number for the next frame, kept before the frame is written so a reset can skip a number but never repeat one
+unsigned int takeFrameNumber();
+
+#endif // COUNTER_TOTALS_H
@@ -1,7 +1,504 @@
 #include "data_frame.h"
+#include "crc.h"
 
-const uint32_t SDRAM_START_ADDRESS_4 = ((uint32_t)0x38000000); // USING THE AHB SRAM4 DOMAIN SPACE
-const uint32_t SDRAM_ALLOCATION_PROTECTED_BUFFER_SIZE = sizeof(DATA_FRAME_BUFFER) + 1000; // Buffer size + extra margin
+// Control block at the start of the shared region (4KB aligned, see shared_region.py), then the edge log and the buffer
+volatile SHARED_CONTROL *shared_control_sdram = (volatile SHARED_CONTROL *)__shared_region_start;
 
-// Pointer to circular buffer in SDRAM
-volatile DATA_FRAME_BUFFER *data_frame_buffer_sdram = (volatile DATA_FRAME_BUFFER *)SDRAM_START_ADDRESS_4;
\ No newline at end of file
+// Edge log after the control block
+volatile EDGE_LOG *edge_log_sdram = (volatile EDGE_LOG *)(__shared_region_start + sizeof(SHARED_CONTROL));
+
+// Pointer to circular buffer in shared memory
+volatile DATA_FRAME_BUFFER *data_frame_buffer_sdram = (volatile DATA_FRAME_BUFFER *)(__shared_region_start + sizeof(SHARED_CONTROL) + sizeof(EDGE_LOG));
+
+const unsigned int dataFrameCapacity = (__shared_region_end - __shared_region_start - sizeof(SHARED_CONTROL) - sizeof(EDGE_LOG) - offsetof(DATA_FRAME_BUFFER, frames)) / sizeof(DATA_FRAME_SEND);
+
+// Copy a struct of unsigned ints word by word
+static void copyWords(volatile void *destination, const volatile void *source, size_t size)
+{
+  volatile unsigned int *to = (volatile unsigned int *)destination;
+  const volatile unsigned int *from = (const volatile unsigned int *)source;
+  for (size_t i = 0; i < size / sizeof(unsigned int); i++)
+  {
+    to[i] = from[i];
+  }
+}
+
+void copyDataFrame(volatile DATA_FRAME_SEND *destination, const volatile DATA_FRAME_SEND *source)
+{
+  copyWords(destination, source, sizeof(DATA_FRAME_SEND));
+}
+
+#ifdef CORE_CM7
+void initSharedRegion()
+{
+  __HAL_RCC_D2SRAM1_CLK_ENABLE();
+  __HAL_RCC_D2SRAM2_CLK_ENABLE();
+
+  // Normal, shareable, non-cacheable memory over SRAM1-2 (the M7 uses none of it otherwise).
+  // The highest region number takes priority over mbed's default RAM regions.
+  MPU_Region_InitTypeDef region = {};
+  region.Enable = MPU_REGION_ENABLE;
+  region.Number = MPU_REGION_NUMBER15;
+  region.BaseAddress = 0x30000000;
+  region.Size = MPU_REGION_SIZE_256KB;
+  region.SubRegionDisable = 0x00;
+  region.TypeExtField = MPU_TEX_LEVEL1;
+  region.AccessPermission = MPU_REGION_FULL_ACCESS;
+  region.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  region.IsShareable = MPU_ACCESS_SHAREABLE;
+  region.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+  region.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+
+  HAL_MPU_Disable();
+  HAL_MPU_ConfigRegion(&region);
+  HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+
+  // Drop anything cached from the region before it was remapped
+  SCB_CleanInvalidateDCache_by_Addr((uint32_t *)__shared_region_start, __shared_region_end - __shared_region_start);
+}
+#endif
+
+#ifdef UNIT_TEST
+void (*journalStoreHook)() = nullptr;
+#endif
+
+// One store of an index or the header, each is a point a reset can interrupt
+static void storeWord(volatile unsigned int *word, unsigned int value)
+{
+#ifdef UNIT_TEST
+  if (journalStoreHook)
+  {
+    journalStoreHook();
+  }
+#endif
+  *word = value;
+}
+
+static uint32_t headerCrc(unsigned int magic, unsigned int version, unsigned int capacity)
+{
+  const unsigned int header[3] = {magic, version, capacity};
+  return crc32(header, sizeof(header));
+}
+
+static uint32_t slotCrc(unsigned int sequence, unsigned int value)
+{
+  const unsigned int slot[2] = {sequence, value};
+  return crc32(slot, sizeof(slot));
+}
+
+// Find the newest valid slot, returns -1 if neither slot is valid
+static int newestSlot(const volatile DATA_FRAME_INDEX *index, unsigned int limit)
+{
+  int newest = -1;
+  unsigned int newestSequence = 0;
+
+  for (int i = 0; i < 2; i++)
+  {
+    const unsigned int sequence = index->slots[i].sequence;
+    const unsigned int value = index->slots[i].value;
+    const unsigned int crc = index->slots[i].crc;
+
+    if (crc != slotCrc(sequence, value) || value >= limit)
+    {
+      continue;
+    }
+
+    // Signed difference handles sequence wrap-around
+    if (newest < 0 || (int)(sequence - newestSequence) > 0)
+    {
+      newest = i;
+      newestSequence = sequence;
+    }
+  }
+
+  return newest;
+}
+
+bool readJournaledIndex(const volatile DATA_FRAME_INDEX *index, unsigned int limit, unsigned int *value)
+{
+  const int slot = newestSlot(index, limit);
+  *value = slot < 0 ? 0 : index->slots[slot].value;
+  return slot >= 0;
+}
+
+unsigned int readFrameIndex(const volatile DATA_FRAME_INDEX *index)
+{
+  unsigned int value;
+  readJournaledIndex(index, dataFrameCapacity, &value);
+  return value;
+}
+
+void writeJournaledIndex(volatile DATA_FRAME_INDEX *index, unsigned int value, unsigned int limit)
+{
+  const int newest = newestSlot(index, limit);
+  const unsigned int sequence = newest < 0 ? 0 : index->slots[newest].sequence + 1;
+
+  // Overwrite the older slot, the newest one stays valid until this write is complete
+  volatile DATA_FRAME_INDEX_SLOT *slot = &index->slots[newest == 0 ? 1 : 0];
+  storeWord(&slot->crc, 0);
+  __DSB();
+  storeWord(&slot->sequence, sequence);
+  storeWord(&slot->value, value);
+  storeWord(&slot->crc, slotCrc(sequence, value));
+  __DSB();
+}
+
+void writeFrameIndex(volatile DATA_FRAME_INDEX *index, unsigned int value)
+{
+  writeJournaledIndex(index, value, dataFrameCapacity);
+}
+
+bool restoreDataFrameBuffer()
+{
+  volatile DATA_FRAME_BUFFER *buffer = data_frame_buffer_sdram;
+
+  if (buffer->magic == DATA_FRAME_BUFFER_MAGIC &&
+      buffer->version == DATA_FRAME_BUFFER_VERSION &&
+      buffer->capacity == dataFrameCapacity &&
+      buffer->headerCrc == headerCrc(buffer->magic, buffer->version, buffer->capacity) &&
+      newestSlot(&buffer->head, dataFrameCapacity) >= 0 &&
+      newestSlot(&buffer->tail, dataFrameCapacity) >= 0)
+  {
+    // Warm reset - keep the buffered frames. A sent index that is not valid or lies outside tail to head
+    // publishes again from the tail, frames are sent twice rather than skipped.
+    unsigned int head, tail, sent;
+    readJournaledIndex(&buffer->head, dataFrameCapacity, &head);
+    readJournaledIndex(&buffer->tail, dataFrameCapacity, &tail);
+    if (!readJournaledIndex(&buffer->sent, dataFrameCapacity, &sent) ||
+        dataFrameCount(sent, tail) > dataFrameCount(head, tail))
+    {
+      writeFrameIndex(&buffer->sent, tail);
+    }
+
+    storeWord(&buffer->bootCount, buffer->bootCount + 1);
+    return true;
+  }
+
+  // Cold boot or corruption - start empty. Invalidate the header first and set the magic last, so a reset part
+  // way through initialisation is seen as corruption again.
+  storeWord(&buffer->magic, 0);
+  __DSB();
+
+  for (int i = 0; i < 2; i++)
+  {
+    storeWord(&buffer->head.slots[i].crc, 0);
+    storeWord(&buffer->tail.slots[i].crc, 0);
+    storeWord(&buffer->sent.slots[i].crc, 0);
+  }
+  writeFrameIndex(&buffer->head, 0);
+  writeFrameIndex(&buffer->tail, 0);
+  writeFrameIndex(&buffer->sent, 0);
+
+  storeWord(&buffer->version, DATA_FRAME_BUFFER_VERSION);
+  storeWord(&buffer->bootCount, 0);
+  storeWord(&buffer->capacity, dataFrameCapacity);
+  storeWord(&buffer->headerCrc, headerCrc(DATA_FRAME_BUFFER_MAGIC, DATA_FRAME_BUFFER_VERSION, dataFrameCapacity));
+  storeWord(&buffer->magic, DATA_FRAME_BUFFER_MAGIC);
+  __DSB();
+
+  return false;
+}
+
+static uint32_t parametersCrc(unsigned int sequence, const INPUT_PARAMETERS *parameters)
+{
+  return crc32(parameters, sizeof(INPUT_PARAMETERS), crc32(&sequence, sizeof(sequence)));
+}
+
+void clearSharedControl()
+{
+  volatile SHARED_CONTROL *control = shared_control_sdram;
+
+  control->consumerReady = 0;
+  control->sequence = 0;
+  control->crc = 0;
+  control->acknowledged.sequence = 0;
+  control->selfTestSequence = 0;
+  control->selfTestCrc = 0;
+  control->selfTestReport.sequence = 0;
+  control->urgentEvents.head.value = 0;
+  control->urgentEvents.tail.value = 0;
+  edge_log_sdram->head.value = 0;
+  edge_log_sdram->head.dropped = 0;
+  edge_log_sdram->tail.value = 0;
+  cleanSharedControlCache();
+}
+
+unsigned int postInputParameters(const INPUT_PARAMETERS *parameters)
+{
+  volatile SHARED_CONTROL *control = shared_control_sdram;
+
+  // Only the M7 writes the sequence so its own copy is current. Skip 0, it means nothing posted.
+  unsigned int sequence = control->sequence + 1;
+  if (sequence == 0)
+  {
+    sequence = 1;
+  }
+
+  // Spoil the CRC first so the M4 never accepts a mix of old and new values
+  control->crc = 0;
+  cleanSharedControlCache();
+
+  control->sequence = sequence;
+  copyWords(&control->parameters, parameters, sizeof(INPUT_PARAMETERS));
+  control->crc = parametersCrc(sequence, parameters);
+  cleanSharedControlCache();
+
+  return sequence;
+}
+
+unsigned int readInputParametersAcknowledged()
+{
+  __DSB();
+  return shared_control_sdram->acknowledged.sequence;
+}
+
+bool readInputParameters(INPUT_PARAMETERS *parameters, unsigned int *sequence)
+{
+  const volatile SHARED_CONTROL *control = shared_control_sdram;
+
+  *sequence = control->sequence;
+  copyWords(parameters, &control->parameters, sizeof(INPUT_PARAMETERS));
+
+  return *sequence != 0 && control->crc == parametersCrc(*sequence, parameters);
+}
+
+void acknowledgeInputParameters(unsigned int sequence)
+{
+  shared_control_sdram->acknowledged.sequence = sequence;
+  __DSB();
+}
+
+static uint32_t selfTestCrc(unsigned int sequence, const SELF_TEST_STEP *step)
+{
+  return crc32(step, sizeof(SELF_TEST_STEP), crc32(&sequence, sizeof(sequence)));
+}
+
+// Posted like a parameter block
+unsigned int postSelfTestStep(const SELF_TEST_STEP *step)
+{
+  volatile SHARED_CONTROL *control = shared_control_sdram;
+
+  unsigned int sequence = control->selfTestSequence + 1;
+  if (sequence == 0)
+  {
+    sequence = 1;
+  }
+
+  control->selfTestCrc = 0;
+  cleanSharedControlCache();
+
+  control->selfTestSequence = sequence;
+  copyWords(&control->selfTest, step, sizeof(SELF_TEST_STEP));
+  control->selfTestCrc = selfTestCrc(sequence, step);
+  cleanSharedControlCache();
+
+  return sequence;
+}
+
+bool readSelfTestStep(SELF_TEST_STEP *step, unsigned int *sequence)
+{
+  const volatile SHARED_CONTROL *control = shared_control_sdram;
+
+  *sequence = control->selfTestSequence;
+  copyWords(step, &control->selfTest, sizeof(SELF_TEST_STEP));
+
+  return *sequence != 0 && control->selfTestCrc == selfTestCrc(*sequence, step);
+}
+
+void writeSelfTestResult(unsigned int sequence, const SELF_TEST_RESULT *result)
+{
+  volatile SELF_TEST_REPORT *report = &shared_control_sdram->selfTestReport;
+
+  copyWords(&report->result, result, sizeof(SELF_TEST_RESULT));
+  __DSB();
+  report->sequence = sequence;
+  __DSB();
+}
+
+bool readSelfTestResult(unsigned int sequence, SELF_TEST_RESULT *result)
+{
+  const volatile SELF_TEST_REPORT *report = &shared_control_sdram->selfTestReport;
+
+  __DSB();
+  if (report->sequence != sequence)
+  {
+    return false;
+  }
+  __DMB();
+  copyWords(result, &report->result, sizeof(SELF_TEST_RESULT));
+  return true;
+}
+
+// Length of one burst including the gap after it, the whole train for a continuous one
+static unsigned long selfTestBurstMicros(const SELF_TEST_STEP *step)
+{
+  return (unsigned long)step->burstPulses * step->periodMicros + step->burstGapMicros;
+}
+
+// Start of a pulse, microseconds into the step
+static unsigned long selfTestPulseStart(const SELF_TEST_STEP *step, unsigned int pulse)
+{
+  if (step->burstPulses == 0)
+  {
+    return (unsigned long)pulse * step->periodMicros;
+  }
+  return (pulse / step->burstPulses) * selfTestBurstMicros(step) + (unsigned long)(pulse % step->burstPulses) * step->periodMicros;
+}
+
+unsigned long selfTestPatternMicros(const SELF_TEST_STEP *step)
+{
+  return step->pulses > 0 ? selfTestPulseStart(step, step->pulses - 1) + step->periodMicros : 0;
+}
+
+unsigned int selfTestLevel(const SELF_TEST_STEP *step, unsigned long elapsed)
+{
+  if (step->periodMicros == 0)
+  {
+    return 1;
+  }
+
+  unsigned long pulse;
+  unsigned long phase;
+  if (step->burstPulses == 0)
+  {
+    pulse = elapsed / step->periodMicros;
+    phase = elapsed % step->periodMicros;
+  }
+  else
+  {
+    const unsigned long within = elapsed % selfTestBurstMicros(step);
+    if (within >= (unsigned long)step->burstPulses * step->periodMicros)
+    {
+      return 1; // Gap between bursts
+    }
+    pulse = (elapsed / selfTestBurstMicros(step)) * step->burstPulses + within / step->periodMicros;
+    phase = within % step->periodMicros;
+  }
+
+  return pulse >= step->pulses || phase >= step->lowMicros ? 1 : 0;
+}
+
+unsigned int selfTestRamp(const SELF_TEST_STEP *step, unsigned long elapsed)
+{
+  const unsigned long length = selfTestPatternMicros(step);
+  if (length == 0 || elapsed >= length)
+  {
+    return step->rampTo;
+  }
+  const long span = (long)step->rampTo - (long)step->rampFrom;
+  return step->rampFrom + (long)((int64_t)span * (int64_t)elapsed / (int64_t)length);
+}
+
+bool pushUrgentEvent(const URGENT_EVENT *event)
+{
+  volatile URGENT_EVENT_RING *ring = &shared_control_sdram->urgentEvents;
+
+  const unsigned int head = ring->head.value;
+  const unsigned int next = (head + 1) % URGENT_EVENT_CAPACITY;
+  if (next == ring->tail.value)
+  {
+    return false;
+  }
+
+  // The event must be complete before the M7 can see the new head
+  copyWords(&ring->events[head], event, sizeof(URGENT_EVENT));
+  __DSB();
+  ring->head.value = next;
+  __DSB();
+
+  return true;
+}
+
+bool readUrgentEvent(URGENT_EVENT *event)
+{
+  const volatile URGENT_EVENT_RING *ring = &shared_control_sdram->urgentEvents;
+
+  const unsigned int tail = ring->tail.value;
+  const unsigned int head = ring->head.value;
+  if (head == tail || head >= URGENT_EVENT_CAPACITY || tail >= URGENT_EVENT_CAPACITY)
+  {
+    return false;
+  }
+
+  __DSB();
+  copyWords(event, &ring->events[tail], sizeof(URGENT_EVENT));
+  return true;
+}
+
+void dropUrgentEvent()
+{
+  volatile URGENT_EVENT_RING *ring = &shared_control_sdram->urgentEvents;
+
+  ring->tail.value = (ring->tail.value + 1) % URGENT_EVENT_CAPACITY;
+  __DSB();
+}
+
+unsigned int urgentEventAge(const URGENT_EVENT *event)
+{
+  __DSB();
+  return shared_control_sdram->acknowledged.clock - event->timestamp;
+}
+
+unsigned int pushEdgeEvent(const EDGE_EVENT *event)
+{
+  volatile EDGE_LOG *log = edge_log_sdram;
+
+  const unsigned int head = log->head.value;
+  const unsigned int next = (head + 1) % EDGE_LOG_CAPACITY;
+  const unsigned int tail = log->tail.value;
+  if (next == tail)
+  {
+    log->head.dropped = log->head.dropped + 1;
+    return 0;
+  }
+
+  copyWords(&log->events[head], event, sizeof(EDGE_EVENT));
+  __DSB();
+  log->head.value = next;
+  __DSB();
+
+  return (next + EDGE_LOG_CAPACITY - tail) % EDGE_LOG_CAPACITY;
+}
+
+unsigned int readEdgeEvents(EDGE_EVENT *events, unsigned int count)
+{
+  const volatile EDGE_LOG *log = edge_log_sdram;
+
+  const unsigned int tail = log->tail.value;
+  const unsigned int head = log->head.value;
+  if (head >= EDGE_LOG_CAPACITY || tail >= EDGE_LOG_CAPACITY)
+  {
+    return 0;
+  }
+
+  const unsigned int queued = (head + EDGE_LOG_CAPACITY - tail) % EDGE_LOG_CAPACITY;
+  count = min(count, queued);
+
+  __DSB();
+  for (unsigned int i = 0; i < count; i++)
+  {
+    copyWords(&events[i], &log->events[(tail + i) % EDGE_LOG_CAPACITY], sizeof(EDGE_EVENT));
+  }
+
+  return count;
+}
+
+void dropEdgeEvents(unsigned int count)
+{
+  volatile EDGE_LOG *log = edge_log_sdram;
+
+  log->tail.value = (log->tail.value + count) % EDGE_LOG_CAPACITY;
+  __DSB();
+}
+
+unsigned int readEdgeEventsDropped()
+{
+  __DSB();
+  return edge_log_sdram->head.dropped;
+}
+
+unsigned int edgeEventAge(const EDGE_EVENT *event)
+{
+  __DSB();
+  return shared_control_sdram->acknowledged.clockMicros - event->timestamp;
+}
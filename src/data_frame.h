@@ -19,50 +19,341 @@ struct DATA_FRAME_SEND
   unsigned int input4State;
   unsigned int input5State;
   unsigned int input6State;
-  unsigned int input7Analog;
-  unsigned int input8Analog;
+  unsigned int input7Analog;  // Mean over span
+  unsigned int input8Analog;  // Mean over span
+  unsigned int span;          // Number of send intervals covered, more than 1 once frames have been coalesced
+  unsigned int input7Min;
+  unsigned int input7Max;
+  unsigned int input8Min;
+  unsigned int input8Max;
+  unsigned int userButtonTotal; // Cumulative counts since the totals were last cleared, survive resets
+  unsigned int input1Total;
+  unsigned int input2Total;
+  unsigned int input3Total;
+  unsigned int input4Total;
+  unsigned int input5Total;
+  unsigned int input6Total;
+  unsigned int dutyCycle; // Percentage of the interval the M4 was awake, mean over span
+  unsigned int frameNumber; // Counts frames since the totals started, kept over resets. A coalesced frame keeps the
+                            // number of its newest interval and covers frameNumber - span + 1 to frameNumber.
+  unsigned int flags;       // FRAME_FLAG_* bits, set if any interval covered has them
 };
 
+#define FRAME_FLAG_SELF_TEST 0x01 // A self-test ran during the frame, its counts are still the real inputs'
+
 // Circular buffer configuration
-// Max frames to fill ~64KB AHB SRAM4: (65536 - 12 bytes overhead) / 64 bytes per frame ≈ 1024
-// Using 1000 for safety margin = ~64KB total = 83 minutes @ 5s intervals
-#define DATA_FRAME_BUFFER_SIZE 1000  // Number of frames that can be buffered
+// The buffer lives in a region of D2 SRAM reserved by the linker (see shared_region.py) and takes every frame
+// that fits after the control block, edge log and header: the default 128KB holds 984 frames = 82 minutes @ 5s
+// intervals at full resolution. One slot is always left empty to tell a full buffer from an empty one.
+// When full, old frames are coalesced rather than dropped so longer outages lose resolution, not counts.
+extern const unsigned int dataFrameCapacity; // Number of frames that can be buffered
 
-struct DATA_FRAME_BUFFER
+// Bounds of the shared region, defined by the linker
+extern "C" uint8_t __shared_region_start[];
+extern "C" uint8_t __shared_region_end[];
+
+// Header identifying a buffer that survived a warm reset. Bump the version whenever
+// DATA_FRAME_SEND or DATA_FRAME_BUFFER change so old contents are discarded after a firmware update.
+#define DATA_FRAME_BUFFER_MAGIC 0x44415542 // "DAUB"
+#define DATA_FRAME_BUFFER_VERSION 8
+
+// A ring index written alternately to two slots, each with its own sequence number and CRC.
+// A reset or a read from the other core in the middle of a write only ever spoils the slot being
+// written, so the newest valid slot always holds a value that was completely written.
+struct DATA_FRAME_INDEX_SLOT
+{
+  volatile unsigned int sequence;
+  volatile unsigned int value;
+  volatile unsigned int crc; // CRC-32 over sequence and value
+};
+
+// Each index is written by one core only and sits on its own 32 byte M7 cache line, so cleaning
+// the M7 cache never writes a stale copy of the other core's index back to shared memory.
+struct __attribute__((aligned(32))) DATA_FRAME_INDEX
 {
-  volatile unsigned int head;  // Index where M4 writes next frame
-  volatile unsigned int tail;  // Index where M7 reads next frame
-  volatile unsigned int count; // Number of frames in buffer
-  DATA_FRAME_SEND frames[DATA_FRAME_BUFFER_SIZE];
+  DATA_FRAME_INDEX_SLOT slots[2];
 };
 
-extern const uint32_t SDRAM_START_ADDRESS_4; // USING THE AHB SRAM4 DOMAIN SPACE
-extern const uint32_t SDRAM_ALLOCATION_PROTECTED_BUFFER_SIZE; // for my own use, malloc will allocate after the size of this variable, increase if we need more than 10KB for core to core variables
+struct DATA_FRAME_BUFFER
+{
+  volatile unsigned int magic;
+  volatile unsigned int version;
+  volatile unsigned int bootCount; // Number of warm resets the contents have survived
+  volatile unsigned int capacity;  // dataFrameCapacity of the firmware that initialised the buffer
+  volatile unsigned int headerCrc; // CRC-32 over magic, version and capacity. Not the boot count, so a reset
+                                   // while it is counted up does not discard the buffer.
+  DATA_FRAME_INDEX head;           // Index where M4 writes next frame, written by M4 only
+  DATA_FRAME_INDEX tail;           // Index of the oldest frame not yet delivered, written by M7 only
+  DATA_FRAME_INDEX sent;           // Index of the next frame the M7 publishes, frames up to it are published and
+                                   // wait for acknowledgement. Written by M7 only.
+  DATA_FRAME_SEND frames[];        // dataFrameCapacity frames, up to the end of the shared region
+};
 
-// Pointer to circular buffer in SDRAM
+// Pointer to circular buffer in shared memory
 extern volatile DATA_FRAME_BUFFER *data_frame_buffer_sdram;
 
-// Cache coherency helpers for dual-core communication
-inline void cleanSharedMemoryCache()
+// Counting inputs: channel 0 is the user button, channels 1-6 are inputs 1-6
+#define INPUT_CHANNELS 7
+
+// Which debounced edges of an input are counted
+enum ChannelMode
+{
+  CHANNEL_MODE_FALLING = 0, // Default
+  CHANNEL_MODE_RISING = 1,
+  CHANNEL_MODE_BOTH = 2,
+  CHANNEL_MODE_DISABLED = 3 // Not counted, the state is still reported
+};
+
+// One-shot commands carried with a parameter block, run once per sequence number
+#define CONTROL_COMMAND_RESET_TOTALS 0x01 // Clear the cumulative totals
+
+// Runtime sampling parameters pushed from the M7 config to the M4
+struct INPUT_PARAMETERS
+{
+  unsigned int sendInterval;                   // Milliseconds between frames
+  unsigned int debounceDelays[INPUT_CHANNELS]; // Milliseconds
+  unsigned int channelModes[INPUT_CHANNELS];   // ChannelMode
+  unsigned int commands;                       // CONTROL_COMMAND_* bits
+  unsigned int urgentChannels;                 // Bit per channel, debounced changes raise an URGENT_EVENT
+  unsigned int edgeLogChannels;                // Bit per channel, debounced changes go to the edge log
+};
+
+// Acknowledgement written by the M4 only, on its own cache line
+struct __attribute__((aligned(32))) SHARED_CONTROL_ACK
+{
+  volatile unsigned int sequence; // Sequence of the last parameter block the M4 applied
+  volatile unsigned int clock;       // M4 millis(), updated every sample so the M7 can age urgent events
+  volatile unsigned int clockMicros; // M4 micros() at the same moment, for edge log timestamps
+};
+
+// Debounced state change on an input marked urgent, published by the M7 ahead of any frame
+struct URGENT_EVENT
+{
+  unsigned int sequence;  // Counts urgent events since the M4 started, a gap means events were dropped
+  unsigned int channel;   // 0 user button, 1-6 inputs 1-6
+  unsigned int state;     // New debounced state
+  unsigned int timestamp; // M4 millis() when the change was accepted
+  unsigned int total;     // Cumulative total of the channel including this edge
+};
+
+// Urgent events do not survive resets - after one the next frame carries the current states anyway.
+// When the ring is full new events are dropped and the gap shows in the sequence numbers.
+#define URGENT_EVENT_CAPACITY 16
+
+// Ring index written by one core only, on its own cache line
+struct __attribute__((aligned(32))) SHARED_RING_INDEX
+{
+  volatile unsigned int value;
+};
+
+struct URGENT_EVENT_RING
+{
+  SHARED_RING_INDEX head; // Written by the M4
+  SHARED_RING_INDEX tail; // Written by the M7
+  volatile URGENT_EVENT events[URGENT_EVENT_CAPACITY];
+};
+
+// One step of the self-test, posted by the M7 and picked up by the M4 at its next sample. While it runs a pulse
+// pattern goes through a debounce state of its own with the channel modes of the selected inputs, and the pins are
+// still read as usual. Its edges only reach the result, so the counts and totals in frames, urgent events and the
+// edge log only carry real edges. Selected analog inputs take a ramp across the step, which only reaches the result.
+// Frames covering a step are flagged with FRAME_FLAG_SELF_TEST.
+struct SELF_TEST_STEP
+{
+  unsigned int channels;       // Bit per input, bit 1 for input 1 up to bit 6 (the user button is not tested)
+  unsigned int periodMicros;   // From one pulse to the next
+  unsigned int lowMicros;      // Each pulse drives the input low for this long, from high
+  unsigned int pulses;         // Pulses in the step
+  unsigned int burstPulses;    // Pulses per burst, 0 for one continuous train
+  unsigned int burstGapMicros; // Extra high time after each burst
+  unsigned int analogChannels; // Bit per analog input, bit 0 for input 7 and bit 1 for input 8
+  unsigned int rampFrom;       // Analog value at the start of the step
+  unsigned int rampTo;         // Analog value at the end of the pulses
+};
+
+// What the M4 counted in a step, reported once the last pulse has had time to pass the debounce
+struct SELF_TEST_RESULT
+{
+  unsigned int counts[INPUT_CHANNELS]; // Synthetic edges counted per channel
+  unsigned int samplePeriod;           // Milliseconds between samples during the step
+  unsigned int analogMin[2];           // Lowest and highest values the analog inputs took, 12 bit
+  unsigned int analogMax[2];
+};
+
+// Written by the M4 only, on its own cache line. The sequence is written last.
+struct __attribute__((aligned(32))) SELF_TEST_REPORT
+{
+  volatile unsigned int sequence; // Of the step the result is for
+  volatile SELF_TEST_RESULT result;
+};
+
+// Signals between the cores, on their own cache lines at the start of the shared region.
+// The M7 posts a parameter block with a new sequence number and the M4 applies it at its next frame
+// boundary, then acknowledges the sequence. The CRC lets the M4 ignore a block caught part way through a post.
+struct __attribute__((aligned(32))) SHARED_CONTROL
+{
+  volatile unsigned int consumerReady; // Set by the M7 once it can publish, the M4 then sends its first frame straight away
+  volatile unsigned int sequence;      // Of the posted parameter block, 0 if none has been posted since boot
+  volatile INPUT_PARAMETERS parameters;
+  volatile unsigned int crc; // CRC-32 over sequence and parameters
+  volatile unsigned int selfTestSequence; // Of the posted self-test step, 0 if none has been posted since boot
+  volatile SELF_TEST_STEP selfTest;
+  volatile unsigned int selfTestCrc; // CRC-32 over selfTestSequence and selfTest
+  SHARED_CONTROL_ACK acknowledged;
+  SELF_TEST_REPORT selfTestReport;
+  URGENT_EVENT_RING urgentEvents;
+};
+
+extern volatile SHARED_CONTROL *shared_control_sdram;
+
+// Debounced edge on an input selected for the edge log, for cycle-time analysis
+struct EDGE_EVENT
+{
+  unsigned int timestamp; // M4 micros() of the first sample at the new level
+  unsigned int edge;      // Channel << 1 | new state
+};
+
+// Room for a few hundred milliseconds of the fastest edges the sampling can follow on every channel.
+// The M4 wakes the M7 each time another quarter fills. When full new edges are dropped and counted.
+#define EDGE_LOG_CAPACITY 1024
+
+struct __attribute__((aligned(32))) EDGE_LOG_HEAD
+{
+  volatile unsigned int value;   // Written by the M4
+  volatile unsigned int dropped; // Edges lost to a full log since the M4 started, written by the M4
+};
+
+// Between the control block and the frame buffer. Like the urgent events it does not survive a reset.
+struct EDGE_LOG
 {
+  EDGE_LOG_HEAD head;
+  SHARED_RING_INDEX tail; // Written by the M7
+  volatile EDGE_EVENT events[EDGE_LOG_CAPACITY];
+};
+
+extern volatile EDGE_LOG *edge_log_sdram;
+
+// Validate the buffer header and indices left from before a reset. If valid the contents are kept and
+// the boot count incremented, and a sent index outside them is moved back to the tail. Otherwise (cold boot or
+// corruption) the buffer is emptied. Called by the M4.
+// Returns true if buffered frames were kept.
+bool restoreDataFrameBuffer();
+
+// Newest completely written value of an index
+unsigned int readFrameIndex(const volatile DATA_FRAME_INDEX *index);
+
+// Commit a new value for an index, only the owning core may call this
+void writeFrameIndex(volatile DATA_FRAME_INDEX *index, unsigned int value);
+
+// The same journaling for indices of other stores, values must be below limit.
+// readJournaledIndex returns false (and 0) if neither slot is valid.
+bool readJournaledIndex(const volatile DATA_FRAME_INDEX *index, unsigned int limit, unsigned int *value);
+void writeJournaledIndex(volatile DATA_FRAME_INDEX *index, unsigned int value, unsigned int limit);
+
+#ifdef UNIT_TEST
+// Called before every store to an index or the buffer header. A test throws from it to stop a write part way,
+// as a reset would (see test/test_data_frame).
+extern void (*journalStoreHook)();
+#endif
+
 #ifdef CORE_CM7
-  // M7 has D-Cache - clean it to ensure writes are visible to M4
-  SCB_CleanDCache_by_Addr((uint32_t *)SDRAM_START_ADDRESS_4, sizeof(DATA_FRAME_BUFFER));
+// Enable the D2 SRAM clocks for the M7 and map the shared region non-cacheable, so both cores always see the
+// same contents without cache maintenance. Called by the M7 before touching shared memory.
+void initSharedRegion();
 #endif
-  // Memory barriers ensure proper ordering on both cores
+
+// Forget any parameter block and acknowledgement left from before a reset. Called by the M7 before booting the M4.
+void clearSharedControl();
+
+// Post a new parameter block for the M4, returns its sequence number. Called by the M7.
+unsigned int postInputParameters(const INPUT_PARAMETERS *parameters);
+
+// Sequence number of the last parameter block the M4 applied. Called by the M7.
+unsigned int readInputParametersAcknowledged();
+
+// Copy out the posted parameter block, returns false if none has been posted or it is incomplete. Called by the M4.
+bool readInputParameters(INPUT_PARAMETERS *parameters, unsigned int *sequence);
+
+// Report a parameter block as applied. Called by the M4.
+void acknowledgeInputParameters(unsigned int sequence);
+
+// Post a self-test step for the M4, returns its sequence number. A step without channels stops a running one.
+// Called by the M7.
+unsigned int postSelfTestStep(const SELF_TEST_STEP *step);
+
+// Copy out the posted self-test step, returns false if none has been posted or it is incomplete. Called by the M4.
+bool readSelfTestStep(SELF_TEST_STEP *step, unsigned int *sequence);
+
+// Report the result of a step. Called by the M4.
+void writeSelfTestResult(unsigned int sequence, const SELF_TEST_RESULT *result);
+
+// Copy out the result of a step, returns false until the M4 has reported it. Called by the M7.
+bool readSelfTestResult(unsigned int sequence, SELF_TEST_RESULT *result);
+
+// Microseconds from the start of a step to the end of its last pulse
+unsigned long selfTestPatternMicros(const SELF_TEST_STEP *step);
+
+// Level of the pulse pattern (1 high, 0 low) elapsed microseconds into a step, high once all pulses are out
+unsigned int selfTestLevel(const SELF_TEST_STEP *step, unsigned long elapsed);
+
+// Value of the analog ramp elapsed microseconds into a step
+unsigned int selfTestRamp(const SELF_TEST_STEP *step, unsigned long elapsed);
+
+// Queue an urgent event for the M7, returns false if the ring is full. Called by the M4.
+bool pushUrgentEvent(const URGENT_EVENT *event);
+
+// Copy out the oldest urgent event without removing it, returns false if there is none. Called by the M7.
+bool readUrgentEvent(URGENT_EVENT *event);
+
+// Remove the oldest urgent event once it has been published. Called by the M7.
+void dropUrgentEvent();
+
+// Milliseconds since an urgent event was raised, by the M4's clock. Called by the M7.
+unsigned int urgentEventAge(const URGENT_EVENT *event);
+
+// Append an edge to the log. Returns the number of edges now queued, 0 if the log was full and the
+// edge was dropped. Called by the M4.
+unsigned int pushEdgeEvent(const EDGE_EVENT *event);
+
+// Copy out up to count of the oldest edges without removing them, returns how many. Called by the M7.
+unsigned int readEdgeEvents(EDGE_EVENT *events, unsigned int count);
+
+// Remove the count oldest edges. Called by the M7.
+void dropEdgeEvents(unsigned int count);
+
+// Edges dropped since the M4 started. Called by the M7.
+unsigned int readEdgeEventsDropped();
+
+// Microseconds since an edge, by the M4's clock. Called by the M7.
+unsigned int edgeEventAge(const EDGE_EVENT *event);
+
+// Number of frames between tail and head
+inline unsigned int dataFrameCount(unsigned int head, unsigned int tail)
+{
+  return (head + dataFrameCapacity - tail) % dataFrameCapacity;
+}
+
+// Copy a frame word by word (volatile structs cannot be assigned directly)
+void copyDataFrame(volatile DATA_FRAME_SEND *destination, const volatile DATA_FRAME_SEND *source);
+
+// Ordering helpers for dual-core communication. The shared region is non-cacheable on the M7 (see
+// initSharedRegion) and the M4 has no data cache, so only the memory barriers are needed.
+inline void cleanSharedMemoryCache()
+{
   __DSB(); // Data Synchronization Barrier
   __ISB(); // Instruction Synchronization Barrier
 }
 
+inline void cleanSharedControlCache()
+{
+  __DSB();
+  __ISB();
+}
+
 inline void invalidateSharedMemoryCache()
 {
-#ifdef CORE_CM7
-  // M7 has D-Cache - invalidate it to ensure we read fresh data from SDRAM
-  SCB_InvalidateDCache_by_Addr((uint32_t *)SDRAM_START_ADDRESS_4, sizeof(DATA_FRAME_BUFFER));
-#endif
-  // Memory barriers ensure proper ordering on both cores
-  __DSB(); // Data Synchronization Barrier
-  __ISB(); // Instruction Synchronization Barrier
+  __DSB();
+  __ISB();
 }
 
 #endif // DATA_FRAME_H
\ No newline at end of file
@@ -0,0 +1,26 @@
+#include "duty_cycle.h"
+
+static unsigned long periodStart = 0;
+static unsigned long periodSleep = 0;
+
+void addSleepTime(unsigned long sleepMicros)
+{
+  periodSleep += sleepMicros;
+}
+
+unsigned int takeDutyCycle()
+{
+  const unsigned long now = micros();
+  const unsigned long elapsed = now - periodStart;
+
+  unsigned int dutyCycle = 0;
+  if (periodSleep < elapsed)
+  {
+    // Round up so any activity at all reports at least 1%
+    dutyCycle = (unsigned int)(((uint64_t)(elapsed - periodSleep) * 100 + elapsed - 1) / elapsed);
+  }
+
+  periodStart = now;
+  periodSleep = 0;
+  return dutyCycle;
+}
@@ -0,0 +1,15 @@
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <Arduino.h>
+
+// Share of time a core is awake, reported so power supplies for battery and solar sites can be sized.
+// Each core keeps its own measurement.
+
+// Account for time spent asleep waiting for the next sample, frame or notification
+void addSleepTime(unsigned long sleepMicros);
+
+// Percentage of time awake since the last call (0-100), then start a new period
+unsigned int takeDutyCycle();
+
+#endif // DUTY_CYCLE_H
@@ -0,0 +1,59 @@
+#include "edge_batch.h"
+#include "frame_codec.h"
+
+void resetEdgeBatch(EDGE_BATCH *batch)
+{
+  batch->length = 0;
+  batch->count = 0;
+  batch->firstTimestamp = 0;
+  batch->lastTimestamp = 0;
+  batch->startedAt = 0;
+}
+
+bool addEdgeEvent(EDGE_BATCH *batch, const EDGE_EVENT *event)
+{
+  if (batch->count == 0)
+  {
+    batch->firstTimestamp = event->timestamp;
+    batch->lastTimestamp = event->timestamp;
+    batch->startedAt = millis();
+  }
+
+  // Unsigned difference handles micros() wrapping every 71 minutes
+  const uint32_t gap = event->timestamp - batch->lastTimestamp;
+  if (gap > EDGE_BATCH_MAX_GAP)
+  {
+    return false;
+  }
+
+  size_t length = batch->length;
+  if (!writeVarint(batch->data, sizeof(batch->data), &length, (gap << 4) | (event->edge & 0x0F)))
+  {
+    return false;
+  }
+
+  batch->length = length;
+  batch->lastTimestamp = event->timestamp;
+  batch->count++;
+  return true;
+}
+
+size_t encodeEdgeBatch(const EDGE_BATCH *batch, unsigned int sequence, unsigned int dropped, unsigned int age,
+                       char *message, size_t size)
+{
+  const int header = snprintf(message, size, "{\"seq\":%u,\"t0\":%u,\"n\":%u,\"drop\":%u,\"age\":%u,\"e\":\"",
+                              sequence, batch->firstTimestamp, batch->count, dropped, age);
+  if (header < 0 || (size_t)header >= size)
+  {
+    return 0;
+  }
+
+  const size_t text = encodeBase64(batch->data, batch->length, message + header, size - header);
+  if ((batch->length > 0 && text == 0) || header + text + 3 > size)
+  {
+    return 0;
+  }
+
+  strcpy(message + header + text, "\"}");
+  return header + text + 2;
+}
@@ -0,0 +1,39 @@
+#ifndef EDGE_BATCH_H
+#define EDGE_BATCH_H
+
+#include <Arduino.h>
+#include "data_frame.h"
+
+// Edges from the edge log packed for one message. Each edge is a single LEB128 varint of
+// (microseconds since the previous edge << 4 | channel << 1 | state), the first relative to the batch's
+// start timestamp, so edges a few milliseconds apart take 2 bytes. Sized so the base64 of a full batch
+// fits the MQTT buffer with room for the topic and JSON around it.
+#define EDGE_BATCH_MAX_BYTES 1536
+
+// Largest gap one varint can carry (about 268 seconds), a longer gap starts a new batch
+#define EDGE_BATCH_MAX_GAP ((1UL << 28) - 1)
+
+struct EDGE_BATCH
+{
+  uint8_t data[EDGE_BATCH_MAX_BYTES];
+  size_t length;
+  unsigned int count;          // Edges in the batch
+  unsigned int firstTimestamp; // M4 micros() of the first edge
+  unsigned int lastTimestamp;  // M4 micros() of the last edge
+  unsigned long startedAt;     // millis() when the first edge was added
+};
+
+// Empty the batch
+void resetEdgeBatch(EDGE_BATCH *batch);
+
+// Append an edge. Returns false if it does not fit (the batch is full or the gap is too long),
+// the batch must then be sent before the edge is added to a fresh one.
+bool addEdgeEvent(EDGE_BATCH *batch, const EDGE_EVENT *event);
+
+// Build the JSON message for a batch: sequence number, start timestamp, edge count, edges dropped since the
+// previous batch, age of the last edge in milliseconds and the packed edges as base64.
+// Returns the message length, 0 if it does not fit in size.
+size_t encodeEdgeBatch(const EDGE_BATCH *batch, unsigned int sequence, unsigned int dropped, unsigned int age,
+                       char *message, size_t size);
+
+#endif // EDGE_BATCH_H
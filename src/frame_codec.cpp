@@ -0,0 +1,304 @@
+#include "frame_codec.h"
+#include <stddef.h>
+
+enum FieldCodec
+{
+  CODEC_COUNT,  // Small per-interval values, stored as they are
+  CODEC_STATE,  // 0/1 input states, bit-packed
+  CODEC_DELTA2, // Slowly changing values, delta-of-delta
+  CODEC_TOTAL   // Running totals, predicted from the previous total plus this frame's count (or span)
+};
+
+struct CODEC_FIELD
+{
+  size_t offset;
+  FieldCodec codec;
+  size_t countOffset; // Count field feeding a CODEC_TOTAL, decoded before it
+};
+
+static const CODEC_FIELD codecFields[] = {
+    {offsetof(DATA_FRAME_SEND, userButtonCount), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input1Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input2Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input3Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input4Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input5Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input6Count), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, userButtonState), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input1State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input2State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input3State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input4State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input5State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input6State), CODEC_STATE, 0},
+    {offsetof(DATA_FRAME_SEND, input7Analog), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, input8Analog), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, span), CODEC_COUNT, 0},
+    {offsetof(DATA_FRAME_SEND, input7Min), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, input7Max), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, input8Min), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, input8Max), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, userButtonTotal), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, userButtonCount)},
+    {offsetof(DATA_FRAME_SEND, input1Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input1Count)},
+    {offsetof(DATA_FRAME_SEND, input2Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input2Count)},
+    {offsetof(DATA_FRAME_SEND, input3Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input3Count)},
+    {offsetof(DATA_FRAME_SEND, input4Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input4Count)},
+    {offsetof(DATA_FRAME_SEND, input5Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input5Count)},
+    {offsetof(DATA_FRAME_SEND, input6Total), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, input6Count)},
+    {offsetof(DATA_FRAME_SEND, dutyCycle), CODEC_DELTA2, 0},
+    {offsetof(DATA_FRAME_SEND, frameNumber), CODEC_TOTAL, offsetof(DATA_FRAME_SEND, span)},
+    {offsetof(DATA_FRAME_SEND, flags), CODEC_COUNT, 0}};
+
+static_assert(sizeof(codecFields) / sizeof(codecFields[0]) == sizeof(DATA_FRAME_SEND) / sizeof(unsigned int),
+              "Every DATA_FRAME_SEND field needs a codec");
+
+// Set in the state byte when a state is not 0/1 and the states follow as varints instead
+#define STATE_ESCAPE 0x80
+
+static unsigned int &field(DATA_FRAME_SEND *frame, size_t offset)
+{
+  return *(unsigned int *)((uint8_t *)frame + offset);
+}
+
+static unsigned int field(const DATA_FRAME_SEND *frame, size_t offset)
+{
+  return *(const unsigned int *)((const uint8_t *)frame + offset);
+}
+
+static uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Value of a field predicted from the frames before it, residuals are stored relative to this
+static unsigned int predict(const CODEC_FIELD &codecField, const DATA_FRAME_SEND *frame,
+                            const DATA_FRAME_SEND *previous, const DATA_FRAME_SEND *beforePrevious)
+{
+  const unsigned int last = field(previous, codecField.offset);
+
+  switch (codecField.codec)
+  {
+  case CODEC_DELTA2:
+    return beforePrevious ? last + (last - field(beforePrevious, codecField.offset)) : last;
+  case CODEC_TOTAL:
+    return last + field(frame, codecField.countOffset);
+  default:
+    return 0;
+  }
+}
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t encodeBase64(const uint8_t *data, size_t length, char *text, size_t size)
+{
+  const size_t textLength = (length + 2) / 3 * 4;
+  if (textLength + 1 > size)
+  {
+    return 0;
+  }
+
+  size_t out = 0;
+  for (size_t i = 0; i < length; i += 3)
+  {
+    const uint32_t b0 = data[i];
+    const uint32_t b1 = i + 1 < length ? data[i + 1] : 0;
+    const uint32_t b2 = i + 2 < length ? data[i + 2] : 0;
+    const uint32_t triple = (b0 << 16) | (b1 << 8) | b2;
+
+    text[out++] = base64Alphabet[(triple >> 18) & 0x3F];
+    text[out++] = base64Alphabet[(triple >> 12) & 0x3F];
+    text[out++] = i + 1 < length ? base64Alphabet[(triple >> 6) & 0x3F] : '=';
+    text[out++] = i + 2 < length ? base64Alphabet[triple & 0x3F] : '=';
+  }
+  text[out] = '\0';
+
+  return out;
+}
+
+bool writeVarint(uint8_t *data, size_t size, size_t *length, uint32_t value)
+{
+  do
+  {
+    if (*length >= size)
+    {
+      return false;
+    }
+    data[(*length)++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+  return true;
+}
+
+bool readVarint(const uint8_t *data, size_t length, size_t *position, uint32_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    if (*position >= length)
+    {
+      return false;
+    }
+    const uint8_t byte = data[(*position)++];
+    *value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t encodeFrameBlock(const DATA_FRAME_SEND *frames, unsigned int count, uint8_t *data, size_t size)
+{
+  if (count == 0 || count > FRAME_BLOCK_FRAMES || size == 0)
+  {
+    return 0;
+  }
+
+  size_t length = 0;
+  data[length++] = count;
+
+  for (unsigned int k = 0; k < count; k++)
+  {
+    const DATA_FRAME_SEND *frame = &frames[k];
+
+    // First frame in full
+    if (k == 0)
+    {
+      for (const CODEC_FIELD &codecField : codecFields)
+      {
+        if (!writeVarint(data, size, &length, field(frame, codecField.offset)))
+        {
+          return 0;
+        }
+      }
+      continue;
+    }
+
+    const DATA_FRAME_SEND *previous = &frames[k - 1];
+    const DATA_FRAME_SEND *beforePrevious = k > 1 ? &frames[k - 2] : nullptr;
+
+    // States packed one bit each, escaped if any is not 0/1
+    uint8_t states = 0;
+    unsigned int bit = 0;
+    for (const CODEC_FIELD &codecField : codecFields)
+    {
+      if (codecField.codec == CODEC_STATE)
+      {
+        const unsigned int state = field(frame, codecField.offset);
+        if (state > 1)
+        {
+          states = STATE_ESCAPE;
+          break;
+        }
+        states |= state << bit++;
+      }
+    }
+    if (length >= size)
+    {
+      return 0;
+    }
+    data[length++] = states;
+
+    for (const CODEC_FIELD &codecField : codecFields)
+    {
+      const unsigned int value = field(frame, codecField.offset);
+      uint32_t encoded;
+
+      if (codecField.codec == CODEC_STATE)
+      {
+        if (!(states & STATE_ESCAPE))
+        {
+          continue;
+        }
+        encoded = value;
+      }
+      else if (codecField.codec == CODEC_COUNT)
+      {
+        encoded = value;
+      }
+      else
+      {
+        encoded = zigzag((int32_t)(value - predict(codecField, frame, previous, beforePrevious)));
+      }
+
+      if (!writeVarint(data, size, &length, encoded))
+      {
+        return 0;
+      }
+    }
+  }
+
+  return length;
+}
+
+unsigned int decodeFrameBlock(const uint8_t *data, size_t length, DATA_FRAME_SEND *frames)
+{
+  if (length == 0 || data[0] == 0 || data[0] > FRAME_BLOCK_FRAMES)
+  {
+    return 0;
+  }
+
+  const unsigned int count = data[0];
+  size_t position = 1;
+
+  for (unsigned int k = 0; k < count; k++)
+  {
+    DATA_FRAME_SEND *frame = &frames[k];
+    uint32_t value;
+
+    if (k == 0)
+    {
+      for (const CODEC_FIELD &codecField : codecFields)
+      {
+        if (!readVarint(data, length, &position, &value))
+        {
+          return 0;
+        }
+        field(frame, codecField.offset) = value;
+      }
+      continue;
+    }
+
+    const DATA_FRAME_SEND *previous = &frames[k - 1];
+    const DATA_FRAME_SEND *beforePrevious = k > 1 ? &frames[k - 2] : nullptr;
+
+    if (position >= length)
+    {
+      return 0;
+    }
+    const uint8_t states = data[position++];
+
+    // Counts first, totals are predicted from them
+    unsigned int bit = 0;
+    for (const CODEC_FIELD &codecField : codecFields)
+    {
+      if (codecField.codec == CODEC_STATE && !(states & STATE_ESCAPE))
+      {
+        field(frame, codecField.offset) = (states >> bit++) & 1;
+        continue;
+      }
+
+      if (!readVarint(data, length, &position, &value))
+      {
+        return 0;
+      }
+
+      if (codecField.codec == CODEC_COUNT || codecField.codec == CODEC_STATE)
+      {
+        field(frame, codecField.offset) = value;
+      }
+      else
+      {
+        field(frame, codecField.offset) = predict(codecField, frame, previous, beforePrevious) + unzigzag(value);
+      }
+    }
+  }
+
+  return position == length ? count : 0;
+}
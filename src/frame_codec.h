@@ -0,0 +1,32 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <Arduino.h>
+#include "data_frame.h"
+
+// Compact encoding for a block of consecutive frames. The first frame is stored in full, later frames as
+// small residuals: states bit-packed into one byte, counts as they are, analog values and duty cycle as
+// delta-of-delta, totals as the difference from the previous total plus this frame's count (0 unless
+// a pulse was missed or the totals were reset) and frame numbers likewise from the previous one plus the span. Every number is a zigzag LEB128 varint, usually 1 byte.
+#define FRAME_BLOCK_FRAMES 32
+
+// Largest possible encoded block: frame count plus every field as a 5 byte varint and a state byte per frame
+#define FRAME_BLOCK_MAX_BYTES (1 + FRAME_BLOCK_FRAMES * (1 + 5 * sizeof(DATA_FRAME_SEND) / sizeof(unsigned int)))
+
+// Encode count (1 to FRAME_BLOCK_FRAMES) frames. Returns the encoded length, 0 if it does not fit in size.
+size_t encodeFrameBlock(const DATA_FRAME_SEND *frames, unsigned int count, uint8_t *data, size_t size);
+
+// Decode a block into frames (room for FRAME_BLOCK_FRAMES). Returns the number of frames, 0 if the block is malformed.
+unsigned int decodeFrameBlock(const uint8_t *data, size_t length, DATA_FRAME_SEND *frames);
+
+// LEB128 varint at data[*length], advancing it. Returns false, leaving any partial bytes, if it does not fit in size.
+bool writeVarint(uint8_t *data, size_t size, size_t *length, uint32_t value);
+
+// LEB128 varint from data[*position], advancing it. Returns false if truncated or longer than 5 bytes.
+bool readVarint(const uint8_t *data, size_t length, size_t *position, uint32_t *value);
+
+// Standard padded base64 with a terminating null, for carrying binary data in JSON messages.
+// Returns the text length, 0 if it does not fit in size.
+size_t encodeBase64(const uint8_t *data, size_t length, char *text, size_t size);
+
+#endif // FRAME_CODEC_H
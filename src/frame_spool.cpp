@@ -0,0 +1,258 @@
+#include "frame_spool.h"
+#include "crc.h"
+
+static volatile FRAME_SPOOL *spool = (volatile FRAME_SPOOL *)FRAME_SPOOL_START_ADDRESS;
+
+// Data area in whole 8 byte units, so there is always room for a wrap marker before the end
+static const unsigned int spoolCapacity = (FRAME_SPOOL_SIZE - offsetof(FRAME_SPOOL, data)) & ~7UL;
+
+static unsigned int frameCount = 0;
+
+// Scratch space for one encoded block
+static uint8_t block[FRAME_BLOCK_MAX_BYTES];
+
+// SRAM4 is cacheable on the M7, write changes through so they survive a reset
+static void persist(const volatile void *address, size_t size)
+{
+  const uintptr_t start = (uintptr_t)address & ~31UL;
+  SCB_CleanDCache_by_Addr((uint32_t *)start, size + ((uintptr_t)address - start));
+  __DSB();
+}
+
+static uint32_t headerCrc()
+{
+  const unsigned int header[3] = {spool->magic, spool->version, spool->capacity};
+  return crc32(header, sizeof(header));
+}
+
+static unsigned int recordSize(unsigned int length)
+{
+  return (sizeof(FRAME_SPOOL_RECORD) + length + 7) & ~7UL;
+}
+
+static volatile FRAME_SPOOL_RECORD *recordAt(unsigned int offset)
+{
+  return (volatile FRAME_SPOOL_RECORD *)&spool->data[offset];
+}
+
+static unsigned int readHead()
+{
+  unsigned int head;
+  readJournaledIndex(&spool->head, spoolCapacity, &head);
+  return head;
+}
+
+static unsigned int readTail()
+{
+  unsigned int tail;
+  readJournaledIndex(&spool->tail, spoolCapacity, &tail);
+  return tail;
+}
+
+static void writeTail(unsigned int tail)
+{
+  writeJournaledIndex(&spool->tail, tail, spoolCapacity);
+  persist(&spool->tail, sizeof(DATA_FRAME_INDEX));
+}
+
+// Walk the records from tail to head, counting frames. Returns false if the chain is broken.
+static bool countFrames(unsigned int tail, unsigned int head, unsigned int *frames)
+{
+  unsigned int offset = tail;
+  unsigned int records = 0;
+  *frames = 0;
+
+  while (offset != head)
+  {
+    if (records++ > spoolCapacity / sizeof(FRAME_SPOOL_RECORD))
+    {
+      return false;
+    }
+
+    const volatile FRAME_SPOOL_RECORD *record = recordAt(offset);
+    if (record->length == 0)
+    {
+      offset = 0;
+      continue;
+    }
+
+    const unsigned int size = recordSize(record->length);
+    if (offset + size > spoolCapacity)
+    {
+      return false;
+    }
+
+    *frames += record->frames;
+    offset = (offset + size) % spoolCapacity;
+  }
+
+  return true;
+}
+
+static void resetFrameSpool()
+{
+  // Invalidate the header first so a reset part way through is seen as corruption again
+  spool->magic = 0;
+  __DSB();
+
+  for (int i = 0; i < 2; i++)
+  {
+    spool->head.slots[i].crc = 0;
+    spool->tail.slots[i].crc = 0;
+  }
+  writeJournaledIndex(&spool->head, 0, spoolCapacity);
+  writeJournaledIndex(&spool->tail, 0, spoolCapacity);
+
+  spool->version = FRAME_SPOOL_VERSION;
+  spool->capacity = spoolCapacity;
+  spool->magic = FRAME_SPOOL_MAGIC;
+  spool->headerCrc = headerCrc();
+  persist(spool, offsetof(FRAME_SPOOL, data));
+
+  frameCount = 0;
+}
+
+bool initFrameSpool()
+{
+  unsigned int head;
+  unsigned int tail;
+
+  if (spool->magic == FRAME_SPOOL_MAGIC &&
+      spool->version == FRAME_SPOOL_VERSION &&
+      spool->capacity == spoolCapacity &&
+      spool->headerCrc == headerCrc() &&
+      readJournaledIndex(&spool->head, spoolCapacity, &head) &&
+      readJournaledIndex(&spool->tail, spoolCapacity, &tail) &&
+      countFrames(tail, head, &frameCount))
+  {
+    return true;
+  }
+
+  resetFrameSpool();
+  return false;
+}
+
+bool spoolFrames(const DATA_FRAME_SEND *frames, unsigned int count)
+{
+  const size_t length = encodeFrameBlock(frames, count, block, sizeof(block));
+  if (length == 0)
+  {
+    return false;
+  }
+
+  const unsigned int size = recordSize(length);
+  const unsigned int head = readHead();
+  const unsigned int tail = readTail();
+
+  // Records never wrap. The head must not land on the tail, that would read as empty.
+  unsigned int at;
+  if (head >= tail && head + size <= spoolCapacity && !(head + size == spoolCapacity && tail == 0))
+  {
+    at = head;
+  }
+  else if (head >= tail && size < tail)
+  {
+    at = 0;
+  }
+  else if (head < tail && head + size < tail)
+  {
+    at = head;
+  }
+  else
+  {
+    return false;
+  }
+
+  volatile FRAME_SPOOL_RECORD *record = recordAt(at);
+  record->length = length;
+  record->frames = count;
+  record->crc = crc32(block, length);
+  for (size_t i = 0; i < length; i++)
+  {
+    spool->data[at + sizeof(FRAME_SPOOL_RECORD) + i] = block[i];
+  }
+  persist(record, size);
+
+  // Only now mark the wrap, until the head moves a reset leaves the marker unreachable
+  if (at != head)
+  {
+    recordAt(head)->length = 0;
+    persist(recordAt(head), sizeof(FRAME_SPOOL_RECORD));
+  }
+
+  writeJournaledIndex(&spool->head, (at + size) % spoolCapacity, spoolCapacity);
+  persist(&spool->head, sizeof(DATA_FRAME_INDEX));
+
+  frameCount += count;
+  return true;
+}
+
+unsigned int readSpoolBlock(DATA_FRAME_SEND *frames)
+{
+  while (frameCount > 0)
+  {
+    const unsigned int head = readHead();
+    unsigned int tail = readTail();
+
+    if (head == tail)
+    {
+      frameCount = 0;
+      return 0;
+    }
+
+    const volatile FRAME_SPOOL_RECORD *record = recordAt(tail);
+    if (record->length == 0)
+    {
+      writeTail(0);
+      continue;
+    }
+
+    const unsigned int length = record->length;
+    if (length > sizeof(block) || tail + recordSize(length) > spoolCapacity)
+    {
+      Serial.println("Frame spool damaged - discarding it");
+      resetFrameSpool();
+      return 0;
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+      block[i] = spool->data[tail + sizeof(FRAME_SPOOL_RECORD) + i];
+    }
+
+    const unsigned int count = record->crc == crc32(block, length) ? decodeFrameBlock(block, length, frames) : 0;
+    if (count == 0 || count != record->frames)
+    {
+      Serial.println("Dropping damaged frame spool block");
+      dropSpoolBlock();
+      continue;
+    }
+
+    return count;
+  }
+
+  return 0;
+}
+
+void dropSpoolBlock()
+{
+  unsigned int tail = readTail();
+  if (readHead() == tail)
+  {
+    return;
+  }
+
+  if (recordAt(tail)->length == 0)
+  {
+    tail = 0;
+  }
+
+  const volatile FRAME_SPOOL_RECORD *record = recordAt(tail);
+  frameCount -= min(frameCount, (unsigned int)record->frames);
+  writeTail((tail + recordSize(record->length)) % spoolCapacity);
+}
+
+unsigned int spooledFrameCount()
+{
+  return frameCount;
+}
@@ -0,0 +1,54 @@
+#ifndef FRAME_SPOOL_H
+#define FRAME_SPOOL_H
+
+#include <Arduino.h>
+#include "data_frame.h"
+#include "frame_codec.h"
+
+// Compressed overflow for the circular buffer, owned by the M7. When the buffer fills during an outage the
+// oldest frames are moved here in blocks of FRAME_BLOCK_FRAMES (see frame_codec.h), which several times
+// more frames fit into than the buffer. The spool always holds older frames than the buffer, so it is
+// drained first. It lives in the 64KB AHB SRAM4 and survives warm resets like the buffer does.
+#define FRAME_SPOOL_MAGIC 0x53504F4C // "SPOL"
+#define FRAME_SPOOL_VERSION 3        // Bump with DATA_FRAME_BUFFER_VERSION or the block encoding
+
+// Block record header, followed by the encoded block and padded to 8 bytes. A length of 0 marks a wrap
+// to the start of the data area.
+struct FRAME_SPOOL_RECORD
+{
+  uint16_t length; // Encoded block bytes
+  uint16_t frames;
+  uint32_t crc; // CRC-32 over the encoded block
+};
+
+struct FRAME_SPOOL
+{
+  volatile unsigned int magic;
+  volatile unsigned int version;
+  volatile unsigned int capacity;  // Bytes in the data area
+  volatile unsigned int headerCrc; // CRC-32 over magic, version and capacity
+  DATA_FRAME_INDEX head;           // Offset where the next record is written
+  DATA_FRAME_INDEX tail;           // Offset of the oldest record
+  uint8_t data[];
+};
+
+const uint32_t FRAME_SPOOL_START_ADDRESS = ((uint32_t)0x38000000); // USING THE AHB SRAM4 DOMAIN SPACE
+const uint32_t FRAME_SPOOL_SIZE = 0x10000;
+
+// Keep the spool left from before a warm reset, or start empty. Returns true if spooled frames were kept.
+bool initFrameSpool();
+
+// Compress and append frames, returns false (nothing written) if there is not enough room
+bool spoolFrames(const DATA_FRAME_SEND *frames, unsigned int count);
+
+// Decode the oldest block into frames (room for FRAME_BLOCK_FRAMES). Damaged blocks are dropped.
+// Returns the number of frames, 0 if the spool is empty.
+unsigned int readSpoolBlock(DATA_FRAME_SEND *frames);
+
+// Remove the oldest block once all of its frames have been sent
+void dropSpoolBlock();
+
+// Number of frames held, for status output
+unsigned int spooledFrameCount();
+
+#endif // FRAME_SPOOL_H
@@ -1,35 +1,62 @@
-#include "SDRAM.h"
 #include "data_frame.h"
+#include "counter_totals.h"
+#include "notify.h"
+#include "duty_cycle.h"
 #include <Watchdog.h>
 #include "Arduino.h"
 
 unsigned long sendInterval = 5000;
 unsigned long previousMillis = 0;
+bool firstFrameSent = false;
 
-unsigned long debounceDelay = 50;
+// Per channel (user button, inputs 1-6), replaced by parameters posted from the M7 config
+unsigned long debounceDelays[INPUT_CHANNELS] = {50, 50, 50, 50, 50, 50, 50};
+unsigned int channelModes[INPUT_CHANNELS] = {0, 0, 0, 0, 0, 0, 0};
+unsigned int urgentChannels = 0; // Bit per channel
+unsigned int urgentEventSequence = 0;
+unsigned int edgeLogChannels = 0; // Bit per channel
+// Inputs are sampled at a fixed rate with the core asleep in between, fast enough for the shortest debounce
+unsigned long samplePeriod = 10;
+bool inputParametersApplied = false;
+unsigned int inputParametersSequence = 0;
 
 unsigned int counter_BTN_USER = 0;
 unsigned int currentState_BTN_USER = 0;
 unsigned int lastState_BTN_USER = 0;
 unsigned long lastDebounceTime_BTN_USER = 0;
+unsigned long lastChangeMicros_BTN_USER = 0;
 
 unsigned int pins[] = {A0, A1, A2, A3, A4, A5, A6, A7};
 unsigned int counters[] = {0, 0, 0, 0, 0, 0, 0, 0};
 unsigned int currentStates[] = {0, 0, 0, 0, 0, 0, 0, 0};
 unsigned int lastStates[] = {0, 0, 0, 0, 0, 0, 0, 0};
 unsigned long lastDebounceTimes[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned long lastChangeMicros[] = {0, 0, 0, 0, 0, 0, 0, 0};
 int analogs[] = {0, 0};
 
+// Self-test step being run (see data_frame.h). The pattern goes through a debounce state of its own, the
+// pins are still read and counted as usual meanwhile.
+SELF_TEST_STEP selfTest;
+SELF_TEST_RESULT selfTestResult;
+unsigned int selfTestSequence = 0; // Of the step running or last seen
+bool selfTestRunning = false;
+bool selfTestInFrame = false; // A step ran during the frame being taken
+unsigned long selfTestStartMicros = 0;
+unsigned long selfTestLengthMicros = 0; // Pulses plus time for the last one to pass the debounce
+unsigned int testCurrentStates[6];
+unsigned int testLastStates[6];
+unsigned long testDebounceTimes[6];
+
 void setup()
 {
   mbed::Watchdog::get_instance().start();
 
-  SDRAM.begin(SDRAM_START_ADDRESS_4);
+  // Resume the circular buffer after a warm reset, or start empty after a cold boot
+  restoreDataFrameBuffer();
+  cleanSharedMemoryCache();
 
-  // Initialize circular buffer
-  data_frame_buffer_sdram->head = 0;
-  data_frame_buffer_sdram->tail = 0;
-  data_frame_buffer_sdram->count = 0;
+  // Restore cumulative totals from backup SRAM
+  initCounterTotals();
 
   pinMode(LEDB, OUTPUT);
 
@@ -40,18 +67,138 @@ void setup()
 
   analogReadResolution(12);
 
-  // This is to allow M7 to have started. Otherwise the buffer is filled with multiple messages.
-  // Reduced from 20s to 10s, with watchdog kicks
-  for (int i = 0; i < 10; i++)
+  // Counting starts straight away. Frames wait in the buffer until the M7 is ready, and the first
+  // frame goes out as soon as the M7 signals it can publish rather than after a full interval.
+  previousMillis = millis();
+}
+
+// True if a debounced change from previous to state is counted on a channel
+bool edgeCounted(unsigned int channel, unsigned int previous, unsigned int state)
+{
+  switch (channelModes[channel])
+  {
+  case CHANNEL_MODE_RISING:
+    return state > previous;
+  case CHANNEL_MODE_BOTH:
+    return true;
+  case CHANNEL_MODE_DISABLED:
+    return false;
+  default:
+    return previous > state;
+  }
+}
+
+// Hand a debounced change on an urgent channel straight to the M7 rather than waiting for the next frame
+void raiseUrgentEvent(unsigned int channel, unsigned int state, unsigned long timestamp)
+{
+  if (!(urgentChannels & (1U << channel)))
+  {
+    return;
+  }
+
+  URGENT_EVENT event;
+  event.sequence = urgentEventSequence++;
+  event.channel = channel;
+  event.state = state;
+  event.timestamp = timestamp;
+  event.total = getCounterTotal(channel);
+
+  // A full ring means the M7 cannot publish, the sequence gap tells the consumer
+  if (pushUrgentEvent(&event))
+  {
+    notifyFrameAvailable();
+  }
+}
+
+// Log a debounced edge with the time of the first sample at the new level, the debounce delay before it
+// was accepted does not skew cycle times
+void logEdge(unsigned int channel, unsigned int state, unsigned long changeMicros)
+{
+  if (!(edgeLogChannels & (1U << channel)))
+  {
+    return;
+  }
+
+  EDGE_EVENT event;
+  event.timestamp = changeMicros;
+  event.edge = channel << 1 | state;
+
+  // Wake the M7 each time another quarter of the log fills or an edge is dropped, it also drains the log
+  // whenever it runs
+  if (pushEdgeEvent(&event) % (EDGE_LOG_CAPACITY / 4) == 0)
+  {
+    notifyFrameAvailable();
+  }
+}
+
+// True if the self-test pattern runs on an input (1-6)
+bool selfTesting(unsigned int channel)
+{
+  return selfTestRunning && (selfTest.channels & (1U << channel));
+}
+
+// Start a newly posted step, replacing any running one, and report a step once it is over
+void checkSelfTest(unsigned long currentMillis, unsigned long currentMicros)
+{
+  if (shared_control_sdram->selfTestSequence == selfTestSequence)
+  {
+    if (selfTestRunning && currentMicros - selfTestStartMicros >= selfTestLengthMicros)
+    {
+      selfTestResult.samplePeriod = samplePeriod;
+      writeSelfTestResult(selfTestSequence, &selfTestResult);
+      selfTestRunning = false;
+    }
+    return;
+  }
+
+  // Caught part way through a post, it is read again at the next sample
+  SELF_TEST_STEP step;
+  unsigned int sequence;
+  if (!readSelfTestStep(&step, &sequence))
+  {
+    return;
+  }
+
+  selfTestSequence = sequence;
+  selfTest = step;
+  selfTest.channels &= 0x7E; // Inputs 1-6
+  selfTestRunning = selfTest.channels != 0 || selfTest.analogChannels != 0;
+  if (!selfTestRunning)
+  {
+    return;
+  }
+
+  // The pattern starts from a settled high, so the first pulse is a whole one
+  unsigned long longestDebounce = 0;
+  for (int i = 0; i < 6; i++)
   {
-    mbed::Watchdog::get_instance().kick();
-    delay(1000);
+    if (selfTesting(i + 1))
+    {
+      testCurrentStates[i] = 1;
+      testLastStates[i] = 1;
+      testDebounceTimes[i] = currentMillis;
+      longestDebounce = max(longestDebounce, debounceDelays[i + 1]);
+    }
   }
+
+  memset(&selfTestResult, 0, sizeof(selfTestResult));
+  selfTestResult.analogMin[0] = selfTestResult.analogMin[1] = UINT_MAX;
+  selfTestStartMicros = currentMicros;
+  selfTestLengthMicros = selfTestPatternMicros(&selfTest) + (longestDebounce + 2 * samplePeriod + 10) * 1000;
 }
 
 void readInputs()
 {
   unsigned long currentMillis = millis();
+  unsigned long currentMicros = micros();
+
+  // Clock the M7 ages urgent events and edges against, written before anything stamped with it
+  shared_control_sdram->acknowledged.clock = currentMillis;
+  shared_control_sdram->acknowledged.clockMicros = currentMicros;
+
+  checkSelfTest(currentMillis, currentMicros);
+  const unsigned long selfTestElapsed = currentMicros - selfTestStartMicros;
+  selfTestInFrame = selfTestInFrame || selfTestRunning;
 
   // BTN_USER
   pin_size_t state_BTN_USER = 1 - digitalRead(BTN_USER);
@@ -62,15 +209,24 @@ void readInputs()
   }
 
   if (state_BTN_USER != lastState_BTN_USER)
+  {
     lastDebounceTime_BTN_USER = currentMillis;
-  if (currentMillis - lastDebounceTime_BTN_USER > debounceDelay && currentState_BTN_USER != state_BTN_USER)
+    lastChangeMicros_BTN_USER = currentMicros;
+  }
+  if (currentMillis - lastDebounceTime_BTN_USER > debounceDelays[0] && currentState_BTN_USER != state_BTN_USER)
   {
-    if (currentState_BTN_USER > state_BTN_USER)
+    if (edgeCounted(0, currentState_BTN_USER, state_BTN_USER))
     {
       counter_BTN_USER++;
+      addCounterTotal(0);
+    }
+    if (state_BTN_USER == 0)
+    {
       digitalWrite(LEDB, LOW);
     }
     currentState_BTN_USER = state_BTN_USER;
+    raiseUrgentEvent(0, state_BTN_USER, currentMillis);
+    logEdge(0, state_BTN_USER, lastChangeMicros_BTN_USER);
   }
   lastState_BTN_USER = state_BTN_USER;
 
@@ -79,26 +235,184 @@ void readInputs()
   {
     pin_size_t state = digitalRead(pins[i]); // Read the pin.
     if (state != lastStates[i])
+    {
       lastDebounceTimes[i] = currentMillis; // If state has changed since last read, reset debounce time.
-    if (currentMillis - lastDebounceTimes[i] > debounceDelay && currentStates[i] != state)
+      lastChangeMicros[i] = currentMicros;
+    }
+    if (currentMillis - lastDebounceTimes[i] > debounceDelays[i + 1] && currentStates[i] != state)
     { // If time since last change (debounce time) exceeds the set debounce delay, proceed...
-      if (currentStates[i] > state)
-      { // Only count falling edges.
+      if (edgeCounted(i + 1, currentStates[i], state))
+      { // Count the edges selected by the channel mode, falling by default.
         counters[i]++;
+        addCounterTotal(i + 1);
       }
       currentStates[i] = state;
+      raiseUrgentEvent(i + 1, state, currentMillis);
+      logEdge(i + 1, state, lastChangeMicros[i]);
     }
     lastStates[i] = state;
+
+    // The test pattern through the same debounce and channel mode, counted only in the test result
+    if (selfTesting(i + 1))
+    {
+      const unsigned int level = selfTestLevel(&selfTest, selfTestElapsed);
+      if (level != testLastStates[i])
+      {
+        testDebounceTimes[i] = currentMillis;
+      }
+      if (currentMillis - testDebounceTimes[i] > debounceDelays[i + 1] && testCurrentStates[i] != level)
+      {
+        if (edgeCounted(i + 1, testCurrentStates[i], level))
+        {
+          selfTestResult.counts[i + 1]++;
+        }
+        testCurrentStates[i] = level;
+      }
+      testLastStates[i] = level;
+    }
   }
 
   for (int i = 0; i < 2; i++)
   {
-    int state = analogRead(pins[i + 6]);
+    // A ramp under test only reaches the result, the frames keep the real input
+    if (selfTestRunning && (selfTest.analogChannels & (1U << i)))
+    {
+      const unsigned int ramp = selfTestRamp(&selfTest, selfTestElapsed);
+      selfTestResult.analogMin[i] = min(selfTestResult.analogMin[i], ramp);
+      selfTestResult.analogMax[i] = max(selfTestResult.analogMax[i], ramp);
+    }
 
-    analogs[i] = state;
+    analogs[i] = analogRead(pins[i + 6]);
   }
 }
 
+// Merge a newer frame into an older adjacent one. Counts are summed, states and the frame number come from the
+// newer frame, flags from either and analog values keep min/max with the mean weighted by the number of intervals
+// each frame covers.
+void mergeFrames(volatile DATA_FRAME_SEND *older, const volatile DATA_FRAME_SEND *newer)
+{
+  const unsigned int span = older->span + newer->span;
+
+  older->userButtonCount += newer->userButtonCount;
+  older->input1Count += newer->input1Count;
+  older->input2Count += newer->input2Count;
+  older->input3Count += newer->input3Count;
+  older->input4Count += newer->input4Count;
+  older->input5Count += newer->input5Count;
+  older->input6Count += newer->input6Count;
+  older->userButtonState = newer->userButtonState;
+  older->input1State = newer->input1State;
+  older->input2State = newer->input2State;
+  older->input3State = newer->input3State;
+  older->input4State = newer->input4State;
+  older->input5State = newer->input5State;
+  older->input6State = newer->input6State;
+  older->input7Analog = (older->input7Analog * older->span + newer->input7Analog * newer->span) / span;
+  older->input8Analog = (older->input8Analog * older->span + newer->input8Analog * newer->span) / span;
+  older->input7Min = min(older->input7Min, newer->input7Min);
+  older->input7Max = max(older->input7Max, newer->input7Max);
+  older->input8Min = min(older->input8Min, newer->input8Min);
+  older->input8Max = max(older->input8Max, newer->input8Max);
+  older->span = span;
+  older->userButtonTotal = newer->userButtonTotal;
+  older->input1Total = newer->input1Total;
+  older->input2Total = newer->input2Total;
+  older->input3Total = newer->input3Total;
+  older->input4Total = newer->input4Total;
+  older->input5Total = newer->input5Total;
+  older->input6Total = newer->input6Total;
+  older->dutyCycle = (older->dutyCycle * older->span + newer->dutyCycle * newer->span) / span;
+  older->frameNumber = newer->frameNumber;
+  older->flags |= newer->flags;
+}
+
+// Free one slot in a full buffer by merging the oldest adjacent pair of frames with the smallest equal span.
+// Every frame doubles its span before any frame doubles again, oldest first, so resolution degrades evenly
+// across the buffer while totals stay exact. Frames the M7 has published but not yet had acknowledged are
+// skipped, and so are the next two: the M7 may be reading one and, having moved `sent` on since it was read here,
+// the one after.
+// Frames are moved in place, so a reset in the middle of this can repeat one frame after a warm restart;
+// the cumulative totals still reconcile. Returns the new head index.
+unsigned int coalesceFrames(unsigned int head, unsigned int tail)
+{
+  const unsigned int count = dataFrameCount(head, tail);
+
+  // An index outside the buffered frames is left from before a reset. Then, or if too few unsent frames
+  // remain to merge, only the two oldest frames are protected.
+  unsigned int inFlight = dataFrameCount(readFrameIndex(&data_frame_buffer_sdram->sent), tail);
+  if (inFlight + 4 > count)
+  {
+    inFlight = 0;
+  }
+
+  // Find the oldest pair with the smallest equal span, falling back to the oldest pair
+  unsigned int pair = inFlight + 2;
+  unsigned int pairSpan = 0;
+  for (unsigned int k = inFlight + 2; k + 1 < count; k++)
+  {
+    const unsigned int span = data_frame_buffer_sdram->frames[(tail + k) % dataFrameCapacity].span;
+    if (span == data_frame_buffer_sdram->frames[(tail + k + 1) % dataFrameCapacity].span && (pairSpan == 0 || span < pairSpan))
+    {
+      pair = k;
+      pairSpan = span;
+    }
+  }
+
+  mergeFrames(&data_frame_buffer_sdram->frames[(tail + pair) % dataFrameCapacity],
+              &data_frame_buffer_sdram->frames[(tail + pair + 1) % dataFrameCapacity]);
+
+  // Close the gap by moving every newer frame back one slot
+  for (unsigned int m = pair + 1; m + 1 < count; m++)
+  {
+    copyDataFrame(&data_frame_buffer_sdram->frames[(tail + m) % dataFrameCapacity],
+                  &data_frame_buffer_sdram->frames[(tail + m + 1) % dataFrameCapacity]);
+  }
+
+  return (head + dataFrameCapacity - 1) % dataFrameCapacity;
+}
+
+// Apply parameters posted by the M7. Only called at a frame boundary so a frame never mixes two settings.
+// Commands run once per posted sequence, also when the M4 restarts on its own and sees the block again.
+void applyInputParameters()
+{
+  INPUT_PARAMETERS parameters;
+  unsigned int sequence;
+
+  if (!readInputParameters(&parameters, &sequence) || (inputParametersApplied && sequence == inputParametersSequence))
+  {
+    return;
+  }
+
+  // Keep the current interval if the posted one is unusable
+  if (parameters.sendInterval >= 100)
+  {
+    sendInterval = parameters.sendInterval;
+  }
+
+  unsigned long shortestDebounce = parameters.debounceDelays[0];
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    debounceDelays[i] = parameters.debounceDelays[i];
+    channelModes[i] = parameters.channelModes[i] <= CHANNEL_MODE_DISABLED ? parameters.channelModes[i] : CHANNEL_MODE_FALLING;
+    shortestDebounce = min(shortestDebounce, debounceDelays[i]);
+  }
+  urgentChannels = parameters.urgentChannels;
+  edgeLogChannels = parameters.edgeLogChannels;
+
+  // Several samples per debounce window, between 1 and 10 ms. Logged edges are timed to the sample that
+  // saw them, so the edge log always samples at the fastest rate.
+  samplePeriod = edgeLogChannels ? 1 : constrain(shortestDebounce / 5, 1UL, 10UL);
+
+  if (sequence != shared_control_sdram->acknowledged.sequence && (parameters.commands & CONTROL_COMMAND_RESET_TOTALS))
+  {
+    resetCounterTotals();
+  }
+
+  inputParametersApplied = true;
+  inputParametersSequence = sequence;
+  acknowledgeInputParameters(sequence);
+}
+
 void loop()
 {
   unsigned long currentMillis = millis();
@@ -107,22 +421,21 @@ void loop()
 
   readInputs();
 
-  if (currentMillis - previousMillis >= sendInterval)
+  if (currentMillis - previousMillis >= sendInterval || (!firstFrameSent && shared_control_sdram->consumerReady))
   {
     // Invalidate cache before reading buffer state
     invalidateSharedMemoryCache();
 
+    // Get the current head position
+    unsigned int writeIndex = readFrameIndex(&data_frame_buffer_sdram->head);
+    const unsigned int tail = readFrameIndex(&data_frame_buffer_sdram->tail);
+
     // Check if buffer is full
-    if (data_frame_buffer_sdram->count >= DATA_FRAME_BUFFER_SIZE)
+    if (dataFrameCount(writeIndex, tail) >= dataFrameCapacity - 1)
     {
-      // Buffer is full - drop the oldest frame by moving tail forward
-      data_frame_buffer_sdram->tail = (data_frame_buffer_sdram->tail + 1) % DATA_FRAME_BUFFER_SIZE;
-      data_frame_buffer_sdram->count--;
+      writeIndex = coalesceFrames(writeIndex, tail);
     }
 
-    // Get the current head position
-    unsigned int writeIndex = data_frame_buffer_sdram->head;
-
     // Write data to buffer at head position
     data_frame_buffer_sdram->frames[writeIndex].userButtonCount = counter_BTN_USER;
     data_frame_buffer_sdram->frames[writeIndex].input1Count = counters[0];
@@ -140,15 +453,30 @@ void loop()
     data_frame_buffer_sdram->frames[writeIndex].input6State = lastStates[5];
     data_frame_buffer_sdram->frames[writeIndex].input7Analog = analogs[0];
     data_frame_buffer_sdram->frames[writeIndex].input8Analog = analogs[1];
+    data_frame_buffer_sdram->frames[writeIndex].span = 1;
+    data_frame_buffer_sdram->frames[writeIndex].input7Min = analogs[0];
+    data_frame_buffer_sdram->frames[writeIndex].input7Max = analogs[0];
+    data_frame_buffer_sdram->frames[writeIndex].input8Min = analogs[1];
+    data_frame_buffer_sdram->frames[writeIndex].input8Max = analogs[1];
+    data_frame_buffer_sdram->frames[writeIndex].userButtonTotal = getCounterTotal(0);
+    data_frame_buffer_sdram->frames[writeIndex].input1Total = getCounterTotal(1);
+    data_frame_buffer_sdram->frames[writeIndex].input2Total = getCounterTotal(2);
+    data_frame_buffer_sdram->frames[writeIndex].input3Total = getCounterTotal(3);
+    data_frame_buffer_sdram->frames[writeIndex].input4Total = getCounterTotal(4);
+    data_frame_buffer_sdram->frames[writeIndex].input5Total = getCounterTotal(5);
+    data_frame_buffer_sdram->frames[writeIndex].input6Total = getCounterTotal(6);
+    data_frame_buffer_sdram->frames[writeIndex].dutyCycle = takeDutyCycle();
+    data_frame_buffer_sdram->frames[writeIndex].frameNumber = takeFrameNumber();
+    data_frame_buffer_sdram->frames[writeIndex].flags = selfTestInFrame ? FRAME_FLAG_SELF_TEST : 0;
 
-    // Move head forward and increment count
-    data_frame_buffer_sdram->head = (data_frame_buffer_sdram->head + 1) % DATA_FRAME_BUFFER_SIZE;
-    data_frame_buffer_sdram->count++;
+    // Move head forward, the frame is only visible to the M7 (and kept over a reset) from here on
+    writeFrameIndex(&data_frame_buffer_sdram->head, (writeIndex + 1) % dataFrameCapacity);
 
-    // Clean cache to make writes visible to M7
+    // Clean cache to make writes visible to M7, then wake it
     cleanSharedMemoryCache();
+    notifyFrameAvailable();
 
-    // Reset counters immediately - data is already safely in SDRAM
+    // Reset counters immediately - data is already safely in shared memory
     // New pulses will accumulate in fresh counters for next transmission
     counter_BTN_USER = 0;
     for (int i = 0; i < 8; i++)
@@ -157,5 +485,14 @@ void loop()
     }
 
     previousMillis = currentMillis;
+    firstFrameSent = true;
+    selfTestInFrame = selfTestRunning;
+
+    applyInputParameters();
   }
+
+  // Sleep until the next sample, the idle thread halts the core (WFI) in between
+  const unsigned long sleepStart = micros();
+  delay(samplePeriod);
+  addSleepTime(micros() - sleepStart);
 }
@@ -4,7 +4,6 @@
 #include <SPI.h>
 #include <PortentaEthernet.h>
 #include <Ethernet.h>
-#include <PubSubClient.h>
 #include <Watchdog.h>
 #include <ArduinoModbus.h>
 #include <ArduinoRS485.h>
@@ -12,6 +11,18 @@
 #include "config.h"
 #include "status.h"
 #include "data_frame.h"
+#include "payload.h"
+#include "notify.h"
+#include "duty_cycle.h"
+#include "frame_spool.h"
+#include "edge_batch.h"
+#include "mqtt_client.h"
+#include "tls_client.h"
+#include "ota_update.h"
+#include "modbus_decode.h"
+#include "benchmark.h"
+#include "self_test.h"
+#include "note_queue.h"
 #include "SDRAM.h"
 
 // VERSION is injected at compile-time from build flags
@@ -33,6 +44,29 @@ const char *VERSION = FIRMWARE_VERSION;
  * mpo = mqttPort
  * mdc = modbusDeviceCount
  * com = communicationMode (ETHERNET, WIFI, BLUES)
+ * cfo = failover transports (array of ETHERNET, WIFI, BLUES tried in order after com)
+ * nbf = noteBatchFrames (frames per note over the Notecard, 1-32)
+ * nsi = noteSyncInterval (seconds between Notecard syncs while notes are queued, 0 to sync only on nsn)
+ * nsn = noteSyncNotes (queued notes that make the Notecard sync at once)
+ * dki = payloadKeyframeInterval (0 = full messages, N = delta messages with a keyframe every N)
+ * fbt = fastBoot
+ * nwc = cached network lease [ip, gateway, subnet, dns, expiry in RTC seconds]
+ * csk = configSigningKey (HMAC-SHA256 key for config tokens received over MQTT)
+ * sin = sendInterval (milliseconds between frames)
+ * dbd = debounceDelays (milliseconds, one value or an array for the user button then inputs 1-6)
+ * icm = channelModes (array for the user button then inputs 1-6: 0 falling, 1 rising, 2 both, 3 disabled)
+ * iur = urgentInputs (array for the user button then inputs 1-6: 1 publishes every state change on /event at once)
+ * iel = edgeLogInputs (array for the user button then inputs 1-6: 1 publishes every edge with its timestamp on /edges)
+ * bfr = backfillRate (backfill messages per minute)
+ * bfb = backfillBurst (backfill messages that may be sent back to back)
+ * mqo = mqttQos (0 or 1)
+ * mif = mqttWindow (QoS 1 messages that may wait for a PUBACK at once, 1-16)
+ * mpv = mqttVersion (4 for MQTT 3.1.1, 5 for MQTT 5)
+ * mse = mqttSessionExpiry (MQTT 5: seconds the broker keeps the session, 0 for a clean session)
+ * mme = mqttMessageExpiry (MQTT 5: seconds the broker keeps each message, 0 for no expiry)
+ * mtl = mqttTls (bool: MQTT over TLS)
+ * mpn = mqttTlsPin (SHA-256 of the broker's public key as 64 hex digits, empty to check against the CA bundle)
+ * osk = otaSigningKey (base64 DER ECDSA P-256 public key checked against firmware update signatures, empty disables OTA)
  */
 
 Notecard notecard;
@@ -41,11 +75,201 @@ bool setupComplete = false;
 
 WiFiClient wifiClient;
 EthernetClient ethClient;
-PubSubClient *mqttClient = nullptr;
+MQTT_CLIENT mqttSession;
+MQTT_CLIENT *mqttClient = nullptr; // Set when publishing over MQTT (WiFi or Ethernet)
+bool mqttSubscribed = false;       // Subscribed since boot, a resumed MQTT 5 session still has the subscriptions
+
+// TLS between the MQTT client and the network client when mqttTls is set. Trust is set up once at boot.
+TlsClient tlsClient;
+mbedtls_x509_crt tlsCaChain;
+uint8_t tlsPin[32];
+bool tlsPinned = false;
+
+// Transports in failover order. Messages go out on the active one; the buffer, spool and delivery tracking
+// are shared, so frames in flight when it changes are published again on the next one.
+struct TRANSPORT
+{
+  CommunicationMode mode;
+  bool started;               // Link brought up
+  unsigned int healthyProbes; // Good probes in a row, see failbackProbes
+  unsigned long retryAt;      // Not started or failed back to before this time
+};
+TRANSPORT transports[MAX_TRANSPORTS];
+int activeTransport = 0;
+CommunicationMode activeMode = NONE;
+unsigned long transportProbedAt = 0;
+
+// How often links are probed, and how many good probes a higher priority transport needs before it takes over
+// again, so a flapping link is not switched to on every probe
+const unsigned long transportProbeInterval = 30000;
+const unsigned int failbackProbes = 2;
+
+// How long a transport that failed is left alone, a DHCP attempt blocks for several seconds
+const unsigned long transportRetryInterval = 300000;
+
+// A WiFi join for a failback probe runs on its own thread: WiFi.begin blocks for half a minute, and the loop has
+// to keep sending urgent events, draining edges and taking PUBACKs meanwhile. The loop starts a join and takes
+// its result on a later probe. The WiFi object is not thread-safe, so every call to it holds wifiLock; the loop
+// only tries the lock where a join may be running, and otherwise finds it free.
+enum WifiJoinState
+{
+  WIFI_JOIN_IDLE,
+  WIFI_JOIN_RUNNING,
+  WIFI_JOIN_DONE
+};
+volatile WifiJoinState wifiJoinState = WIFI_JOIN_IDLE;
+volatile int wifiJoinStatus = 0; // WiFi.begin's result, once done
+rtos::Thread wifiJoinThread(osPriorityBelowNormal, 4096);
+rtos::EventFlags wifiJoinFlags;
+bool wifiJoinThreadStarted = false;
+rtos::Mutex wifiLock;
+
+// MQTT connection attempts on one transport before failing over to the next
+const unsigned int failoverMqttAttempts = 3;
+
+// What a published message releases once it has been delivered
+enum PublishStream
+{
+  STREAM_OTHER,    // Nothing, the message is already gone from its source
+  STREAM_LIVE,     // The frame at the buffer tail
+  STREAM_BACKFILL, // A frame of the current spool block
+  STREAM_BLOCK     // The whole current spool block, sent compressed as one note
+};
+
+// Each stream keeps its own sequence numbers and delta state
+PAYLOAD_ENCODER livePayloadEncoder;
+PAYLOAD_ENCODER backfillPayloadEncoder;
+
+// Set when a remote config change needs a restart, so the response can be published first
+unsigned long restartAt = 0;
+
+// Set when staged firmware is to be applied, so the status can be published first
+unsigned long otaApplyAt = 0;
+
+// OTA progress is reported every otaStatusChunks chunks, and whenever a chunk is refused
+const unsigned int otaStatusChunks = 32;
+unsigned int otaChunksSinceStatus = 0;
+
+// Frames decoded from the oldest spool block, next to go out on the backfill topic
+DATA_FRAME_SEND spoolBlock[FRAME_BLOCK_FRAMES];
+unsigned int spoolBlockCount = 0;
+unsigned int spoolBlockNext = 0;  // Next frame to publish
+unsigned int spoolBlockAcked = 0; // Frames delivered, the block leaves the spool once all are
+
+// Next buffer frame to publish. Frames from the tail up to here are published and wait for their acknowledgement.
+unsigned int liveSendIndex = 0;
+
+// Token bucket pacing the backfill topic, in 1/60000ths of a message so whole messages per minute
+// refill exactly once per millisecond
+const unsigned long backfillTokenCost = 60000;
+unsigned long backfillTokens = 0;
+unsigned long backfillRefilledAt = 0;
+
+// Edges drained from the edge log, published once full or when the oldest has waited edgeBatchInterval
+EDGE_BATCH edgeBatch;
+unsigned int edgeBatchSequence = 0;
+unsigned int edgeDroppedReported = 0; // M4 drop count included in the last batch sent
+const unsigned long edgeBatchInterval = 1000;
+
+// Set when the spool has no room for the backlog, until a block leaves it. The backlog then waits in the buffer
+// and the live topic gets a copy of each newest frame, so it stays current.
+bool spoolFull = false;
+unsigned int liveCopyFrameNumber = 0; // Newest frame copied to the live topic, 0 for none
+
+// Backlog reserved in a full buffer, see spoolBacklog
+unsigned int reservedFrames = 0;
+unsigned int reservedFrameNumber = 0; // Newest frame when it was reserved
+
+// Sequence number of the next frame note
+unsigned int blockSequence = 0;
+
+// Notes queued on the Notecard, see note_queue.h
+NOTE_QUEUE noteQueue;
+
+// Self-test sweep requested on the self-test topic, run one step at a time
+SELF_TEST_PLAN selfTestPlan;
+SELF_TEST_OUTCOME selfTestOutcomes[SELF_TEST_MAX_STEPS];
+unsigned int selfTestStep = 0;      // Index of the running step
+unsigned int selfTestSequence = 0;  // Posted sequence of the running step, 0 while no test runs
+unsigned long selfTestDeadline = 0; // By when the M4 should have reported the step
+
+// Commands for the M4 are resent with every parameter block until the M4 acknowledges one carrying them
+unsigned int pendingControlCommands = 0;
+unsigned int postedControlSequence = 0;
+
+// Longest sleep while waiting for a frame, keeps MQTT keepalives and incoming messages serviced
+const unsigned long frameWaitTimeout = 250;
+
+// Longest sleep while messages wait for a PUBACK, which does not wake the loop
+const unsigned long acknowledgementPollInterval = 5;
+
+// Frames are held back this long after the broker refuses one, e.g. with 0x97 quota exceeded
+const unsigned long refusedHoldInterval = 30000;
+unsigned long framesHeldUntil = 0;
+
+#ifdef BENCHMARK
+// Benchmark build (see README): the M4 is not started and the M7 fills the buffer with synthetic frames in its
+// place, which then take the normal publish path. A publish run keeps a frame waiting for benchPublishMillis,
+// giving the sustained rate and the latency from a frame entering the buffer to its delivery. A drain run then
+// adds benchBacklogFrames at once and times them out through the spool and backfill pacing, like a backlog
+// after an outage. Each run is reported as a JSON line on the bench topic.
+enum BenchPhase
+{
+  BENCH_WAITING,  // For the link, and for anything left from before a reset to be delivered
+  BENCH_PUBLISH,  // Publish run
+  BENCH_SETTLING, // Publish run over, waiting for its last frames before reporting
+  BENCH_DRAIN,    // Drain run
+  BENCH_DONE
+};
+
+const unsigned long benchPublishMillis = 60000;
+const unsigned int benchBacklogFrames = 1000;
+
+BenchPhase benchPhase = BENCH_WAITING;
+BENCH_LATENCY benchLatency;
+BENCH_REPORT benchReport;
+unsigned long *benchFilledAt = nullptr; // micros() each buffer slot was filled at
+DATA_FRAME_SEND benchFrame;             // Last synthetic frame
+unsigned long benchStartedAt = 0;
+unsigned long benchFrames = 0; // Frames delivered in the current run
+unsigned long benchBytes = 0;  // Message bytes sent for them
+unsigned int benchBacklog = 0; // Frames the drain run waits for
+
+// A message with count frames was delivered, index is the buffer slot of a live frame
+void benchFramesDelivered(PublishStream stream, unsigned int index, unsigned int count)
+{
+  benchFrames += count;
+  if (benchPhase != BENCH_DRAIN && stream == STREAM_LIVE && benchFilledAt)
+  {
+    addBenchLatency(&benchLatency, micros() - benchFilledAt[index]);
+  }
+}
+
+// A message carrying frames was sent
+void benchFramesSent(size_t length)
+{
+  benchBytes += length;
+}
+#else
+inline void benchFramesDelivered(PublishStream, unsigned int, unsigned int) {}
+inline void benchFramesSent(size_t) {}
+inline void runBenchmark() {}
+#endif
 
 unsigned int wifiAttempts = 0;
 unsigned int mqttAttempts = 0;
 
+// Set once the cached lease is configured as a static address, see checkNetworkLease
+bool networkLeaseInUse = false;
+
+// Reconnecting is spread over loop passes, one WiFi or MQTT attempt at a time
+const unsigned long linkRetryInterval = 1000;
+const unsigned long wifiRetryInterval = 3000;
+const unsigned long mqttRetryInterval = 2000;
+unsigned long reconnectAt = 0;          // No attempt before this time
+unsigned int wifiReconnectAttempts = 0; // Since the WiFi link dropped
+unsigned int transportMqttAttempts = 0; // Failed in a row on the active transport, see failoverMqttAttempts
+
 constexpr auto modbus_baudrate{19200};
 constexpr auto wordlen{9.6f}; // try also with 10.0f
 constexpr auto modbus_bitduration{1.f / modbus_baudrate};
@@ -75,6 +299,7 @@ void printEncryptionType(int thisType)
   }
 }
 
+// Call with wifiLock held
 void listNetworks()
 {
   // scan for nearby networks:
@@ -104,6 +329,7 @@ void listNetworks()
   }
 }
 
+// Call with wifiLock held
 void setWifiMacAddress()
 {
   if (strlen(deviceId) > 0)
@@ -114,6 +340,7 @@ void setWifiMacAddress()
   byte mac[6];
   WiFi.macAddress(mac);
   sprintf(deviceId, "%02X%02X%02X%02X%02X%02X", mac[5], mac[4], mac[3], mac[2], mac[1], mac[0]);
+  deviceIdDerived = true;
 
   Serial.print("WiFi MAC: ");
   Serial.println(deviceId);
@@ -129,6 +356,7 @@ void setEthernetMacAddress()
   byte mac[6];
   Ethernet.macAddress(mac);
   sprintf(deviceId, "%02X%02X%02X%02X%02X%02X", mac[5], mac[4], mac[3], mac[2], mac[1], mac[0]);
+  deviceIdDerived = true;
 
   Serial.print("Ethernet MAC: ");
   Serial.println(deviceId);
@@ -143,404 +371,1716 @@ float getModbusRegister(int id, int address)
 
     return -1;
   }
-  else
-  {
-    uint16_t reg1 = ModbusRTUClient.read();
-    uint16_t reg2 = ModbusRTUClient.read();
 
-    // 32 bit IEEE754 floating point numbers (Used by RS-Pro devices)
-    if (modbusRegisterStyle == 0)
-    {
-      uint32_t regs = (reg1 << 16) | reg2;
-
-      float v = *(float *)&regs;
+  uint16_t reg1 = ModbusRTUClient.read();
+  uint16_t reg2 = ModbusRTUClient.read();
 
-      return v;
-    }
-    // MSB->LSB, LSW-> MSW (Used by Carlo Gavazzi devices)
-    else if (modbusRegisterStyle == 1)
-    {
-      uint32_t regs = (reg2 << 16) | reg1;
+  return decodeModbusValue(reg1, reg2, modbusRegisterStyle);
+}
 
-      return (float)regs;
-    }
+// Join the configured network, blocking until joined or failed. Returns the WiFi status. Call with wifiLock held.
+int beginWifi()
+{
+  if (strcmp(wifiPassword, "") == 0)
+  {
+    return WiFi.begin(wifiSsid);
   }
-
-  return -1; // Default return for failed request
+  return WiFi.begin(wifiSsid, wifiPassword);
 }
 
-void setupWifi()
+// Make one attempt to connect to WiFi, the caller tries again later. After 10 failed attempts in a row the device
+// resets, unless failover transports are configured.
+bool setupWifi()
 {
   setDeviceState(STATE_WIFI_CONNECTING);
 
   mbed::Watchdog::get_instance().kick();
 
-  WiFi.disconnect();
-  delay(5000);
+  wifiLock.lock();
 
-  mbed::Watchdog::get_instance().kick();
+  // Scan once before a run of attempts, for the log
+  if (!fastBoot && wifiAttempts == 0)
+  {
+    WiFi.disconnect();
+    delay(5000);
 
-  Serial.println();
-  Serial.println("Scanning WiFi networks...");
-  listNetworks();
+    mbed::Watchdog::get_instance().kick();
 
-  mbed::Watchdog::get_instance().kick();
+    Serial.println();
+    Serial.println("Scanning WiFi networks...");
+    listNetworks();
+
+    mbed::Watchdog::get_instance().kick();
+  }
+  else if (networkLeaseValid() && communicationMode == WIFI)
+  {
+    // Reuse the last lease instead of waiting for DHCP, only still valid after a warm reset
+    Serial.println("Using cached network lease");
+    WiFi.config(IPAddress(cachedLocalIp), IPAddress(cachedDns), IPAddress(cachedGateway), IPAddress(cachedSubnet));
+    networkLeaseInUse = true;
+  }
 
   // We start by connecting to a WiFi network
   Serial.println();
   Serial.print("Connecting to ");
   Serial.println(wifiSsid);
 
-  int status;
-
-  // Poll WiFi status with frequent watchdog kicks
-  while (status != WL_CONNECTED)
+  if (wifiAttempts >= 10)
   {
-    Serial.print(".");
-
-    if (wifiAttempts > 10)
+    Serial.print("WiFi status: ");
+    Serial.println(WiFi.status());
+    Serial.println("WiFi connection failed after 10 attempts");
+    showError(ERROR_WIFI_FAILED);
+    if (transportCount < 2)
     {
-      Serial.println();
-      Serial.print("WiFi status: ");
-      Serial.println(WiFi.status());
-      Serial.println("WiFi connection failed after 10 attempts");
-      showError(ERROR_WIFI_FAILED);
       HAL_NVIC_SystemReset();
     }
+    wifiAttempts = 0;
+  }
 
-    // Initiate WiFi connection (non-blocking)
-    if (strcmp(wifiPassword, "") == 0)
-    {
-      status = WiFi.begin(wifiSsid);
-    }
-    else
-    {
-      status = WiFi.begin(wifiSsid, wifiPassword);
-    }
-
-    // Kick watchdog frequently to prevent timeout during connection
-    mbed::Watchdog::get_instance().kick();
+  const int status = beginWifi();
 
-    delay(3000); // Short delay for faster status checking
+  // Kick watchdog, joining can take several seconds
+  mbed::Watchdog::get_instance().kick();
 
+  if (status != WL_CONNECTED)
+  {
+    wifiLock.unlock();
     wifiAttempts++;
+    Serial.println("WiFi connection failed");
+    return false;
   }
+  wifiAttempts = 0;
 
   setWifiMacAddress();
 
   Serial.println("WiFi connected");
   Serial.print("IP address: ");
   Serial.println(WiFi.localIP());
-}
-
-void reconnect()
-{
-  if (!mqttClient)
-    return;
 
-  // If using WiFi, check and reconnect WiFi first if needed
-  if (communicationMode == WIFI)
+  if (fastBoot && communicationMode == WIFI)
   {
-    if (WiFi.status() != WL_CONNECTED)
-    {
-      Serial.println("WiFi disconnected, attempting to reconnect...");
-      setDeviceState(STATE_WIFI_CONNECTING);
-
-      // Reset WiFi attempts counter for reconnection
-      unsigned int wifiReconnectAttempts = 0;
-
-      while (WiFi.status() != WL_CONNECTED && wifiReconnectAttempts < 10)
-      {
-        Serial.print(".");
-
-        int status;
-        if (strcmp(wifiPassword, "") == 0)
-        {
-          status = WiFi.begin(wifiSsid);
-        }
-        else
-        {
-          status = WiFi.begin(wifiSsid, wifiPassword);
-        }
-
-        mbed::Watchdog::get_instance().kick();
-        delay(3000);
-        wifiReconnectAttempts++;
-      }
-
-      if (WiFi.status() == WL_CONNECTED)
-      {
-        Serial.println();
-        Serial.println("WiFi reconnected");
-        Serial.print("IP address: ");
-        Serial.println(WiFi.localIP());
-        // Reset MQTT attempts counter after successful WiFi reconnection
-        mqttAttempts = 0;
-      }
-      else
-      {
-        Serial.println();
-        Serial.println("WiFi reconnection failed");
-        showError(ERROR_WIFI_FAILED);
-        HAL_NVIC_SystemReset();
-      }
-    }
+    cacheNetworkLease(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), WiFi.dnsIP());
   }
 
-  setDeviceState(STATE_MQTT_CONNECTING);
+  wifiLock.unlock();
+  return true;
+}
 
-  while (!mqttClient->connected())
+// Body of wifiJoinThread, one join per request from startWifiJoin
+void runWifiJoins()
+{
+  while (true)
   {
-    Serial.print("Attempting MQTT connection...");
-
-    if (mqttClient->connect(mqttClientId, mqttUsername, mqttPassword))
-    {
-      Serial.println("connected");
-      break;
-    }
-    else
-    {
-      Serial.print("failed. rc=");
-      Serial.print(mqttClient->state());
-      Serial.println(" trying again...");
-      showError(ERROR_MQTT_FAILED);
-      setDeviceState(STATE_MQTT_CONNECTING);
-    }
-
-    mqttAttempts++;
-    if (mqttAttempts > 10)
-    {
-      showError(ERROR_MQTT_FAILED);
-      HAL_NVIC_SystemReset();
-    }
-
-    // Wait 2 seconds between attempts with watchdog kicks every 500ms
-    for (int i = 0; i < 4; i++)
-    {
-      mbed::Watchdog::get_instance().kick();
-      delay(500);
-    }
+    wifiJoinFlags.wait_any(1);
+    wifiLock.lock();
+    wifiJoinStatus = beginWifi();
+    wifiJoinState = WIFI_JOIN_DONE;
+    wifiLock.unlock();
   }
 }
 
-void setupNetworking()
+// Start joining WiFi in the background, unless a join is running or waiting to be taken
+void startWifiJoin()
 {
-  // MODBUS
-  RS485.setDelays(modbus_preDelayBR, modbus_postDelayBR);
-  if (!ModbusRTUClient.begin(modbus_baudrate, SERIAL_8N1))
+  if (wifiJoinState != WIFI_JOIN_IDLE)
   {
-    Serial.println("Failed to start Modbus RTU Client!");
+    return;
+  }
+  if (!wifiJoinThreadStarted)
+  {
+    wifiJoinThread.start(runWifiJoins);
+    wifiJoinThreadStarted = true;
   }
-  ModbusRTUClient.setTimeout(500);
 
-  mbed::Watchdog::get_instance().kick();
+  Serial.print("Joining ");
+  Serial.print(wifiSsid);
+  Serial.println(" in the background");
+  if (networkLeaseValid() && communicationMode == WIFI)
+  {
+    wifiLock.lock();
+    WiFi.config(IPAddress(cachedLocalIp), IPAddress(cachedDns), IPAddress(cachedGateway), IPAddress(cachedSubnet));
+    wifiLock.unlock();
+    networkLeaseInUse = true;
+  }
+  wifiJoinState = WIFI_JOIN_RUNNING;
+  wifiJoinFlags.set(1);
+}
 
-  if (communicationMode == ETHERNET)
+// Take the result of a finished background join. Returns true, with the WiFi transport started, if it joined.
+bool finishWifiJoin(TRANSPORT *transport)
+{
+  wifiJoinState = WIFI_JOIN_IDLE;
+  if (wifiJoinStatus != WL_CONNECTED)
   {
-    setDeviceState(STATE_ETHERNET_CONNECTING);
-    Serial.println("Trying Ethernet:");
-    while (Ethernet.begin(nullptr, 10000, 4000) == 0)
-    {
-      Serial.println("Failed to configure Ethernet using DHCP...");
-      if (Ethernet.linkStatus() == LinkOFF)
-      {
-        Serial.println("Ethernet cable is not connected...");
-      }
-      // Kick watchdog to prevent timeout during DHCP attempts
-      mbed::Watchdog::get_instance().kick();
-      delay(1000);
-    }
+    Serial.println("WiFi connection failed");
+    return false;
+  }
 
-    Serial.print("Connected via Ethernet: ");
-    Serial.println(Ethernet.localIP());
+  wifiLock.lock();
+  setWifiMacAddress();
+  Serial.print("WiFi connected, IP address: ");
+  Serial.println(WiFi.localIP());
+  wifiLock.unlock();
+  wifiClient.setTimeout(5000); // 5 second timeout
+  transport->started = true;
+  return true;
+}
 
-    ethClient.setTimeout(5000); // 5 second timeout
-    mqttClient = new PubSubClient(ethClient);
-    setEthernetMacAddress();
-  }
-  else if (communicationMode == WIFI)
+// Build a topic under {prefix}/busroot/v2/dau/{deviceId}, suffix may be empty
+void buildTopic(char *topic, size_t size, const char *suffix)
+{
+  if (strlen(mqttTopicPrefix) > 0)
   {
-    setupWifi();
-    wifiClient.setTimeout(5000); // 5 second timeout
-    mqttClient = new PubSubClient(wifiClient);
+    snprintf(topic, size, "%s/busroot/v2/dau/%s%s", mqttTopicPrefix, deviceId, suffix);
   }
-  else if (communicationMode == BLUES)
+  else
   {
-    notecard.setDebugOutputStream(Serial);
-    notecard.begin();
+    snprintf(topic, size, "busroot/v2/dau/%s%s", deviceId, suffix);
   }
-  else if (communicationMode == NONE)
+}
+
+// True if a message published now would leave the device
+bool publishLinkUp()
+{
+  if (serialOnlyMode || activeMode == BLUES || activeMode == NONE)
   {
-    Serial.println("Communication mode: NONE - Serial output only");
+    return true;
   }
+  return mqttClient && mqttConnected(mqttClient);
+}
 
-  mbed::Watchdog::get_instance().kick();
+// Publish the buffer position of the next unsent frame, the M4 never coalesces frames up to it
+void setLiveSendIndex(unsigned int index)
+{
+  liveSendIndex = index;
+  writeFrameIndex(&data_frame_buffer_sdram->sent, index);
+  cleanSharedMemoryCache();
+}
 
-  if (mqttClient)
+// Release what a delivered message carried, called in publish order
+void messageDelivered(uint32_t stream)
+{
+  if (stream == STREAM_LIVE)
   {
-    Serial.println("=== MQTT Configuration ===");
-    if (communicationMode == ETHERNET)
-    {
-      Serial.print("Network: Ethernet - IP: ");
-      Serial.println(Ethernet.localIP());
-    }
-    else if (communicationMode == WIFI)
+    // Delivered in publish order, so the frame is the oldest in the buffer
+    const unsigned int tail = readFrameIndex(&data_frame_buffer_sdram->tail);
+    benchFramesDelivered(STREAM_LIVE, tail, 1);
+    writeFrameIndex(&data_frame_buffer_sdram->tail, (tail + 1) % dataFrameCapacity);
+
+    // Clean cache to make buffer updates visible to M4
+    cleanSharedMemoryCache();
+  }
+  else if (stream == STREAM_BLOCK)
+  {
+    benchFramesDelivered(STREAM_BLOCK, 0, spoolBlockCount);
+    dropSpoolBlock();
+    spoolFull = false;
+    spoolBlockCount = 0;
+    spoolBlockNext = 0;
+    spoolBlockAcked = 0;
+    blockSequence++;
+  }
+  else if (stream == STREAM_BACKFILL)
+  {
+    benchFramesDelivered(STREAM_BACKFILL, 0, 1);
+
+    // A block leaves the spool once all its frames are delivered, a reset part way through repeats the block
+    if (++spoolBlockAcked == spoolBlockCount)
     {
-      Serial.print("Network: WiFi - IP: ");
-      Serial.println(WiFi.localIP());
-      Serial.print("RSSI: ");
-      Serial.println(WiFi.RSSI());
+      dropSpoolBlock();
+      spoolFull = false;
+      spoolBlockCount = 0;
+      spoolBlockNext = 0;
+      spoolBlockAcked = 0;
     }
-    Serial.print("Server: ");
-    Serial.println(mqttServer);
-    Serial.print("Port: ");
-    Serial.println(mqttPort);
-    Serial.print("Client ID: ");
-    Serial.println(mqttClientId);
-    Serial.print("Username: ");
-    Serial.println(mqttUsername);
-    Serial.print("Password: ");
-    Serial.println(mqttPassword);
-    Serial.print("Buffer Size: ");
-    Serial.println(2560);
-    Serial.print("Keep Alive: ");
-    Serial.println(15);
-    Serial.println("========================");
-
-    mqttClient->setServer(mqttServer, mqttPort);
-    mqttClient->setBufferSize(2560); // Increased from 2056 to add safety margin
-    mqttClient->setKeepAlive(15);    // Keep connection alive with 15 second keepalive
-    reconnect();
   }
 }
 
-void setup()
+// Take back frames published but not yet acknowledged. They are published again from the buffer and spool
+// rather than repeated by the MQTT client, keeping each stream's sequence numbers and delta state in order.
+void rewindUndelivered()
 {
-  mbed::Watchdog::get_instance().start();
-
-  pinMode(LEDR, OUTPUT);
-  pinMode(LEDG, OUTPUT);
-  pinMode(LEDB, OUTPUT);
-  pinMode(LED_D0, OUTPUT);
-  pinMode(LED_D1, OUTPUT);
-  pinMode(LED_D2, OUTPUT);
-  pinMode(LED_D3, OUTPUT);
-
-  digitalWrite(LEDR, 0);
-  digitalWrite(LEDG, 0);
-  digitalWrite(LEDB, 0);
-  digitalWrite(LED_D0, 0);
-  digitalWrite(LED_D1, 0);
-  digitalWrite(LED_D2, 0);
-  digitalWrite(LED_D3, 0);
+  if (mqttClient)
+  {
+    mqttDiscardInflight(mqttClient, STREAM_LIVE);
+    mqttDiscardInflight(mqttClient, STREAM_BACKFILL);
+    mqttDiscardInflight(mqttClient, STREAM_BLOCK);
+  }
 
-  Serial.begin(19200); // The USB serial connection
+  const unsigned int tail = readFrameIndex(&data_frame_buffer_sdram->tail);
+  if (liveSendIndex != tail)
+  {
+    setLiveSendIndex(tail);
+  }
+  spoolBlockNext = spoolBlockAcked;
 
-  for (const auto timeout = millis() + 2500; !Serial && millis() < timeout; delay(250))
-    ;
+  // The newest frame goes out again once reconnected
+  liveCopyFrameNumber = 0;
+}
 
-  // Boot M4 core after basic initialization
-  bootM4();
+// A message the broker refused in its PUBACK. Frames are taken back and published again once the hold is over,
+// other messages are already gone from their source and are only counted by the client.
+void messageRefused(uint32_t stream, uint8_t reason)
+{
+  Serial.print("Broker refused a message, reason 0x");
+  Serial.print(reason, HEX);
+  Serial.print(", refused so far: ");
+  Serial.println(mqttClient ? mqttClient->refusedCount : 0);
 
-  initFlashStorage();
+  if (stream == STREAM_LIVE || stream == STREAM_BACKFILL || stream == STREAM_BLOCK)
+  {
+    // The broker dropped a frame the delta state counts as sent, so both streams start over from a keyframe
+    rewindUndelivered();
+    requestKeyframe(&livePayloadEncoder);
+    requestKeyframe(&backfillPayloadEncoder);
+    framesHeldUntil = millis() + refusedHoldInterval;
+  }
+}
 
-  // Initialize config editor state machine
-  initConfigEditor();
+// True if the active transport only carries frames in compressed blocks, one Notecard note per block
+bool blocksOnly()
+{
+  return activeMode == BLUES && !serialOnlyMode;
 }
 
-bool attemptPublish(const char *topic, const char *message)
+// Every frame behind the newest is backlog. Move it into the compressed spool, which drains on the backfill topic,
+// so the live topic only ever carries the newest frame. Waits for live frames still awaiting their PUBACK, they
+// leave the buffer from the tail first. While offline only whole blocks are moved, for the best compression.
+// Once the buffer is full the M4 coalesces its frames, so the backlog is first reserved by moving `sent` past it
+// and only copied once the M4 has written a newer frame: one it was coalescing then may still have been moving
+// them. Returns the new tail. On a blocks-only transport every frame is backlog and blocks of noteBatchFrames
+// are moved.
+unsigned int spoolBacklog(unsigned int head, unsigned int tail)
 {
-  if ((communicationMode == WIFI || communicationMode == ETHERNET) && mqttClient)
+  const unsigned int queued = blocksOnly() ? 0 : 1;
+  const unsigned int count = dataFrameCount(head, tail);
+  if (count <= queued || liveSendIndex != tail || spoolFull)
   {
-    // If MQTT is down, try reconnecting
-    if (!mqttClient->connected())
-    {
-      reconnect();
-    }
+    return tail;
+  }
 
-    // Attempt to publish
-    if (mqttClient->connected())
-    {
-      bool success = mqttClient->publish(topic, message);
-      if (!success)
-      {
-        Serial.println("MQTT publish failed");
+  unsigned int backlog = min(count - queued, (unsigned int)FRAME_BLOCK_FRAMES);
+  if ((blocksOnly() && backlog < (unsigned int)noteBatchFrames) ||
+      (!blocksOnly() && backlog < FRAME_BLOCK_FRAMES && !publishLinkUp()))
+  {
+    return tail;
+  }
 
-        // Set running state
-        setDeviceState(ERROR_PUBLISH_FAILED);
-      }
-      return success;
-    }
-    return false;
+  // A full buffer keeps its head where it is, the newest frame is always the one before it. One frame short of
+  // full counts too, the M4 may write that frame meanwhile.
+  const unsigned int newest =
+      data_frame_buffer_sdram->frames[(head + dataFrameCapacity - 1) % dataFrameCapacity].frameNumber;
+  if (reservedFrames == 0 && count + 1 >= dataFrameCapacity - 1)
+  {
+    reservedFrames = backlog;
+    reservedFrameNumber = newest;
+    writeFrameIndex(&data_frame_buffer_sdram->sent, (tail + backlog) % dataFrameCapacity);
+    cleanSharedMemoryCache();
+    return tail;
   }
-  else if (communicationMode == BLUES)
+  if (reservedFrames > 0)
   {
-    // Create a JSON request object for the Notecard
-    J *req = notecard.newRequest("note.add");
-    if (req != NULL)
+    if (newest == reservedFrameNumber)
     {
-      JAddStringToObject(req, "file", "data.qo");
-      JAddBoolToObject(req, "sync", true);
+      return tail;
+    }
+    backlog = reservedFrames;
+    reservedFrames = 0;
+  }
 
-      // Add the message as body
-      J *body = JCreateObject();
-      if (body != NULL)
-      {
-        JAddStringToObject(body, "topic", topic);
-        JAddStringToObject(body, "message", message);
-        JAddItemToObject(req, "body", body);
-      }
+  DATA_FRAME_SEND frames[FRAME_BLOCK_FRAMES];
+  for (unsigned int k = 0; k < backlog; k++)
+  {
+    copyDataFrame(&frames[k], &data_frame_buffer_sdram->frames[(tail + k) % dataFrameCapacity]);
+  }
 
-      return notecard.sendRequest(req);
-    }
-    return false;
+  if (!spoolFrames(frames, backlog))
+  {
+    // Tried again once a block has left the spool. Releases any reservation.
+    spoolFull = true;
+    setLiveSendIndex(tail);
+    return tail;
   }
 
-  return true; // Serial-only mode always succeeds
+  // Frames are in the spool before they leave the buffer, a reset in between only repeats them
+  const unsigned int newTail = (tail + backlog) % dataFrameCapacity;
+  writeFrameIndex(&data_frame_buffer_sdram->tail, newTail);
+  setLiveSendIndex(newTail);
+
+  return newTail;
 }
 
-void sendMessage(const char *topic, const char *message)
+// Refill the backfill bucket at backfillRate messages per minute, up to backfillBurst messages
+void refillBackfillTokens()
 {
-  // Always output to serial
-  Serial.println();
-  Serial.println(topic);
-  Serial.println(message);
-  Serial.println();
+  const unsigned long now = millis();
+  const unsigned long elapsed = min(now - backfillRefilledAt, 60000UL);
+  backfillRefilledAt = now;
 
-  if (!serialOnlyMode)
+  const unsigned long limit = (unsigned long)max(backfillBurst, 1) * backfillTokenCost;
+  backfillTokens = min(backfillTokens + elapsed * (unsigned long)max(backfillRate, 0), limit);
+}
+
+// Milliseconds until the bucket holds a whole message
+unsigned long backfillTokenWait()
+{
+  if (backfillTokens >= backfillTokenCost)
   {
-    // Attempt to publish the message
-    attemptPublish(topic, message);
+    return 0;
   }
-  else
+  if (backfillRate <= 0)
   {
-    delay(500);
+    return ULONG_MAX;
   }
+  return (backfillTokenCost - backfillTokens + backfillRate - 1) / backfillRate;
 }
 
-void loop()
+// Send the sampling parameters from config, and any pending commands, to the M4
+void pushInputParameters()
 {
-  // Config editor state machine
-  mbed::Watchdog::get_instance().kick();
-  if (handleConfigEditorState())
+  INPUT_PARAMETERS parameters;
+  parameters.sendInterval = sendInterval;
+  for (int i = 0; i < INPUT_CHANNELS; i++)
   {
-    return; // Still in config editor mode
+    parameters.debounceDelays[i] = debounceDelays[i];
+    parameters.channelModes[i] = channelModes[i];
   }
+  parameters.commands = pendingControlCommands;
 
-  if (!setupComplete)
+  parameters.urgentChannels = 0;
+  parameters.edgeLogChannels = 0;
+  for (int i = 0; i < INPUT_CHANNELS; i++)
   {
-    loadConfigTokenFromMemory();
-    deinitFlashStorage();
-    applyConfigToken();
-
-    if (!serialOnlyMode)
+    if (urgentInputs[i])
     {
-      printConfig();
+      parameters.urgentChannels |= 1U << i;
+    }
+    if (edgeLogInputs[i])
+    {
+      parameters.edgeLogChannels |= 1U << i;
+    }
+  }
+
+  postedControlSequence = postInputParameters(&parameters);
+}
+
+// Drop commands once the M4 has applied a block carrying them
+void checkInputParametersAcknowledged()
+{
+  if (pendingControlCommands != 0 && readInputParametersAcknowledged() == postedControlSequence)
+  {
+    if (pendingControlCommands & CONTROL_COMMAND_RESET_TOTALS)
+    {
+      Serial.println("Totals reset");
+    }
+    pendingControlCommands = 0;
+  }
+}
+
+// Publish the outcome of the self-test steps run so far
+void publishSelfTestReport(unsigned int count)
+{
+  char topic[128] = {0};
+  char message[1536] = {0};
+
+  buildTopic(topic, sizeof(topic), "/selftest/report");
+  encodeSelfTestReport(&selfTestPlan, selfTestOutcomes, count, message, sizeof(message));
+  Serial.print("Self-test: ");
+  Serial.println(message);
+
+  // The request came over MQTT, but the link may have failed over to the Notecard since
+  if (mqttClient)
+  {
+    mqttPublish(mqttClient, topic, (const uint8_t *)message, strlen(message), 0, STREAM_OTHER);
+  }
+}
+
+// Post the current step of the self-test to the M4
+void startSelfTestStep()
+{
+  SELF_TEST_STEP step;
+  buildSelfTestStep(&selfTestPlan, selfTestStep, &step);
+  selfTestSequence = postSelfTestStep(&step);
+
+  // The M4 reports once the last pulse has passed the debounce
+  int longestDebounce = 0;
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    longestDebounce = max(longestDebounce, debounceDelays[i]);
+  }
+  selfTestDeadline = millis() + selfTestPatternMicros(&step) / 1000 + longestDebounce + 2000;
+
+  Serial.print("Self-test: ");
+  Serial.print(selfTestPlan.rates[selfTestStep]);
+  Serial.println(" Hz");
+}
+
+// Report a self-test request that was not run
+void rejectSelfTestRequest(const char *result)
+{
+  Serial.print("Self-test: ");
+  Serial.println(result);
+
+  char message[48];
+  snprintf(message, sizeof(message), "{\"result\":\"%s\"}", result);
+  char topic[128] = {0};
+  buildTopic(topic, sizeof(topic), "/selftest/report");
+  mqttPublish(mqttClient, topic, (const uint8_t *)message, strlen(message), 0, STREAM_OTHER);
+}
+
+// Start a self-test sweep, replacing one still running. The request is a signed command
+// {"cmd":"selftest","csq":N} carrying the plan.
+void handleSelfTestRequest(const uint8_t *payload, size_t length)
+{
+  JsonDocument doc;
+  const SignedCommandResult result = acceptSignedCommand(payload, length, "selftest", doc);
+  if (result != SIGNED_COMMAND_ACCEPTED)
+  {
+    rejectSelfTestRequest(getSignedCommandResultName(result));
+    return;
+  }
+
+  if (!parseSelfTestRequest(doc, &selfTestPlan))
+  {
+    rejectSelfTestRequest("invalid");
+    return;
+  }
+
+  selfTestStep = 0;
+  startSelfTestStep();
+}
+
+// Compare each step once the M4 reports it and move on to the next, publishing the report after the last
+void checkSelfTest()
+{
+  if (selfTestSequence == 0)
+  {
+    return;
+  }
+
+  SELF_TEST_OUTCOME *outcome = &selfTestOutcomes[selfTestStep];
+  SELF_TEST_RESULT result;
+  if (readSelfTestResult(selfTestSequence, &result))
+  {
+    SELF_TEST_STEP step;
+    buildSelfTestStep(&selfTestPlan, selfTestStep, &step);
+    evaluateSelfTestStep(&step, &result, channelModes, debounceDelays, selfTestPlan.rates[selfTestStep], outcome);
+
+    if (++selfTestStep < selfTestPlan.stepCount)
+    {
+      startSelfTestStep();
+      return;
+    }
+  }
+  else if ((long)(millis() - selfTestDeadline) >= 0)
+  {
+    // The M4 is not running the steps, give the inputs back and report what there is
+    Serial.println("Self-test: no result from the M4");
+    memset(outcome, 0, sizeof(*outcome));
+    outcome->rate = selfTestPlan.rates[selfTestStep++];
+
+    SELF_TEST_STEP stop = {0};
+    postSelfTestStep(&stop);
+  }
+  else
+  {
+    return;
+  }
+
+  selfTestSequence = 0;
+  publishSelfTestReport(selfTestStep);
+}
+
+// Validate and apply a signed config token, then report the outcome on the response topic
+void handleRemoteConfig(const uint8_t *payload, size_t length)
+{
+  const RemoteConfigResult result = applyRemoteConfig(payload, length);
+
+  Serial.print("Remote config: ");
+  Serial.println(getRemoteConfigResultName(result));
+
+  const bool ok = result == REMOTE_CONFIG_APPLIED || result == REMOTE_CONFIG_RESTART;
+  if (result == REMOTE_CONFIG_APPLIED)
+  {
+    printConfig();
+
+    // Sampling changes reach the M4 at its next frame
+    pushInputParameters();
+  }
+
+  char responseTopic[160] = {0};
+  char response[128] = {0};
+  buildTopic(responseTopic, sizeof(responseTopic), "/config/response");
+  snprintf(response, sizeof(response), "{\"ok\":%s,\"result\":\"%s\",\"restart\":%s}",
+           ok ? "true" : "false",
+           getRemoteConfigResultName(result),
+           result == REMOTE_CONFIG_RESTART ? "true" : "false");
+  mqttPublish(mqttClient, responseTopic, (const uint8_t *)response, strlen(response), 0, STREAM_OTHER);
+
+  if (result == REMOTE_CONFIG_RESTART)
+  {
+    // Give the response time to leave before restarting
+    restartAt = millis() + 2000;
+  }
+}
+
+// Report an image's transfer on the OTA status topic, the sender carries on from the offset given
+void publishOtaStatus(OtaTarget target, OtaResult result)
+{
+  const OTA_IMAGE *image = &otaImages[target];
+
+  char statusTopic[160] = {0};
+  char status[192] = {0};
+  buildTopic(statusTopic, sizeof(statusTopic), "/ota/status");
+  snprintf(status, sizeof(status),
+           "{\"t\":\"%s\",\"v\":\"%s\",\"state\":\"%s\",\"result\":\"%s\",\"o\":%lu,\"n\":%lu}",
+           getOtaTargetName(target),
+           image->version,
+           getOtaStateName(image->state),
+           getOtaResultName(result),
+           (unsigned long)image->received,
+           (unsigned long)image->size);
+  Serial.print("OTA: ");
+  Serial.println(status);
+  otaChunksSinceStatus = 0;
+
+  // An apply requested over MQTT may run after a failover to the Notecard
+  if (mqttClient)
+  {
+    mqttPublish(mqttClient, statusTopic, (const uint8_t *)status, strlen(status), 0, STREAM_OTHER);
+  }
+}
+
+// Handle a message on one of the OTA topics: begin, chunk or apply
+void handleOtaMessage(const char *kind, const uint8_t *payload, size_t length)
+{
+  OtaTarget target = OTA_TARGET_M7;
+  if (strcmp(kind, "chunk") == 0)
+  {
+    const OtaResult result = writeOtaChunk(payload, length, &target);
+    if (result != OTA_OK || otaImages[target].state != OTA_RECEIVING || ++otaChunksSinceStatus >= otaStatusChunks)
+    {
+      publishOtaStatus(target, result);
+    }
+  }
+  else if (strcmp(kind, "begin") == 0)
+  {
+    const OtaResult result = beginOtaImage(payload, length, &target);
+    publishOtaStatus(target, result);
+  }
+  else if (strcmp(kind, "apply") == 0)
+  {
+    // Applied from the loop, after this status has had time to leave
+    Serial.println("OTA: apply requested");
+    otaApplyAt = millis() + 2000;
+  }
+}
+
+// Answer a totals reset request on its response topic
+void publishTotalsResponse(const char *result)
+{
+  Serial.print("Totals reset: ");
+  Serial.println(result);
+
+  char message[48];
+  snprintf(message, sizeof(message), "{\"result\":\"%s\"}", result);
+  char topic[128] = {0};
+  buildTopic(topic, sizeof(topic), "/totals/response");
+  mqttPublish(mqttClient, topic, (const uint8_t *)message, strlen(message), 0, STREAM_OTHER);
+}
+
+// Clear the cumulative totals at the M4's next frame. The request is a signed command {"cmd":"reset","csq":N}.
+void handleTotalsReset(const uint8_t *payload, size_t length)
+{
+  JsonDocument doc;
+  const SignedCommandResult result = acceptSignedCommand(payload, length, "reset", doc);
+  if (result != SIGNED_COMMAND_ACCEPTED)
+  {
+    publishTotalsResponse(getSignedCommandResultName(result));
+    return;
+  }
+
+  pendingControlCommands |= CONTROL_COMMAND_RESET_TOTALS;
+  pushInputParameters();
+  publishTotalsResponse("reset");
+}
+
+void mqttCallback(char *topic, uint8_t *payload, size_t length)
+{
+  char resyncTopic[128] = {0};
+  char configTopic[128] = {0};
+  char resetTotalsTopic[128] = {0};
+  char otaTopic[128] = {0};
+  char selfTestTopic[128] = {0};
+  buildTopic(resyncTopic, sizeof(resyncTopic), "/resync");
+  buildTopic(configTopic, sizeof(configTopic), "/config");
+  buildTopic(resetTotalsTopic, sizeof(resetTotalsTopic), "/totals/reset");
+  buildTopic(otaTopic, sizeof(otaTopic), "/ota/");
+  buildTopic(selfTestTopic, sizeof(selfTestTopic), "/selftest");
+
+  // Any message on the resync topic makes the next message a keyframe
+  if (strcmp(topic, resyncTopic) == 0)
+  {
+    Serial.println("Resync requested");
+    requestKeyframe(&livePayloadEncoder);
+    requestKeyframe(&backfillPayloadEncoder);
+  }
+  else if (strcmp(topic, configTopic) == 0)
+  {
+    handleRemoteConfig(payload, length);
+  }
+  else if (strcmp(topic, resetTotalsTopic) == 0)
+  {
+    handleTotalsReset(payload, length);
+  }
+  else if (strncmp(topic, otaTopic, strlen(otaTopic)) == 0)
+  {
+    handleOtaMessage(topic + strlen(otaTopic), payload, length);
+  }
+  // Run the counting self-test, the request picks the inputs, rates and pattern
+  else if (strcmp(topic, selfTestTopic) == 0)
+  {
+    Serial.println("Self-test requested");
+    handleSelfTestRequest(payload, length);
+  }
+}
+
+// Parse the TLS pin or CA bundle, once for all connections
+void setupTls()
+{
+  if (strlen(mqttTlsPin) > 0)
+  {
+    if (!parseTlsPin(mqttTlsPin, tlsPin))
+    {
+      Serial.println("Invalid TLS pin, expected 64 hex digits");
+      showError(ERROR_CONFIG_LOAD);
+    }
+    tlsPinned = true;
+    Serial.println("TLS: broker key pinned");
+  }
+  else
+  {
+    mbedtls_x509_crt_init(&tlsCaChain);
+    const int loaded = loadTlsCaBundle(&tlsCaChain, TLS_CA_BUNDLE_PATH);
+    Serial.print("TLS: CA certificates loaded: ");
+    Serial.println(loaded);
+    if (loaded == 0)
+    {
+      Serial.println("No CA certificates, TLS connections will fail");
+    }
+  }
+
+  mbed::Watchdog::get_instance().kick();
+}
+
+// Make one attempt to bring a transport's link up, the caller tries again later. Returns true once the link is up.
+bool startTransport(TRANSPORT *transport)
+{
+  const bool failover = transportCount > 1;
+
+  if (transport->mode == ETHERNET)
+  {
+    setDeviceState(STATE_ETHERNET_CONNECTING);
+    Serial.println("Trying Ethernet:");
+    if (failover && Ethernet.linkStatus() == LinkOFF)
+    {
+      Serial.println("Ethernet cable is not connected...");
+      return false;
+    }
+    if (!transport->started && fastBoot && networkLeaseValid() && communicationMode == ETHERNET)
+    {
+      // Reuse the last lease instead of waiting for DHCP, only still valid after a warm reset
+      Serial.println("Using cached network lease");
+      Ethernet.begin(nullptr, IPAddress(cachedLocalIp), IPAddress(cachedDns), IPAddress(cachedGateway), IPAddress(cachedSubnet));
+      networkLeaseInUse = true;
+    }
+    if (Ethernet.localIP() == IPAddress(0, 0, 0, 0) && Ethernet.begin(nullptr, 10000, 4000) == 0)
+    {
+      Serial.println("Failed to configure Ethernet using DHCP...");
+      if (Ethernet.linkStatus() == LinkOFF)
+      {
+        Serial.println("Ethernet cable is not connected...");
+      }
+      // Kick watchdog after the DHCP attempt
+      mbed::Watchdog::get_instance().kick();
+      return false;
+    }
+
+    Serial.print("Connected via Ethernet: ");
+    Serial.println(Ethernet.localIP());
+
+    if (fastBoot && communicationMode == ETHERNET)
+    {
+      cacheNetworkLease(Ethernet.localIP(), Ethernet.gatewayIP(), Ethernet.subnetMask(), Ethernet.dnsServerIP());
+    }
+
+    ethClient.setTimeout(5000); // 5 second timeout
+    setEthernetMacAddress();
+  }
+  else if (transport->mode == WIFI)
+  {
+    // A join started by a failback probe has WiFi to itself until it finishes
+    if (wifiJoinState == WIFI_JOIN_RUNNING)
+    {
+      Serial.println("WiFi is still joining in the background");
+      return false;
+    }
+    if (wifiJoinState == WIFI_JOIN_DONE)
+    {
+      return finishWifiJoin(transport);
+    }
+    if (!setupWifi())
+    {
+      return false;
+    }
+    wifiClient.setTimeout(5000); // 5 second timeout
+  }
+  else if (transport->mode == BLUES)
+  {
+    // The Notecard queues notes until it reaches Notehub, so it is usable as soon as it answers
+    if (!transport->started)
+    {
+      notecard.setDebugOutputStream(Serial);
+      notecard.begin();
+      if (!startNoteQueue(&noteQueue, &notecard))
+      {
+        Serial.println("Notecard template failed, frame notes are sent as JSON");
+      }
+    }
+  }
+  else if (transport->mode == NONE)
+  {
+    Serial.println("Communication mode: NONE - Serial output only");
+  }
+
+  transport->started = true;
+  mbed::Watchdog::get_instance().kick();
+  return true;
+}
+
+// True if the transport's link is up. Only the link is checked, a broker that cannot be reached shows up when
+// publishing.
+bool probeTransport(TRANSPORT *transport)
+{
+  if (!transport->started)
+  {
+    return false;
+  }
+
+  if (transport->mode == ETHERNET)
+  {
+    return Ethernet.linkStatus() != LinkOFF && Ethernet.localIP() != IPAddress(0, 0, 0, 0);
+  }
+  else if (transport->mode == WIFI)
+  {
+    // A background join holds WiFi, its result is taken once it finishes
+    if (!wifiLock.trylock())
+    {
+      return false;
+    }
+    const bool connected = WiFi.status() == WL_CONNECTED;
+    wifiLock.unlock();
+    return connected;
+  }
+  else if (transport->mode == BLUES)
+  {
+    J *rsp = notecard.requestAndResponse(notecard.newRequest("card.version"));
+    const bool answered = rsp != NULL && !notecard.responseError(rsp);
+    notecard.deleteResponse(rsp);
+    return answered;
+  }
+  return true;
+}
+
+// Send messages over this transport from now on. Frames in flight on the previous one go out again from the
+// buffer and spool, so nothing is lost; the MQTT session keeps any other unacknowledged messages for when it
+// is used again.
+void activateTransport(int index)
+{
+  if (mqttClient)
+  {
+    rewindUndelivered();
+    mqttDisconnect(mqttClient);
+  }
+
+  activeTransport = index;
+  activeMode = transports[index].mode;
+  mqttClient = nullptr;
+  reconnectAt = millis();
+  transportMqttAttempts = 0;
+
+  Serial.print("Transport: ");
+  Serial.println(getCommunicationModeName(activeMode));
+
+  if (activeMode == ETHERNET || activeMode == WIFI)
+  {
+    Client *network = activeMode == ETHERNET ? (Client *)&ethClient : (Client *)&wifiClient;
+    if (mqttTls)
+    {
+      tlsClient.begin(network, tlsPinned ? nullptr : &tlsCaChain, tlsPinned ? tlsPin : nullptr);
+      network = &tlsClient;
+    }
+    mqttSession.transport = network;
+    mqttClient = &mqttSession;
+
+    if (activeMode == ETHERNET)
+    {
+      Serial.print("Network: Ethernet - IP: ");
+      Serial.println(Ethernet.localIP());
+    }
+    else
+    {
+      wifiLock.lock();
+      Serial.print("Network: WiFi - IP: ");
+      Serial.println(WiFi.localIP());
+      Serial.print("RSSI: ");
+      Serial.println(WiFi.RSSI());
+      wifiLock.unlock();
+    }
+  }
+
+  // Consumers see a new connection
+  requestKeyframe(&livePayloadEncoder);
+  requestKeyframe(&backfillPayloadEncoder);
+}
+
+// Move to the next transport that comes up after the active one failed. If none does the active one stays, and
+// reconnecting carries on there. A broker that cannot be reached on the new one fails it over again in turn.
+void failTransport()
+{
+  if (transportCount < 2)
+  {
+    return;
+  }
+
+  transports[activeTransport].healthyProbes = 0;
+  transports[activeTransport].retryAt = millis() + transportRetryInterval;
+
+  for (int i = 1; i < transportCount; i++)
+  {
+    const int index = (activeTransport + i) % transportCount;
+    TRANSPORT *transport = &transports[index];
+    if (probeTransport(transport) || startTransport(transport))
+    {
+      activateTransport(index);
+      return;
+    }
+  }
+}
+
+// Make one attempt to connect to the broker on the active transport, bringing WiFi back first if needed, and
+// return. Attempts are spaced out by the retry intervals, so the loop keeps moving frames into the spool between
+// them while offline. Returns true once connected. With failover transports configured, moves to the next one
+// after a few failed attempts; with a single transport it keeps trying and resets in the end.
+bool reconnect()
+{
+  if (!mqttClient)
+    return false;
+
+  if (mqttConnected(mqttClient))
+    return true;
+
+  if ((long)(millis() - reconnectAt) < 0)
+    return false;
+
+  // A link that has not come up since boot, or since failing over to it
+  TRANSPORT *transport = &transports[activeTransport];
+  if (!transport->started)
+  {
+    if (!startTransport(transport))
+    {
+      reconnectAt = millis() + linkRetryInterval;
+      failTransport();
+      return false;
+    }
+  }
+
+  // If using WiFi, check and reconnect WiFi first if needed. Its status is checked again on the next attempt.
+  if (activeMode == WIFI)
+  {
+    wifiLock.lock();
+    const bool wifiConnected = WiFi.status() == WL_CONNECTED;
+    wifiLock.unlock();
+    if (!wifiConnected)
+    {
+      if (wifiReconnectAttempts == 0)
+      {
+        Serial.println("WiFi disconnected, attempting to reconnect...");
+      }
+      setDeviceState(STATE_WIFI_CONNECTING);
+
+      if (wifiReconnectAttempts >= 10)
+      {
+        Serial.println();
+        Serial.println("WiFi reconnection failed");
+        showError(ERROR_WIFI_FAILED);
+        wifiReconnectAttempts = 0;
+        if (transportCount > 1)
+        {
+          failTransport();
+          return false;
+        }
+        HAL_NVIC_SystemReset();
+      }
+
+      Serial.print(".");
+      wifiLock.lock();
+      if (strcmp(wifiPassword, "") == 0)
+      {
+        WiFi.begin(wifiSsid);
+      }
+      else
+      {
+        WiFi.begin(wifiSsid, wifiPassword);
+      }
+      wifiLock.unlock();
+
+      mbed::Watchdog::get_instance().kick();
+      wifiReconnectAttempts++;
+      reconnectAt = millis() + wifiRetryInterval;
+      return false;
+    }
+
+    if (wifiReconnectAttempts > 0)
+    {
+      Serial.println();
+      Serial.println("WiFi reconnected");
+      Serial.print("IP address: ");
+      wifiLock.lock();
+      Serial.println(WiFi.localIP());
+      wifiLock.unlock();
+      wifiReconnectAttempts = 0;
+      // Reset MQTT attempts counter after successful WiFi reconnection
+      mqttAttempts = 0;
+    }
+  }
+
+  setDeviceState(STATE_MQTT_CONNECTING);
+  Serial.print("Attempting MQTT connection...");
+
+  if (mqttConnect(mqttClient, mqttClientId, mqttUsername, mqttPassword))
+  {
+    Serial.println(mqttSessionResumed(mqttClient) ? "connected (session resumed)" : "connected");
+    if (mqttTls)
+    {
+      Serial.print("TLS handshake: ");
+      Serial.print(tlsClient.handshakeMillis);
+      Serial.println(tlsClient.resumed ? " ms (resumed)" : " ms");
+    }
+
+    // Always subscribe after boot, the resumed session may be from before a change of device ID
+    if (!mqttSubscribed || !mqttSessionResumed(mqttClient))
+    {
+      char resyncTopic[128] = {0};
+      buildTopic(resyncTopic, sizeof(resyncTopic), "/resync");
+      mqttSubscribe(mqttClient, resyncTopic);
+
+      char configTopic[128] = {0};
+      buildTopic(configTopic, sizeof(configTopic), "/config");
+      mqttSubscribe(mqttClient, configTopic);
+
+      char resetTotalsTopic[128] = {0};
+      buildTopic(resetTotalsTopic, sizeof(resetTotalsTopic), "/totals/reset");
+      mqttSubscribe(mqttClient, resetTotalsTopic);
+
+      // OTA begin, chunk and apply
+      char otaTopic[128] = {0};
+      buildTopic(otaTopic, sizeof(otaTopic), "/ota/+");
+      mqttSubscribe(mqttClient, otaTopic);
+
+      char selfTestTopic[128] = {0};
+      buildTopic(selfTestTopic, sizeof(selfTestTopic), "/selftest");
+      mqttSubscribe(mqttClient, selfTestTopic);
+      mqttSubscribed = true;
+    }
+
+    // A transfer cut short by the disconnect carries on from the last byte written
+    for (int i = 0; i < OTA_TARGETS; i++)
+    {
+      if (otaImages[i].state == OTA_RECEIVING)
+      {
+        publishOtaStatus((OtaTarget)i, OTA_OK);
+      }
+    }
+
+    // Consumers may have missed messages while disconnected
+    requestKeyframe(&livePayloadEncoder);
+    requestKeyframe(&backfillPayloadEncoder);
+    mqttAttempts = 0;
+    transportMqttAttempts = 0;
+    return true;
+  }
+
+  Serial.print("failed. rc=");
+  Serial.print(mqttClient->state);
+  if (mqttTls && tlsClient.lastError != 0)
+  {
+    Serial.print(" tls=-0x");
+    Serial.print(-tlsClient.lastError, HEX);
+  }
+  Serial.println(" trying again...");
+  showError(ERROR_MQTT_FAILED);
+  setDeviceState(STATE_MQTT_CONNECTING);
+
+  mbed::Watchdog::get_instance().kick();
+  reconnectAt = millis() + mqttRetryInterval;
+
+  if (transportCount > 1 && ++transportMqttAttempts >= failoverMqttAttempts)
+  {
+    failTransport();
+    return false;
+  }
+
+  mqttAttempts++;
+  if (mqttAttempts > 10)
+  {
+    // A stale cached lease may be why, fall back to DHCP after the reset
+    if (cachedLocalIp != 0)
+    {
+      cacheNetworkLease(0, 0, 0, 0);
+    }
+
+    showError(ERROR_MQTT_FAILED);
+    HAL_NVIC_SystemReset();
+  }
+
+  return false;
+}
+
+// A cached lease is a static address to the network stack, which does not renew it with the DHCP server. Once it
+// has expired the address may be given to another device: forget it, so the next DHCP lease is cached afresh,
+// and if it is in use restart to take a new one. Frames in the buffer and spool survive the restart.
+void checkNetworkLease()
+{
+  if (cachedLocalIp == 0 || networkLeaseValid())
+  {
+    return;
+  }
+
+  Serial.println("Cached network lease expired");
+  cacheNetworkLease(0, 0, 0, 0);
+  if (networkLeaseInUse)
+  {
+    Serial.println("Restarting to take a new lease from DHCP");
+    HAL_NVIC_SystemReset();
+  }
+}
+
+// Probe the links now and then. Fail over when the active link is down, and fail back to a higher priority
+// transport once it has been up for failbackProbes probes in a row. A WiFi transport that is down is joined in
+// the background, see startWifiJoin, so probing it does not hold up the loop.
+void checkTransports()
+{
+  if (transportCount < 2 || millis() - transportProbedAt < transportProbeInterval)
+  {
+    return;
+  }
+  transportProbedAt = millis();
+
+  if (!probeTransport(&transports[activeTransport]))
+  {
+    Serial.println("Active transport is down");
+    failTransport();
+    return;
+  }
+
+  for (int i = 0; i < activeTransport; i++)
+  {
+    TRANSPORT *transport = &transports[i];
+    if ((long)(millis() - transport->retryAt) < 0)
+    {
+      continue;
+    }
+
+    bool healthy = probeTransport(transport);
+    if (!healthy && transport->mode == WIFI)
+    {
+      if (wifiJoinState != WIFI_JOIN_DONE)
+      {
+        startWifiJoin();
+        continue;
+      }
+      healthy = finishWifiJoin(transport);
+      if (!healthy)
+      {
+        transport->retryAt = millis() + transportRetryInterval;
+      }
+    }
+    else if (!healthy)
+    {
+      transport->retryAt = millis() + transportRetryInterval;
+      healthy = startTransport(transport);
+    }
+    transport->healthyProbes = healthy ? transport->healthyProbes + 1 : 0;
+
+    if (transport->healthyProbes >= failbackProbes)
+    {
+      Serial.println("Failing back to a higher priority transport");
+      const int previous = activeTransport;
+      activateTransport(i);
+      if (mqttClient && !reconnect())
+      {
+        // The broker cannot be reached this way yet, stay where we were
+        transport->healthyProbes = 0;
+        transport->retryAt = millis() + transportRetryInterval;
+        activateTransport(previous);
+      }
+      return;
+    }
+  }
+}
+
+void setupNetworking()
+{
+  // MODBUS
+  RS485.setDelays(modbus_preDelayBR, modbus_postDelayBR);
+  if (!ModbusRTUClient.begin(modbus_baudrate, SERIAL_8N1))
+  {
+    Serial.println("Failed to start Modbus RTU Client!");
+  }
+  ModbusRTUClient.setTimeout(500);
+
+  mbed::Watchdog::get_instance().kick();
+
+  bool mqttUsed = false;
+  for (int i = 0; i < transportCount; i++)
+  {
+    transports[i].mode = transportOrder[i];
+    transports[i].started = false;
+    transports[i].healthyProbes = 0;
+    transports[i].retryAt = millis();
+    mqttUsed = mqttUsed || transportOrder[i] == ETHERNET || transportOrder[i] == WIFI;
+  }
+
+  if (mqttUsed)
+  {
+    if (mqttTls)
+    {
+      setupTls();
+    }
+
+    Serial.println("=== MQTT Configuration ===");
+    Serial.print("Server: ");
+    Serial.println(mqttServer);
+    Serial.print("Port: ");
+    Serial.println(mqttPort);
+    Serial.print("Client ID: ");
+    Serial.println(mqttClientId);
+    Serial.print("Username: ");
+    Serial.println(mqttUsername);
+    Serial.print("Password: ");
+    Serial.println(mqttPassword);
+    Serial.print("Buffer Size: ");
+    Serial.println(MQTT_MAX_PACKET_SIZE);
+    Serial.print("Keep Alive: ");
+    Serial.println(15);
+    Serial.print("QoS: ");
+    Serial.println(mqttQos);
+    Serial.print("In-flight Window: ");
+    Serial.println(mqttWindow);
+    Serial.print("Protocol: ");
+    Serial.println(mqttVersion == 5 ? "MQTT 5" : "MQTT 3.1.1");
+    if (mqttVersion == 5)
+    {
+      Serial.print("Session Expiry: ");
+      Serial.println(mqttSessionExpiry);
+      Serial.print("Message Expiry: ");
+      Serial.println(mqttMessageExpiry);
+    }
+    Serial.println("========================");
+
+    // Keep connection alive with 15 second keepalive. The transport is set when one is activated.
+    mqttInit(&mqttSession, nullptr, mqttServer, mqttPort, 15, mqttWindow, mqttCallback, messageDelivered);
+    mqttOnRefused(&mqttSession, messageRefused);
+    if (mqttVersion == 5)
+    {
+      mqttUseVersion5(&mqttSession, mqttSessionExpiry, mqttMessageExpiry);
+    }
+  }
+
+  // Start on the first transport that comes up, in priority order. If none does the first is kept and the loop
+  // carries on bringing it up, moving frames into the spool meanwhile.
+  int first = 0;
+  for (int i = 0; i < transportCount; i++)
+  {
+    if (startTransport(&transports[i]))
+    {
+      first = i;
+      break;
+    }
+    mbed::Watchdog::get_instance().kick();
+  }
+  activateTransport(first);
+
+  // The loop carries on connecting to the broker from here
+  reconnect();
+  transportProbedAt = millis();
+}
+
+void setup()
+{
+  mbed::Watchdog::get_instance().start();
+
+  pinMode(LEDR, OUTPUT);
+  pinMode(LEDG, OUTPUT);
+  pinMode(LEDB, OUTPUT);
+  pinMode(LED_D0, OUTPUT);
+  pinMode(LED_D1, OUTPUT);
+  pinMode(LED_D2, OUTPUT);
+  pinMode(LED_D3, OUTPUT);
+
+  digitalWrite(LEDR, 0);
+  digitalWrite(LEDG, 0);
+  digitalWrite(LEDB, 0);
+  digitalWrite(LED_D0, 0);
+  digitalWrite(LED_D1, 0);
+  digitalWrite(LED_D2, 0);
+  digitalWrite(LED_D3, 0);
+
+  Serial.begin(19200); // The USB serial connection
+
+  // Boot M4 core after basic initialization, it holds its first frame until we are ready to publish
+  initSharedRegion();
+  clearSharedControl();
+  initFrameNotification();
+#ifdef BENCHMARK
+  // The M7 fills the buffer itself
+  restoreDataFrameBuffer();
+  benchFilledAt = new unsigned long[dataFrameCapacity]();
+#else
+  bootM4();
+#endif
+
+  // Keep frames spooled before a warm reset, they go out ahead of the buffer
+  if (initFrameSpool())
+  {
+    Serial.print("Frame spool restored: ");
+    Serial.print(spooledFrameCount());
+    Serial.println(" frames");
+  }
+
+  initFlashStorage();
+
+  // Fast boot skips waiting for a serial monitor, the editor is then only entered on request
+  loadConfigTokenFromMemory();
+  fastBoot = fastBootConfigured();
+  checkNetworkLease();
+  if (!fastBoot)
+  {
+    for (const auto timeout = millis() + 2500; !Serial && millis() < timeout; delay(250))
+      ;
+  }
+
+  // Initialize config editor state machine
+  initConfigEditor();
+}
+
+bool attemptPublish(const char *topic, const char *message, PublishStream stream)
+{
+  if (mqttClient)
+  {
+    // If MQTT is down the loop is reconnecting. Whatever was in flight goes out again from its source first,
+    // so this message waits until then.
+    if (!mqttConnected(mqttClient))
+    {
+      rewindUndelivered();
+      return false;
+    }
+
+    // Attempt to publish, delivery is reported through messageDelivered
+    bool success = mqttPublish(mqttClient, topic, (const uint8_t *)message, strlen(message), mqttQos, stream);
+    if (!success)
+    {
+      Serial.println("MQTT publish failed");
+
+      // Set running state
+      setDeviceState(ERROR_PUBLISH_FAILED);
+    }
+    return success;
+  }
+  else if (activeMode == BLUES)
+  {
+    // The note is queued until the next sync
+    return addMessageNote(&noteQueue, topic, message);
+  }
+
+  return true; // Serial-only mode always succeeds
+}
+
+bool sendMessage(const char *topic, const char *message, PublishStream stream)
+{
+  // Always output to serial
+  Serial.println();
+  Serial.println(topic);
+  Serial.println(message);
+  Serial.println();
+
+  if (!serialOnlyMode)
+  {
+    // Attempt to publish the message
+    if (!attemptPublish(topic, message, stream))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    delay(500);
+  }
+
+  // Only MQTT waits for an acknowledgement, anything else is delivered once sent
+  if (!mqttClient || serialOnlyMode)
+  {
+    messageDelivered(stream);
+  }
+
+  return true;
+}
+
+// Encode a frame for one stream and publish it under the device topic plus suffix. Returns true once sent,
+// otherwise the frame must be sent again and the stream's next message is a keyframe.
+bool publishFrame(PAYLOAD_ENCODER *encoder, const char *suffix, const DATA_FRAME_SEND *frame, bool withMeter,
+                  PublishStream stream)
+{
+  // Get Wifi strength
+  int32_t rssi = -1;
+  if (activeMode == WIFI)
+  {
+    wifiLock.lock();
+    rssi = WiFi.RSSI();
+    wifiLock.unlock();
+  }
+
+  // Share of the time since the previous message the M7 was awake
+  const unsigned int dutyCycle = takeDutyCycle();
+
+  char topic[128] = {0};
+  char message[2056] = {0};
+
+  buildTopic(topic, sizeof(topic), suffix);
+
+  // MODBUS
+  if (!withMeter)
+  {
+    encodePayload(encoder, payloadKeyframeInterval, frame, rssi, dutyCycle, nullptr, message, sizeof(message));
+  }
+  else
+  {
+    // Temporarily remove support for multiple Modbus devices
+    const int i = 0;
+
+    // When changing address, need to perform a dummy request
+    // Not sure why this happens, but first request after address change always fails.
+    getModbusRegister(i + 1, 0x00);
+
+    METER_READING meter;
+    meter.p1Volts = getModbusRegister(i + 1, p1VoltsModbusAddress);
+    meter.p2Volts = getModbusRegister(i + 1, p2VoltsModbusAddress);
+    meter.p3Volts = getModbusRegister(i + 1, p3VoltsModbusAddress);
+    meter.p1Amps = getModbusRegister(i + 1, p1AmpsModbusAddress);
+    meter.p2Amps = getModbusRegister(i + 1, p2AmpsModbusAddress);
+    meter.p3Amps = getModbusRegister(i + 1, p3AmpsModbusAddress);
+    meter.pf = getModbusRegister(i + 1, pfModbusAddress);
+    meter.kWh = getModbusRegister(i + 1, kWhModbusAddress);
+
+    encodePayload(encoder, payloadKeyframeInterval, frame, rssi, dutyCycle, &meter, message, sizeof(message));
+
+    mbed::Watchdog::get_instance().kick();
+  }
+
+  // Remove unnecessary trailing zeros.
+  String messageString = String(message);
+  messageString.replace(".0000", "");
+  messageString.toCharArray(message, 2056);
+
+  if (!sendMessage(topic, message, stream))
+  {
+    // The frame will be sent again, as a keyframe since the consumer never saw this one
+    requestKeyframe(encoder);
+    return false;
+  }
+
+  benchFramesSent(strlen(message));
+  return true;
+}
+
+// Publish the oldest urgent event on the event topic, it stays queued until sent. Returns true once sent.
+bool publishUrgentEvent(const URGENT_EVENT *event)
+{
+  char topic[128] = {0};
+  char message[128] = {0};
+
+  buildTopic(topic, sizeof(topic), "/event");
+  encodeUrgentEvent(event, urgentEventAge(event), message, sizeof(message));
+
+  if (!sendMessage(topic, message, STREAM_OTHER))
+  {
+    return false;
+  }
+
+  // An urgent event does not wait for the Notecard's next scheduled sync
+  if (activeMode == BLUES)
+  {
+    requestNoteSync(&noteQueue);
+  }
+  return true;
+}
+
+// Move edges from the shared log into the batch, so the log is emptied even while messages are slow to send.
+// Returns true once the batch is ready to publish.
+bool drainEdgeLog()
+{
+  EDGE_EVENT events[32];
+  unsigned int count;
+
+  while ((count = readEdgeEvents(events, 32)) > 0)
+  {
+    unsigned int added = 0;
+    while (added < count && addEdgeEvent(&edgeBatch, &events[added]))
+    {
+      added++;
+    }
+    dropEdgeEvents(added);
+
+    if (added < count)
+    {
+      return true; // Full, the rest waits in the log for the next batch
+    }
+  }
+
+  return edgeBatch.count > 0 && millis() - edgeBatch.startedAt >= edgeBatchInterval;
+}
+
+// Publish the edge batch on the edges topic. Returns true once sent.
+bool publishEdgeBatch()
+{
+  char topic[128] = {0};
+  char message[2200] = {0};
+
+  const unsigned int dropped = readEdgeEventsDropped();
+  EDGE_EVENT last = {edgeBatch.lastTimestamp, 0};
+
+  buildTopic(topic, sizeof(topic), "/edges");
+  if (encodeEdgeBatch(&edgeBatch, edgeBatchSequence, dropped - edgeDroppedReported, edgeEventAge(&last) / 1000,
+                      message, sizeof(message)) == 0 ||
+      !sendMessage(topic, message, STREAM_OTHER))
+  {
+    return false;
+  }
+
+  edgeBatchSequence++;
+  edgeDroppedReported = dropped;
+  resetEdgeBatch(&edgeBatch);
+  return true;
+}
+
+// Add the current spool block to the Notecard as one frame note. The note is stored by the Notecard, so the block
+// is delivered once it has been added. Returns true once added.
+bool queueFrameNote()
+{
+  uint8_t block[FRAME_BLOCK_MAX_BYTES];
+  const size_t length = encodeFrameBlock(spoolBlock, spoolBlockCount, block, sizeof(block));
+  if (length == 0)
+  {
+    return false;
+  }
+
+  Serial.print("Frame note ");
+  Serial.print(blockSequence);
+  Serial.print(": ");
+  Serial.print(spoolBlockCount);
+  Serial.print(" frames in ");
+  Serial.print(length);
+  Serial.println(" bytes");
+
+  if (!addFrameNote(&noteQueue, block, length, blockSequence, spoolBlockCount))
+  {
+    Serial.println("Notecard note.add failed");
+    setDeviceState(ERROR_PUBLISH_FAILED);
+    return false;
+  }
+
+  benchFramesSent((length + 2) / 3 * 4);
+  messageDelivered(STREAM_BLOCK);
+  return true;
+}
+
+// Have the Notecard send its queued notes, see checkNoteSync
+void checkNotecardSync()
+{
+  if (activeMode != BLUES || serialOnlyMode)
+  {
+    return;
+  }
+  checkNoteSync(&noteQueue, noteSyncInterval, noteSyncNotes);
+}
+
+#ifdef BENCHMARK
+// Next synthetic frame: a few counts per input, cumulative totals and slowly moving analog values, so delta
+// encoding and the spool see realistic frames
+void nextBenchFrame()
+{
+  static unsigned int n = 0;
+  n++;
+
+  unsigned int *counts = &benchFrame.userButtonCount;
+  unsigned int *states = &benchFrame.userButtonState;
+  unsigned int *totals = &benchFrame.userButtonTotal;
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    counts[i] = (n * (i + 1)) % 5;
+    states[i] = (n + i) % 2;
+    totals[i] += counts[i];
+  }
+  benchFrame.input7Analog = 2048 + (n * 7) % 64;
+  benchFrame.input8Analog = 1024 + (n * 13) % 32;
+  benchFrame.input7Min = benchFrame.input7Analog - 3;
+  benchFrame.input7Max = benchFrame.input7Analog + 3;
+  benchFrame.input8Min = benchFrame.input8Analog - 2;
+  benchFrame.input8Max = benchFrame.input8Analog + 2;
+  benchFrame.span = 1;
+  benchFrame.dutyCycle = 2;
+  benchFrame.frameNumber = n;
+}
+
+// Write a synthetic frame at the buffer head as the M4 would, false if the buffer is full
+bool addBenchFrame()
+{
+  const unsigned int head = readFrameIndex(&data_frame_buffer_sdram->head);
+  const unsigned int next = (head + 1) % dataFrameCapacity;
+  if (next == readFrameIndex(&data_frame_buffer_sdram->tail))
+  {
+    return false;
+  }
+
+  nextBenchFrame();
+  copyDataFrame(&data_frame_buffer_sdram->frames[head], &benchFrame);
+  benchFilledAt[head] = micros();
+  writeFrameIndex(&data_frame_buffer_sdram->head, next);
+  cleanSharedMemoryCache();
+  return true;
+}
+
+void startBenchRun(BenchPhase phase)
+{
+  benchPhase = phase;
+  benchStartedAt = millis();
+  benchFrames = 0;
+  benchBytes = 0;
+  resetBenchLatency(&benchLatency);
+}
+
+// Fill in the report for the current run, it is published once nothing else is in flight
+void endBenchRun(const char *name, bool latency)
+{
+  benchReport.name = name;
+  benchReport.transport = serialOnlyMode ? "SERIAL" : getCommunicationModeName(activeMode);
+  benchReport.qos = mqttClient && !serialOnlyMode ? mqttQos : -1;
+  benchReport.frames = benchFrames;
+  benchReport.bytes = benchBytes;
+  benchReport.millis = millis() - benchStartedAt;
+  benchReport.backfillRate = latency ? -1 : backfillRate;
+  benchReport.latency = latency ? &benchLatency : nullptr;
+}
+
+void publishBenchReport()
+{
+  char topic[128] = {0};
+  char message[256] = {0};
+
+  buildTopic(topic, sizeof(topic), "/bench");
+  encodeBenchReport(&benchReport, message, sizeof(message));
+  sendMessage(topic, message, STREAM_OTHER);
+}
+
+// Step the benchmark, called every loop before the buffer is read
+void runBenchmark()
+{
+  invalidateSharedMemoryCache();
+  const unsigned int head = readFrameIndex(&data_frame_buffer_sdram->head);
+  const bool idle = head == readFrameIndex(&data_frame_buffer_sdram->tail) && spoolBlockCount == 0 &&
+                    spooledFrameCount() == 0 && (!mqttClient || mqttInflightCount(mqttClient) == 0);
+
+  switch (benchPhase)
+  {
+  case BENCH_WAITING:
+    if (idle && publishLinkUp())
+    {
+      Serial.println("Benchmark: publish run");
+      startBenchRun(BENCH_PUBLISH);
+    }
+    break;
+
+  case BENCH_PUBLISH:
+    // One frame always waiting, so every loop publishes without the buffer becoming backlog
+    if (millis() - benchStartedAt >= benchPublishMillis)
+    {
+      endBenchRun("publish", true);
+      benchPhase = BENCH_SETTLING;
+    }
+    else if (head == liveSendIndex)
+    {
+      addBenchFrame();
+    }
+    break;
+
+  case BENCH_SETTLING:
+    if (idle)
+    {
+      publishBenchReport();
+
+      Serial.println("Benchmark: drain run");
+      startBenchRun(BENCH_DRAIN);
+      benchBacklog = 0;
+      while (benchBacklog < benchBacklogFrames && addBenchFrame())
+      {
+        benchBacklog++;
+      }
+    }
+    break;
+
+  case BENCH_DRAIN:
+    if (benchFrames >= benchBacklog)
+    {
+      endBenchRun("drain", false);
+      benchPhase = BENCH_DONE;
+      publishBenchReport();
+      Serial.println("Benchmark complete");
+    }
+    break;
+
+  case BENCH_DONE:
+    break;
+  }
+}
+#endif
+
+void loop()
+{
+  // Config editor state machine
+  mbed::Watchdog::get_instance().kick();
+  if (handleConfigEditorState())
+  {
+    return; // Still in config editor mode
+  }
+
+  if (!setupComplete)
+  {
+    loadConfigTokenFromMemory();
+    deinitFlashStorage();
+    applyConfigToken();
+
+    if (!serialOnlyMode)
+    {
+      printConfig();
+      initOta();
       setupNetworking();
 
       if (strlen(mqttClientId) == 0)
       {
         strcpy(mqttClientId, deviceId);
+        mqttClientIdDerived = true;
       }
     }
     else
@@ -548,160 +2088,199 @@ void loop()
       Serial.println("Running in serial-only mode - network disabled");
     }
 
+    resetPayloadEncoder(&livePayloadEncoder);
+    resetPayloadEncoder(&backfillPayloadEncoder);
+    resetEdgeBatch(&edgeBatch);
+    setLiveSendIndex(readFrameIndex(&data_frame_buffer_sdram->tail));
+    backfillTokens = (unsigned long)max(backfillBurst, 1) * backfillTokenCost;
+    backfillRefilledAt = millis();
+
+    // The M4 samples with its defaults until it picks these up with its first frame
+    pushInputParameters();
+
     setupComplete = true;
 
+    // Let the M4 send its first frame now rather than after a full interval
+    shared_control_sdram->consumerReady = 1;
+    cleanSharedControlCache();
+
     // Set running state
     setDeviceState(STATE_RUNNING);
   }
 
+  runBenchmark();
+
   // void receiveDataFromM4()
   // Invalidate cache before reading buffer to ensure we see fresh data
   invalidateSharedMemoryCache();
 
-  // Check if there are frames available in the buffer
-  if (data_frame_buffer_sdram->count > 0)
+  const unsigned int head = readFrameIndex(&data_frame_buffer_sdram->head);
+  spoolBacklog(head, readFrameIndex(&data_frame_buffer_sdram->tail));
+
+  // The next block is only read once every frame of the current one has been delivered
+  if (spoolBlockCount == 0)
+  {
+    spoolBlockCount = readSpoolBlock(spoolBlock);
+    spoolBlockNext = 0;
+    spoolBlockAcked = 0;
+  }
+  const bool backfillWaiting = spoolBlockNext < spoolBlockCount;
+
+  // A dropped connection is retried one attempt per pass, so the spool above keeps taking the backlog while offline.
+  // Nothing is published until it is back, and with the in-flight window full nothing more until PUBACKs arrive.
+  const bool connected = !mqttClient || reconnect();
+  const bool canPublish = connected && (!mqttClient || mqttCanPublish(mqttClient, mqttQos));
+
+  // Urgent events go ahead of everything, then live frames and edge batches, then the backfill only as fast as
+  // the bucket allows
+  URGENT_EVENT event;
+  const bool urgent = canPublish && readUrgentEvent(&event);
+  const bool edges = drainEdgeLog();
+  refillBackfillTokens();
+
+  // Only the newest frame goes out live, the spool takes everything older first. While the spool is full the
+  // backlog waits in the buffer and the newest frame is published as a copy, once, releasing nothing: it is sent
+  // again on the backfill topic in turn. Not while the M4 may be coalescing the buffer.
+  const unsigned int unsent = dataFrameCount(head, liveSendIndex);
+  const unsigned int newestIndex = (head + dataFrameCapacity - 1) % dataFrameCapacity;
+  const bool liveCopy = spoolFull && unsent > 1 &&
+                        dataFrameCount(head, readFrameIndex(&data_frame_buffer_sdram->tail)) + 1 < dataFrameCapacity - 1 &&
+                        data_frame_buffer_sdram->frames[newestIndex].frameNumber != liveCopyFrameNumber;
+  const bool framesHeld = (long)(millis() - framesHeldUntil) < 0;
+  const bool live = canPublish && !urgent && !framesHeld && (unsent == 1 || liveCopy) && !blocksOnly();
+  const bool edgeBatchSend = canPublish && !urgent && !live && edges;
+  const bool backfill = canPublish && !urgent && !framesHeld && !live && !edgeBatchSend && backfillWaiting &&
+                        (blocksOnly() || backfillTokenWait() == 0);
+
+  if (urgent)
+  {
+    if (publishUrgentEvent(&event))
+    {
+      dropUrgentEvent();
+    }
+  }
+  else if (edgeBatchSend)
+  {
+    publishEdgeBatch();
+  }
+  else if (live || backfill)
   {
     digitalWrite(LEDB, 1);
     setDeviceState(STATE_PUBLISHING);
-    // Get the tail position (oldest frame)
-    unsigned int readIndex = data_frame_buffer_sdram->tail;
-
-    // Copy data from volatile SDRAM (field by field to avoid volatile assignment issues)
-    DATA_FRAME_SEND dataFromM4;
-    dataFromM4.userButtonCount = data_frame_buffer_sdram->frames[readIndex].userButtonCount;
-    dataFromM4.input1Count = data_frame_buffer_sdram->frames[readIndex].input1Count;
-    dataFromM4.input2Count = data_frame_buffer_sdram->frames[readIndex].input2Count;
-    dataFromM4.input3Count = data_frame_buffer_sdram->frames[readIndex].input3Count;
-    dataFromM4.input4Count = data_frame_buffer_sdram->frames[readIndex].input4Count;
-    dataFromM4.input5Count = data_frame_buffer_sdram->frames[readIndex].input5Count;
-    dataFromM4.input6Count = data_frame_buffer_sdram->frames[readIndex].input6Count;
-    dataFromM4.userButtonState = data_frame_buffer_sdram->frames[readIndex].userButtonState;
-    dataFromM4.input1State = data_frame_buffer_sdram->frames[readIndex].input1State;
-    dataFromM4.input2State = data_frame_buffer_sdram->frames[readIndex].input2State;
-    dataFromM4.input3State = data_frame_buffer_sdram->frames[readIndex].input3State;
-    dataFromM4.input4State = data_frame_buffer_sdram->frames[readIndex].input4State;
-    dataFromM4.input5State = data_frame_buffer_sdram->frames[readIndex].input5State;
-    dataFromM4.input6State = data_frame_buffer_sdram->frames[readIndex].input6State;
-    dataFromM4.input7Analog = data_frame_buffer_sdram->frames[readIndex].input7Analog;
-    dataFromM4.input8Analog = data_frame_buffer_sdram->frames[readIndex].input8Analog;
-
-    // Move tail forward and decrement count
-    data_frame_buffer_sdram->tail = (data_frame_buffer_sdram->tail + 1) % DATA_FRAME_BUFFER_SIZE;
-    data_frame_buffer_sdram->count--;
-
-    // Clean cache to make buffer updates visible to M4
-    cleanSharedMemoryCache();
 
-    // Get Wifi strength
-    int32_t rssi = -1;
-    if (communicationMode == WIFI)
+    if (live)
     {
-      rssi = WiFi.RSSI();
-    }
-
-    char topic[128] = {0};
-    char message[2056] = {0};
+      // Copy the newest frame from shared memory. It stays in the buffer until it has been delivered.
+      DATA_FRAME_SEND dataFromM4;
+      copyDataFrame(&dataFromM4, &data_frame_buffer_sdram->frames[newestIndex]);
+      PublishStream stream = STREAM_OTHER;
+      if (unsent == 1)
+      {
+        setLiveSendIndex(head);
+        stream = STREAM_LIVE;
+      }
+      else
+      {
+        liveCopyFrameNumber = dataFromM4.frameNumber;
+      }
 
-    if (strlen(mqttTopicPrefix) > 0)
-    {
-      snprintf(topic, sizeof(topic), "%s/busroot/v2/dau/%s", mqttTopicPrefix, deviceId);
+      if (!publishFrame(&livePayloadEncoder, "", &dataFromM4, modbusDeviceCount > 0, stream))
+      {
+        rewindUndelivered();
+      }
     }
-    else
+    else if (blocksOnly() && spoolBlockNext == 0)
     {
-      snprintf(topic, sizeof(topic), "busroot/v2/dau/%s", deviceId);
-    }
-
-    // MODBUS
-    if (modbusDeviceCount == 0)
-    {
-      snprintf(message, sizeof(message), "{\"v\":\"%s\",\"rssi\":%d,\"cb\":%u,\"c1\":%u,\"c2\":%u,\"c3\":%u,\"c4\":%u,\"c5\":%u,\"c6\":%u,\"sb\":%u,\"s1\":%u,\"s2\":%u,\"s3\":%u,\"s4\":%u,\"s5\":%u,\"s6\":%u,\"a7\":%u,\"a8\":%u}",
-               VERSION,
-               rssi,
-               dataFromM4.userButtonCount,
-               dataFromM4.input1Count,
-               dataFromM4.input2Count,
-               dataFromM4.input3Count,
-               dataFromM4.input4Count,
-               dataFromM4.input5Count,
-               dataFromM4.input6Count,
-               dataFromM4.userButtonState,
-               dataFromM4.input1State,
-               dataFromM4.input2State,
-               dataFromM4.input3State,
-               dataFromM4.input4State,
-               dataFromM4.input5State,
-               dataFromM4.input6State,
-               dataFromM4.input7Analog,
-               dataFromM4.input8Analog);
+      // The whole block in one note, delivered (and dropped from the spool) as one. Notes only fill the
+      // Notecard's queue, the syncs pace the link, so the backfill bucket is not used.
+      spoolBlockNext = spoolBlockCount;
+      if (!queueFrameNote())
+      {
+        rewindUndelivered();
+      }
     }
     else
     {
-      // Temporarily remove support for multiple Modbus devices
-      const int i = 0;
-
-      // When changing address, need to perform a dummy request
-      // Not sure why this happens, but first request after address change always fails.
-      getModbusRegister(i + 1, 0x00);
-
-      const float p1Volts = getModbusRegister(i + 1, p1VoltsModbusAddress);
-      const float p2Volts = getModbusRegister(i + 1, p2VoltsModbusAddress);
-      const float p3Volts = getModbusRegister(i + 1, p3VoltsModbusAddress);
-      const float p1Amps = getModbusRegister(i + 1, p1AmpsModbusAddress);
-      const float p2Amps = getModbusRegister(i + 1, p2AmpsModbusAddress);
-      const float p3Amps = getModbusRegister(i + 1, p3AmpsModbusAddress);
-      const float pf = getModbusRegister(i + 1, pfModbusAddress);
-      const float kWh = getModbusRegister(i + 1, kWhModbusAddress);
-
-      snprintf(message, sizeof(message), "{\"v\":\"%s\",\"rssi\":%d,\"cb\":%u,\"c1\":%u,\"c2\":%u,\"c3\":%u,\"c4\":%u,\"c5\":%u,\"c6\":%u,\"sb\":%u,\"s1\":%u,\"s2\":%u,\"s3\":%u,\"s4\":%u,\"s5\":%u,\"s6\":%u,\"a7\":%u,\"a8\":%u,\"p1v%u\":%.4f,\"p2v%u\":%.4f,\"p3v%u\":%.4f,\"p1a%u\":%.4f,\"p2a%u\":%.4f,\"p3a%u\":%.4f,\"pf%u\":%.4f,\"kWh%u\":%.4f}",
-               VERSION,
-               rssi,
-               dataFromM4.userButtonCount,
-               dataFromM4.input1Count,
-               dataFromM4.input2Count,
-               dataFromM4.input3Count,
-               dataFromM4.input4Count,
-               dataFromM4.input5Count,
-               dataFromM4.input6Count,
-               dataFromM4.userButtonState,
-               dataFromM4.input1State,
-               dataFromM4.input2State,
-               dataFromM4.input3State,
-               dataFromM4.input4State,
-               dataFromM4.input5State,
-               dataFromM4.input6State,
-               dataFromM4.input7Analog,
-               dataFromM4.input8Analog,
-               i + 1, p1Volts,
-               i + 1, p2Volts,
-               i + 1, p3Volts,
-               i + 1, p1Amps,
-               i + 1, p2Amps,
-               i + 1, p3Amps,
-               i + 1, pf,
-               i + 1, kWh);
+      // Meter readings are only current, so they are not attached to old frames
+      const unsigned int index = spoolBlockNext++;
+      if (publishFrame(&backfillPayloadEncoder, "/backfill", &spoolBlock[index], false, STREAM_BACKFILL))
+      {
+        backfillTokens -= backfillTokenCost;
+      }
+      else
+      {
+        rewindUndelivered();
+      }
+    }
 
-      mbed::Watchdog::get_instance().kick();
+    // Small delay to make LED change visible even on fast connections, skipped while frames are waiting.
+    // Ends early when the M4 signals, so an urgent event raised meanwhile is not held up.
+    if (dataFrameCount(head, liveSendIndex) == 0 && !backfillWaiting)
+    {
+      waitForFrame(100);
     }
 
-    // Remove unnecessary trailing zeros.
-    String messageString = String(message);
-    messageString.replace(".0000", "");
-    messageString.toCharArray(message, 2056);
+    digitalWrite(LEDB, 0);
+    setDeviceState(STATE_RUNNING);
+  }
 
-    sendMessage(topic, message);
+  // Handles PUBACKs, which release frames through messageDelivered
+  if (mqttClient && !mqttLoop(mqttClient))
+  {
+    rewindUndelivered();
+  }
 
-    memset(topic, 0, sizeof(topic));
-    memset(message, 0, sizeof(message));
+  checkInputParametersAcknowledged();
+  checkSelfTest();
+  checkTransports();
+  checkNetworkLease();
+  checkNotecardSync();
 
-    delay(100); // small delay to make LED change visible even on fast connections.
+  // Staged firmware is put in place and takes over after the restart. Frames still in the buffer and spool
+  // survive it.
+  if (otaApplyAt != 0 && (long)(millis() - otaApplyAt) >= 0)
+  {
+    otaApplyAt = 0;
+    const OtaResult result = applyOta();
+    if (result == OTA_OK)
+    {
+      Serial.println("Restarting to apply firmware update");
+      HAL_NVIC_SystemReset();
+    }
+    for (int i = 0; i < OTA_TARGETS; i++)
+    {
+      publishOtaStatus((OtaTarget)i, result);
+    }
+  }
 
-    digitalWrite(LEDB, 0);
-    setDeviceState(STATE_RUNNING);
+  // Controlled restart for config changes that cannot be applied while running
+  if (restartAt != 0 && (long)(millis() - restartAt) >= 0)
+  {
+    Serial.println("Restarting to apply config");
+    HAL_NVIC_SystemReset();
   }
 
-  if (mqttClient)
+  // Nothing to send now - sleep until the M4 signals, a backfill token is due or the edge batch is due,
+  // rather than polling
+  if (!urgent && !live && !edgeBatchSend && !backfill)
   {
-    mqttClient->loop();
+    unsigned long timeout = backfillWaiting ? min(frameWaitTimeout, backfillTokenWait()) : frameWaitTimeout;
+    if (edgeBatch.count > 0)
+    {
+      timeout = min(timeout, edgeBatchInterval - min(millis() - edgeBatch.startedAt, edgeBatchInterval));
+    }
+    if (mqttClient && mqttInflightCount(mqttClient) > 0)
+    {
+      timeout = min(timeout, acknowledgementPollInterval);
+    }
+    if (!connected)
+    {
+      timeout = min(timeout, (unsigned long)max((long)(reconnectAt - millis()), 0L));
+    }
+
+    const unsigned long sleepStart = micros();
+    waitForFrame(timeout);
+    addSleepTime(micros() - sleepStart);
   }
 
   mbed::Watchdog::get_instance().kick();
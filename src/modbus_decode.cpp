@@ -0,0 +1,18 @@
+#include "modbus_decode.h"
+
+float decodeModbusValue(uint16_t first, uint16_t second, int style)
+{
+  if (style == MODBUS_STYLE_IEEE_FLOAT)
+  {
+    const uint32_t bits = (uint32_t)first << 16 | second;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  else if (style == MODBUS_STYLE_UINT32_LSW)
+  {
+    return (float)((uint32_t)second << 16 | first);
+  }
+
+  return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef MODBUS_DECODE_H
+#define MODBUS_DECODE_H
+
+#include <Arduino.h>
+
+// Word orders of a 32 bit meter value read as two input registers, the modbusRegisterStyle config
+enum ModbusRegisterStyle
+{
+  MODBUS_STYLE_IEEE_FLOAT = 0, // IEEE754 float, high word first (RS-Pro)
+  MODBUS_STYLE_UINT32_LSW = 1  // Unsigned integer, low word first (Carlo Gavazzi)
+};
+
+// Value of a register pair in the order read. Returns -1 for an unknown style, as for a failed request.
+float decodeModbusValue(uint16_t first, uint16_t second, int style);
+
+#endif // MODBUS_DECODE_H
@@ -0,0 +1,873 @@
+#include "mqtt_client.h"
+
+// Control packet types (first byte, high nibble)
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82 // Reserved flag bits set as required
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_PUBLISH_DUP 0x08
+#define MQTT_PUBLISH_QOS1 0x02
+
+// MQTT 5 properties used here
+#define MQTT_PROPERTY_MESSAGE_EXPIRY 0x02
+#define MQTT_PROPERTY_SESSION_EXPIRY 0x11
+#define MQTT_PROPERTY_SERVER_KEEP_ALIVE 0x13
+#define MQTT_PROPERTY_RECEIVE_MAXIMUM 0x21
+#define MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM 0x22
+#define MQTT_PROPERTY_TOPIC_ALIAS 0x23
+#define MQTT_PROPERTY_MAXIMUM_QOS 0x24
+#define MQTT_PROPERTY_MAXIMUM_PACKET_SIZE 0x27
+
+// Most a PUBLISH adds around topic and payload: topic length, packet ID and with MQTT 5 the property length,
+// topic alias and message expiry
+#define MQTT_PUBLISH_OVERHEAD (2 + 2 + 1 + 3 + 5)
+
+// How long to wait for the CONNACK
+#define MQTT_CONNECT_TIMEOUT 5000
+
+// Largest fixed header: type byte and a 4 byte remaining length
+#define MQTT_MAX_HEADER 5
+
+static MQTT_INFLIGHT *inflightAt(MQTT_CLIENT *client, unsigned int position)
+{
+  return &client->inflight[(client->inflightFirst + position) % MQTT_MAX_INFLIGHT];
+}
+
+// Write the fixed header for a packet whose variable header and payload start at data[MQTT_MAX_HEADER], moving
+// it up against them. Returns the offset the packet starts at.
+static size_t writeFixedHeader(uint8_t *data, uint8_t type, size_t remaining)
+{
+  uint8_t length[4];
+  size_t digits = 0;
+  do
+  {
+    length[digits] = remaining % 128;
+    remaining /= 128;
+    if (remaining > 0)
+    {
+      length[digits] |= 0x80;
+    }
+    digits++;
+  } while (remaining > 0 && digits < 4);
+
+  const size_t start = MQTT_MAX_HEADER - 1 - digits;
+  data[start] = type;
+  memcpy(&data[start + 1], length, digits);
+  return start;
+}
+
+// Variable byte integer as used for lengths. Returns the new position.
+static size_t writeVariableInt(uint8_t *data, size_t position, uint32_t value)
+{
+  do
+  {
+    data[position] = value % 128;
+    value /= 128;
+    if (value > 0)
+    {
+      data[position] |= 0x80;
+    }
+    position++;
+  } while (value > 0);
+  return position;
+}
+
+// Returns false if the integer is malformed or runs past end
+static bool readVariableInt(const uint8_t *data, size_t *position, size_t end, uint32_t *value)
+{
+  *value = 0;
+  for (unsigned int i = 0; i < 4 && *position < end; i++)
+  {
+    const uint8_t digit = data[(*position)++];
+    *value |= (uint32_t)(digit & 0x7F) << (7 * i);
+    if (!(digit & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t readInt(const uint8_t *data, size_t position, size_t bytes)
+{
+  uint32_t value = 0;
+  for (size_t i = 0; i < bytes; i++)
+  {
+    value = (value << 8) | data[position + i];
+  }
+  return value;
+}
+
+// Bytes taken by the value of a property starting at position, 0 if the property is unknown or runs past end
+static size_t propertyValueSize(uint8_t id, const uint8_t *data, size_t position, size_t end)
+{
+  size_t size = 0;
+  switch (id)
+  {
+  case 0x01: // Payload format indicator
+  case 0x17: // Request problem information
+  case 0x19: // Request response information
+  case 0x24: // Maximum QoS
+  case 0x25: // Retain available
+  case 0x28: // Wildcard subscription available
+  case 0x29: // Subscription identifiers available
+  case 0x2A: // Shared subscription available
+    size = 1;
+    break;
+  case 0x13: // Server keep alive
+  case 0x21: // Receive maximum
+  case 0x22: // Topic alias maximum
+  case 0x23: // Topic alias
+    size = 2;
+    break;
+  case 0x02: // Message expiry interval
+  case 0x11: // Session expiry interval
+  case 0x18: // Will delay interval
+  case 0x27: // Maximum packet size
+    size = 4;
+    break;
+  case 0x0B: // Subscription identifier
+  {
+    size_t after = position;
+    uint32_t value;
+    size = readVariableInt(data, &after, end, &value) ? after - position : 0;
+    break;
+  }
+  case 0x03: // Content type
+  case 0x08: // Response topic
+  case 0x09: // Correlation data
+  case 0x12: // Assigned client identifier
+  case 0x15: // Authentication method
+  case 0x16: // Authentication data
+  case 0x1A: // Response information
+  case 0x1C: // Server reference
+  case 0x1F: // Reason string
+    size = position + 2 <= end ? 2 + readInt(data, position, 2) : 0;
+    break;
+  case 0x26: // User property, a pair of strings
+    if (position + 2 <= end)
+    {
+      const size_t first = 2 + readInt(data, position, 2);
+      size = position + first + 2 <= end ? first + 2 + readInt(data, position + first, 2) : 0;
+    }
+    break;
+  }
+  return position + size <= end ? size : 0;
+}
+
+static size_t writeString(uint8_t *data, size_t position, const char *text, size_t length)
+{
+  data[position++] = length >> 8;
+  data[position++] = length & 0xFF;
+  memcpy(&data[position], text, length);
+  return position + length;
+}
+
+static void connectionLost(MQTT_CLIENT *client, int state)
+{
+  client->transport->stop();
+  client->state = state;
+  client->receivedLength = 0;
+  client->receivedTotal = 0;
+}
+
+static bool writePacket(MQTT_CLIENT *client, const uint8_t *data, size_t length)
+{
+  if (client->transport->write(data, length) != length)
+  {
+    connectionLost(client, MQTT_CONNECTION_LOST);
+    return false;
+  }
+  client->lastOutbound = millis();
+  return true;
+}
+
+// Send a packet built in client->outbound from MQTT_MAX_HEADER on
+static bool sendOutbound(MQTT_CLIENT *client, uint8_t type, size_t end)
+{
+  const size_t start = writeFixedHeader(client->outbound, type, end - MQTT_MAX_HEADER);
+  return writePacket(client, &client->outbound[start], end - start);
+}
+
+static bool sendPacketId(MQTT_CLIENT *client, uint8_t type, uint16_t packetId)
+{
+  const uint8_t packet[4] = {type, 2, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF)};
+  return writePacket(client, packet, sizeof(packet));
+}
+
+// Hand back acknowledged messages from the oldest, stopping at the first one still waiting
+static void releaseAcknowledged(MQTT_CLIENT *client)
+{
+  while (client->inflightCount > 0 && inflightAt(client, 0)->acknowledged)
+  {
+    const uint32_t tag = inflightAt(client, 0)->tag;
+    const uint8_t reason = inflightAt(client, 0)->reason;
+    client->inflightFirst = (client->inflightFirst + 1) % MQTT_MAX_INFLIGHT;
+    client->inflightCount--;
+
+    if (reason >= MQTT_REASON_FAILURE && client->refusedCallback)
+    {
+      client->refusedCallback(tag, reason);
+    }
+    else if (client->acknowledgedCallback)
+    {
+      client->acknowledgedCallback(tag);
+    }
+  }
+}
+
+static void handlePublish(MQTT_CLIENT *client, const uint8_t *packet, size_t header, size_t total)
+{
+  const uint8_t qos = (packet[0] >> 1) & 0x03;
+
+  size_t position = header;
+  const size_t topicLength = (packet[position] << 8) | packet[position + 1];
+  position += 2;
+  if (position + topicLength > total)
+  {
+    return;
+  }
+
+  // Our topics are all shorter than this, a longer one cannot match a subscription anyway
+  char topic[160];
+  const size_t copied = min(topicLength, sizeof(topic) - 1);
+  memcpy(topic, &packet[position], copied);
+  topic[copied] = '\0';
+  position += topicLength;
+
+  uint16_t packetId = 0;
+  if (qos > 0)
+  {
+    if (position + 2 > total)
+    {
+      return;
+    }
+    packetId = (packet[position] << 8) | packet[position + 1];
+    position += 2;
+  }
+
+  // No topic aliases were offered to the broker, so the properties hold nothing needed here
+  if (client->version == MQTT_VERSION_5)
+  {
+    uint32_t propertiesLength;
+    if (!readVariableInt(packet, &position, total, &propertiesLength) || position + propertiesLength > total)
+    {
+      return;
+    }
+    position += propertiesLength;
+  }
+
+  // Acknowledge first, the callback may take a while (e.g. saving config to flash)
+  if (qos == 1 && !sendPacketId(client, MQTT_PUBACK, packetId))
+  {
+    return;
+  }
+
+  if (client->messageCallback)
+  {
+    client->messageCallback(topic, client->received + position, total - position);
+  }
+}
+
+// Take the broker's limits from the CONNACK properties
+static void handleConnackProperties(MQTT_CLIENT *client, const uint8_t *packet, size_t position, size_t total)
+{
+  uint32_t propertiesLength;
+  if (!readVariableInt(packet, &position, total, &propertiesLength) || position + propertiesLength > total)
+  {
+    return;
+  }
+
+  const size_t end = position + propertiesLength;
+  while (position < end)
+  {
+    const uint8_t id = packet[position++];
+    const size_t size = propertyValueSize(id, packet, position, end);
+    if (size == 0)
+    {
+      return;
+    }
+
+    const uint32_t value = size <= 4 ? readInt(packet, position, size) : 0;
+    switch (id)
+    {
+    case MQTT_PROPERTY_RECEIVE_MAXIMUM:
+      client->receiveMaximum = value;
+      break;
+    case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+      client->topicAliasMaximum = value;
+      break;
+    case MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+      client->maximumPacketSize = value;
+      break;
+    case MQTT_PROPERTY_MAXIMUM_QOS:
+      client->maximumQos = value;
+      break;
+    case MQTT_PROPERTY_SERVER_KEEP_ALIVE:
+      // The broker's keep alive replaces ours, it is also what the next CONNECT asks for
+      client->keepAlive = value;
+      break;
+    }
+    position += size;
+  }
+}
+
+static void handlePacket(MQTT_CLIENT *client, size_t header, size_t total)
+{
+  const uint8_t *packet = client->received;
+
+  switch (packet[0] & 0xF0)
+  {
+  case MQTT_CONNACK:
+    if (total >= header + 2)
+    {
+      client->sessionPresent = packet[header] & 0x01;
+      client->state = packet[header + 1] == 0 ? MQTT_CONNECTED : packet[header + 1];
+      if (client->version == MQTT_VERSION_5 && client->state == MQTT_CONNECTED)
+      {
+        handleConnackProperties(client, packet, header + 2, total);
+      }
+    }
+    break;
+  case MQTT_PUBLISH:
+    handlePublish(client, packet, header, total);
+    break;
+  case MQTT_PUBACK:
+    // An MQTT 5 reason code may follow, none means success
+    if (total >= header + 2)
+    {
+      const uint16_t packetId = (packet[header] << 8) | packet[header + 1];
+      const uint8_t reason = total >= header + 3 ? packet[header + 2] : 0;
+      for (unsigned int i = 0; i < client->inflightCount; i++)
+      {
+        MQTT_INFLIGHT *message = inflightAt(client, i);
+        if (message->packetId == packetId)
+        {
+          message->acknowledged = true;
+          message->reason = reason;
+          if (reason >= MQTT_REASON_FAILURE)
+          {
+            client->refusedCount++;
+            client->lastRefusedReason = reason;
+          }
+          break;
+        }
+      }
+      releaseAcknowledged(client);
+    }
+    break;
+  case MQTT_PINGRESP:
+    client->pingOutstanding = false;
+    break;
+  case MQTT_DISCONNECT:
+    // Only sent by an MQTT 5 broker, e.g. when it shuts down or takes over the session for another connection
+    connectionLost(client, MQTT_CONNECTION_LOST);
+    break;
+  default:
+    // SUBACK and anything unexpected
+    break;
+  }
+}
+
+// Read whatever has arrived, handling each complete packet. Packets too large for the buffer are skipped.
+static void readPackets(MQTT_CLIENT *client)
+{
+  while (client->state == MQTT_CONNECTED || client->state == MQTT_DISCONNECTED)
+  {
+    if (client->transport->available() <= 0)
+    {
+      return;
+    }
+
+    const int value = client->transport->read();
+    if (value < 0)
+    {
+      return;
+    }
+    client->lastInbound = millis();
+
+    if (client->receivedLength < sizeof(client->received))
+    {
+      client->received[client->receivedLength] = value;
+    }
+    client->receivedLength++;
+
+    // Work out the full length once the remaining length is complete (its last byte has no continuation bit)
+    size_t header = 0;
+    if (client->receivedTotal == 0 && client->receivedLength >= 2 && !(value & 0x80))
+    {
+      size_t remaining = 0;
+      for (size_t i = 1; i < client->receivedLength && i < MQTT_MAX_HEADER; i++)
+      {
+        remaining |= (size_t)(client->received[i] & 0x7F) << (7 * (i - 1));
+      }
+      client->receivedTotal = client->receivedLength + remaining;
+    }
+    else if (client->receivedTotal == 0 && client->receivedLength >= MQTT_MAX_HEADER)
+    {
+      // Malformed remaining length
+      connectionLost(client, MQTT_CONNECTION_LOST);
+      return;
+    }
+
+    if (client->receivedTotal != 0 && client->receivedLength == client->receivedTotal)
+    {
+      for (header = 1; client->received[header] & 0x80; header++)
+      {
+      }
+      header++;
+
+      if (client->receivedTotal <= sizeof(client->received))
+      {
+        handlePacket(client, header, client->receivedTotal);
+      }
+      client->receivedLength = 0;
+      client->receivedTotal = 0;
+    }
+  }
+}
+
+// Index of a topic in the alias table, adding it if there is room. -1 if it must always be sent in full.
+static int findTopic(MQTT_CLIENT *client, const char *topic)
+{
+  if (client->version != MQTT_VERSION_5)
+  {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < client->topicCount; i++)
+  {
+    if (strcmp(client->topics[i], topic) == 0)
+    {
+      return i;
+    }
+  }
+
+  if (client->topicCount == MQTT_MAX_TOPICS || strlen(topic) >= MQTT_MAX_TOPIC_LENGTH)
+  {
+    return -1;
+  }
+  strcpy(client->topics[client->topicCount], topic);
+  return client->topicCount++;
+}
+
+// Build a PUBLISH in data, starting at offset 0. A topic in the alias table is named only on the first
+// message that uses its alias on this connection. packetId 0 means QoS 0. The caller has checked the packet
+// fits with MQTT_PUBLISH_OVERHEAD. Returns the packet length.
+static size_t buildPublish(MQTT_CLIENT *client, uint8_t *data, const char *topic, int topicIndex, uint16_t packetId,
+                           const uint8_t *payload, size_t length, size_t *payloadOffset)
+{
+  const bool alias = topicIndex >= 0 && (unsigned int)topicIndex < client->topicAliasMaximum;
+  const bool named = !alias || !(client->aliasSent & (1UL << topicIndex));
+
+  size_t position = named ? writeString(data, MQTT_MAX_HEADER, topic, strlen(topic))
+                          : writeString(data, MQTT_MAX_HEADER, "", 0);
+  if (packetId != 0)
+  {
+    data[position++] = packetId >> 8;
+    data[position++] = packetId & 0xFF;
+  }
+
+  if (client->version == MQTT_VERSION_5)
+  {
+    uint8_t properties[8];
+    size_t propertiesLength = 0;
+    if (alias)
+    {
+      properties[propertiesLength++] = MQTT_PROPERTY_TOPIC_ALIAS;
+      properties[propertiesLength++] = 0;
+      properties[propertiesLength++] = topicIndex + 1;
+      client->aliasSent |= 1UL << topicIndex;
+    }
+    if (client->messageExpiry > 0)
+    {
+      properties[propertiesLength++] = MQTT_PROPERTY_MESSAGE_EXPIRY;
+      for (int shift = 24; shift >= 0; shift -= 8)
+      {
+        properties[propertiesLength++] = (client->messageExpiry >> shift) & 0xFF;
+      }
+    }
+    position = writeVariableInt(data, position, propertiesLength);
+    memcpy(&data[position], properties, propertiesLength);
+    position += propertiesLength;
+  }
+
+  memcpy(&data[position], payload, length);
+  position += length;
+
+  const size_t start = writeFixedHeader(data, MQTT_PUBLISH | (packetId != 0 ? MQTT_PUBLISH_QOS1 : 0),
+                                        position - MQTT_MAX_HEADER);
+  memmove(data, &data[start], position - start);
+  *payloadOffset = position - length - start;
+  return position - start;
+}
+
+void mqttInit(MQTT_CLIENT *client, Client *transport, const char *host, uint16_t port, uint16_t keepAlive,
+              unsigned int window, MqttMessageCallback messageCallback, MqttAcknowledgedCallback acknowledgedCallback)
+{
+  client->transport = transport;
+  client->host = host;
+  client->port = port;
+  client->keepAlive = keepAlive;
+  client->window = constrain(window, 1U, (unsigned int)MQTT_MAX_INFLIGHT);
+  client->messageCallback = messageCallback;
+  client->acknowledgedCallback = acknowledgedCallback;
+  client->refusedCallback = nullptr;
+  client->version = MQTT_VERSION_3_1_1;
+  client->sessionExpiry = 0;
+  client->messageExpiry = 0;
+  client->sessionPresent = false;
+  client->receiveMaximum = 0xFFFF;
+  client->topicAliasMaximum = 0;
+  client->maximumPacketSize = 0;
+  client->maximumQos = 1;
+  client->topicCount = 0;
+  client->aliasSent = 0;
+  client->state = MQTT_DISCONNECTED;
+  client->nextPacketId = 1;
+  client->pingOutstanding = false;
+  client->refusedCount = 0;
+  client->lastRefusedReason = 0;
+  client->inflightFirst = 0;
+  client->inflightCount = 0;
+  client->receivedLength = 0;
+  client->receivedTotal = 0;
+}
+
+void mqttUseVersion5(MQTT_CLIENT *client, uint32_t sessionExpiry, uint32_t messageExpiry)
+{
+  client->version = MQTT_VERSION_5;
+  client->sessionExpiry = sessionExpiry;
+  client->messageExpiry = messageExpiry;
+}
+
+void mqttOnRefused(MQTT_CLIENT *client, MqttRefusedCallback refusedCallback)
+{
+  client->refusedCallback = refusedCallback;
+}
+
+bool mqttConnect(MQTT_CLIENT *client, const char *clientId, const char *username, const char *password)
+{
+  if (mqttConnected(client))
+  {
+    return true;
+  }
+
+  client->receivedLength = 0;
+  client->receivedTotal = 0;
+  client->pingOutstanding = false;
+
+  // Defaults until the CONNACK says otherwise. Topic aliases only last for one connection.
+  client->sessionPresent = false;
+  client->receiveMaximum = 0xFFFF;
+  client->topicAliasMaximum = 0;
+  client->maximumPacketSize = 0;
+  client->maximumQos = 1;
+  client->aliasSent = 0;
+
+  if (!client->transport->connect(client->host, client->port))
+  {
+    client->state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+
+  const size_t usernameLength = username ? strlen(username) : 0;
+  const size_t passwordLength = password ? strlen(password) : 0;
+  const size_t clientIdLength = strlen(clientId);
+  if (MQTT_MAX_HEADER + 10 + 6 + 6 + clientIdLength + usernameLength + passwordLength > sizeof(client->outbound))
+  {
+    connectionLost(client, MQTT_CONNECT_FAILED);
+    return false;
+  }
+
+  // Clean session, or with MQTT 5 and a session expiry resume the broker's session if it still has one
+  uint8_t flags = client->version == MQTT_VERSION_5 && client->sessionExpiry > 0 ? 0x00 : 0x02;
+  if (usernameLength > 0)
+  {
+    flags |= 0x80;
+  }
+  if (passwordLength > 0)
+  {
+    flags |= 0x40;
+  }
+
+  uint8_t *data = client->outbound;
+  size_t position = writeString(data, MQTT_MAX_HEADER, "MQTT", 4);
+  data[position++] = client->version;
+  data[position++] = flags;
+  data[position++] = client->keepAlive >> 8;
+  data[position++] = client->keepAlive & 0xFF;
+  if (client->version == MQTT_VERSION_5)
+  {
+    if (client->sessionExpiry > 0)
+    {
+      data[position++] = 5;
+      data[position++] = MQTT_PROPERTY_SESSION_EXPIRY;
+      for (int shift = 24; shift >= 0; shift -= 8)
+      {
+        data[position++] = (client->sessionExpiry >> shift) & 0xFF;
+      }
+    }
+    else
+    {
+      data[position++] = 0;
+    }
+  }
+  position = writeString(data, position, clientId, clientIdLength);
+  if (usernameLength > 0)
+  {
+    position = writeString(data, position, username, usernameLength);
+  }
+  if (passwordLength > 0)
+  {
+    position = writeString(data, position, password, passwordLength);
+  }
+
+  // Incoming packets are only handled while DISCONNECTED or CONNECTED, the CONNACK moves the state on
+  client->state = MQTT_DISCONNECTED;
+  if (!sendOutbound(client, MQTT_CONNECT, position))
+  {
+    return false;
+  }
+
+  const unsigned long start = millis();
+  while (client->state == MQTT_DISCONNECTED)
+  {
+    if (millis() - start >= MQTT_CONNECT_TIMEOUT)
+    {
+      connectionLost(client, MQTT_CONNECTION_TIMEOUT);
+      return false;
+    }
+    if (!client->transport->connected())
+    {
+      connectionLost(client, MQTT_CONNECTION_LOST);
+      return false;
+    }
+    readPackets(client);
+    delay(1);
+  }
+
+  if (client->state != MQTT_CONNECTED)
+  {
+    connectionLost(client, client->state);
+    return false;
+  }
+  client->lastInbound = millis();
+
+  // Repeat whatever the broker may not have received before the connection dropped. Messages sent with a topic
+  // alias are rebuilt, as the alias died with the old connection.
+  for (unsigned int i = 0; i < client->inflightCount; i++)
+  {
+    MQTT_INFLIGHT *message = inflightAt(client, i);
+    if (!message->acknowledged)
+    {
+      if (message->topic >= 0)
+      {
+        const size_t length = buildPublish(client, client->outbound, client->topics[message->topic], message->topic,
+                                           message->packetId, &message->packet[message->payloadOffset],
+                                           message->length - message->payloadOffset, &message->payloadOffset);
+        memcpy(message->packet, client->outbound, length);
+        message->length = length;
+      }
+      message->packet[0] |= MQTT_PUBLISH_DUP;
+      if (!writePacket(client, message->packet, message->length))
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool mqttSessionResumed(const MQTT_CLIENT *client)
+{
+  return client->sessionPresent;
+}
+
+bool mqttConnected(MQTT_CLIENT *client)
+{
+  if (client->state == MQTT_CONNECTED && !client->transport->connected())
+  {
+    connectionLost(client, MQTT_CONNECTION_LOST);
+  }
+  return client->state == MQTT_CONNECTED;
+}
+
+void mqttDisconnect(MQTT_CLIENT *client)
+{
+  if (mqttConnected(client))
+  {
+    const uint8_t packet[2] = {MQTT_DISCONNECT, 0};
+    writePacket(client, packet, sizeof(packet));
+  }
+  client->transport->stop();
+  client->state = MQTT_DISCONNECTED;
+}
+
+bool mqttSubscribe(MQTT_CLIENT *client, const char *topic)
+{
+  const size_t topicLength = strlen(topic);
+  if (!mqttConnected(client) || MQTT_MAX_HEADER + 2 + 1 + 2 + topicLength + 1 > sizeof(client->outbound))
+  {
+    return false;
+  }
+
+  const uint16_t packetId = client->nextPacketId;
+  client->nextPacketId = client->nextPacketId == 0xFFFF ? 1 : client->nextPacketId + 1;
+
+  uint8_t *data = client->outbound;
+  size_t position = MQTT_MAX_HEADER;
+  data[position++] = packetId >> 8;
+  data[position++] = packetId & 0xFF;
+  if (client->version == MQTT_VERSION_5)
+  {
+    data[position++] = 0; // No properties
+  }
+  position = writeString(data, position, topic, topicLength);
+  data[position++] = 1; // Requested QoS
+
+  return sendOutbound(client, MQTT_SUBSCRIBE, position);
+}
+
+bool mqttCanPublish(MQTT_CLIENT *client, uint8_t qos)
+{
+  const unsigned int window = min(client->window, (unsigned int)client->receiveMaximum);
+  return mqttConnected(client) && (qos == 0 || client->maximumQos == 0 || client->inflightCount < window);
+}
+
+bool mqttPublish(MQTT_CLIENT *client, const char *topic, const uint8_t *payload, size_t length, uint8_t qos, uint32_t tag)
+{
+  // Sized for the full topic name even when an alias is used, so the message can always be rebuilt with it
+  const size_t topicLength = strlen(topic);
+  const size_t largest = MQTT_MAX_HEADER + MQTT_PUBLISH_OVERHEAD + topicLength + length;
+  if (!mqttCanPublish(client, qos) || largest > MQTT_MAX_PACKET_SIZE ||
+      (client->maximumPacketSize > 0 && largest > client->maximumPacketSize))
+  {
+    return false;
+  }
+
+  MQTT_INFLIGHT *message = qos > 0 && client->maximumQos > 0 ? inflightAt(client, client->inflightCount) : nullptr;
+  const int topicIndex = findTopic(client, topic);
+  size_t payloadOffset;
+
+  if (!message)
+  {
+    const size_t packetLength = buildPublish(client, client->outbound, topic, topicIndex, 0, payload, length, &payloadOffset);
+    if (!writePacket(client, client->outbound, packetLength))
+    {
+      return false;
+    }
+    if (client->acknowledgedCallback)
+    {
+      client->acknowledgedCallback(tag);
+    }
+    return true;
+  }
+
+  // Skip IDs still waiting for a PUBACK, the window is far smaller than the ID space so this ends quickly
+  uint16_t packetId;
+  bool inUse;
+  do
+  {
+    packetId = client->nextPacketId;
+    client->nextPacketId = client->nextPacketId == 0xFFFF ? 1 : client->nextPacketId + 1;
+    inUse = false;
+    for (unsigned int i = 0; i < client->inflightCount; i++)
+    {
+      inUse = inUse || inflightAt(client, i)->packetId == packetId;
+    }
+  } while (inUse);
+
+  // The packet starts at offset 0 so it can be sent again as it is
+  message->length = buildPublish(client, message->packet, topic, topicIndex, packetId, payload, length, &payloadOffset);
+  message->payloadOffset = payloadOffset;
+  message->topic = topicIndex;
+  message->packetId = packetId;
+  message->acknowledged = false;
+  message->reason = 0;
+  message->tag = tag;
+  client->inflightCount++;
+
+  // Once queued the message is ours to deliver, if the write fails it is sent again after the next connect
+  writePacket(client, message->packet, message->length);
+  return true;
+}
+
+bool mqttLoop(MQTT_CLIENT *client)
+{
+  if (!mqttConnected(client))
+  {
+    return false;
+  }
+
+  readPackets(client);
+  if (client->state != MQTT_CONNECTED)
+  {
+    return false;
+  }
+
+  // Same keep alive rule as PubSubClient: ping when either direction has been quiet for the keep alive
+  // interval, and give up if the previous ping was never answered
+  const unsigned long now = millis();
+  const unsigned long interval = client->keepAlive * 1000UL;
+  if (interval > 0 && (now - client->lastInbound >= interval || now - client->lastOutbound >= interval))
+  {
+    if (client->pingOutstanding)
+    {
+      connectionLost(client, MQTT_CONNECTION_TIMEOUT);
+      return false;
+    }
+
+    const uint8_t packet[2] = {MQTT_PINGREQ, 0};
+    if (!writePacket(client, packet, sizeof(packet)))
+    {
+      return false;
+    }
+    client->lastInbound = now;
+    client->pingOutstanding = true;
+  }
+
+  return true;
+}
+
+unsigned int mqttInflightCount(const MQTT_CLIENT *client)
+{
+  return client->inflightCount;
+}
+
+void mqttDiscardInflight(MQTT_CLIENT *client, uint32_t tag)
+{
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < client->inflightCount; i++)
+  {
+    MQTT_INFLIGHT *message = inflightAt(client, i);
+    if (message->tag == tag)
+    {
+      continue;
+    }
+    if (kept != i)
+    {
+      MQTT_INFLIGHT *destination = inflightAt(client, kept);
+      destination->packetId = message->packetId;
+      destination->acknowledged = message->acknowledged;
+      destination->reason = message->reason;
+      destination->tag = message->tag;
+      destination->topic = message->topic;
+      destination->payloadOffset = message->payloadOffset;
+      destination->length = message->length;
+      memcpy(destination->packet, message->packet, message->length);
+    }
+    kept++;
+  }
+  client->inflightCount = kept;
+
+  // Messages that were only waiting behind a discarded one can be handed back now
+  releaseAcknowledged(client);
+}
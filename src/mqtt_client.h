@@ -0,0 +1,148 @@
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Minimal MQTT 3.1.1 / 5 client with pipelined QoS 1 publishing. Up to window PUBLISH packets may be waiting
+// for their PUBACK at once, so throughput is not bound by the round trip time. Every publish carries a tag
+// that is handed back through the acknowledged callback once the broker has taken the message (straight
+// away for QoS 0), always in publish order, so the caller releases the data behind a message only once it
+// has been delivered. Messages still unacknowledged when the connection drops are sent again with the DUP
+// flag after the next connect, unless the caller discards them first. A message an MQTT 5 broker refuses in its
+// PUBACK (reason code 0x80 or above, e.g. 0x97 quota exceeded) is handed back in the same order through the
+// refused callback instead, if one is set, so the caller can publish it again later.
+//
+// With MQTT 5 each topic is given a topic alias, so only its first message on a connection carries the topic
+// name. The session can outlive the connection (no need to subscribe again when the broker still has it), the
+// broker's receive maximum further limits the window and every message can carry an expiry interval.
+#define MQTT_MAX_PACKET_SIZE 2560
+#define MQTT_MAX_INFLIGHT 16
+
+// Topics remembered for aliases, further topics are always sent in full
+#define MQTT_MAX_TOPICS 8
+#define MQTT_MAX_TOPIC_LENGTH 128
+
+#define MQTT_VERSION_3_1_1 4
+#define MQTT_VERSION_5 5
+
+// Connection state, negative values are local failures, positive values the broker's CONNACK return code
+// (reason code with MQTT 5)
+#define MQTT_CONNECTION_TIMEOUT -4 // No response to a ping or to CONNECT
+#define MQTT_CONNECTION_LOST -3    // A read or write failed
+#define MQTT_CONNECT_FAILED -2     // The transport could not connect
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+// PUBACK reason codes from this one up mean the broker did not take the message
+#define MQTT_REASON_FAILURE 0x80
+
+typedef void (*MqttMessageCallback)(char *topic, uint8_t *payload, size_t length);
+typedef void (*MqttAcknowledgedCallback)(uint32_t tag);
+typedef void (*MqttRefusedCallback)(uint32_t tag, uint8_t reason);
+
+// A QoS 1 PUBLISH kept until its PUBACK arrives, as sent so it can be repeated after a reconnect
+struct MQTT_INFLIGHT
+{
+  uint16_t packetId;
+  bool acknowledged; // PUBACK received, waiting for older messages before it is handed back
+  uint8_t reason;    // The PUBACK's reason code, 0 (success) with MQTT 3.1.1
+  uint32_t tag;
+  int topic;            // Index in MQTT_CLIENT topics, -1 if the full topic name is in the packet
+  size_t payloadOffset; // Where the payload starts in packet, for rebuilding it after a reconnect
+  size_t length;
+  uint8_t packet[MQTT_MAX_PACKET_SIZE];
+};
+
+struct MQTT_CLIENT
+{
+  Client *transport;
+  const char *host;
+  uint16_t port;
+  uint16_t keepAlive;  // Seconds
+  unsigned int window; // QoS 1 messages that may wait for a PUBACK, 1 to MQTT_MAX_INFLIGHT
+  MqttMessageCallback messageCallback;
+  MqttAcknowledgedCallback acknowledgedCallback;
+  MqttRefusedCallback refusedCallback;
+
+  uint8_t version;        // MQTT_VERSION_3_1_1 or MQTT_VERSION_5
+  uint32_t sessionExpiry; // MQTT 5: seconds the broker keeps the session after a disconnect, 0 for a clean session
+  uint32_t messageExpiry; // MQTT 5: seconds the broker keeps each message for, 0 for no expiry
+
+  // Limits from the broker's CONNACK, reset on every connect
+  bool sessionPresent;         // The broker resumed the previous session, subscriptions included
+  uint16_t receiveMaximum;     // QoS 1 messages the broker will take before acknowledging any
+  uint16_t topicAliasMaximum;  // Highest topic alias the broker accepts
+  uint32_t maximumPacketSize;  // 0 if unlimited
+  uint8_t maximumQos;
+
+  // Topics seen so far, the alias of topic i is i + 1. aliasSent marks those named on the current connection.
+  char topics[MQTT_MAX_TOPICS][MQTT_MAX_TOPIC_LENGTH];
+  unsigned int topicCount;
+  uint32_t aliasSent;
+
+  int state;
+  uint16_t nextPacketId;
+  unsigned long lastInbound;
+  unsigned long lastOutbound;
+  bool pingOutstanding;
+
+  unsigned long refusedCount; // Messages refused in a PUBACK since mqttInit
+  uint8_t lastRefusedReason;
+
+  MQTT_INFLIGHT inflight[MQTT_MAX_INFLIGHT]; // Oldest first from inflightFirst
+  unsigned int inflightFirst;
+  unsigned int inflightCount;
+
+  uint8_t received[MQTT_MAX_PACKET_SIZE]; // Incoming packet being assembled
+  size_t receivedLength;
+  size_t receivedTotal;                   // Full length of the incoming packet once the header is complete
+  uint8_t outbound[MQTT_MAX_PACKET_SIZE]; // Control packets and QoS 0 messages being built
+};
+
+// Set up a client, nothing is sent until mqttConnect. Speaks MQTT 3.1.1 unless mqttUseVersion5 is called.
+void mqttInit(MQTT_CLIENT *client, Client *transport, const char *host, uint16_t port, uint16_t keepAlive,
+              unsigned int window, MqttMessageCallback messageCallback, MqttAcknowledgedCallback acknowledgedCallback);
+
+// Switch to MQTT 5 before connecting. sessionExpiry and messageExpiry are in seconds, 0 for a clean session
+// and for messages that never expire.
+void mqttUseVersion5(MQTT_CLIENT *client, uint32_t sessionExpiry, uint32_t messageExpiry);
+
+// Hand messages the broker refuses back through refusedCallback rather than as acknowledged. Without one they
+// are only counted in refusedCount.
+void mqttOnRefused(MQTT_CLIENT *client, MqttRefusedCallback refusedCallback);
+
+// Open the transport, send CONNECT and wait for the CONNACK. The session is clean unless MQTT 5 with a session
+// expiry is used. On success any unacknowledged messages are sent again with DUP set. Returns true once
+// connected, the reason is left in client->state otherwise.
+bool mqttConnect(MQTT_CLIENT *client, const char *clientId, const char *username, const char *password);
+
+// True if the broker resumed the session on the last connect, so earlier subscriptions are still in place
+bool mqttSessionResumed(const MQTT_CLIENT *client);
+
+bool mqttConnected(MQTT_CLIENT *client);
+
+// Send DISCONNECT and close the transport. Unacknowledged messages are kept.
+void mqttDisconnect(MQTT_CLIENT *client);
+
+// Subscribe with QoS 1, the SUBACK is not waited for
+bool mqttSubscribe(MQTT_CLIENT *client, const char *topic);
+
+// True if a message with this QoS can be published now without waiting for acknowledgements
+bool mqttCanPublish(MQTT_CLIENT *client, uint8_t qos);
+
+// Publish a message with QoS 0 or 1 (0 if the broker allows no more). Returns false if it could not be sent
+// (not connected, window full, too large or a QoS 0 write failed), the acknowledged callback is then never called for it. A QoS 1 message is
+// accepted once queued, even if the connection then fails.
+bool mqttPublish(MQTT_CLIENT *client, const char *topic, const uint8_t *payload, size_t length, uint8_t qos, uint32_t tag);
+
+// Handle whatever the broker has sent and keep the connection alive. Call often. Returns false if not connected.
+bool mqttLoop(MQTT_CLIENT *client);
+
+// QoS 1 messages waiting for a PUBACK
+unsigned int mqttInflightCount(const MQTT_CLIENT *client);
+
+// Forget unacknowledged messages with this tag, they are neither sent again nor handed back
+void mqttDiscardInflight(MQTT_CLIENT *client, uint32_t tag);
+
+#endif // MQTT_CLIENT_H
@@ -0,0 +1,114 @@
+#include "note_queue.h"
+#include "frame_codec.h"
+
+// A frame note's compressed block in base64, too large for the stack
+static char blockPayload[(FRAME_BLOCK_MAX_BYTES + 2) / 3 * 4 + 1];
+
+// Template field values give the type: 24 is a 4 byte and 21 a 1 byte unsigned integer
+bool startNoteQueue(NOTE_QUEUE *queue, Notecard *notecard)
+{
+  queue->notecard = notecard;
+  queue->notesSinceSync = 0;
+  queue->syncedAt = millis();
+  queue->syncDue = false;
+
+  J *req = notecard->newRequest("note.template");
+  if (req != NULL)
+  {
+    JAddStringToObject(req, "file", NOTE_FRAMES_FILE);
+    JAddNumberToObject(req, "length", FRAME_BLOCK_MAX_BYTES);
+
+    J *body = JCreateObject();
+    if (body != NULL)
+    {
+      JAddNumberToObject(body, "seq", 24);
+      JAddNumberToObject(body, "n", 21);
+      JAddItemToObject(req, "body", body);
+    }
+  }
+  return notecard->sendRequest(req);
+}
+
+bool addMessageNote(NOTE_QUEUE *queue, const char *topic, const char *message)
+{
+  J *req = queue->notecard->newRequest("note.add");
+  if (req == NULL)
+  {
+    return false;
+  }
+  JAddStringToObject(req, "file", NOTE_MESSAGES_FILE);
+
+  J *body = JCreateObject();
+  if (body != NULL)
+  {
+    JAddStringToObject(body, "topic", topic);
+    JAddStringToObject(body, "message", message);
+    JAddItemToObject(req, "body", body);
+  }
+
+  if (!queue->notecard->sendRequest(req))
+  {
+    return false;
+  }
+  queue->notesSinceSync++;
+  return true;
+}
+
+bool addFrameNote(NOTE_QUEUE *queue, const uint8_t *block, size_t length, unsigned int sequence, unsigned int frames)
+{
+  if (encodeBase64(block, length, blockPayload, sizeof(blockPayload)) == 0)
+  {
+    return false;
+  }
+
+  J *req = queue->notecard->newRequest("note.add");
+  if (req == NULL)
+  {
+    return false;
+  }
+  JAddStringToObject(req, "file", NOTE_FRAMES_FILE);
+  JAddStringToObject(req, "payload", blockPayload);
+
+  J *body = JCreateObject();
+  if (body != NULL)
+  {
+    JAddNumberToObject(body, "seq", sequence);
+    JAddNumberToObject(body, "n", frames);
+    JAddItemToObject(req, "body", body);
+  }
+
+  if (!queue->notecard->sendRequest(req))
+  {
+    return false;
+  }
+  queue->notesSinceSync++;
+  return true;
+}
+
+void requestNoteSync(NOTE_QUEUE *queue)
+{
+  queue->syncDue = true;
+}
+
+bool checkNoteSync(NOTE_QUEUE *queue, unsigned long syncInterval, unsigned int syncNotes)
+{
+  if (queue->notesSinceSync == 0)
+  {
+    return false;
+  }
+
+  const bool intervalPassed = syncInterval > 0 && millis() - queue->syncedAt >= syncInterval * 1000UL;
+  if (!queue->syncDue && !intervalPassed && queue->notesSinceSync < syncNotes)
+  {
+    return false;
+  }
+
+  if (!queue->notecard->sendRequest(queue->notecard->newRequest("hub.sync")))
+  {
+    Serial.println("Notecard sync request failed");
+  }
+  queue->notesSinceSync = 0;
+  queue->syncedAt = millis();
+  queue->syncDue = false;
+  return true;
+}
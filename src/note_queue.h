@@ -0,0 +1,41 @@
+#ifndef NOTE_QUEUE_H
+#define NOTE_QUEUE_H
+
+#include <Arduino.h>
+#include <Notecard.h>
+
+// Notes queued on the Notecard. Frames go in templated notes, stored and sent in the Notecard's compact binary
+// form with a compressed frame block as the payload. Events, edges and responses go in JSON notes with their
+// topic. Queued notes are sent in one session once enough are waiting, the sync interval has passed or an
+// urgent event is queued. Notes left from before a reset go with the next sync.
+#define NOTE_FRAMES_FILE "frames.qo"
+#define NOTE_MESSAGES_FILE "data.qo"
+
+struct NOTE_QUEUE
+{
+  Notecard *notecard;
+  unsigned int notesSinceSync;
+  unsigned long syncedAt; // millis() of the last sync
+  bool syncDue;           // An urgent note is waiting
+};
+
+// Start queueing on a Notecard that has just answered, registering the template for frame notes. Without the
+// template the Notecard still takes the notes, as JSON. Returns false if the template was not taken.
+bool startNoteQueue(NOTE_QUEUE *queue, Notecard *notecard);
+
+// Queue a message as a JSON note. Returns true once queued.
+bool addMessageNote(NOTE_QUEUE *queue, const char *topic, const char *message);
+
+// Queue a block of frames (see encodeFrameBlock) as one frame note with its sequence number and frame count.
+// The Notecard stores the note, so the frames are delivered once this returns true.
+bool addFrameNote(NOTE_QUEUE *queue, const uint8_t *block, size_t length, unsigned int sequence, unsigned int frames);
+
+// Have the notes queued so far sent at the next checkNoteSync, for an urgent event
+void requestNoteSync(NOTE_QUEUE *queue);
+
+// Ask the Notecard to sync once syncNotes are waiting, syncInterval seconds have passed (0 for never) or an
+// urgent note is waiting. A failed sync is left to the next trigger, the notes stay queued on the Notecard.
+// Returns true if a sync was asked for.
+bool checkNoteSync(NOTE_QUEUE *queue, unsigned long syncInterval, unsigned int syncNotes);
+
+#endif // NOTE_QUEUE_H
@@ -0,0 +1,49 @@
+#include "notify.h"
+#include "mbed.h"
+
+#ifdef CORE_CM7
+#define FRAME_AVAILABLE_FLAG 0x01
+
+static rtos::EventFlags frameEvents;
+
+// Only acknowledge our own semaphores, others may belong to the core libraries
+static void frameNotificationHandler()
+{
+  const uint32_t mask = __HAL_HSEM_SEMID_TO_MASK(HSEM_ID_FRAME_AVAILABLE);
+  if (HSEM->C1MISR & mask)
+  {
+    HSEM->C1ICR = mask;
+    frameEvents.set(FRAME_AVAILABLE_FLAG);
+  }
+}
+
+void initFrameNotification()
+{
+  __HAL_RCC_HSEM_CLK_ENABLE();
+
+  NVIC_SetVector(HSEM1_IRQn, (uint32_t)&frameNotificationHandler);
+  HAL_NVIC_SetPriority(HSEM1_IRQn, 10, 0);
+  HAL_NVIC_EnableIRQ(HSEM1_IRQn);
+
+  // The interrupt stays enabled, the handler only clears the status bit
+  HAL_HSEM_ActivateNotification(__HAL_HSEM_SEMID_TO_MASK(HSEM_ID_FRAME_AVAILABLE));
+}
+
+bool waitForFrame(unsigned long timeoutMs)
+{
+  // Flags latch, so a frame committed just before waiting returns straight away
+  const uint32_t flags = frameEvents.wait_any_for(FRAME_AVAILABLE_FLAG, std::chrono::milliseconds(timeoutMs));
+  return !(flags & osFlagsError) && (flags & FRAME_AVAILABLE_FLAG);
+}
+#endif
+
+void notifyFrameAvailable()
+{
+  __HAL_RCC_HSEM_CLK_ENABLE();
+
+  // A take and release raises the interrupt on the M7 if it is listening
+  if (HAL_HSEM_FastTake(HSEM_ID_FRAME_AVAILABLE) == HAL_OK)
+  {
+    HAL_HSEM_Release(HSEM_ID_FRAME_AVAILABLE, 0);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <Arduino.h>
+
+// Inter-core notifications using the STM32H7 hardware semaphores (HSEM). Releasing a semaphore raises
+// an interrupt on the other core, so the consumer can sleep instead of polling shared memory.
+// IDs are kept clear of the low semaphores used by the core libraries.
+#define HSEM_ID_FRAME_AVAILABLE 10 // M4 -> M7: a frame or urgent event was committed to shared memory
+
+// Enable the frame notification interrupt. Called by the M7 before booting the M4.
+void initFrameNotification();
+
+// Wake the M7, called by the M4 after moving head forward or queuing an urgent event
+void notifyFrameAvailable();
+
+// Sleep until the M4 commits a frame or the timeout expires. Returns true if notified. Called by the M7.
+bool waitForFrame(unsigned long timeoutMs);
+
+#endif // NOTIFY_H
@@ -0,0 +1,566 @@
+#include "ota_update.h"
+#include "config.h"
+#include "crc.h"
+#include <Watchdog.h>
+#include <FlashIAP.h>
+#include <BlockDevice.h>
+#include <MBRBlockDevice.h>
+#include <FATFileSystem.h>
+#include <Arduino_Portenta_OTA.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+
+OTA_IMAGE otaImages[OTA_TARGETS];
+
+static const char *imagePaths[OTA_TARGETS] = {OTA_M7_PATH, OTA_M4_PATH};
+static const char *headerPaths[OTA_TARGETS] = {"/fs/M7.HDR", "/fs/M4.HDR"};
+
+static mbed::MBRBlockDevice *partition = nullptr;
+static mbed::FATFileSystem *fileSystem = nullptr;
+static bool mounted = false;
+
+// "major.minor.patch", optionally with a leading v, as one number that orders versions. 0 if it is not a version,
+// as for a development build.
+static uint32_t parseVersion(const char *text)
+{
+  unsigned int major, minor, patch;
+  char extra;
+  if (*text == 'v')
+  {
+    text++;
+  }
+  if (sscanf(text, "%u.%u.%u%c", &major, &minor, &patch, &extra) != 3 || major > 1023 || minor > 1023 ||
+      patch > 1023)
+  {
+    return 0;
+  }
+  return major << 20 | minor << 10 | patch;
+}
+
+// The version running on a core. The M4's is the newer of the M7's, the two being released together, and the
+// last M4 image applied.
+static uint32_t runningVersion(OtaTarget target)
+{
+  uint32_t version = parseVersion(VERSION);
+  if (target == OTA_TARGET_M4)
+  {
+    char text[OTA_MAX_VERSION] = {0};
+    FILE *file = fopen(OTA_M4_VERSION_PATH, "rb");
+    if (file)
+    {
+      fread(text, 1, sizeof(text) - 1, file);
+      fclose(file);
+    }
+    version = max(version, parseVersion(text));
+  }
+  return version;
+}
+
+// True if an image of this version may replace the running firmware
+static bool newerThanRunning(OtaTarget target, const char *version)
+{
+  const uint32_t image = parseVersion(version);
+  return image != 0 && image > runningVersion(target);
+}
+
+// Bytes of the staged file, 0 if there is none
+static uint32_t stagedSize(OtaTarget target)
+{
+  FILE *file = fopen(imagePaths[target], "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fclose(file);
+  return size > 0 ? size : 0;
+}
+
+static bool saveHeader(OtaTarget target)
+{
+  const OTA_IMAGE *image = &otaImages[target];
+  OTA_HEADER header = {};
+  header.magic = OTA_HEADER_MAGIC;
+  header.size = image->size;
+  memcpy(header.version, image->version, sizeof(header.version));
+  header.signatureLength = image->signatureLength;
+  memcpy(header.signature, image->signature, image->signatureLength);
+  header.verified = image->state == OTA_VERIFIED;
+
+  FILE *file = fopen(headerPaths[target], "wb");
+  if (!file)
+  {
+    return false;
+  }
+  const bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+  return fclose(file) == 0 && written;
+}
+
+// Forget a staged image, so it is neither resumed nor applied
+static void removeStaged(OtaTarget target)
+{
+  remove(headerPaths[target]);
+  remove(imagePaths[target]);
+  memset(&otaImages[target], 0, sizeof(OTA_IMAGE));
+}
+
+// Check the signed header and the staged file against the signature and otaSigningKey (base64 DER public key)
+static bool verifyStaged(OtaTarget target)
+{
+  const OTA_IMAGE *image = &otaImages[target];
+
+  uint8_t key[160];
+  size_t keyLength = 0;
+  if (mbedtls_base64_decode(key, sizeof(key), &keyLength, (const unsigned char *)otaSigningKey,
+                            strlen(otaSigningKey)) != 0)
+  {
+    return false;
+  }
+
+  FILE *file = fopen(imagePaths[target], "rb");
+  if (!file)
+  {
+    return false;
+  }
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+
+  char header[48];
+  const int headerLength = snprintf(header, sizeof(header), "%s %s %lu\n", getOtaTargetName(target), image->version,
+                                    (unsigned long)image->size);
+  mbedtls_sha256_update_ret(&sha, (const uint8_t *)header, headerLength);
+
+  uint8_t buffer[1024];
+  uint32_t hashed = 0;
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    mbedtls_sha256_update_ret(&sha, buffer, read);
+    hashed += read;
+    mbed::Watchdog::get_instance().kick();
+  }
+  fclose(file);
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish_ret(&sha, hash);
+  mbedtls_sha256_free(&sha);
+
+  mbedtls_pk_context publicKey;
+  mbedtls_pk_init(&publicKey);
+  const bool valid = hashed == image->size &&
+                     mbedtls_pk_parse_public_key(&publicKey, key, keyLength) == 0 &&
+                     mbedtls_pk_can_do(&publicKey, MBEDTLS_PK_ECDSA) &&
+                     mbedtls_pk_verify(&publicKey, MBEDTLS_MD_SHA256, hash, sizeof(hash), image->signature,
+                                       image->signatureLength) == 0;
+  mbedtls_pk_free(&publicKey);
+  return valid;
+}
+
+// Write the staged M4 image over the M4's flash, in whole program pages padded with erased bytes
+static bool flashM4Image()
+{
+  FILE *file = fopen(imagePaths[OTA_TARGET_M4], "rb");
+  if (!file)
+  {
+    return false;
+  }
+
+  mbed::FlashIAP flash;
+  bool ok = flash.init() == 0;
+
+  const uint32_t end = OTA_M4_ADDRESS + otaImages[OTA_TARGET_M4].size;
+  for (uint32_t address = OTA_M4_ADDRESS; ok && address < end; address += flash.get_sector_size(address))
+  {
+    ok = flash.erase(address, flash.get_sector_size(address)) == 0;
+    mbed::Watchdog::get_instance().kick();
+  }
+
+  const uint32_t page = flash.get_page_size();
+  uint8_t buffer[1024];
+  for (uint32_t address = OTA_M4_ADDRESS; ok && address < end;)
+  {
+    const size_t read = fread(buffer, 1, sizeof(buffer), file);
+    const size_t length = (read + page - 1) / page * page;
+    memset(buffer + read, flash.get_erase_value(), length - read);
+    ok = read > 0 && flash.program(buffer, address, length) == 0;
+    address += read;
+    mbed::Watchdog::get_instance().kick();
+  }
+
+  flash.deinit();
+  fclose(file);
+  return ok;
+}
+
+// Hand the staged M7 image to the bootloader, which installs it on the next restart. The library mounts the
+// partition itself.
+static bool stageM7Image()
+{
+  fileSystem->unmount();
+  mounted = false;
+
+  Arduino_Portenta_OTA_QSPI ota(QSPI_FLASH_FATFS_MBR, OTA_PARTITION);
+  if (ota.begin() != Arduino_Portenta_OTA::Error::None)
+  {
+    Serial.println("OTA: the bootloader cannot open the OTA partition");
+    return false;
+  }
+  if (ota.decompress() < 0)
+  {
+    Serial.println("OTA: the M7 image is not a valid .ota file");
+    return false;
+  }
+  return ota.update() == Arduino_Portenta_OTA::Error::None;
+}
+
+void initOta()
+{
+  if (strlen(otaSigningKey) == 0)
+  {
+    return;
+  }
+
+  partition = new mbed::MBRBlockDevice(mbed::BlockDevice::get_default_instance(), OTA_PARTITION);
+  fileSystem = new mbed::FATFileSystem(OTA_MOUNT_NAME);
+  if (fileSystem->mount(partition) != 0)
+  {
+    Serial.println("OTA: cannot mount the OTA partition, is the QSPI flash partitioned?");
+    return;
+  }
+  mounted = true;
+
+  for (int i = 0; i < OTA_TARGETS; i++)
+  {
+    const OtaTarget target = (OtaTarget)i;
+    OTA_HEADER header;
+    FILE *file = fopen(headerPaths[target], "rb");
+    if (!file)
+    {
+      continue;
+    }
+    const bool read = fread(&header, sizeof(header), 1, file) == 1;
+    fclose(file);
+
+    OTA_IMAGE *image = &otaImages[target];
+    const uint32_t staged = stagedSize(target);
+    header.version[OTA_MAX_VERSION - 1] = '\0';
+    if (!read || header.magic != OTA_HEADER_MAGIC || header.signatureLength > OTA_MAX_SIGNATURE ||
+        staged > header.size)
+    {
+      removeStaged(target);
+      continue;
+    }
+
+    // Installed meanwhile, or overtaken by a newer firmware
+    if (!newerThanRunning(target, header.version))
+    {
+      Serial.print("OTA: dropping the staged ");
+      Serial.print(getOtaTargetName(target));
+      Serial.print(" image, version ");
+      Serial.print(header.version);
+      Serial.println(" is not newer than the running one");
+      removeStaged(target);
+      continue;
+    }
+
+    image->size = header.size;
+    memcpy(image->version, header.version, sizeof(image->version));
+    image->received = staged;
+    image->signatureLength = header.signatureLength;
+    memcpy(image->signature, header.signature, header.signatureLength);
+    image->state = header.verified ? OTA_VERIFIED : OTA_RECEIVING;
+
+    // Reset after the last chunk was written but before it was verified
+    if (image->state == OTA_RECEIVING && image->received == image->size)
+    {
+      image->state = verifyStaged(target) ? OTA_VERIFIED : OTA_FAILED;
+      saveHeader(target);
+    }
+
+    Serial.print("OTA: ");
+    Serial.print(getOtaTargetName(target));
+    Serial.print(" image ");
+    Serial.print(image->version);
+    Serial.print(" ");
+    Serial.print(getOtaStateName(image->state));
+    Serial.print(", ");
+    Serial.print(image->received);
+    Serial.print(" of ");
+    Serial.print(image->size);
+    Serial.println(" bytes");
+  }
+}
+
+OtaResult beginOtaImage(const uint8_t *payload, size_t length, OtaTarget *target)
+{
+  if (!mounted)
+  {
+    return OTA_DISABLED;
+  }
+
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length))
+  {
+    return OTA_INVALID;
+  }
+
+  const char *name = doc["t"] | "";
+  if (strcmp(name, "m7") == 0)
+  {
+    *target = OTA_TARGET_M7;
+  }
+  else if (strcmp(name, "m4") == 0)
+  {
+    *target = OTA_TARGET_M4;
+  }
+  else
+  {
+    return OTA_INVALID;
+  }
+
+  const uint32_t size = doc["n"] | 0UL;
+  const char *version = doc["v"] | "";
+  const char *signatureText = doc["sig"] | "";
+  uint8_t signature[OTA_MAX_SIGNATURE];
+  size_t signatureLength = 0;
+  if (size == 0 || size > OTA_IMAGE_MAX_SIZE || parseVersion(version) == 0 || strlen(version) >= OTA_MAX_VERSION ||
+      mbedtls_base64_decode(signature, sizeof(signature), &signatureLength, (const unsigned char *)signatureText,
+                            strlen(signatureText)) != 0 ||
+      signatureLength == 0)
+  {
+    return OTA_INVALID;
+  }
+  if (!newerThanRunning(*target, version))
+  {
+    return OTA_ROLLBACK;
+  }
+
+  // The same image again carries on from where it stopped
+  OTA_IMAGE *image = &otaImages[*target];
+  if ((image->state == OTA_RECEIVING || image->state == OTA_VERIFIED) && image->size == size &&
+      strcmp(image->version, version) == 0 && image->signatureLength == signatureLength &&
+      memcmp(image->signature, signature, signatureLength) == 0)
+  {
+    return OTA_OK;
+  }
+
+  removeStaged(*target);
+  image->size = size;
+  strcpy(image->version, version);
+  image->signatureLength = signatureLength;
+  memcpy(image->signature, signature, signatureLength);
+  image->state = OTA_RECEIVING;
+
+  FILE *file = fopen(imagePaths[*target], "wb");
+  if (!file || fclose(file) != 0 || !saveHeader(*target))
+  {
+    removeStaged(*target);
+    return OTA_WRITE_FAILED;
+  }
+  return OTA_OK;
+}
+
+OtaResult writeOtaChunk(const uint8_t *payload, size_t length, OtaTarget *target)
+{
+  const size_t headerLength = 5;
+  if (!mounted)
+  {
+    return OTA_DISABLED;
+  }
+  if (length <= headerLength + 4 || payload[0] >= OTA_TARGETS)
+  {
+    return OTA_INVALID;
+  }
+
+  uint32_t crc;
+  memcpy(&crc, payload + length - 4, sizeof(crc));
+  if (crc32(payload, length - 4) != crc)
+  {
+    return OTA_BAD_CRC;
+  }
+
+  *target = (OtaTarget)payload[0];
+  OTA_IMAGE *image = &otaImages[*target];
+  if (image->state != OTA_RECEIVING)
+  {
+    return image->state == OTA_IDLE ? OTA_NOT_STARTED : OTA_OK;
+  }
+
+  uint32_t offset;
+  memcpy(&offset, payload + 1, sizeof(offset));
+  const uint8_t *data = payload + headerLength;
+  size_t dataLength = length - headerLength - 4;
+  if (offset > image->received || offset + dataLength > image->size)
+  {
+    return OTA_OUT_OF_ORDER;
+  }
+  if (offset + dataLength <= image->received)
+  {
+    return OTA_OK; // Already written, sent again after a reconnect
+  }
+
+  // Only the part past what was written before, chunks may overlap after a resume
+  const size_t skip = image->received - offset;
+  data += skip;
+  dataLength -= skip;
+
+  FILE *file = fopen(imagePaths[*target], "ab");
+  const bool written = file && fwrite(data, 1, dataLength, file) == dataLength;
+  if (!file || fclose(file) != 0 || !written)
+  {
+    // Part of the data may have landed, carry on from what the file holds
+    image->received = stagedSize(*target);
+    return OTA_WRITE_FAILED;
+  }
+  image->received += dataLength;
+
+  if (image->received == image->size)
+  {
+    image->state = verifyStaged(*target) ? OTA_VERIFIED : OTA_FAILED;
+    saveHeader(*target);
+    if (image->state == OTA_FAILED)
+    {
+      return OTA_BAD_SIGNATURE;
+    }
+  }
+  return OTA_OK;
+}
+
+OtaResult applyOta()
+{
+  if (!mounted)
+  {
+    return OTA_DISABLED;
+  }
+
+  bool staged = false;
+  for (int i = 0; i < OTA_TARGETS; i++)
+  {
+    const OtaState state = otaImages[i].state;
+    if (state == OTA_RECEIVING)
+    {
+      return OTA_NOT_READY;
+    }
+    staged = staged || state == OTA_VERIFIED;
+  }
+  if (!staged)
+  {
+    return OTA_NOT_READY;
+  }
+
+  // The staged files may have changed since they were verified
+  for (int i = 0; i < OTA_TARGETS; i++)
+  {
+    if (otaImages[i].state == OTA_VERIFIED && !newerThanRunning((OtaTarget)i, otaImages[i].version))
+    {
+      removeStaged((OtaTarget)i);
+      return OTA_ROLLBACK;
+    }
+    if (otaImages[i].state == OTA_VERIFIED && !verifyStaged((OtaTarget)i))
+    {
+      otaImages[i].state = OTA_FAILED;
+      saveHeader((OtaTarget)i);
+      return OTA_BAD_SIGNATURE;
+    }
+  }
+
+  // Check the bootloader first, so an M7 image it cannot take does not leave the M4 half updated
+  const bool m7 = otaImages[OTA_TARGET_M7].state == OTA_VERIFIED;
+  const bool m4 = otaImages[OTA_TARGET_M4].state == OTA_VERIFIED;
+  if (m7)
+  {
+    Arduino_Portenta_OTA_QSPI ota(QSPI_FLASH_FATFS_MBR, OTA_PARTITION);
+    if (!ota.isOtaCapable())
+    {
+      Serial.println("OTA: the bootloader does not support updates from the QSPI flash");
+      return OTA_APPLY_FAILED;
+    }
+  }
+
+  if (m4)
+  {
+    Serial.println("OTA: writing the M4 image");
+    if (!flashM4Image())
+    {
+      return OTA_WRITE_FAILED;
+    }
+
+    // The floor for later M4 images
+    FILE *file = fopen(OTA_M4_VERSION_PATH, "wb");
+    if (file)
+    {
+      fputs(otaImages[OTA_TARGET_M4].version, file);
+      fclose(file);
+    }
+    removeStaged(OTA_TARGET_M4);
+  }
+
+  if (m7)
+  {
+    // The header goes first, so an image the bootloader refuses is not applied again after the restart
+    remove(headerPaths[OTA_TARGET_M7]);
+    memset(&otaImages[OTA_TARGET_M7], 0, sizeof(OTA_IMAGE));
+    Serial.println("OTA: handing the M7 image to the bootloader");
+    if (!stageM7Image())
+    {
+      return OTA_APPLY_FAILED;
+    }
+  }
+
+  return OTA_OK;
+}
+
+const char *getOtaTargetName(OtaTarget target)
+{
+  return target == OTA_TARGET_M4 ? "m4" : "m7";
+}
+
+const char *getOtaStateName(OtaState state)
+{
+  switch (state)
+  {
+  case OTA_IDLE:
+    return "idle";
+  case OTA_RECEIVING:
+    return "receiving";
+  case OTA_VERIFIED:
+    return "verified";
+  case OTA_FAILED:
+    return "failed";
+  }
+  return "unknown";
+}
+
+const char *getOtaResultName(OtaResult result)
+{
+  switch (result)
+  {
+  case OTA_OK:
+    return "ok";
+  case OTA_DISABLED:
+    return "disabled";
+  case OTA_INVALID:
+    return "invalid";
+  case OTA_BAD_CRC:
+    return "bad_crc";
+  case OTA_NOT_STARTED:
+    return "not_started";
+  case OTA_OUT_OF_ORDER:
+    return "out_of_order";
+  case OTA_WRITE_FAILED:
+    return "write_failed";
+  case OTA_BAD_SIGNATURE:
+    return "bad_signature";
+  case OTA_ROLLBACK:
+    return "rollback";
+  case OTA_NOT_READY:
+    return "not_ready";
+  case OTA_APPLY_FAILED:
+    return "apply_failed";
+  }
+  return "unknown";
+}
@@ -0,0 +1,115 @@
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <Arduino.h>
+
+// Firmware updates delivered over MQTT. Each image arrives in CRC-checked chunks that are appended to a file in
+// the QSPI flash, so the running firmware, the M4's sampling and the frame buffer are not touched while it
+// downloads. A transfer resumes from the last byte written, after a dropped connection or a reset. Only images
+// whose ECDSA P-256 signature checks out against otaSigningKey are applied, the check is repeated just before.
+// The signature covers a header naming the target, version and size as well as the image, and only versions
+// newer than the running one are taken, so an older signed image cannot be sent again to downgrade the device.
+//
+// Both cores run from the internal flash (the M7 from bank 1, the M4 from bank 2 with the 50_50 layout), so
+// there is no idle bank to write into while running. Applying therefore takes a restart:
+// - The M7 image is a standard Arduino .ota file (LZSS compressed with its header), staged where the Arduino
+//   bootloader picks it up. The bootloader installs it on the next restart.
+// - The M4 image is a plain .bin, written to bank 2 by the M7 just before the restart. The M4 stops
+//   as soon as its flash is erased.
+
+// FAT partition of the QSPI flash set aside for OTA by the Opta's standard partitioning, also used by the bootloader
+#define OTA_PARTITION 2
+#define OTA_MOUNT_NAME "fs"
+#define OTA_M7_PATH "/fs/UPDATE.BIN.LZSS"
+#define OTA_M4_PATH "/fs/M4.BIN"
+#define OTA_M4_VERSION_PATH "/fs/M4.VER" // Version of the last M4 image applied, the M4 cannot report its own
+
+// Where the M4 image runs from with the 50_50 flash layout, and its largest size
+#define OTA_M4_ADDRESS 0x08100000
+#define OTA_IMAGE_MAX_SIZE 0x100000
+
+// A DER encoded ECDSA P-256 signature takes up to 72 bytes
+#define OTA_MAX_SIGNATURE 72
+
+// Versions are "major.minor.patch", each part up to 1023
+#define OTA_MAX_VERSION 16
+
+enum OtaTarget
+{
+  OTA_TARGET_M7,
+  OTA_TARGET_M4,
+  OTA_TARGETS
+};
+
+enum OtaState
+{
+  OTA_IDLE,      // Nothing staged
+  OTA_RECEIVING, // Chunks are being appended
+  OTA_VERIFIED,  // Complete with a valid signature, applied on request
+  OTA_FAILED     // Complete but the signature does not match, needs a new begin
+};
+
+enum OtaResult
+{
+  OTA_OK,
+  OTA_DISABLED,      // No signing key configured, or the OTA partition cannot be mounted
+  OTA_INVALID,       // Malformed message
+  OTA_BAD_CRC,       // Chunk damaged in transit
+  OTA_NOT_STARTED,   // Chunk for an image with no transfer in progress
+  OTA_OUT_OF_ORDER,  // Chunk beyond the bytes received so far, send again from the reported offset
+  OTA_WRITE_FAILED,  // The QSPI or internal flash could not be written
+  OTA_BAD_SIGNATURE, // The image does not match its signature
+  OTA_ROLLBACK,      // The image is not newer than the running firmware
+  OTA_NOT_READY,     // Nothing verified to apply, or a transfer is still in progress
+  OTA_APPLY_FAILED   // The bootloader cannot take the M7 image
+};
+
+// An image being received or staged
+struct OTA_IMAGE
+{
+  OtaState state;
+  uint32_t size;     // Bytes in the whole image
+  uint32_t received; // Bytes written so far
+  char version[OTA_MAX_VERSION];
+  uint8_t signature[OTA_MAX_SIGNATURE];
+  size_t signatureLength;
+};
+
+// Staged file header, kept next to each image so a transfer survives a reset
+#define OTA_HEADER_MAGIC 0x41544F02 // "\x02OTA"
+
+struct OTA_HEADER
+{
+  uint32_t magic;
+  uint32_t size;
+  char version[OTA_MAX_VERSION];
+  uint32_t signatureLength;
+  uint8_t signature[OTA_MAX_SIGNATURE];
+  uint32_t verified;
+};
+
+extern OTA_IMAGE otaImages[OTA_TARGETS];
+
+// Mount the OTA partition and pick up images staged before a reset. Does nothing without a signing key.
+void initOta();
+
+// Start an image, or resume it if the same image (version, size and signature) is already staged. The payload is
+// JSON: {"t": "m7" or "m4", "v": version, "n": size in bytes, "sig": base64 DER signature}. The signature is over
+// the SHA-256 of the line "<t> <v> <n>\n" followed by the image. Versions not above the running one are refused.
+OtaResult beginOtaImage(const uint8_t *payload, size_t length, OtaTarget *target);
+
+// Append a chunk: 1 byte target, 4 byte offset and the data, followed by the CRC-32 over all of that, little
+// endian. Data already written is skipped, so chunks may be sent again. The image is verified once complete.
+OtaResult writeOtaChunk(const uint8_t *payload, size_t length, OtaTarget *target);
+
+// Check the signatures and versions again and put the verified images in place. Returns OTA_OK when a restart is needed to
+// complete the update. Other results leave the running firmware as it is, except when an M4 image was being
+// written: OTA_WRITE_FAILED, or OTA_APPLY_FAILED for an M7 image sent with it, leave the M4 stopped until a
+// restart. Once an M7 image was handed over, further OTA messages are refused until the restart.
+OtaResult applyOta();
+
+const char *getOtaTargetName(OtaTarget target);
+const char *getOtaStateName(OtaState state);
+const char *getOtaResultName(OtaResult result);
+
+#endif // OTA_UPDATE_H
@@ -0,0 +1,229 @@
+#include "payload.h"
+#include <stdarg.h>
+#include <stddef.h>
+
+extern const char *VERSION;
+
+// JSON key and frame field for each value reported by the M4, in message order
+struct FRAME_FIELD
+{
+  const char *key;
+  size_t offset;
+};
+
+static const FRAME_FIELD frameFields[] = {
+    {"cb", offsetof(DATA_FRAME_SEND, userButtonCount)},
+    {"c1", offsetof(DATA_FRAME_SEND, input1Count)},
+    {"c2", offsetof(DATA_FRAME_SEND, input2Count)},
+    {"c3", offsetof(DATA_FRAME_SEND, input3Count)},
+    {"c4", offsetof(DATA_FRAME_SEND, input4Count)},
+    {"c5", offsetof(DATA_FRAME_SEND, input5Count)},
+    {"c6", offsetof(DATA_FRAME_SEND, input6Count)},
+    {"sb", offsetof(DATA_FRAME_SEND, userButtonState)},
+    {"s1", offsetof(DATA_FRAME_SEND, input1State)},
+    {"s2", offsetof(DATA_FRAME_SEND, input2State)},
+    {"s3", offsetof(DATA_FRAME_SEND, input3State)},
+    {"s4", offsetof(DATA_FRAME_SEND, input4State)},
+    {"s5", offsetof(DATA_FRAME_SEND, input5State)},
+    {"s6", offsetof(DATA_FRAME_SEND, input6State)},
+    {"a7", offsetof(DATA_FRAME_SEND, input7Analog)},
+    {"a8", offsetof(DATA_FRAME_SEND, input8Analog)},
+    {"tb", offsetof(DATA_FRAME_SEND, userButtonTotal)},
+    {"t1", offsetof(DATA_FRAME_SEND, input1Total)},
+    {"t2", offsetof(DATA_FRAME_SEND, input2Total)},
+    {"t3", offsetof(DATA_FRAME_SEND, input3Total)},
+    {"t4", offsetof(DATA_FRAME_SEND, input4Total)},
+    {"t5", offsetof(DATA_FRAME_SEND, input5Total)},
+    {"t6", offsetof(DATA_FRAME_SEND, input6Total)},
+    {"d4", offsetof(DATA_FRAME_SEND, dutyCycle)}};
+
+// Key prefix for each meter reading, suffixed with the Modbus device number
+static const FRAME_FIELD meterFields[] = {
+    {"p1v", offsetof(METER_READING, p1Volts)},
+    {"p2v", offsetof(METER_READING, p2Volts)},
+    {"p3v", offsetof(METER_READING, p3Volts)},
+    {"p1a", offsetof(METER_READING, p1Amps)},
+    {"p2a", offsetof(METER_READING, p2Amps)},
+    {"p3a", offsetof(METER_READING, p3Amps)},
+    {"pf", offsetof(METER_READING, pf)},
+    {"kWh", offsetof(METER_READING, kWh)}};
+
+// Temporarily only a single Modbus device is supported
+static const unsigned int meterDeviceNumber = 1;
+
+static unsigned int frameValue(const DATA_FRAME_SEND *frame, const FRAME_FIELD &field)
+{
+  return *(const unsigned int *)((const uint8_t *)frame + field.offset);
+}
+
+static float meterValue(const METER_READING *meter, const FRAME_FIELD &field)
+{
+  return *(const float *)((const uint8_t *)meter + field.offset);
+}
+
+void appendFormat(char *message, size_t size, size_t *length, const char *format, ...)
+{
+  if (*length >= size)
+  {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(message + *length, size - *length, format, args);
+  va_end(args);
+
+  if (written > 0)
+  {
+    *length += written;
+    if (*length >= size)
+    {
+      *length = size - 1;
+    }
+  }
+}
+
+// Separator before the next key, nothing for the first key in the object
+static const char *separator(size_t length)
+{
+  return length > 1 ? "," : "";
+}
+
+void resetPayloadEncoder(PAYLOAD_ENCODER *encoder)
+{
+  memset(encoder, 0, sizeof(PAYLOAD_ENCODER));
+  encoder->forceKeyframe = true;
+}
+
+void requestKeyframe(PAYLOAD_ENCODER *encoder)
+{
+  encoder->forceKeyframe = true;
+}
+
+size_t encodePayload(PAYLOAD_ENCODER *encoder,
+                     unsigned int keyframeInterval,
+                     const DATA_FRAME_SEND *frame,
+                     int32_t rssi,
+                     unsigned int dutyCycle,
+                     const METER_READING *meter,
+                     char *message,
+                     size_t size)
+{
+  const bool deltaMode = keyframeInterval > 0;
+  const bool keyframe = !deltaMode || encoder->forceKeyframe || encoder->framesSinceKeyframe + 1 >= keyframeInterval;
+
+  size_t length = 0;
+  appendFormat(message, size, &length, "{");
+
+  if (deltaMode)
+  {
+    appendFormat(message, size, &length, "\"seq\":%lu", encoder->sequence);
+    if (keyframe)
+    {
+      appendFormat(message, size, &length, ",\"k\":1");
+    }
+  }
+
+  // Every message names its frame, so the same frame seen on both topics or again after a reconnect is recognised
+  appendFormat(message, size, &length, "%s\"fn\":%u", separator(length), frame->frameNumber);
+
+  if (keyframe)
+  {
+    appendFormat(message, size, &length, ",\"v\":\"%s\"", VERSION);
+  }
+
+  if (keyframe || rssi != encoder->previousRssi)
+  {
+    appendFormat(message, size, &length, "%s\"rssi\":%d", separator(length), (int)rssi);
+  }
+
+  if (keyframe || dutyCycle != encoder->previousDutyCycle)
+  {
+    appendFormat(message, size, &length, "%s\"d7\":%u", separator(length), dutyCycle);
+  }
+
+  for (const FRAME_FIELD &field : frameFields)
+  {
+    const unsigned int value = frameValue(frame, field);
+    if (keyframe || value != frameValue(&encoder->previousFrame, field))
+    {
+      appendFormat(message, size, &length, "%s\"%s\":%u", separator(length), field.key, value);
+    }
+  }
+
+  // Coalesced frames report how many intervals they cover and the analog range over them. Delta messages keep
+  // the span in their state like any other key, so a consumer sees it drop back to 1 after coalesced frames.
+  if (deltaMode && (keyframe || frame->span != encoder->previousFrame.span))
+  {
+    appendFormat(message, size, &length, ",\"sp\":%u", frame->span);
+  }
+  if (frame->span > 1)
+  {
+    if (!deltaMode)
+    {
+      appendFormat(message, size, &length, ",\"sp\":%u", frame->span);
+    }
+    appendFormat(message, size, &length, ",\"a7n\":%u,\"a7x\":%u,\"a8n\":%u,\"a8x\":%u",
+           frame->input7Min, frame->input7Max, frame->input8Min, frame->input8Max);
+  }
+
+  // Frames a self-test ran in, kept in the delta state like the span so a consumer sees the flag clear
+  const unsigned int selfTestFlag = frame->flags & FRAME_FLAG_SELF_TEST ? 1 : 0;
+  if (deltaMode ? keyframe || selfTestFlag != (encoder->previousFrame.flags & FRAME_FLAG_SELF_TEST ? 1U : 0U)
+                : selfTestFlag)
+  {
+    appendFormat(message, size, &length, ",\"st\":%u", selfTestFlag);
+  }
+
+  if (meter)
+  {
+    for (const FRAME_FIELD &field : meterFields)
+    {
+      const float value = meterValue(meter, field);
+      if (keyframe || value != meterValue(&encoder->previousMeter, field))
+      {
+        appendFormat(message, size, &length, "%s\"%s%u\":%.4f", separator(length), field.key, meterDeviceNumber, value);
+      }
+    }
+  }
+
+  appendFormat(message, size, &length, "}");
+
+  // Remember what the consumer now holds so the next delta is relative to it
+  encoder->previousFrame = *frame;
+  encoder->previousRssi = rssi;
+  encoder->previousDutyCycle = dutyCycle;
+  if (meter)
+  {
+    encoder->previousMeter = *meter;
+  }
+
+  if (deltaMode)
+  {
+    encoder->sequence++;
+    encoder->framesSinceKeyframe = keyframe ? 0 : encoder->framesSinceKeyframe + 1;
+    encoder->forceKeyframe = false;
+  }
+
+  return length;
+}
+
+size_t encodeUrgentEvent(const URGENT_EVENT *event, unsigned int age, char *message, size_t size)
+{
+  // Channel suffix as in the frame keys: sb/tb for the user button, s1/t1 to s6/t6 for the inputs
+  char channel[11]; // Room for any unsigned int
+  if (event->channel == 0)
+  {
+    strcpy(channel, "b");
+  }
+  else
+  {
+    snprintf(channel, sizeof(channel), "%u", event->channel);
+  }
+
+  size_t length = 0;
+  appendFormat(message, size, &length, "{\"seq\":%u,\"s%s\":%u,\"t%s\":%u,\"age\":%u}",
+         event->sequence, channel, event->state, channel, event->total, age);
+
+  return length;
+}
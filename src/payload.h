@@ -0,0 +1,59 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <Arduino.h>
+#include "data_frame.h"
+
+// Energy meter readings published alongside a frame when a Modbus device is configured
+struct METER_READING
+{
+  float p1Volts;
+  float p2Volts;
+  float p3Volts;
+  float p1Amps;
+  float p2Amps;
+  float p3Amps;
+  float pf;
+  float kWh;
+};
+
+// Per-stream encoder state. Delta frames are relative to the last frame this encoder produced.
+struct PAYLOAD_ENCODER
+{
+  unsigned long sequence;            // Sequence number of the next message
+  unsigned int framesSinceKeyframe;  // Delta frames sent since the last keyframe
+  bool forceKeyframe;                // Next message must be a keyframe (boot, reconnect, resync)
+  DATA_FRAME_SEND previousFrame;
+  METER_READING previousMeter;
+  int32_t previousRssi;
+  unsigned int previousDutyCycle;
+};
+
+// Reset encoder state, the next message will be a keyframe
+void resetPayloadEncoder(PAYLOAD_ENCODER *encoder);
+
+// Request a keyframe for the next message without resetting the sequence number
+void requestKeyframe(PAYLOAD_ENCODER *encoder);
+
+// Build a JSON message for the frame. keyframeInterval of 0 disables delta encoding and
+// produces the full legacy message. dutyCycle is the M7's awake percentage since the previous message.
+// meter may be nullptr when no Modbus device is configured.
+// Returns the message length.
+size_t encodePayload(PAYLOAD_ENCODER *encoder,
+                     unsigned int keyframeInterval,
+                     const DATA_FRAME_SEND *frame,
+                     int32_t rssi,
+                     unsigned int dutyCycle,
+                     const METER_READING *meter,
+                     char *message,
+                     size_t size);
+
+// Append formatted text to message, keeping track of its length. Output is truncated (never overflowed) if full.
+// Used by the other JSON encoders as well.
+void appendFormat(char *message, size_t size, size_t *length, const char *format, ...);
+
+// Build a JSON message for an urgent event, using the frame keys for the channel's state and total.
+// age is the milliseconds since the change was accepted. Returns the message length.
+size_t encodeUrgentEvent(const URGENT_EVENT *event, unsigned int age, char *message, size_t size);
+
+#endif // PAYLOAD_H
@@ -0,0 +1,215 @@
+#include "self_test.h"
+#include <ArduinoJson.h>
+#include "payload.h"
+
+static const float defaultRates[] = {1, 2, 5, 10, 20, 50, 100, 200};
+
+// Longest a step may take, so a request cannot hold the inputs for hours
+static const float maxStepSeconds = 600;
+
+bool parseSelfTestRequest(JsonDocument &doc, SELF_TEST_PLAN *plan)
+{
+  plan->channels = 0x7E; // Inputs 1-6
+  plan->analogChannels = 0;
+  plan->pulses = 50;
+  plan->dutyPercent = 50;
+  plan->burstPulses = 0;
+  plan->burstGapMillis = 0;
+  plan->rampFrom = 0;
+  plan->rampTo = 4095;
+  plan->stepCount = sizeof(defaultRates) / sizeof(defaultRates[0]);
+  memcpy(plan->rates, defaultRates, sizeof(defaultRates));
+
+  if (doc["ch"].is<JsonArray>())
+  {
+    plan->channels = 0;
+    for (JsonVariant value : doc["ch"].as<JsonArray>())
+    {
+      const int channel = value | 0;
+      if (channel < 1 || channel > 6)
+      {
+        return false;
+      }
+      plan->channels |= 1U << channel;
+    }
+  }
+
+  if (doc["hz"].is<JsonArray>())
+  {
+    plan->stepCount = 0;
+    for (JsonVariant value : doc["hz"].as<JsonArray>())
+    {
+      const float rate = value | 0.0f;
+      if (plan->stepCount >= SELF_TEST_MAX_STEPS || rate < 0.1f || rate > 1000 ||
+          (plan->stepCount > 0 && rate <= plan->rates[plan->stepCount - 1]))
+      {
+        return false;
+      }
+      plan->rates[plan->stepCount++] = rate;
+    }
+  }
+
+  plan->pulses = doc["n"] | plan->pulses;
+  plan->dutyPercent = doc["duty"] | plan->dutyPercent;
+  plan->burstPulses = doc["bp"] | plan->burstPulses;
+  plan->burstGapMillis = doc["bg"] | plan->burstGapMillis;
+
+  if (doc["an"].is<JsonArray>())
+  {
+    for (JsonVariant value : doc["an"].as<JsonArray>())
+    {
+      const int channel = value | 0;
+      if (channel < 7 || channel > 8)
+      {
+        return false;
+      }
+      plan->analogChannels |= 1U << (channel - 7);
+    }
+  }
+
+  if (doc["ramp"].is<JsonArray>())
+  {
+    plan->rampFrom = doc["ramp"][0] | 0;
+    plan->rampTo = doc["ramp"][1] | 4095;
+  }
+
+  return plan->stepCount > 0 && (plan->channels != 0 || plan->analogChannels != 0) && plan->pulses > 0 &&
+         plan->pulses / plan->rates[0] <= maxStepSeconds && plan->dutyPercent >= 1 && plan->dutyPercent <= 99 &&
+         plan->burstGapMillis <= 60000 && plan->rampFrom <= 4095 && plan->rampTo <= 4095;
+}
+
+void buildSelfTestStep(const SELF_TEST_PLAN *plan, unsigned int index, SELF_TEST_STEP *step)
+{
+  step->channels = plan->channels;
+  step->periodMicros = (unsigned int)(1000000.0f / plan->rates[index]);
+  step->lowMicros = max(step->periodMicros * plan->dutyPercent / 100, 1U);
+  step->pulses = plan->pulses;
+  step->burstPulses = plan->burstPulses;
+  step->burstGapMicros = plan->burstPulses > 0 ? plan->burstGapMillis * 1000 : 0;
+  step->analogChannels = plan->analogChannels;
+  step->rampFrom = plan->rampFrom;
+  step->rampTo = plan->rampTo;
+}
+
+void evaluateSelfTestStep(const SELF_TEST_STEP *step, const SELF_TEST_RESULT *result, const int *channelModes,
+                          const int *debounceDelays, float rate, SELF_TEST_OUTCOME *outcome)
+{
+  outcome->rate = rate;
+  outcome->completed = true;
+  outcome->rated = true;
+  outcome->exact = true;
+  outcome->analogOk = true;
+
+  // The debounce accepts a level once it has held for the delay, seen by samples and a millisecond clock
+  const unsigned long shortestPhase = min(step->lowMicros, step->periodMicros - step->lowMicros);
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    outcome->expected[i] = 0;
+    outcome->counts[i] = 0;
+    if (!(step->channels & (1U << i)))
+    {
+      continue;
+    }
+
+    // Each pulse is one falling and one rising edge
+    const int mode = channelModes[i];
+    const unsigned int edges = mode == CHANNEL_MODE_BOTH ? 2 : mode == CHANNEL_MODE_DISABLED ? 0 : 1;
+    outcome->expected[i] = step->pulses * edges;
+    outcome->counts[i] = result->counts[i];
+    outcome->exact = outcome->exact && outcome->counts[i] == outcome->expected[i];
+
+    const unsigned long needed = ((unsigned long)max(debounceDelays[i], 0) + 2 * result->samplePeriod + 1) * 1000;
+    outcome->rated = outcome->rated && shortestPhase >= needed;
+  }
+
+  // The ramp is sampled, so its ends are reached to within the change over one sample
+  const unsigned long length = max(selfTestPatternMicros(step), 1UL);
+  const unsigned int low = min(step->rampFrom, step->rampTo);
+  const unsigned int high = max(step->rampFrom, step->rampTo);
+  const unsigned int tolerance = (unsigned long long)(high - low) * (result->samplePeriod + 1) * 1000 / length + 1;
+  for (int i = 0; i < 2; i++)
+  {
+    if (step->analogChannels & (1U << i))
+    {
+      outcome->analogOk = outcome->analogOk && result->analogMin[i] >= low && result->analogMax[i] <= high &&
+                          result->analogMin[i] <= low + tolerance && result->analogMax[i] + tolerance >= high;
+    }
+  }
+}
+
+// The values of the tested inputs, in input order
+static void appendChannels(char *message, size_t size, size_t *length, const char *key, unsigned int channels,
+                           const unsigned int *values)
+{
+  appendFormat(message, size, length, ",\"%s\":[", key);
+  const char *separator = "";
+  for (int i = 0; i < INPUT_CHANNELS; i++)
+  {
+    if (channels & (1U << i))
+    {
+      appendFormat(message, size, length, "%s%u", separator, values ? values[i] : i);
+      separator = ",";
+    }
+  }
+  appendFormat(message, size, length, "]");
+}
+
+size_t encodeSelfTestReport(const SELF_TEST_PLAN *plan, const SELF_TEST_OUTCOME *outcomes, unsigned int count,
+                            char *message, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  message[0] = '\0';
+
+  bool pass = count == plan->stepCount;
+  bool lossless = true;
+  float maxRate = 0;
+  for (unsigned int k = 0; k < count; k++)
+  {
+    const SELF_TEST_OUTCOME *outcome = &outcomes[k];
+    pass = pass && outcome->completed && outcome->analogOk && (outcome->exact || !outcome->rated);
+    lossless = lossless && outcome->completed && outcome->exact;
+    if (lossless)
+    {
+      maxRate = outcome->rate;
+    }
+  }
+
+  size_t length = 0;
+  appendFormat(message, size, &length, "{\"result\":\"%s\",\"max_hz\":%g,\"n\":%u,\"duty\":%u", pass ? "pass" : "fail",
+         maxRate, plan->pulses, plan->dutyPercent);
+  if (plan->burstPulses > 0)
+  {
+    appendFormat(message, size, &length, ",\"bp\":%u,\"bg\":%u", plan->burstPulses, plan->burstGapMillis);
+  }
+  appendChannels(message, size, &length, "ch", plan->channels, nullptr);
+
+  appendFormat(message, size, &length, ",\"steps\":[");
+  for (unsigned int k = 0; k < count; k++)
+  {
+    const SELF_TEST_OUTCOME *outcome = &outcomes[k];
+    appendFormat(message, size, &length, "%s{\"hz\":%g", k > 0 ? "," : "", outcome->rate);
+    if (!outcome->completed)
+    {
+      appendFormat(message, size, &length, ",\"ok\":false,\"error\":\"no result\"}");
+      continue;
+    }
+    appendFormat(message, size, &length, ",\"ok\":%s,\"rated\":%s", outcome->exact ? "true" : "false",
+           outcome->rated ? "true" : "false");
+    if (plan->channels != 0)
+    {
+      appendChannels(message, size, &length, "exp", plan->channels, outcome->expected);
+      appendChannels(message, size, &length, "cnt", plan->channels, outcome->counts);
+    }
+    if (plan->analogChannels != 0)
+    {
+      appendFormat(message, size, &length, ",\"analog\":%s", outcome->analogOk ? "true" : "false");
+    }
+    appendFormat(message, size, &length, "}");
+  }
+  appendFormat(message, size, &length, "]}");
+
+  return length;
+}
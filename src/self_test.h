@@ -0,0 +1,59 @@
+#ifndef SELF_TEST_H
+#define SELF_TEST_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "data_frame.h"
+
+// Self-test sweep run by the M7: the M4 drives a burst of synthetic pulses into the counting of each selected
+// input at one rate after another (see SELF_TEST_STEP) and the counts are compared with what the channel modes
+// should make of them. Requested with a signed command {"cmd":"selftest","csq":N} whose other keys are optional:
+//   ch    inputs to test, 1-6 (all)             hz    rates in Hz, rising (1, 2, 5, 10, 20, 50, 100, 200)
+//   n     pulses per rate (50)                   duty  percent of each period the input is low (50)
+//   bp    pulses per burst, 0 for none (0)       bg    milliseconds between bursts (0)
+//   an    analog inputs to ramp, 7-8 (none)      ramp  [from, to] of the ramp, 12 bit ([0, 4095])
+#define SELF_TEST_MAX_STEPS 12
+
+struct SELF_TEST_PLAN
+{
+  unsigned int channels; // Bit per input 1-6, as in SELF_TEST_STEP
+  unsigned int analogChannels;
+  unsigned int pulses;
+  unsigned int dutyPercent;
+  unsigned int burstPulses;
+  unsigned int burstGapMillis;
+  unsigned int rampFrom;
+  unsigned int rampTo;
+  unsigned int stepCount;
+  float rates[SELF_TEST_MAX_STEPS]; // Hz
+};
+
+// A step compared against what the M4 counted
+struct SELF_TEST_OUTCOME
+{
+  float rate;
+  bool completed;                        // The M4 reported the step in time
+  bool rated;                            // Pulses long enough for the debounce and sampling of every input tested
+  bool exact;                            // Every input counted what it should
+  bool analogOk;                         // The ramp reached the analog inputs from end to end
+  unsigned int expected[INPUT_CHANNELS]; // Edges each input should count
+  unsigned int counts[INPUT_CHANNELS];
+};
+
+// Read the plan from a request's body, keys left out take the defaults. Returns false if it is not valid.
+bool parseSelfTestRequest(JsonDocument &doc, SELF_TEST_PLAN *plan);
+
+// The step for one rate of the plan
+void buildSelfTestStep(const SELF_TEST_PLAN *plan, unsigned int index, SELF_TEST_STEP *step);
+
+// Compare a step's result with the counts expected under the channel modes and debounce delays (milliseconds)
+void evaluateSelfTestStep(const SELF_TEST_STEP *step, const SELF_TEST_RESULT *result, const int *channelModes,
+                          const int *debounceDelays, float rate, SELF_TEST_OUTCOME *outcome);
+
+// Build the report JSON for the steps run. The test passes if every step came back, every rated step counted
+// exactly and the ramps arrived; the highest rate up to which every step counted exactly is reported as max_hz.
+// Returns the message length.
+size_t encodeSelfTestReport(const SELF_TEST_PLAN *plan, const SELF_TEST_OUTCOME *outcomes, unsigned int count,
+                            char *message, size_t size);
+
+#endif // SELF_TEST_H
@@ -0,0 +1,397 @@
+#include "tls_client.h"
+#include <Watchdog.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/pk.h>
+#include <BlockDevice.h>
+#include <MBRBlockDevice.h>
+#include <FATFileSystem.h>
+
+// Transport callbacks for mbedtls, the context is the underlying Client
+static int sendToTransport(void *context, const unsigned char *data, size_t length)
+{
+  Client *transport = (Client *)context;
+  if (!transport->connected())
+  {
+    return MBEDTLS_ERR_SSL_CONN_EOF;
+  }
+  const size_t written = transport->write(data, length);
+  return written > 0 ? (int)written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+static int receiveFromTransport(void *context, unsigned char *data, size_t length)
+{
+  Client *transport = (Client *)context;
+  if (transport->available() <= 0)
+  {
+    // 0 tells mbedtls the connection has closed
+    return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : 0;
+  }
+  const int received = transport->read(data, length);
+  return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+// With a pin only the broker's own key matters: chain, validity and host name errors are cleared and the
+// leaf certificate is accepted only if the SHA-256 of its public key matches
+static int verifyPinned(void *context, mbedtls_x509_crt *certificate, int depth, uint32_t *flags)
+{
+  const uint8_t *pin = (const uint8_t *)context;
+  *flags = 0;
+  if (depth != 0)
+  {
+    return 0;
+  }
+
+  // The key is written at the end of the buffer
+  uint8_t key[600];
+  const int length = mbedtls_pk_write_pubkey_der(&certificate->pk, key, sizeof(key));
+  uint8_t hash[32];
+  if (length <= 0 || mbedtls_sha256_ret(key + sizeof(key) - length, length, hash, 0) != 0 ||
+      memcmp(hash, pin, sizeof(hash)) != 0)
+  {
+    *flags = MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+  }
+  return 0;
+}
+
+// Returns the number of certificates in the chain after parsing the file, -1 if it cannot be opened
+static int parseCaFile(mbedtls_x509_crt *chain, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    return -1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  // mbedtls wants the whole PEM with a terminating null, the text is only needed until it is parsed
+  char *pem = size > 0 ? (char *)malloc(size + 1) : nullptr;
+  if (pem)
+  {
+    const size_t read = fread(pem, 1, size, file);
+    pem[read] = '\0';
+
+    // Certificates that fail to parse are skipped
+    mbedtls_x509_crt_parse(chain, (const unsigned char *)pem, read + 1);
+    free(pem);
+  }
+  fclose(file);
+
+  int loaded = 0;
+  for (const mbedtls_x509_crt *certificate = chain; certificate && certificate->raw.len > 0;
+       certificate = certificate->next)
+  {
+    loaded++;
+  }
+  return loaded;
+}
+
+int loadTlsCaBundle(mbedtls_x509_crt *chain, const char *path)
+{
+  // The WiFi library may already have the partition mounted, otherwise mount it just for the read
+  const int loaded = parseCaFile(chain, path);
+  if (loaded >= 0)
+  {
+    return loaded;
+  }
+
+  mbed::MBRBlockDevice partition(mbed::BlockDevice::get_default_instance(), 1);
+  mbed::FATFileSystem fileSystem("wlan");
+  if (fileSystem.mount(&partition) != 0)
+  {
+    return 0;
+  }
+  const int mountedLoaded = parseCaFile(chain, path);
+  fileSystem.unmount();
+  return max(mountedLoaded, 0);
+}
+
+bool parseTlsPin(const char *text, uint8_t pin[32])
+{
+  if (strlen(text) != 64)
+  {
+    return false;
+  }
+
+  for (int i = 0; i < 64; i++)
+  {
+    const char c = text[i];
+    int value;
+    if (c >= '0' && c <= '9')
+    {
+      value = c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      value = c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+      value = c - 'A' + 10;
+    }
+    else
+    {
+      return false;
+    }
+    pin[i / 2] = i % 2 == 0 ? value << 4 : pin[i / 2] | value;
+  }
+  return true;
+}
+
+void TlsClient::begin(Client *transport, mbedtls_x509_crt *caChain, const uint8_t *pin)
+{
+  this->transport = transport;
+  this->caChain = caChain;
+  this->pin = pin;
+}
+
+// Allocate the TLS context once, it is reused for every connection
+bool TlsClient::setup()
+{
+  if (initialised)
+  {
+    return true;
+  }
+
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&random);
+  mbedtls_ssl_config_init(&config);
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_session_init(&session);
+
+  static const char personalisation[] = "busroot-dau";
+  lastError = mbedtls_ctr_drbg_seed(&random, mbedtls_entropy_func, &entropy,
+                                    (const unsigned char *)personalisation, sizeof(personalisation) - 1);
+  if (lastError == 0)
+  {
+    lastError = mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                            MBEDTLS_SSL_PRESET_DEFAULT);
+  }
+  if (lastError != 0)
+  {
+    return false;
+  }
+
+  mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &random);
+  if (pin)
+  {
+    // Without a CA chain a required verification always fails, the pin is checked after the handshake
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_verify(&config, verifyPinned, (void *)pin);
+  }
+  else
+  {
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&config, caChain, nullptr);
+  }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  mbedtls_ssl_conf_max_frag_len(&config, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+#endif
+
+  lastError = mbedtls_ssl_setup(&ssl, &config);
+  if (lastError != 0)
+  {
+    return false;
+  }
+
+  initialised = true;
+  return true;
+}
+
+int TlsClient::handshake(const char *host)
+{
+  lastError = mbedtls_ssl_session_reset(&ssl);
+  if (lastError == 0 && host)
+  {
+    lastError = mbedtls_ssl_set_hostname(&ssl, host);
+  }
+  if (lastError == 0 && haveSession)
+  {
+    // A broker that no longer has the session simply does a full handshake
+    lastError = mbedtls_ssl_set_session(&ssl, &session);
+  }
+  if (lastError != 0)
+  {
+    return 0;
+  }
+  mbedtls_ssl_set_bio(&ssl, transport, sendToTransport, receiveFromTransport, nullptr);
+
+  const unsigned long start = millis();
+  while ((lastError = mbedtls_ssl_handshake(&ssl)) != 0)
+  {
+    if ((lastError != MBEDTLS_ERR_SSL_WANT_READ && lastError != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+        millis() - start >= TLS_HANDSHAKE_TIMEOUT)
+    {
+      // Do not offer a session the broker has just refused
+      haveSession = false;
+      transport->stop();
+      return 0;
+    }
+    mbed::Watchdog::get_instance().kick();
+    delay(1);
+  }
+  handshakeMillis = millis() - start;
+
+  if (pin && mbedtls_ssl_get_verify_result(&ssl) != 0)
+  {
+    lastError = MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+    haveSession = false;
+    mbedtls_ssl_close_notify(&ssl);
+    transport->stop();
+    return 0;
+  }
+
+  // The broker echoes the offered session ID when it resumes
+  const mbedtls_ssl_session *current = ssl.session;
+  resumed = haveSession && current->id_len == sessionIdLength && memcmp(current->id, sessionId, sessionIdLength) == 0;
+
+  // Keep this session (with its ticket, if the broker issued one) for the next connect
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  haveSession = mbedtls_ssl_get_session(&ssl, &session) == 0;
+  sessionIdLength = current->id_len;
+  memcpy(sessionId, current->id, sessionIdLength);
+
+  open = true;
+  return 1;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+  stop();
+  if (!setup() || !transport->connect(ip, port))
+  {
+    return 0;
+  }
+  return handshake(nullptr);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+  stop();
+  if (!setup() || !transport->connect(host, port))
+  {
+    return 0;
+  }
+  return handshake(host);
+}
+
+size_t TlsClient::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+size_t TlsClient::write(const uint8_t *data, size_t length)
+{
+  if (!open)
+  {
+    return 0;
+  }
+
+  size_t written = 0;
+  const unsigned long start = millis();
+  while (written < length)
+  {
+    const int result = mbedtls_ssl_write(&ssl, data + written, length - written);
+    if (result > 0)
+    {
+      written += result;
+    }
+    else if ((result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+             millis() - start >= TLS_HANDSHAKE_TIMEOUT)
+    {
+      stop();
+      break;
+    }
+  }
+  return written;
+}
+
+int TlsClient::available()
+{
+  if (!open)
+  {
+    return 0;
+  }
+
+  // Decrypt the next record once it has arrived, a zero length read does just that
+  if (mbedtls_ssl_get_bytes_avail(&ssl) == 0 && transport->available() > 0)
+  {
+    const int result = mbedtls_ssl_read(&ssl, nullptr, 0);
+    if (result < 0 && result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      stop();
+      return 0;
+    }
+  }
+  return mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int TlsClient::read(uint8_t *data, size_t length)
+{
+  if (!open)
+  {
+    return -1;
+  }
+
+  const int result = mbedtls_ssl_read(&ssl, data, length);
+  if (result > 0)
+  {
+    return result;
+  }
+  if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    // Closed by the broker (0 or close notify) or a fatal error
+    stop();
+  }
+  return -1;
+}
+
+int TlsClient::peek()
+{
+  // Not used by the MQTT client, and mbedtls has no way to look without consuming
+  return -1;
+}
+
+void TlsClient::flush()
+{
+  transport->flush();
+}
+
+void TlsClient::stop()
+{
+  if (open)
+  {
+    mbedtls_ssl_close_notify(&ssl);
+    open = false;
+  }
+  if (transport)
+  {
+    transport->stop();
+  }
+}
+
+uint8_t TlsClient::connected()
+{
+  if (open && !transport->connected() && mbedtls_ssl_get_bytes_avail(&ssl) == 0)
+  {
+    stop();
+  }
+  return open;
+}
+
+TlsClient::operator bool()
+{
+  return open;
+}
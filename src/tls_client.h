@@ -0,0 +1,82 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// TLS on top of a plain Client (Ethernet or WiFi) using the core's mbedtls, for MQTT over TLS.
+//
+// Everything costly is done once: the trust anchors are parsed at boot and the TLS context is allocated on
+// the first connect and reset rather than freed on stop. The session (ID or ticket) from the last handshake is
+// offered on the next connect, so a reconnect after a brief drop takes one round trip and no public key
+// operations instead of a full handshake. Records are limited to 4KB where the library allows, which fits
+// the largest MQTT packet.
+//
+// The broker is authenticated either by the SHA-256 of its certificate's public key (pinning, chain and
+// host name are then not checked) or against a CA bundle, with its host name checked.
+
+// Bundle the Opta's WiFi firmware updater writes to the QSPI flash, also used by WiFiSSLClient
+#define TLS_CA_BUNDLE_PATH "/wlan/cacert.pem"
+
+// How long a handshake may take before the connect fails
+#define TLS_HANDSHAKE_TIMEOUT 15000
+
+// Parse the CA bundle at path into chain. Returns the number of certificates loaded, 0 on failure.
+int loadTlsCaBundle(mbedtls_x509_crt *chain, const char *path);
+
+// Parse a SHA-256 pin given as 64 hex digits. Returns false if it is malformed.
+bool parseTlsPin(const char *text, uint8_t pin[32]);
+
+class TlsClient : public Client
+{
+public:
+  // Set the transport and trust before the first connect. caChain is used when pin is null, both must outlive
+  // the client.
+  void begin(Client *transport, mbedtls_x509_crt *caChain, const uint8_t *pin);
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *data, size_t length) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override;
+
+  // Milliseconds the last handshake took, and whether it resumed the previous session
+  unsigned long handshakeMillis = 0;
+  bool resumed = false;
+
+  // mbedtls error of the last failed connect, 0 if none
+  int lastError = 0;
+
+private:
+  bool setup();
+  int handshake(const char *host);
+
+  Client *transport = nullptr;
+  mbedtls_x509_crt *caChain = nullptr;
+  const uint8_t *pin = nullptr;
+
+  bool initialised = false;
+  bool open = false;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context random;
+  mbedtls_ssl_config config;
+  mbedtls_ssl_context ssl;
+
+  bool haveSession = false;
+  mbedtls_ssl_session session;
+  uint8_t sessionId[32]; // ID of the saved session, to tell whether the broker resumed it
+  size_t sessionIdLength = 0;
+};
+
+#endif // TLS_CLIENT_H
@@ -0,0 +1,219 @@
+#include <unity.h>
+#include <vector>
+#include "config_store.h"
+
+// Power cuts part way through writeConfigRecord. The device below counts every program unit and erase page as
+// one step and loses power at a chosen step: that unit is left half written (or the page half erased) and
+// nothing after it reaches the flash. Reading back must then give the config as it was before the save, or the
+// new one if its record was complete, and a further save must still work.
+
+class RamBlockDevice : public mbed::BlockDevice
+{
+public:
+  static const bd_size_t programSize = 32;
+  static const bd_size_t eraseSize = 2048;
+
+  std::vector<uint8_t> memory = std::vector<uint8_t>(2 * eraseSize, 0xFF);
+
+  // Steps taken since the last cut was armed, and the step the power fails at (-1 for none)
+  long steps = 0;
+  long cutAt = -1;
+
+  void arm(long step)
+  {
+    steps = 0;
+    cutAt = step;
+  }
+
+  bool powerLost() const
+  {
+    return cutAt >= 0 && steps > cutAt;
+  }
+
+  int init() override { return 0; }
+  int deinit() override { return 0; }
+
+  int read(void *buffer, bd_addr_t address, bd_size_t size) override
+  {
+    if (address + size > memory.size())
+    {
+      return -1;
+    }
+    memcpy(buffer, memory.data() + address, size);
+    return 0;
+  }
+
+  // Flash programming only clears bits
+  int program(const void *buffer, bd_addr_t address, bd_size_t size) override
+  {
+    if (address % programSize != 0 || size % programSize != 0 || address + size > memory.size())
+    {
+      return -1;
+    }
+    const uint8_t *data = (const uint8_t *)buffer;
+    for (bd_size_t unit = 0; unit < size; unit += programSize)
+    {
+      const bd_size_t length = step() ? programSize : (powerLost() && steps == cutAt + 1 ? programSize / 2 : 0);
+      for (bd_size_t i = 0; i < length; i++)
+      {
+        memory[address + unit + i] &= data[unit + i];
+      }
+      if (powerLost())
+      {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  int erase(bd_addr_t address, bd_size_t size) override
+  {
+    if (address % eraseSize != 0 || size % eraseSize != 0 || address + size > memory.size())
+    {
+      return -1;
+    }
+    for (bd_size_t page = 0; page < size; page += programSize)
+    {
+      const bool complete = step();
+      for (bd_size_t i = 0; i < programSize; i++)
+      {
+        if (complete || (powerLost() && steps == cutAt + 1 && i % 2 == 0))
+        {
+          memory[address + page + i] = 0xFF;
+        }
+      }
+      if (powerLost())
+      {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  bd_size_t get_read_size() const override { return 1; }
+  bd_size_t get_program_size() const override { return programSize; }
+  bd_size_t get_erase_size() const override { return eraseSize; }
+  bd_size_t size() const override { return memory.size(); }
+
+private:
+  // Count a step, false if the power fails before it completes
+  bool step()
+  {
+    steps++;
+    return !powerLost();
+  }
+};
+
+static RamBlockDevice device;
+
+// A config of the given length, different for every seed
+static std::vector<uint8_t> makeConfig(unsigned int seed, size_t length)
+{
+  std::vector<uint8_t> data(length);
+  for (size_t i = 0; i < length; i++)
+  {
+    data[i] = (uint8_t)(seed * 31 + i * 7);
+  }
+  return data;
+}
+
+static ConfigRecordType readBack(std::vector<uint8_t> *data)
+{
+  uint8_t buffer[CONFIG_RECORD_MAX_LENGTH];
+  size_t length = 0;
+  const ConfigRecordType type = readConfigRecord(&device, buffer, sizeof(buffer), &length);
+  data->assign(buffer, buffer + length);
+  return type;
+}
+
+// Cut the power at every step of saving data, checking what each cut leaves, then save it for good
+static void saveWithEveryCut(const std::vector<uint8_t> &data, unsigned int seed)
+{
+  std::vector<uint8_t> before;
+  const ConfigRecordType typeBefore = readBack(&before);
+  const std::vector<uint8_t> saved = device.memory;
+
+  for (long cut = 0;; cut++)
+  {
+    device.arm(cut);
+    const bool written = writeConfigRecord(&device, data.data(), data.size());
+    const bool interrupted = device.powerLost();
+    device.arm(-1);
+
+    if (!interrupted)
+    {
+      TEST_ASSERT_TRUE(written);
+      break;
+    }
+
+    std::vector<uint8_t> after;
+    const ConfigRecordType type = readBack(&after);
+    const bool old = type == typeBefore && after == before;
+    const bool fresh = type == CONFIG_RECORD_VALID && after == data;
+    char message[96];
+    snprintf(message, sizeof(message), "save %u cut at step %ld read back neither config", seed, cut);
+    TEST_ASSERT_TRUE_MESSAGE(old || fresh, message);
+
+    // Saving again after the cut works
+    const std::vector<uint8_t> retry = makeConfig(seed + 1000, 40);
+    TEST_ASSERT_TRUE(writeConfigRecord(&device, retry.data(), retry.size()));
+    TEST_ASSERT_EQUAL(CONFIG_RECORD_VALID, readBack(&after));
+    snprintf(message, sizeof(message), "save %u cut at step %ld lost the next save", seed, cut);
+    TEST_ASSERT_TRUE_MESSAGE(after == retry, message);
+
+    device.memory = saved;
+  }
+
+  std::vector<uint8_t> after;
+  TEST_ASSERT_EQUAL(CONFIG_RECORD_VALID, readBack(&after));
+  TEST_ASSERT_TRUE(after == data);
+}
+
+void setUp()
+{
+  device.memory.assign(device.memory.size(), 0xFF);
+  device.arm(-1);
+}
+
+void tearDown()
+{
+}
+
+void test_empty_device_reads_nothing()
+{
+  std::vector<uint8_t> data;
+  TEST_ASSERT_EQUAL(CONFIG_RECORD_NONE, readBack(&data));
+}
+
+// Enough saves of varying size to fill both sectors several times, so cuts land in appends, in the erase of
+// a full sector and in the first record after it
+void test_power_cut_at_every_step()
+{
+  for (unsigned int seed = 0; seed < 40; seed++)
+  {
+    saveWithEveryCut(makeConfig(seed, 60 + (seed * 37) % 400), seed);
+  }
+}
+
+// The first save after a web tool upload goes to sector B and then erases the token
+void test_power_cut_replacing_legacy_token()
+{
+  const char token[] = "eyJkaWQiOiJEQVUwMDAwMSIsImNvbSI6IkVUSEVSTkVUIn0=";
+  memcpy(device.memory.data(), token, strlen(token));
+
+  std::vector<uint8_t> data;
+  TEST_ASSERT_EQUAL(CONFIG_RECORD_LEGACY, readBack(&data));
+  TEST_ASSERT_EQUAL(strlen(token), data.size());
+
+  saveWithEveryCut(makeConfig(1, 200), 1);
+  saveWithEveryCut(makeConfig(2, 300), 2);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_device_reads_nothing);
+  RUN_TEST(test_power_cut_at_every_step);
+  RUN_TEST(test_power_cut_replacing_legacy_token);
+  return UNITY_END();
+}
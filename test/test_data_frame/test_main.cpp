@@ -0,0 +1,211 @@
+#include <unity.h>
+#include <sys/mman.h>
+#include "data_frame.h"
+#include "sim.h"
+
+// Resets part way through writing the frame buffer indices and header. Every store to them goes through
+// journalStoreHook, which stops the write after a given number of stores as a reset would. Whatever was left,
+// restoreDataFrameBuffer must come back with a head and tail that were each completely written.
+
+// Thrown from the hook in place of a reset
+struct TornWrite
+{
+};
+
+static unsigned int storesLeft;
+
+static void countStore()
+{
+  if (storesLeft-- == 0)
+  {
+    throw TornWrite();
+  }
+}
+
+// Run a write stopped after the given number of stores, true if it finished before that
+template <class Write>
+static bool writeTorn(unsigned int stores, Write write)
+{
+  storesLeft = stores;
+  journalStoreHook = countStore;
+  bool finished = true;
+  try
+  {
+    write();
+  }
+  catch (const TornWrite &)
+  {
+    finished = false;
+  }
+  journalStoreHook = nullptr;
+  return finished;
+}
+
+static unsigned int readValid(const volatile DATA_FRAME_INDEX *index)
+{
+  unsigned int value;
+  TEST_ASSERT_TRUE_MESSAGE(readJournaledIndex(index, dataFrameCapacity, &value), "no valid slot");
+  return value;
+}
+
+// A buffer holding frames tail to head, as left by an earlier boot
+static void startBuffer(unsigned int head, unsigned int tail)
+{
+  restoreDataFrameBuffer();
+  writeFrameIndex(&data_frame_buffer_sdram->head, head);
+  writeFrameIndex(&data_frame_buffer_sdram->tail, tail);
+  writeFrameIndex(&data_frame_buffer_sdram->sent, tail);
+}
+
+void setUp()
+{
+  memset((void *)data_frame_buffer_sdram, 0, sizeof(DATA_FRAME_BUFFER));
+}
+
+void tearDown()
+{
+  journalStoreHook = nullptr;
+}
+
+void test_cold_boot_starts_empty()
+{
+  TEST_ASSERT_FALSE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(0, readValid(&data_frame_buffer_sdram->head));
+  TEST_ASSERT_EQUAL_UINT(0, readValid(&data_frame_buffer_sdram->tail));
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+}
+
+// Several writes in a row, so both slots of the index are overwritten with a reset part way through
+void test_index_write_torn_at_each_store()
+{
+  startBuffer(10, 3);
+  unsigned int head = 10;
+
+  for (unsigned int write = 0; write < 4; write++)
+  {
+    const unsigned int next = head + 7;
+    unsigned int stores = 0;
+    bool finished = false;
+    while (!finished)
+    {
+      finished = writeTorn(stores++, [&]
+                           { writeFrameIndex(&data_frame_buffer_sdram->head, next); });
+
+      TEST_ASSERT_TRUE_MESSAGE(restoreDataFrameBuffer(), "buffer discarded after a torn index write");
+      const unsigned int restored = readValid(&data_frame_buffer_sdram->head);
+      TEST_ASSERT_EQUAL_UINT(finished ? next : head, restored);
+      TEST_ASSERT_EQUAL_UINT(3, readValid(&data_frame_buffer_sdram->tail));
+
+      // The next attempt starts from what the reset left, as after a real one
+    }
+    TEST_ASSERT_GREATER_THAN(1, stores);
+    head = next;
+  }
+}
+
+// The M7 moving the tail on while the M4 resets in the middle of the header update at boot
+void test_warm_restore_torn_at_each_store()
+{
+  startBuffer(200, 150);
+
+  unsigned int stores = 0;
+  bool finished = false;
+  while (!finished)
+  {
+    finished = writeTorn(stores++, []
+                         { restoreDataFrameBuffer(); });
+
+    TEST_ASSERT_TRUE_MESSAGE(restoreDataFrameBuffer(), "buffer discarded after a torn warm restore");
+    TEST_ASSERT_EQUAL_UINT(200, readValid(&data_frame_buffer_sdram->head));
+    TEST_ASSERT_EQUAL_UINT(150, readValid(&data_frame_buffer_sdram->tail));
+  }
+}
+
+// A buffer left by firmware with another layout is emptied. A reset part way through must never leave the old
+// indices in a buffer that reads as valid.
+void test_cold_initialisation_torn_at_each_store()
+{
+  unsigned int stores = 0;
+  bool finished = false;
+  while (!finished)
+  {
+    startBuffer(500, 20);
+    data_frame_buffer_sdram->version = DATA_FRAME_BUFFER_VERSION - 1;
+
+    finished = writeTorn(stores++, []
+                         { restoreDataFrameBuffer(); });
+
+    const bool kept = restoreDataFrameBuffer();
+    TEST_ASSERT_TRUE_MESSAGE(kept == finished, "a torn initialisation was taken as valid");
+    TEST_ASSERT_EQUAL_UINT(0, readValid(&data_frame_buffer_sdram->head));
+    TEST_ASSERT_EQUAL_UINT(0, readValid(&data_frame_buffer_sdram->tail));
+    TEST_ASSERT_EQUAL_UINT(0, readValid(&data_frame_buffer_sdram->sent));
+    TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  }
+  TEST_ASSERT_GREATER_THAN(10, stores);
+}
+
+// A spoiled slot is skipped, the other one still holds the previous value
+void test_corrupt_slot_falls_back()
+{
+  startBuffer(40, 30);
+  writeFrameIndex(&data_frame_buffer_sdram->head, 41);
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (data_frame_buffer_sdram->head.slots[i].value == 41)
+    {
+      data_frame_buffer_sdram->head.slots[i].crc ^= 1;
+    }
+  }
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(40, readValid(&data_frame_buffer_sdram->head));
+}
+
+// A sent index outside the buffered frames, or with no valid slot, restarts publishing from the tail
+void test_sent_outside_buffer_clamped_to_tail()
+{
+  startBuffer(40, 30);
+  writeFrameIndex(&data_frame_buffer_sdram->sent, 35);
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(35, readValid(&data_frame_buffer_sdram->sent));
+
+  writeFrameIndex(&data_frame_buffer_sdram->sent, 45);
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(30, readValid(&data_frame_buffer_sdram->sent));
+
+  // Wrapped around the end of the buffer
+  startBuffer(5, dataFrameCapacity - 5);
+  writeFrameIndex(&data_frame_buffer_sdram->sent, 2);
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(2, readValid(&data_frame_buffer_sdram->sent));
+  writeFrameIndex(&data_frame_buffer_sdram->sent, 10);
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(dataFrameCapacity - 5, readValid(&data_frame_buffer_sdram->sent));
+
+  for (int i = 0; i < 2; i++)
+  {
+    data_frame_buffer_sdram->sent.slots[i].crc ^= 1;
+  }
+  TEST_ASSERT_TRUE(restoreDataFrameBuffer());
+  TEST_ASSERT_EQUAL_UINT(dataFrameCapacity - 5, readValid(&data_frame_buffer_sdram->sent));
+}
+
+int main(int argc, char **argv)
+{
+  // The shared region at its hardware address, as the simulator maps it
+  if (mmap((void *)SIM_D2_SRAM_ADDRESS, SIM_D2_SRAM_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)SIM_D2_SRAM_ADDRESS)
+  {
+    return 1;
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_cold_boot_starts_empty);
+  RUN_TEST(test_index_write_torn_at_each_store);
+  RUN_TEST(test_warm_restore_torn_at_each_store);
+  RUN_TEST(test_cold_initialisation_torn_at_each_store);
+  RUN_TEST(test_corrupt_slot_falls_back);
+  RUN_TEST(test_sent_outside_buffer_clamped_to_tail);
+  return UNITY_END();
+}
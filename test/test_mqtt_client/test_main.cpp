@@ -0,0 +1,255 @@
+#include <unity.h>
+#include <SocketClient.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "mqtt_client.h"
+#include "sim.h"
+
+// The pipelined QoS 1 publishing against the simulator's broker over a loopback socket, with the broker holding
+// every packet for a while so each round trip is as long as on a cellular link. With a window of messages in
+// flight the round trips overlap, and messages cut off by a dropped connection are sent again after the next
+// connect and handed back once, in publish order. Messages an MQTT 5 broker refuses are handed back as refused.
+
+static const uint16_t brokerPort = 18841;
+static const unsigned int latency = 100; // Milliseconds added to every round trip
+static const char *topic = "test/mqtt_client";
+
+static char sinkPath[] = "/tmp/test_mqtt_client_XXXXXX";
+static SocketClient transport(SIM_LINK_ETHERNET);
+static MQTT_CLIENT client;
+static std::vector<uint32_t> acknowledged;
+static std::vector<uint32_t> refused;
+static uint8_t refusedReason = 0;
+
+uint64_t simMicros()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t simBootMicros()
+{
+  return simMicros();
+}
+
+static void onAcknowledged(uint32_t tag)
+{
+  acknowledged.push_back(tag);
+}
+
+static void onRefused(uint32_t tag, uint8_t reason)
+{
+  refused.push_back(tag);
+  refusedReason = reason;
+}
+
+static void connectClient(unsigned int window, bool version5 = false)
+{
+  mqttInit(&client, &transport, "127.0.0.1", brokerPort, 60, window, nullptr, onAcknowledged);
+  mqttOnRefused(&client, onRefused);
+  if (version5)
+  {
+    mqttUseVersion5(&client, 0, 0);
+  }
+  TEST_ASSERT_TRUE_MESSAGE(mqttConnect(&client, "test-mqtt-client", nullptr, nullptr), "no connection to the broker");
+}
+
+// Publish messages tagged first to first + count - 1 as fast as the window allows
+static void publish(uint32_t first, unsigned int count)
+{
+  for (uint32_t tag = first; tag < first + count;)
+  {
+    mqttLoop(&client);
+    if (mqttCanPublish(&client, 1))
+    {
+      char payload[32];
+      snprintf(payload, sizeof(payload), "{\"tag\":%u}", tag);
+      TEST_ASSERT_TRUE(mqttPublish(&client, topic, (const uint8_t *)payload, strlen(payload), 1, tag));
+      tag++;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+}
+
+// Run the client until every message is acknowledged, false if that takes longer than timeout
+static bool drain(unsigned long timeout)
+{
+  const unsigned long start = millis();
+  while (mqttInflightCount(&client) > 0)
+  {
+    if (millis() - start > timeout)
+    {
+      return false;
+    }
+    mqttLoop(&client);
+    delay(1);
+  }
+  return true;
+}
+
+// Times the broker received each tag, from its sink
+static std::vector<unsigned int> receivedTags(uint32_t count)
+{
+  std::vector<unsigned int> received(count, 0);
+  FILE *sink = fopen(sinkPath, "r");
+  char line[512];
+  while (sink && fgets(line, sizeof(line), sink))
+  {
+    const char *found = strstr(line, "{\\\"tag\\\":");
+    if (found && strstr(line, topic))
+    {
+      const unsigned long tag = strtoul(found + strlen("{\\\"tag\\\":"), nullptr, 10);
+      if (tag < count)
+      {
+        received[tag]++;
+      }
+    }
+  }
+  if (sink)
+  {
+    fclose(sink);
+  }
+  return received;
+}
+
+void setUp()
+{
+  acknowledged.clear();
+  refused.clear();
+  setSimBrokerRefusals(0, 0);
+  truncate(sinkPath, 0);
+}
+
+void tearDown()
+{
+  mqttDisconnect(&client);
+}
+
+// Stop-and-wait pays one round trip per message, the window only about one per window of messages
+void test_window_overlaps_round_trips()
+{
+  const unsigned int messages = 48;
+
+  connectClient(1);
+  unsigned long start = millis();
+  publish(0, 8);
+  TEST_ASSERT_TRUE(drain(5000));
+  const unsigned long serial = millis() - start;
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT(8 * latency, serial);
+  mqttDisconnect(&client);
+
+  acknowledged.clear();
+  connectClient(8);
+  start = millis();
+  publish(0, messages);
+  TEST_ASSERT_TRUE(drain(5000));
+  const unsigned long pipelined = millis() - start;
+
+  char message[96];
+  snprintf(message, sizeof(message), "%u messages took %lu ms with a window of 8", messages, pipelined);
+  TEST_ASSERT_LESS_THAN_UINT_MESSAGE((messages / 8 + 2) * latency, pipelined, message);
+
+  TEST_ASSERT_EQUAL_UINT(messages, acknowledged.size());
+  for (uint32_t tag = 0; tag < messages; tag++)
+  {
+    TEST_ASSERT_EQUAL_UINT(tag, acknowledged[tag]);
+  }
+}
+
+// The connection drops with a full window waiting for PUBACKs. Nothing is handed back for it, and after the
+// reconnect the same messages go again and are each handed back once, in order.
+void test_inflight_sent_again_after_reconnect()
+{
+  const unsigned int messages = 24;
+
+  connectClient(8);
+  publish(0, 8);
+  TEST_ASSERT_TRUE(acknowledged.empty());
+  transport.stop();
+  TEST_ASSERT_FALSE(mqttConnected(&client));
+  TEST_ASSERT_EQUAL_UINT(8, mqttInflightCount(&client));
+
+  TEST_ASSERT_TRUE(mqttConnect(&client, "test-mqtt-client", nullptr, nullptr));
+  publish(8, messages - 8);
+  TEST_ASSERT_TRUE(drain(5000));
+
+  TEST_ASSERT_EQUAL_UINT(messages, acknowledged.size());
+  for (uint32_t tag = 0; tag < messages; tag++)
+  {
+    TEST_ASSERT_EQUAL_UINT(tag, acknowledged[tag]);
+  }
+
+  // The broker may see a message twice, the first copy having arrived before the drop, but never misses one
+  const std::vector<unsigned int> received = receivedTags(messages);
+  for (uint32_t tag = 0; tag < messages; tag++)
+  {
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT(1, received[tag]);
+  }
+}
+
+// Messages discarded while disconnected are neither sent again nor handed back
+void test_discarded_inflight_not_sent_again()
+{
+  connectClient(8);
+  publish(0, 4);
+  transport.stop();
+  TEST_ASSERT_FALSE(mqttConnected(&client));
+  mqttDiscardInflight(&client, 2);
+
+  TEST_ASSERT_TRUE(mqttConnect(&client, "test-mqtt-client", nullptr, nullptr));
+  TEST_ASSERT_TRUE(drain(5000));
+
+  const uint32_t expected[] = {0, 1, 3};
+  TEST_ASSERT_EQUAL_UINT(3, acknowledged.size());
+  TEST_ASSERT_EQUAL_UINT32_ARRAY(expected, acknowledged.data(), 3);
+}
+
+// A refusal such as quota exceeded is not a delivery: the message comes back as refused and the rest as
+// acknowledged
+void test_refused_messages_not_acknowledged()
+{
+  connectClient(8, true);
+  setSimBrokerRefusals(2, 0x97);
+  publish(0, 6);
+  TEST_ASSERT_TRUE(drain(5000));
+
+  const uint32_t expectedRefused[] = {0, 1};
+  const uint32_t expectedAcknowledged[] = {2, 3, 4, 5};
+  TEST_ASSERT_EQUAL_UINT(2, refused.size());
+  TEST_ASSERT_EQUAL_UINT32_ARRAY(expectedRefused, refused.data(), 2);
+  TEST_ASSERT_EQUAL_HEX8(0x97, refusedReason);
+  TEST_ASSERT_EQUAL_UINT(4, acknowledged.size());
+  TEST_ASSERT_EQUAL_UINT32_ARRAY(expectedAcknowledged, acknowledged.data(), 4);
+  TEST_ASSERT_EQUAL_UINT(2, client.refusedCount);
+}
+
+int main(int argc, char **argv)
+{
+  const int sink = mkstemp(sinkPath);
+  if (sink < 0)
+  {
+    return 1;
+  }
+  close(sink);
+
+  setSimBrokerLatency(latency);
+  if (!startSimBroker(brokerPort, sinkPath))
+  {
+    return 1;
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_window_overlaps_round_trips);
+  RUN_TEST(test_inflight_sent_again_after_reconnect);
+  RUN_TEST(test_discarded_inflight_not_sent_again);
+  RUN_TEST(test_refused_messages_not_acknowledged);
+  const int failures = UNITY_END();
+  unlink(sinkPath);
+  return failures;
+}
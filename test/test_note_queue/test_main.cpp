@@ -0,0 +1,263 @@
+#include <unity.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "note_queue.h"
+#include "frame_codec.h"
+#include "sim.h"
+
+// Notes against the simulator's Notecard, which writes every request it takes to a sink as a JSON line. Checks
+// the frame note template, that a frame note carries its block whole and that syncs are asked for on each of
+// their triggers and only then. The clock is the test's, so the sync interval runs without waiting for it.
+
+static char sinkPath[] = "/tmp/test_note_queue_XXXXXX";
+static long sinkRead = 0; // Where the requests not yet looked at start
+static Notecard notecard;
+static NOTE_QUEUE queue;
+static uint64_t clockMicros = 0;
+
+uint64_t simMicros()
+{
+  return clockMicros;
+}
+
+uint64_t simBootMicros()
+{
+  return clockMicros;
+}
+
+static void advanceSeconds(unsigned long seconds)
+{
+  clockMicros += seconds * 1000000ULL;
+}
+
+// Requests the Notecard took since the last call, as JSON
+static std::vector<std::string> takeRequests()
+{
+  std::vector<std::string> requests;
+  FILE *sink = fopen(sinkPath, "r");
+  if (!sink)
+  {
+    return requests;
+  }
+  fseek(sink, sinkRead, SEEK_SET);
+  char line[4096];
+  while (fgets(line, sizeof(line), sink))
+  {
+    const char *request = strstr(line, "\"request\":");
+    if (request)
+    {
+      std::string text = request + strlen("\"request\":");
+      requests.push_back(text.substr(0, text.rfind('}')));
+    }
+  }
+  sinkRead = ftell(sink);
+  fclose(sink);
+  return requests;
+}
+
+static std::string stringValue(const std::string &json, const char *key)
+{
+  const std::string pattern = std::string("\"") + key + "\":\"";
+  const size_t start = json.find(pattern);
+  if (start == std::string::npos)
+  {
+    return "";
+  }
+  const size_t from = start + pattern.size();
+  return json.substr(from, json.find('"', from) - from);
+}
+
+static size_t decodeBase64(const std::string &text, uint8_t *data)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t length = 0;
+  uint32_t bits = 0;
+  int count = 0;
+  for (char c : text)
+  {
+    const char *found = strchr(alphabet, c);
+    if (c == '=' || !found)
+    {
+      break;
+    }
+    bits = bits << 6 | (uint32_t)(found - alphabet);
+    count += 6;
+    if (count >= 8)
+    {
+      count -= 8;
+      data[length++] = (bits >> count) & 0xFF;
+    }
+  }
+  return length;
+}
+
+static void makeFrames(DATA_FRAME_SEND *frames, unsigned int count)
+{
+  memset(frames, 0, count * sizeof(DATA_FRAME_SEND));
+  for (unsigned int i = 0; i < count; i++)
+  {
+    frames[i].input1Count = i % 3;
+    frames[i].input1Total = 100 + i * 2;
+    frames[i].input7Analog = frames[i].input7Min = frames[i].input7Max = 2000 + i;
+    frames[i].span = 1;
+    frames[i].frameNumber = 500 + i;
+  }
+}
+
+// Queue a block of count frames as note sequence, and check the note carries all of them
+static void checkFrameNote(unsigned int sequence, unsigned int count)
+{
+  DATA_FRAME_SEND frames[FRAME_BLOCK_FRAMES];
+  makeFrames(frames, count);
+  uint8_t block[FRAME_BLOCK_MAX_BYTES];
+  const size_t length = encodeFrameBlock(frames, count, block, sizeof(block));
+  TEST_ASSERT_GREATER_THAN(0, length);
+  TEST_ASSERT_TRUE(addFrameNote(&queue, block, length, sequence, count));
+
+  const std::vector<std::string> requests = takeRequests();
+  TEST_ASSERT_EQUAL_UINT(1, requests.size());
+  const std::string &note = requests[0];
+  TEST_ASSERT_EQUAL_STRING("note.add", stringValue(note, "req").c_str());
+  TEST_ASSERT_EQUAL_STRING(NOTE_FRAMES_FILE, stringValue(note, "file").c_str());
+  char body[64];
+  snprintf(body, sizeof(body), "\"body\":{\"seq\":%u,\"n\":%u}", sequence, count);
+  TEST_ASSERT_TRUE_MESSAGE(note.find(body) != std::string::npos, note.c_str());
+
+  uint8_t decoded[FRAME_BLOCK_MAX_BYTES];
+  const size_t decodedLength = decodeBase64(stringValue(note, "payload"), decoded);
+  TEST_ASSERT_EQUAL_UINT(length, decodedLength);
+  DATA_FRAME_SEND received[FRAME_BLOCK_FRAMES];
+  TEST_ASSERT_EQUAL_UINT(count, decodeFrameBlock(decoded, decodedLength, received));
+  TEST_ASSERT_EQUAL_MEMORY(frames, received, count * sizeof(DATA_FRAME_SEND));
+}
+
+static unsigned int countSyncs(const std::vector<std::string> &requests)
+{
+  unsigned int syncs = 0;
+  for (const std::string &request : requests)
+  {
+    syncs += stringValue(request, "req") == "hub.sync";
+  }
+  return syncs;
+}
+
+static void addMessages(unsigned int count)
+{
+  for (unsigned int i = 0; i < count; i++)
+  {
+    TEST_ASSERT_TRUE(addMessageNote(&queue, "busroot/v2/dau/TEST/event", "{\"c\":1,\"s\":0}"));
+  }
+}
+
+void setUp()
+{
+  takeRequests();
+  startNoteQueue(&queue, &notecard);
+  takeRequests();
+}
+
+void tearDown()
+{
+}
+
+void test_template_registered_on_start()
+{
+  TEST_ASSERT_TRUE(startNoteQueue(&queue, &notecard));
+
+  const std::vector<std::string> requests = takeRequests();
+  TEST_ASSERT_EQUAL_UINT(1, requests.size());
+  TEST_ASSERT_EQUAL_STRING("note.template", stringValue(requests[0], "req").c_str());
+  TEST_ASSERT_EQUAL_STRING(NOTE_FRAMES_FILE, stringValue(requests[0], "file").c_str());
+  char length[32];
+  snprintf(length, sizeof(length), "\"length\":%u", (unsigned int)FRAME_BLOCK_MAX_BYTES);
+  TEST_ASSERT_TRUE(requests[0].find(length) != std::string::npos);
+  TEST_ASSERT_TRUE(requests[0].find("\"body\":{\"seq\":24,\"n\":21}") != std::string::npos);
+}
+
+void test_frame_notes_carry_whole_blocks()
+{
+  checkFrameNote(0, 1);
+  checkFrameNote(1, 7);
+  checkFrameNote(2, FRAME_BLOCK_FRAMES);
+}
+
+void test_messages_go_to_their_own_file()
+{
+  addMessages(1);
+  const std::vector<std::string> requests = takeRequests();
+  TEST_ASSERT_EQUAL_UINT(1, requests.size());
+  TEST_ASSERT_EQUAL_STRING("note.add", stringValue(requests[0], "req").c_str());
+  TEST_ASSERT_EQUAL_STRING(NOTE_MESSAGES_FILE, stringValue(requests[0], "file").c_str());
+  TEST_ASSERT_EQUAL_STRING("busroot/v2/dau/TEST/event", stringValue(requests[0], "topic").c_str());
+}
+
+void test_sync_once_enough_notes_wait()
+{
+  addMessages(2);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 900, 3));
+  addMessages(1);
+  TEST_ASSERT_TRUE(checkNoteSync(&queue, 900, 3));
+  TEST_ASSERT_EQUAL_UINT(1, countSyncs(takeRequests()));
+
+  // Frame notes count as well, and the count starts again after a sync
+  checkFrameNote(0, 4);
+  checkFrameNote(1, 4);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 900, 3));
+  addMessages(1);
+  TEST_ASSERT_TRUE(checkNoteSync(&queue, 900, 3));
+  TEST_ASSERT_EQUAL_UINT(1, countSyncs(takeRequests()));
+}
+
+void test_sync_once_interval_passed()
+{
+  addMessages(1);
+  advanceSeconds(899);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 900, 8));
+  advanceSeconds(1);
+  TEST_ASSERT_TRUE(checkNoteSync(&queue, 900, 8));
+  TEST_ASSERT_EQUAL_UINT(1, countSyncs(takeRequests()));
+
+  // Nothing queued, nothing to sync however long it has been
+  advanceSeconds(3600);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 900, 8));
+
+  // An interval of 0 leaves it to the note count
+  addMessages(1);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 0, 8));
+  TEST_ASSERT_EQUAL_UINT(0, countSyncs(takeRequests()));
+}
+
+void test_urgent_note_syncs_at_once()
+{
+  addMessages(1);
+  requestNoteSync(&queue);
+  TEST_ASSERT_TRUE(checkNoteSync(&queue, 900, 8));
+  TEST_ASSERT_EQUAL_UINT(1, countSyncs(takeRequests()));
+
+  // The request is used up by the sync
+  addMessages(1);
+  TEST_ASSERT_FALSE(checkNoteSync(&queue, 900, 8));
+}
+
+int main(int argc, char **argv)
+{
+  const int sink = mkstemp(sinkPath);
+  if (sink < 0)
+  {
+    return 1;
+  }
+  close(sink);
+  setSimNotecardSink(sinkPath);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_template_registered_on_start);
+  RUN_TEST(test_frame_notes_carry_whole_blocks);
+  RUN_TEST(test_messages_go_to_their_own_file);
+  RUN_TEST(test_sync_once_enough_notes_wait);
+  RUN_TEST(test_sync_once_interval_passed);
+  RUN_TEST(test_urgent_note_syncs_at_once);
+  const int failures = UNITY_END();
+  unlink(sinkPath);
+  return failures;
+}